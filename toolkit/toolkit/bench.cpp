@@ -0,0 +1,520 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <fstream>
+#include <functional>
+#include <armadillo>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "helpers.hpp"
+#include "json11/json11.hpp"
+#include "storage/backends.hpp"
+#include "storage/synthetic.hpp"
+#include "storage/waveform.hpp"
+#include "compute/eeg_spectrogram.hpp"
+#include "compute/eeg_change_point.hpp"
+#include "compute/downsample.hpp"
+
+using namespace std;
+using namespace arma;
+using namespace json11;
+
+#ifndef BENCH_COMMIT
+#define BENCH_COMMIT "unknown"
+#endif
+
+#define BENCH_MRN "bench" // synthetic recording written to the bench directory
+#define BENCH_DIR_TEMPLATE "/tmp/bench-XXXXXX" // bench directory unless one is given
+#define BENCH_CODEC_MRN "bench-codec" // realistic recording the codecs compress
+#define BENCH_SEED 42 // seed of the realistic recording
+#define BENCH_FS 256 // sample rate of the synthetic recording
+#define BENCH_EXTENT 16 // downsampling factor
+#define BENCH_MIN_FREQ 0 // band read from the cached spectrogram
+#define BENCH_MAX_FREQ 20
+
+static const int BENCH_CODECS[] = {CODEC_NONE, CODEC_SHUFFLE_ZLIB, CODEC_LOGQ16_ZLIB};
+static const string BENCH_CODEC_NAMES[] = {"none", "shuffle_zlib", "logq16_zlib"};
+
+// directory of the arrays of the run, never DATADIR
+static string bench_dir;
+
+typedef struct bench_result
+{
+  string name;
+  string variant; // "warm", "cold", "buffered" or "synced"
+  string backend;
+  double nbytes; // data processed by each run
+  vector<double> times; // seconds of each run
+} bench_result_t;
+
+/*
+ * Drop a file from the page cache, unprivileged unlike drop_caches
+ */
+static int evict_file(const char* path, const struct stat* sb, int type, struct FTW* ftw)
+{
+  if (type == FTW_F)
+  {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+      fdatasync(fd);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  }
+  return 0;
+}
+
+static int remove_file(const char* path, const struct stat* sb, int type, struct FTW* ftw)
+{
+  remove(path);
+  return 0;
+}
+
+/*
+ * Drop the files of the arrays at `paths`, which may be directories, from
+ * the page cache
+ */
+static void evict_paths(vector<string>& paths)
+{
+  for (string& path : paths)
+  {
+    nftw(path.c_str(), evict_file, 16, FTW_PHYS);
+  }
+}
+
+static void remove_paths(vector<string>& paths)
+{
+  for (string& path : paths)
+  {
+    nftw(path.c_str(), remove_file, 16, FTW_DEPTH | FTW_PHYS);
+  }
+}
+
+/*
+ * Files of the array `mrn_name` of `backend`
+ */
+template<typename Backend>
+static vector<string> get_array_paths(Backend* backend, string mrn_name)
+{
+  string path = backend->get_array_path(mrn_name);
+  return {path, path + "-metadata"};
+}
+
+/*
+ * Time `repeats` runs of `f`. Cold runs evict `paths` from the page cache
+ * first, warm runs follow an untimed run that loads them.
+ */
+static void run(vector<bench_result_t>& results, string name, string variant, string backend,
+    double nbytes, int repeats, vector<string>& paths, function<void()> f)
+{
+  bench_result_t result = {name, variant, backend, nbytes, {}};
+  bool cold = variant == "cold";
+  if (!cold)
+  {
+    f();
+  }
+  for (int i = 0; i < repeats; i++)
+  {
+    if (cold)
+    {
+      evict_paths(paths);
+    }
+    unsigned long long start = getticks();
+    f();
+    result.times.push_back(ticks_to_seconds(getticks() - start));
+  }
+  cerr << name << " " << variant << " " << backend << ": " <<
+    *min_element(result.times.begin(), result.times.end()) << "s" << endl;
+  results.push_back(result);
+}
+
+static Json result_to_json(bench_result_t& result)
+{
+  vector<double> times = result.times;
+  sort(times.begin(), times.end());
+  double median = times[times.size() / 2];
+  double mean = accumulate(times.begin(), times.end(), 0.0) / times.size();
+  return Json::object
+  {
+    {"name", result.name},
+    {"variant", result.variant},
+    {"backend", result.backend},
+    {"nbytes", result.nbytes},
+    {"repeats", (int) times.size()},
+    {"min", times.front()},
+    {"median", median},
+    {"mean", mean},
+    {"max", times.back()},
+    {"throughput", median > 0 ? result.nbytes / median : 0}
+  };
+}
+
+/*
+ * Write a synthetic recording of `nsamples` samples of every channel with
+ * `backend`, in the chunk size of `edf_to_array`
+ */
+template<typename Backend>
+static void write_recording(Backend* backend, int64_t nsamples, bool sync)
+{
+  string mrn = BENCH_MRN;
+  frowvec chunk_buf = randu<frowvec>(min(nsamples, (int64_t) READ_CHUNK_SIZE));
+  ArrayMetadata metadata = ArrayMetadata(BENCH_FS, nsamples, nsamples, NCHANNELS);
+  backend->create_array(mrn, &metadata);
+  for (int i = 0; i < NCHANNELS; i++)
+  {
+    for (int64_t start = 0; start < nsamples; start += chunk_buf.n_elem)
+    {
+      int64_t end = min(start + (int64_t) chunk_buf.n_elem, nsamples);
+      frowvec buf = chunk_buf.cols(0, end - start - 1);
+      backend->write_array(mrn, CHANNEL_ARRAY[i], start, end, buf);
+    }
+  }
+  if (sync)
+  {
+    backend->sync_array(mrn);
+  }
+  backend->close_array(mrn);
+}
+
+/*
+ * Write and read the synthetic recording and a cached spectrogram with the
+ * layout of `spec_params` with `Backend`, in the chunk sizes used by
+ * `edf_to_array`, `precompute_spectrogram` and the server.
+ */
+template<typename Backend>
+static void bench_backend(string backend_name, SpecParams* spec_params, int repeats,
+    vector<bench_result_t>& results)
+{
+  Backend backend;
+  backend.set_data_dir(bench_dir);
+  string mrn = BENCH_MRN;
+  string cached_mrn_name = backend.mrn_to_cached_mrn_name(mrn, CH_NAME_MAP[LL]);
+  vector<string> raw_paths = get_array_paths(&backend, mrn);
+  vector<string> cached_paths = get_array_paths(&backend, cached_mrn_name);
+
+  int64_t nsamples = spec_params->total_nsamples;
+  double raw_nbytes = sizeof(float) * nsamples * NCHANNELS;
+  run(results, "write_raw", "buffered", backend_name, raw_nbytes, repeats, raw_paths,
+      [&]() { write_recording(&backend, nsamples, false); });
+  run(results, "write_raw", "synced", backend_name, raw_nbytes, repeats, raw_paths,
+      [&]() { write_recording(&backend, nsamples, true); });
+
+  // one channel at a time, like `read_channels`
+  auto read_raw = [&]()
+  {
+    backend.open_array(mrn);
+    frowvec buf;
+    for (int i = 0; i < NCHANNELS; i++)
+    {
+      for (int64_t start = 0; start < nsamples; start += READ_CHUNK_SIZE)
+      {
+        int64_t end = min(start + (int64_t) READ_CHUNK_SIZE, nsamples);
+        buf.set_size(end - start);
+        backend.read_array(mrn, CHANNEL_ARRAY[i], start, end, buf);
+      }
+    }
+    backend.close_array(mrn);
+  };
+  run(results, "read_raw", "cold", backend_name, raw_nbytes, repeats, raw_paths, read_raw);
+  run(results, "read_raw", "warm", backend_name, raw_nbytes, repeats, raw_paths, read_raw);
+
+  // the layout of `precompute_spectrogram`, the band is what the webapp reads
+  int nfreqs = spec_params->nfreqs;
+  int64_t nblocks = spec_params->total_nblocks;
+  int freq_start = spec_params->freq_start;
+  int freq_end = spec_params->freq_end;
+  int64_t chunk_nblocks = max(WRITE_CHUNK_SIZE / spec_params->shift, 1);
+  fmat spec_chunk = randu<fmat>(nfreqs, min(chunk_nblocks, nblocks));
+  double cached_nbytes = sizeof(float) * nblocks * nfreqs;
+  auto write_cached = [&](bool sync)
+  {
+    ArrayMetadata metadata = ArrayMetadata(BENCH_FS, nblocks, nblocks, nfreqs);
+    backend.create_array(cached_mrn_name, &metadata);
+    for (int64_t start = 0; start < nblocks; start += chunk_nblocks)
+    {
+      int64_t end = min(start + chunk_nblocks, nblocks);
+      fmat buf = spec_chunk.cols(0, end - start - 1);
+      backend.write_array(cached_mrn_name, ALL, start, end, buf);
+    }
+    if (sync)
+    {
+      backend.sync_array(cached_mrn_name);
+    }
+    backend.close_array(cached_mrn_name);
+  };
+  run(results, "write_cached", "buffered", backend_name, cached_nbytes, repeats, cached_paths,
+      [&]() { write_cached(false); });
+  run(results, "write_cached", "synced", backend_name, cached_nbytes, repeats, cached_paths,
+      [&]() { write_cached(true); });
+
+  int64_t window_nblocks = max(READ_CHUNK_SIZE / spec_params->shift, 1);
+  auto read_cached = [&]()
+  {
+    backend.open_array(cached_mrn_name);
+    fmat buf;
+    for (int64_t start = 0; start < nblocks; start += window_nblocks)
+    {
+      int64_t end = min(start + window_nblocks, nblocks);
+      buf.set_size(freq_end - freq_start, end - start);
+      backend.read_array(cached_mrn_name, start, end, freq_start, freq_end, buf);
+    }
+    backend.close_array(cached_mrn_name);
+  };
+  double band_nbytes = sizeof(float) * nblocks * (freq_end - freq_start);
+  run(results, "read_cached_band", "cold", backend_name, band_nbytes, repeats, cached_paths, read_cached);
+  run(results, "read_cached_band", "warm", backend_name, band_nbytes, repeats, cached_paths, read_cached);
+
+  // the recording of the configured backend is used by `bench_compute`
+  remove_paths(cached_paths);
+  if (backend_name != TOSTRING(BACKEND))
+  {
+    remove_paths(raw_paths);
+  }
+}
+
+/*
+ * Write the cached spectrogram of a realistic synthetic recording of
+ * `nsamples` samples with every codec of `BinaryBackend` and read its band
+ * back. Random data doesn't compress like spectrograms do, so the recording
+ * is generated by `write_synthetic_array`. The size of each array is set in
+ * `codec_bytes`.
+ */
+static void bench_codecs(int64_t nsamples, int repeats, vector<bench_result_t>& results,
+    Json::object* codec_bytes)
+{
+  string mrn = BENCH_CODEC_MRN;
+  synthetic_recording_t recording;
+  init_synthetic_recording_t(&recording, BENCH_SEED, BENCH_FS, SYNTHETIC_MIN_SIGNALS, nsamples);
+  StorageBackend backend;
+  backend.set_data_dir(bench_dir);
+  write_synthetic_array(&recording, &backend, mrn);
+
+  SpecParams spec_params = SpecParams(&backend, mrn, (int64_t) 0, recording.nsamples);
+  fmat spec_mat;
+  eeg_spectrogram(&spec_params, LL, spec_mat);
+  backend.close_array(mrn);
+  spec_params.set_band(BENCH_MIN_FREQ, BENCH_MAX_FREQ);
+
+  BinaryBackend binary_backend;
+  binary_backend.set_data_dir(bench_dir);
+  string cached_mrn_name = binary_backend.mrn_to_cached_mrn_name(mrn, CH_NAME_MAP[LL]);
+  vector<string> cached_paths = get_array_paths(&binary_backend, cached_mrn_name);
+  int64_t nblocks = spec_mat.n_cols;
+  int64_t chunk_nblocks = max(WRITE_CHUNK_SIZE / spec_params.shift, 1);
+  int64_t window_nblocks = max(READ_CHUNK_SIZE / spec_params.shift, 1);
+  int freq_start = spec_params.freq_start;
+  int freq_end = spec_params.freq_end;
+  double cached_nbytes = sizeof(float) * spec_mat.n_elem;
+  double band_nbytes = sizeof(float) * nblocks * (freq_end - freq_start);
+
+  for (int i = 0; i < (int) (sizeof(BENCH_CODECS) / sizeof(BENCH_CODECS[0])); i++)
+  {
+    string name = "BinaryBackend/" + BENCH_CODEC_NAMES[i];
+    auto write_cached = [&]()
+    {
+      ArrayMetadata metadata = ArrayMetadata(BENCH_FS, nblocks, nblocks, spec_mat.n_rows);
+      metadata.optional_metadata = Json::object {{"codec", BENCH_CODECS[i]}};
+      binary_backend.create_array(cached_mrn_name, &metadata);
+      for (int64_t start = 0; start < nblocks; start += chunk_nblocks)
+      {
+        int64_t end = min(start + chunk_nblocks, nblocks);
+        fmat buf = spec_mat.cols(start, end - 1);
+        binary_backend.write_array(cached_mrn_name, ALL, start, end, buf);
+      }
+      binary_backend.close_array(cached_mrn_name);
+    };
+    run(results, "write_cached_codec", "buffered", name, cached_nbytes, repeats, cached_paths,
+        write_cached);
+
+    struct stat st;
+    (*codec_bytes)[BENCH_CODEC_NAMES[i]] = stat(cached_paths[0].c_str(), &st) ? 0.0 : (double) st.st_size;
+
+    auto read_cached = [&]()
+    {
+      binary_backend.open_array(cached_mrn_name);
+      fmat buf;
+      for (int64_t start = 0; start < nblocks; start += window_nblocks)
+      {
+        int64_t end = min(start + window_nblocks, nblocks);
+        buf.set_size(freq_end - freq_start, end - start);
+        binary_backend.read_array(cached_mrn_name, start, end, freq_start, freq_end, buf);
+      }
+      binary_backend.close_array(cached_mrn_name);
+    };
+    run(results, "read_cached_band_codec", "cold", name, band_nbytes, repeats, cached_paths, read_cached);
+    run(results, "read_cached_band_codec", "warm", name, band_nbytes, repeats, cached_paths, read_cached);
+    remove_paths(cached_paths);
+  }
+
+  vector<string> paths = get_array_paths(&backend, mrn);
+  for (int level = 1; level <= get_waveform_nlevels(recording.nsamples); level++)
+  {
+    for (string kind : {"min", "max"})
+    {
+      vector<string> level_paths = get_array_paths(&backend,
+          backend.mrn_to_waveform_mrn_name(mrn, kind, level));
+      paths.insert(paths.end(), level_paths.begin(), level_paths.end());
+    }
+  }
+  remove_paths(paths);
+}
+
+/*
+ * Time the compute kernels on the synthetic recording of `spec_params`,
+ * written with the `BACKEND` of `config.hpp`
+ */
+static void bench_compute(SpecParams* spec_params_ptr, int repeats, vector<bench_result_t>& results)
+{
+  SpecParams& spec_params = *spec_params_ptr;
+  StorageBackend* backend = spec_params.backend;
+  string backend_name = TOSTRING(BACKEND);
+  string mrn = BENCH_MRN;
+  vector<string> raw_paths = get_array_paths(backend, mrn);
+  vector<string> no_paths;
+  backend->open_array(mrn);
+
+  int64_t nblocks = spec_params.nblocks;
+  frowvec diff = randu<frowvec>(spec_params.nsamples);
+  fmat spec_mat;
+  fft_state_t fft_state;
+  auto fft = [&]()
+  {
+    spec_mat.zeros(spec_params.freq_end - spec_params.freq_start, nblocks);
+    FFT(&spec_params, &fft_state, diff, nblocks, spec_mat);
+  };
+  double diff_nbytes = sizeof(float) * diff.n_elem;
+  init_fft_state_t(&spec_params, &fft_state);
+  run(results, "fft", "warm", backend_name, diff_nbytes, repeats, no_paths, fft);
+  free_fft_state_t(&fft_state);
+
+  // a narrow band evaluates the bins directly
+  float bin_width = spec_params.bin_to_freq(1);
+  spec_params.set_band(bin_width, 4 * bin_width);
+  init_fft_state_t(&spec_params, &fft_state);
+  run(results, "fft_narrow_band", "warm", backend_name, diff_nbytes, repeats, no_paths, fft);
+  free_fft_state_t(&fft_state);
+  spec_params.set_band(BENCH_MIN_FREQ, BENCH_MAX_FREQ);
+
+  double region_nbytes = sizeof(float) * spec_params.nsamples * NUM_DIFFS;
+  auto spectrogram = [&]()
+  {
+    eeg_spectrogram(&spec_params, LL, spec_mat);
+  };
+  run(results, "eeg_spectrogram", "cold", backend_name, region_nbytes, repeats, raw_paths, spectrogram);
+  run(results, "eeg_spectrogram", "warm", backend_name, region_nbytes, repeats, raw_paths, spectrogram);
+
+  double spec_nbytes = sizeof(float) * spec_mat.n_elem;
+  cp_data_t cp_data;
+  run(results, "get_change_points", "warm", backend_name, spec_nbytes, repeats, no_paths,
+      [&]() { get_change_points(spec_mat, &cp_data); });
+
+  // includes copying the input, `downsample` reduces it in place
+  vector<string> methods = {"drop", "mean", "max", "percentile"};
+  fmat buf;
+  for (string& method : methods)
+  {
+    run(results, "downsample_" + method, "warm", backend_name, spec_nbytes, repeats, no_paths,
+        [&]()
+        {
+          buf = spec_mat;
+          downsample(buf, BENCH_EXTENT, get_downsample_method(method));
+        });
+  }
+  backend->close_array(mrn);
+}
+
+/*
+ * Microbenchmarks of the storage backends and compute kernels on a
+ * synthetic recording, so runs are comparable across commits and machines.
+ * The arrays are written to `dir`, or a temporary directory that is removed
+ * afterwards, never to DATADIR. Progress goes to stderr and the results are
+ * written as JSON.
+ */
+int main(int argc, char* argv[])
+{
+  if (argc > 5)
+  {
+    cout << "\nusage: ./bench [hours] [repeats] [output] [dir]\n" << endl;
+    return 1;
+  }
+  double hours = argc > 1 ? atof(argv[1]) : 1;
+  int repeats = max(argc > 2 ? atoi(argv[2]) : 5, 1);
+  string output = argc > 3 ? argv[3] : "bench.json";
+  int64_t nsamples = max(hours_to_samples(BENCH_FS, hours), (int64_t) 1);
+
+  bool tmp_dir = argc <= 4;
+  if (tmp_dir)
+  {
+    char dir_template[] = BENCH_DIR_TEMPLATE;
+    if (!mkdtemp(dir_template))
+    {
+      cout << "Unable to create " << BENCH_DIR_TEMPLATE << endl;
+      return 1;
+    }
+    bench_dir = dir_template;
+  }
+  else
+  {
+    bench_dir = argv[4];
+    mkdir(bench_dir.c_str(), 0755);
+  }
+  if (bench_dir.back() != '/')
+  {
+    bench_dir += "/";
+  }
+
+  // the spectrogram layout of the recording is the same for every backend
+  StorageBackend backend;
+  backend.set_data_dir(bench_dir);
+  write_recording(&backend, nsamples, false);
+  SpecParams spec_params = SpecParams(&backend, BENCH_MRN, (int64_t) 0, nsamples);
+  spec_params.set_band(BENCH_MIN_FREQ, BENCH_MAX_FREQ);
+  backend.close_array(BENCH_MRN);
+
+  vector<bench_result_t> results;
+  bench_backend<BinaryBackend>("BinaryBackend", &spec_params, repeats, results);
+  bench_backend<HDF5Backend>("HDF5Backend", &spec_params, repeats, results);
+  bench_backend<TileDBBackend>("TileDBBackend", &spec_params, repeats, results);
+  bench_compute(&spec_params, repeats, results);
+  Json::object codec_bytes;
+  bench_codecs(nsamples, repeats, results, &codec_bytes);
+  vector<string> raw_paths = get_array_paths(&backend, BENCH_MRN);
+  if (tmp_dir)
+  {
+    raw_paths = {bench_dir};
+  }
+  remove_paths(raw_paths);
+
+  Json::array json_results;
+  for (bench_result_t& result : results)
+  {
+    json_results.push_back(result_to_json(result));
+  }
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  Json json = Json::object
+  {
+    {"commit", BENCH_COMMIT},
+    {"host", host},
+    {"time", (double) time(NULL)},
+    {"hours", hours},
+    {"fs", BENCH_FS},
+    {"nsamples", (double) nsamples},
+    {"nchannels", NCHANNELS},
+    {"read_chunk", READ_CHUNK},
+    {"write_chunk", WRITE_CHUNK},
+    {"codecBytes", codec_bytes},
+    {"results", json_results}
+  };
+  ofstream file(output);
+  file << json.dump() << endl;
+  file.close();
+  cerr << "Wrote " << results.size() << " results to " << output << endl;
+  return 0;
+}
@@ -0,0 +1,146 @@
+#include <math.h>
+#include <armadillo>
+
+#include "band_power.hpp"
+#include "../helpers.hpp"
+#include "downsample.hpp"
+
+using namespace arma;
+using namespace std;
+
+#define RATIO_EPS 1e-12 // avoid dividing by an empty band
+
+void init_bp_state_t(bp_state_t* bp_state)
+{
+  for (int i = 0; i < NUM_BAND_POWERS; i++)
+  {
+    bp_state->sums[i] = 0;
+  }
+}
+
+/*
+ * Index of the first frequency bin at or above `freq` Hz
+ */
+static inline int freq_to_bin(SpecParams* spec_params, float freq)
+{
+  return ceil(freq * spec_params->nfft / spec_params->fs);
+}
+
+/*
+ * Fill `bp_mat` (NUM_BAND_POWERS x nblocks) with the power of each band in
+ * `FREQ_BANDS` followed by the `BAND_RATIOS` for every block of `spec_mat`,
+ * which holds the bins [`freq_start`, `freq_end`) of `spec_params`.
+ */
+void band_power(SpecParams* spec_params, fmat& spec_mat, fmat& bp_mat)
+{
+  bp_mat.zeros(NUM_BAND_POWERS, spec_mat.n_cols);
+  if (spec_params->fs == 0)
+  {
+    return;
+  }
+
+  int bin_start[NUM_BANDS], bin_end[NUM_BANDS];
+  for (int b = 0; b < NUM_BANDS; b++)
+  {
+    bin_start[b] = max(freq_to_bin(spec_params, FREQ_BANDS[b].min_freq), spec_params->freq_start);
+    bin_end[b] = min(freq_to_bin(spec_params, FREQ_BANDS[b].max_freq), spec_params->freq_end);
+  }
+
+  for (uword col = 0; col < spec_mat.n_cols; col++)
+  {
+    // spectrogram values are magnitudes, the power of a band is the
+    // sum of their squares
+    float* spec_col = spec_mat.colptr(col) - spec_params->freq_start;
+    float* bp_col = bp_mat.colptr(col);
+    for (int b = 0; b < NUM_BANDS; b++)
+    {
+      float power = 0;
+      for (int bin = bin_start[b]; bin < bin_end[b]; bin++)
+      {
+        power += spec_col[bin] * spec_col[bin];
+      }
+      bp_col[b] = power;
+    }
+    for (int r = 0; r < NUM_BAND_RATIOS; r++)
+    {
+      bp_col[NUM_BANDS + r] = bp_col[BAND_RATIOS[r].num] / (bp_col[BAND_RATIOS[r].den] + RATIO_EPS);
+    }
+  }
+}
+
+/*
+ * Create the band power array `bp_mrn_name` with one row per block and its
+ * prefix sum array `prefix_mrn_name`. Row `i` of the prefix sums holds the
+ * sums of the blocks [0, `i`).
+ */
+void create_band_power_arrays(StorageBackend* backend, string bp_mrn_name, string prefix_mrn_name,
+    int fs, int64_t nblocks)
+{
+  ArrayMetadata bp_metadata = ArrayMetadata(fs, nblocks, nblocks, NUM_BAND_POWERS);
+  cout << "Creating: " << bp_mrn_name << endl;
+  backend->create_array(bp_mrn_name, &bp_metadata);
+
+  ArrayMetadata prefix_metadata = ArrayMetadata(fs, nblocks + 1, nblocks + 1, 2 * NUM_BAND_POWERS);
+  cout << "Creating: " << prefix_mrn_name << endl;
+  backend->create_array(prefix_mrn_name, &prefix_metadata);
+
+  fmat zero_row = zeros<fmat>(2 * NUM_BAND_POWERS, 1);
+  backend->write_array(prefix_mrn_name, ALL, 0, 1, zero_row);
+}
+
+/*
+ * Write the band powers `bp_mat` of the blocks starting at `start_block`
+ * and their prefix sums, continuing from `bp_state`.
+ */
+void write_band_power(StorageBackend* backend, string bp_mrn_name, string prefix_mrn_name,
+    int64_t start_block, fmat& bp_mat, bp_state_t* bp_state)
+{
+  int64_t end_block = start_block + bp_mat.n_cols;
+
+  backend->write_array(bp_mrn_name, ALL, start_block, end_block, bp_mat);
+
+  fmat prefix_mat;
+  prefix_sums(bp_mat, bp_state->sums, prefix_mat);
+  backend->write_array(prefix_mrn_name, ALL, start_block + 1, end_block + 1, prefix_mat);
+}
+
+/*
+ * Fill `bp_mat` (NUM_BAND_POWERS x width) with the average band powers of
+ * `width` equal buckets of the blocks [`start_block`, `end_block`). Each
+ * bucket is the difference of two rows of the prefix sums, so only the
+ * `width + 1` bucket boundaries are read however long the range is. If `width` is not
+ * smaller than the number of blocks the band powers are read directly.
+ */
+void read_band_power(StorageBackend* backend, string mrn, string ch_name,
+    int64_t start_block, int64_t end_block, int width, fmat& bp_mat)
+{
+  string bp_mrn_name = backend->mrn_to_bandpower_mrn_name(mrn, ch_name);
+  string prefix_mrn_name = backend->mrn_to_bandpower_prefix_mrn_name(mrn, ch_name);
+  int64_t nblocks = end_block - start_block;
+  if (nblocks <= 0 || !backend->array_exists(prefix_mrn_name))
+  {
+    bp_mat.zeros(NUM_BAND_POWERS, 0);
+    return;
+  }
+
+  if (width <= 0 || width >= nblocks)
+  {
+    bp_mat.set_size(NUM_BAND_POWERS, nblocks);
+    backend->open_array(bp_mrn_name);
+    backend->read_array(bp_mrn_name, start_block, end_block, bp_mat);
+    backend->close_array(bp_mrn_name);
+    return;
+  }
+
+  vector<int64_t> rows(width + 1);
+  for (int col = 0; col <= width; col++)
+  {
+    rows[col] = start_block + nblocks * col / width;
+  }
+  fmat prefix_mat = fmat(2 * NUM_BAND_POWERS, width + 1);
+  backend->open_array(prefix_mrn_name);
+  backend->read_rows(prefix_mrn_name, rows, 0, 2 * NUM_BAND_POWERS, prefix_mat);
+
+  prefix_means(prefix_mat, rows, bp_mat);
+  backend->close_array(prefix_mrn_name);
+}
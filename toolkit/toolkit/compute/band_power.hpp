@@ -0,0 +1,32 @@
+#ifndef BAND_POWER_H
+#define BAND_POWER_H
+
+#include <armadillo>
+#include <string>
+
+#include "../storage/backends.hpp"
+#include "../config.hpp"
+#include "eeg_spectrogram.hpp"
+
+using namespace arma;
+using namespace std;
+
+/*
+ * Running sums of the band powers. They carry over between chunks so the
+ * prefix sums can be computed while precomputing chunk by chunk.
+ */
+typedef struct bp_state
+{
+  double sums[NUM_BAND_POWERS];
+} bp_state_t;
+
+void init_bp_state_t(bp_state_t* bp_state);
+void band_power(SpecParams* spec_params, fmat& spec_mat, fmat& bp_mat);
+void create_band_power_arrays(StorageBackend* backend, string bp_mrn_name, string prefix_mrn_name,
+    int fs, int64_t nblocks);
+void write_band_power(StorageBackend* backend, string bp_mrn_name, string prefix_mrn_name,
+    int64_t start_block, fmat& bp_mat, bp_state_t* bp_state);
+void read_band_power(StorageBackend* backend, string mrn, string ch_name,
+    int64_t start_block, int64_t end_block, int width, fmat& bp_mat);
+
+#endif // BAND_POWER_H
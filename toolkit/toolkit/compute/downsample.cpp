@@ -0,0 +1,225 @@
+#include <math.h>
+#include <string.h>
+#include <armadillo>
+
+#include "downsample.hpp"
+#include "../helpers.hpp"
+
+using namespace arma;
+using namespace std;
+
+#define PERCENTILE_Z 1.645f // z-score of the 95th percentile of a normal distribution
+
+ColumnAggregator::ColumnAggregator(int method, uint extent, uword nrows, uword ncols, float* out)
+{
+  this->method = method;
+  this->extent = max(extent, 1u);
+  this->nrows = nrows;
+  this->ncols = ncols;
+  this->out = out;
+  col = 0;
+  count = 0;
+  if (method == DOWNSAMPLE_PERCENTILE)
+  {
+    sum_sq.resize(nrows);
+    group_min.resize(nrows);
+    group_max.resize(nrows);
+  }
+}
+
+/*
+ * Returns true once all `ncols` output columns are filled
+ */
+bool ColumnAggregator::done()
+{
+  return col >= ncols;
+}
+
+/*
+ * Add the next input column `in` of `nrows` values to the current group.
+ * The loops are kept branch free so the compiler vectorizes them.
+ */
+void ColumnAggregator::push(const float* in)
+{
+  if (done())
+  {
+    return;
+  }
+
+  float* __restrict dst = out + col * nrows;
+  float* __restrict sq = sum_sq.data();
+  float* __restrict lo = group_min.data();
+  float* __restrict hi = group_max.data();
+  if (count == 0)
+  {
+    // the first column of a group initializes the output
+    memcpy(dst, in, nrows * sizeof(float));
+    if (method == DOWNSAMPLE_PERCENTILE)
+    {
+      for (uword i = 0; i < nrows; i++)
+      {
+        sq[i] = in[i] * in[i];
+        lo[i] = in[i];
+        hi[i] = in[i];
+      }
+    }
+  }
+  else
+  {
+    switch (method)
+    {
+      case DOWNSAMPLE_MEAN:
+        for (uword i = 0; i < nrows; i++)
+        {
+          dst[i] += in[i];
+        }
+        break;
+      case DOWNSAMPLE_MAX:
+        for (uword i = 0; i < nrows; i++)
+        {
+          dst[i] = in[i] > dst[i] ? in[i] : dst[i];
+        }
+        break;
+      case DOWNSAMPLE_PERCENTILE:
+        for (uword i = 0; i < nrows; i++)
+        {
+          dst[i] += in[i];
+          sq[i] += in[i] * in[i];
+          lo[i] = in[i] < lo[i] ? in[i] : lo[i];
+          hi[i] = in[i] > hi[i] ? in[i] : hi[i];
+        }
+        break;
+      default: // DOWNSAMPLE_DROP keeps the first column of the group
+        break;
+    }
+  }
+
+  if (++count == extent)
+  {
+    finish_column();
+  }
+}
+
+/*
+ * Turn the accumulated sums of the current group into the output values and
+ * move on to the next output column.
+ */
+void ColumnAggregator::finish_column()
+{
+  float* __restrict dst = out + col * nrows;
+  float* __restrict sq = sum_sq.data();
+  float* __restrict lo = group_min.data();
+  float* __restrict hi = group_max.data();
+  float scale = 1.0f / extent;
+  if (method == DOWNSAMPLE_MEAN)
+  {
+    for (uword i = 0; i < nrows; i++)
+    {
+      dst[i] *= scale;
+    }
+  }
+  else if (method == DOWNSAMPLE_PERCENTILE)
+  {
+    // approximate the upper percentile from the mean and variance of the
+    // group instead of sorting it, within the values the group reached
+    for (uword i = 0; i < nrows; i++)
+    {
+      float mean = dst[i] * scale;
+      float var = sq[i] * scale - mean * mean;
+      float value = mean + PERCENTILE_Z * sqrtf(var > 0 ? var : 0);
+      value = value > hi[i] ? hi[i] : value;
+      dst[i] = value < lo[i] ? lo[i] : value;
+    }
+  }
+  col++;
+  count = 0;
+}
+
+/*
+ * Map the name of a downsampling method in a request to its DOWNSAMPLE_*
+ * value. Unknown names use the default `DOWNSAMPLE`.
+ */
+int get_downsample_method(string name)
+{
+  if (name == "drop")
+  {
+    return DOWNSAMPLE_DROP;
+  }
+  else if (name == "mean")
+  {
+    return DOWNSAMPLE_MEAN;
+  }
+  else if (name == "max")
+  {
+    return DOWNSAMPLE_MAX;
+  }
+  else if (name == "percentile")
+  {
+    return DOWNSAMPLE_PERCENTILE;
+  }
+  return DOWNSAMPLE;
+}
+
+/*
+ * Reduce every `extent` columns of the given matrix to one with `method`.
+ * If `extent` is `0` or `1` the matrix is unchanged
+ */
+void downsample(fmat& buf, uint extent, int method)
+{
+  if (extent > 1) // don't downsample for 0 or 1
+  {
+    fmat new_buf = fmat(buf.n_rows, buf.n_cols / extent);
+    ColumnAggregator aggregator = ColumnAggregator(method, extent,
+        new_buf.n_rows, new_buf.n_cols, new_buf.memptr());
+    for (uword i = 0; i < buf.n_cols && !aggregator.done(); i++)
+    {
+      aggregator.push(buf.colptr(i));
+    }
+    buf = new_buf;
+  }
+}
+
+/*
+ * Fill `prefix_mat` (2 * n_rows x n_cols) with the running sums of each row
+ * of `buf` after each column, continuing from `sums`. Each sum is stored as
+ * a hi, lo pair of floats so long recordings keep their precision.
+ */
+void prefix_sums(fmat& buf, double* sums, fmat& prefix_mat)
+{
+  prefix_mat.set_size(2 * buf.n_rows, buf.n_cols);
+  for (uword col = 0; col < buf.n_cols; col++)
+  {
+    float* buf_col = buf.colptr(col);
+    float* prefix_col = prefix_mat.colptr(col);
+    for (uword i = 0; i < buf.n_rows; i++)
+    {
+      sums[i] += buf_col[i];
+      split_double(sums[i], &prefix_col[2 * i], &prefix_col[2 * i + 1]);
+    }
+  }
+}
+
+/*
+ * Fill `buf` (n_rows / 2 x rows.size() - 1) with the means between
+ * consecutive `rows` of the prefix sums, where column `i` of `prefix_mat`
+ * holds the prefix sums at `rows[i]`.
+ */
+void prefix_means(fmat& prefix_mat, vector<int64_t>& rows, fmat& buf)
+{
+  uword nrows = prefix_mat.n_rows / 2;
+  uword ncols = rows.size() > 1 ? rows.size() - 1 : 0;
+  buf.set_size(nrows, ncols);
+  for (uword col = 0; col < ncols; col++)
+  {
+    float* prev_col = prefix_mat.colptr(col);
+    float* next_col = prefix_mat.colptr(col + 1);
+    float* buf_col = buf.colptr(col);
+    double count = rows[col + 1] - rows[col];
+    for (uword i = 0; i < nrows; i++)
+    {
+      double prev_sum = join_double(prev_col[2 * i], prev_col[2 * i + 1]);
+      double sum = join_double(next_col[2 * i], next_col[2 * i + 1]);
+      buf_col[i] = (sum - prev_sum) / count;
+    }
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef DOWNSAMPLE_H
+#define DOWNSAMPLE_H
+
+#include <armadillo>
+#include <string>
+#include <vector>
+
+#include "../config.hpp"
+
+using namespace arma;
+using namespace std;
+
+/*
+ * Reduce groups of `extent` consecutive columns of `nrows` values into single
+ * columns of `out`, which holds `ncols` columns. Input columns are pushed one
+ * at a time as they are produced, so the full resolution matrix never has to
+ * be held in memory. Groups that would exceed `ncols` are ignored, matching
+ * `ncols = input_ncols / extent`.
+ */
+class ColumnAggregator
+{
+  private:
+    int method; // one of the DOWNSAMPLE_* methods
+    uint extent; // number of input columns per output column
+    uword nrows; // values per column
+    uword ncols; // output columns
+    float* out; // output buffer, `nrows` x `ncols` column-major
+    uword col; // output column being aggregated
+    uint count; // input columns pushed into `col`
+    vector<float> sum_sq; // running sum of squares for DOWNSAMPLE_PERCENTILE
+    vector<float> group_min; // running min and max clamping DOWNSAMPLE_PERCENTILE
+    vector<float> group_max;
+
+    void finish_column();
+
+  public:
+    ColumnAggregator(int method, uint extent, uword nrows, uword ncols, float* out);
+    void push(const float* in);
+    bool done();
+};
+
+int get_downsample_method(string name);
+void downsample(fmat& buf, uint extent, int method=DOWNSAMPLE);
+void prefix_sums(fmat& buf, double* sums, fmat& prefix_mat);
+void prefix_means(fmat& prefix_mat, vector<int64_t>& rows, fmat& buf);
+
+#endif // DOWNSAMPLE_H
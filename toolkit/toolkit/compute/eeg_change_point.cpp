@@ -1,8 +1,10 @@
 #include "eeg_change_point.hpp"
 
+#include <math.h>
 #include <armadillo>
 
 using namespace arma;
+using namespace std;
 
 static inline int round_up(int num_to_round, int multiple)
 {
@@ -39,84 +41,229 @@ void get_change_points_as_arr(float* spec_arr, int n_rows, int n_cols, cp_data_t
 }
 
 // TODO(joshblum): make real variable names
-void get_change_points(fmat& spec_mat,
-                       cp_data_t* cp_data)
-{
-  frowvec s = sum(spec_mat, 0); // sum rows
-  int stride = 10;
-  int nt = round_up(s.n_cols / stride, 10);
-  init_cp_data_t(cp_data, nt);
+// CUSUM parameters
+static const int MAX_VAL = 5000;
+static const float B = 0.95;
+static const float BB = 0.995;
+static const int MAX_AMP = 3000;
+static const int SIGMA = 100;
+static const int K = 4 * SIGMA / 2;
+static const int H = 5 * SIGMA;
 
-  int max_val = 5000;
+void init_cp_state_t(cp_state_t* cp_state)
+{
+  cp_state->m = 1000;
+  cp_state->mu = 1000;
+  cp_state->cu = 0;
+  cp_state->cl = 0;
+  cp_state->np = 0;
+  cp_state->nm = 0;
+  cp_state->ct = 0;
+  cp_state->block = 0;
+}
 
-  float b = 0.95;
-  float bb = 0.995;
-  int max_amp = 3000;
+/*
+ * Advance `cp_state` with the next value `s_j` of the summed signal.
+ * Returns true if a change point was detected.
+ */
+static bool cp_step(cp_state_t* cp_state, double s_j)
+{
+  cp_state->ct++;
+  s_j = s_j > MAX_VAL ? MAX_VAL : s_j;
 
-  // CUMSUM parameters
-  int sigma = 100;
-  int K = 4 * sigma / 2;
-  int h = 5;
-  int H = h * sigma;
+  // signal we are tracking -- short term mean
+  cp_state->m = fmin(cp_state->m * B + (1 - B) * s_j, MAX_AMP);
+  if (cp_state->ct < 20)
+  {
+    cp_state->mu = fmin(cp_state->mu * BB + (1 - BB) * cp_state->m, MAX_AMP);
+  }
 
+  cp_state->cu = fmax(0, cp_state->cu + cp_state->m - cp_state->mu - K);
+  cp_state->cl = fmax(0, cp_state->cl + cp_state->mu - cp_state->m - K);
 
-  int ct = 0;
-  int total_count = 0;
+  cp_state->np = (cp_state->np + 1) * (cp_state->cu > 0);
+  cp_state->nm = (cp_state->nm + 1) * (cp_state->cl > 0);
 
-  float np = 0.;
-  float nm = 0.;
-  for (int j = 1; j < nt; j++)
+  if (cp_state->cu > H || cp_state->cl > H)
   {
-    ct++;
-    double s_j = s[j * stride] > max_val ? max_val : s[j * stride];
-    //printf("s_j: %f\n", s_j);
-
-    // signal we are tracking -- short term mean
-    cp_data->m[j] = fmin(cp_data->m[j - 1] * b + (1 - b) * s_j, max_amp);
-    if (ct < 20)
+    cp_state->ct = 0;
+    if (cp_state->cu > H)
     {
-      cp_data->mu[j] = fmin(cp_data->mu[j - 1] * bb + (1 - bb) * cp_data->m[j], max_amp);
+      cp_state->mu = cp_state->mu + K + cp_state->cu / cp_state->np;
+      cp_state->cu = 0.;
+      cp_state->np  = 0;
     }
-    else
+    if (cp_state->cl > H)
     {
-      cp_data->mu[j] = cp_data->mu[j - 1];
+      cp_state->mu = cp_state->mu - K - cp_state->cl / cp_state->nm;
+      cp_state->cl = 0.;
+      cp_state->nm = 0.;
     }
+    return true;
+  }
+  return false;
+}
+
+void get_change_points(fmat& spec_mat,
+                       cp_data_t* cp_data)
+{
+  frowvec s = sum(spec_mat, 0); // sum rows
+  int stride = CP_STRIDE;
+  int nt = round_up(s.n_cols / stride, 10);
+  init_cp_data_t(cp_data, nt);
 
-    cp_data->cu[j] = fmax(0, cp_data->cu[j - 1] + cp_data->m[j] - cp_data->mu[j] - K);
-    cp_data->cl[j] = fmax(0, cp_data->cl[j - 1] + cp_data->mu[j] - cp_data->m[j] - K);
+  cp_state_t cp_state;
+  init_cp_state_t(&cp_state);
 
-    np = (np + 1) * (cp_data->cu[j] > 0);
-    nm = (nm + 1) * (cp_data->cl[j] > 0);
+  int total_count = 0;
+  for (int j = 1; j < nt; j++)
+  {
+    bool is_change_point = cp_step(&cp_state, s[j * stride]);
+    cp_data->m[j] = cp_state.m;
+    cp_data->mu[j] = cp_state.mu;
+    cp_data->cu[j] = cp_state.cu;
+    cp_data->cl[j] = cp_state.cl;
 
-    if (cp_data->cu[j] > H || cp_data->cl[j] > H)
+    if (is_change_point)
     {
       cp_data->cp[total_count] = j * stride; // time of change point
       total_count++;
-      ct = 0;
-
-      if (cp_data->cu[j] > H)
-      {
-        cp_data->mu[j] = cp_data->mu[j] + K + cp_data->cu[j] / np;
-        cp_data->cu[j] = 0.;
-        np  = 0;
-      }
-      if (cp_data->cl[j] > H)
-      {
-        cp_data->mu[j] = cp_data->mu[j] - K - cp_data->cl[j] / nm;
-        cp_data->cl[j] = 0.;
-        nm = 0.;
-      }
     }
   }
   // TODO(joshblum): ensure we are clipping the array properly here
   // TODO(joshblum): head method missing on ubuntu package?
   // cp_data->cp.head(total_count);
   // cp_data->yp.head(total_count);
-  cp_data->yp.fill(max_amp);
+  cp_data->yp.fill(MAX_AMP);
   cp_data->total_count = total_count;
 
 }
 
+/*
+ * Run the change point detection over the next chunk of the spectrogram.
+ * `spec_mat` holds the blocks starting at `cp_state->block` and the blocks
+ * of detected change points are appended to `cp_blocks`.
+ */
+void update_change_points(fmat& spec_mat, cp_state_t* cp_state, vector<int64_t>& cp_blocks)
+{
+  frowvec s = sum(spec_mat, 0); // sum rows
+  for (uword i = 0; i < s.n_cols; i++, cp_state->block++)
+  {
+    // the first block only seeds the state, like in `get_change_points`
+    if (cp_state->block == 0 || cp_state->block % CP_STRIDE != 0)
+    {
+      continue;
+    }
+    if (cp_step(cp_state, s[i]))
+    {
+      cp_blocks.push_back(cp_state->block);
+    }
+  }
+}
+
+/*
+ * Store the sorted change point blocks `cp_blocks` in the array `cp_mrn_name`
+ * with one row per change point. A float is only exact up to 2^24 so each
+ * block is split into its high and low `CP_LOW_BITS` bits in two columns.
+ * The number of change points is stored as `nsamples`, and an array without
+ * change points holds a single padding row since backends can't create empty
+ * arrays.
+ */
+void write_change_points(StorageBackend* backend, string cp_mrn_name, int fs, vector<int64_t>& cp_blocks)
+{
+  int64_t ncps = cp_blocks.size();
+  int64_t nrows = max(ncps, (int64_t) 1);
+  fmat buf = zeros<fmat>(2, nrows);
+  for (int64_t i = 0; i < ncps; i++)
+  {
+    buf(0, i) = cp_blocks[i] >> CP_LOW_BITS;
+    buf(1, i) = cp_blocks[i] & ((1 << CP_LOW_BITS) - 1);
+  }
+
+  ArrayMetadata metadata = ArrayMetadata(fs, ncps, nrows, 2);
+  backend->create_array(cp_mrn_name, &metadata);
+  backend->write_array(cp_mrn_name, ALL, 0, nrows, buf);
+  backend->close_array(cp_mrn_name);
+}
+
+/*
+ * Block of the `i`th change point in `buf`, which holds the columns of the
+ * array. Arrays written before the blocks were split have a single column.
+ */
+static int64_t get_change_point(fmat& buf, uword i)
+{
+  if (buf.n_rows == 1)
+  {
+    return buf(0, i);
+  }
+  return ((int64_t) buf(0, i) << CP_LOW_BITS) + (int64_t) buf(1, i);
+}
+
+/*
+ * Read the `i`th change point of the array `cp_mrn_name`
+ */
+static int64_t read_change_point(StorageBackend* backend, string cp_mrn_name, int ncols, int64_t i)
+{
+  fmat buf = fmat(ncols, 1);
+  backend->read_array(cp_mrn_name, i, i + 1, buf);
+  return get_change_point(buf, 0);
+}
+
+/*
+ * Index of the first change point of the array `cp_mrn_name` at or after
+ * `block`
+ */
+static int64_t lower_bound_change_point(StorageBackend* backend, string cp_mrn_name,
+    int ncols, int64_t ncps, int64_t block)
+{
+  int64_t lo = 0;
+  int64_t hi = ncps;
+  while (lo < hi)
+  {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (read_change_point(backend, cp_mrn_name, ncols, mid) < block)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+ * Fill `cp_blocks` with the change points of the array `cp_mrn_name` in the
+ * spectrogram blocks [`start_block`, `end_block`). The bounds are found with
+ * a binary search so only the change points in the range are read.
+ */
+void read_change_points(StorageBackend* backend, string cp_mrn_name,
+    int64_t start_block, int64_t end_block, vector<int64_t>& cp_blocks)
+{
+  cp_blocks.clear();
+  if (!backend->array_exists(cp_mrn_name))
+  {
+    return;
+  }
+
+  backend->open_array(cp_mrn_name);
+  int ncols = backend->get_ncols(cp_mrn_name);
+  int64_t ncps = backend->get_nsamples(cp_mrn_name);
+  int64_t start = lower_bound_change_point(backend, cp_mrn_name, ncols, ncps, start_block);
+  int64_t end = lower_bound_change_point(backend, cp_mrn_name, ncols, ncps, end_block);
+  if (end > start)
+  {
+    fmat buf = fmat(ncols, end - start);
+    backend->read_array(cp_mrn_name, start, end, buf);
+    for (uword i = 0; i < buf.n_cols; i++)
+    {
+      cp_blocks.push_back(get_change_point(buf, i));
+    }
+  }
+  backend->close_array(cp_mrn_name);
+}
+
 void print_frowvec(char* name, frowvec vector, int num_samples)
 {
   printf("%s: [ ", name);
@@ -2,8 +2,16 @@
 #define CHANGE_POINT_H
 // #define ARMA_NO_DEBUG // enable for no bounds checking
 #include <armadillo>
+#include <string>
+#include <vector>
+
+#include "../storage/backends.hpp"
 
 using namespace arma;
+using namespace std;
+
+#define CP_STRIDE 10 // only every `CP_STRIDE` spectrogram block is tracked
+#define CP_LOW_BITS 24 // blocks are stored as two floats, exact up to 2^24 each
 
 typedef struct cp_data
 {
@@ -16,7 +24,28 @@ typedef struct cp_data
   int total_count;
 } cp_data_t;
 
+/*
+ * CUSUM state of the online change point detection. It only depends on the
+ * blocks seen so far so the spectrogram can be processed in chunks.
+ */
+typedef struct cp_state
+{
+  float m; // short term mean of the tracked signal
+  float mu; // long term mean of the tracked signal
+  float cu; // upper cumulative sum
+  float cl; // lower cumulative sum
+  float np; // number of steps with `cu` > 0
+  float nm; // number of steps with `cl` > 0
+  int ct; // steps since the last change point
+  int64_t block; // next spectrogram block to process
+} cp_state_t;
+
 void init_cp_data_t(cp_data_t* cp_data, int nt);
+void init_cp_state_t(cp_state_t* cp_state);
+void update_change_points(fmat& spec_mat, cp_state_t* cp_state, vector<int64_t>& cp_blocks);
+void write_change_points(StorageBackend* backend, string cp_mrn_name, int fs, vector<int64_t>& cp_blocks);
+void read_change_points(StorageBackend* backend, string cp_mrn_name,
+    int64_t start_block, int64_t end_block, vector<int64_t>& cp_blocks);
 void get_change_points(fmat& spec_mat, cp_data_t* cp_data);
 void get_change_points_as_arr(float* spec_arr, int n_rows, int n_cols, cp_data_t* cp_data);
 void example_change_points_as_arr(float* spec_arr, int n_rows, int n_cols);
@@ -3,37 +3,51 @@
 #include <stdlib.h>
 #include <iostream>
 #include <iomanip>
-#include <fftw3.h>
+#include <sstream>
+#include <memory>
+#include <algorithm>
 
 #include "../storage/backends.hpp"
 #include "../helpers.hpp"
 #include "eeg_spectrogram.hpp"
+#include "downsample.hpp"
+#include "eeg_change_point.hpp"
+#include "band_power.hpp"
+#include "precompute_journal.hpp"
+#include "sparse_cache.hpp"
+#include "request_trace.hpp"
+#include "event_trace.hpp"
 
 
 using namespace arma;
 using namespace std;
 
 /*
- * Print attributes of a SpecParams object
+ * Print attributes of a SpecParams object. The lines are written at once
+ * without flushing so requests served concurrently don't wait on stdout.
  */
 void SpecParams::print()
 {
-  cout << "spec_params: {" << endl;
-  cout << "\tmrn: " << mrn << endl;
-  cout << "\tstart_time: " << setprecision(2) << start_time << endl;
-  cout << "\tend_time: " << setprecision(2) << end_time << endl;
-  cout << "\tstart_offset: " << start_offset << endl;
-  cout << "\tend_offset: " << end_offset << endl;
-  cout << "\tspec_start_offset: " << spec_start_offset << endl;
-  cout << "\tspec_end_offset: " << spec_end_offset << endl;
-  cout << "\tnfft: " << nfft << endl;
-  cout << "\tnstep: " << nstep << endl;
-  cout << "\tshift: " << shift << endl;
-  cout << "\tnsamples: " << nsamples << endl;
-  cout << "\tnblocks: " << nblocks << endl;
-  cout << "\tnfreqs: " << nfreqs << endl;
-  cout << "\tfs: " << fs << endl;
-  cout << "}" << endl;
+  ostringstream out;
+  out << "spec_params: {\n";
+  out << "\tmrn: " << mrn << "\n";
+  out << "\tstart_time: " << setprecision(2) << start_time << "\n";
+  out << "\tend_time: " << setprecision(2) << end_time << "\n";
+  out << "\tstart_offset: " << start_offset << "\n";
+  out << "\tend_offset: " << end_offset << "\n";
+  out << "\tspec_start_offset: " << spec_start_offset << "\n";
+  out << "\tspec_end_offset: " << spec_end_offset << "\n";
+  out << "\tnfft: " << nfft << "\n";
+  out << "\tnstep: " << nstep << "\n";
+  out << "\tshift: " << shift << "\n";
+  out << "\tnsamples: " << nsamples << "\n";
+  out << "\tnblocks: " << nblocks << "\n";
+  out << "\tnfreqs: " << nfreqs << "\n";
+  out << "\tfreq_start: " << freq_start << "\n";
+  out << "\tfreq_end: " << freq_end << "\n";
+  out << "\tfs: " << fs << "\n";
+  out << "}\n";
+  cout << out.str();
 }
 
 int SpecParams::get_nfft(int pad)
@@ -41,34 +55,9 @@ int SpecParams::get_nfft(int pad)
   return fmax(get_next_pow_2(shift) + pad, shift);
 }
 
-float SpecParams::get_valid_start_time(int nsamples)
+int64_t SpecParams::get_nblocks(int64_t nsamples)
 {
-  return clip_time(nsamples, fmax(0.0, start_time));
-}
-
-float SpecParams::get_valid_end_time(int nsamples)
-{
-  return clip_time(nsamples, end_time);
-}
-
-/*
- * Ensure that the given `time` does not exceed
- * the number of samples, `nsamples`
- */
-float SpecParams::clip_time(int nsamples, float time)
-{
-  return fmin(nsamples / (fs * 60.0 * 60.0), time);
-}
-
-int SpecParams::get_nsamples(int nsamples, float duration)
-{
-  // get number of samples required for our duration
-  return fmin(nsamples, hours_to_samples(fs, duration));
-}
-
-int SpecParams::get_nblocks(int nsamples)
-{
-  if (nsamples == 0)
+  if (nsamples <= 0)
   {
     return 0;
   }
@@ -81,17 +70,11 @@ int SpecParams::get_nfreqs()
 }
 
 /*
- * Add attributes to the `SpecParams` object
- * used to calculate the spectrogram
+ * Read the sample rate and length of the recording
+ * and set the window sizes used for the spectrogram
  */
-SpecParams::SpecParams(StorageBackend* backend,
-                       string mrn, float _start_time, float _end_time)
+void SpecParams::load_metadata()
 {
-  this->mrn = mrn;
-  this->backend = backend;
-  start_time = _start_time;
-  end_time = _end_time;
-
   if (backend->array_exists(mrn))
   {
     backend->open_array(mrn);
@@ -110,28 +93,111 @@ SpecParams::SpecParams(StorageBackend* backend,
   shift = fs * 4;
   nstep = fs * 1;
   nfft = get_nfft(pad);
-  float min_interval = 1;
-  start_time = get_valid_start_time(nsamples);
-  end_time = get_valid_end_time(nsamples);
+  nfreqs = get_nfreqs();
+  freq_start = 0;
+  freq_end = nfreqs;
+}
 
-  if (start_time == end_time)
+/*
+ * Restrict the spectrogram to the frequency bins covering
+ * [`min_freq`, `max_freq`] in Hz. All `nfreqs` bins are used by default.
+ */
+void SpecParams::set_band(float min_freq, float max_freq)
+{
+  freq_start = 0;
+  freq_end = nfreqs;
+  if (fs == 0)
   {
-    start_time = fmax(0, start_time - min_interval);
-  } else if (start_time > end_time)
+    return;
+  }
+  if (min_freq > max_freq)
   {
-    float tmp = start_time;
-    start_time = end_time;
-    end_time = tmp;
+    swap(min_freq, max_freq);
   }
-  float duration = end_time - start_time;
-  nsamples = get_nsamples(nsamples, duration);
-  nblocks = get_nblocks(nsamples);
-  nfreqs = get_nfreqs();
+  freq_start = min(max((int) floor(min_freq * nfft / fs), 0), nfreqs - 1);
+  freq_end = min(max((int) ceil(max_freq * nfft / fs) + 1, freq_start + 1), nfreqs);
+}
 
-  start_offset = hours_to_samples(fs, start_time);
-  end_offset = hours_to_samples(fs, end_time) - 1; // exclusive range
-  spec_start_offset = get_nblocks(start_offset);
-  spec_end_offset = get_nblocks(end_offset + 1);
+/*
+ * Convert a frequency bin to its frequency in Hz
+ */
+float SpecParams::bin_to_freq(int bin)
+{
+  return nfft ? bin * fs / (float) nfft : 0;
+}
+
+/*
+ * Set the raw data range [`start_offset`, `end_offset`) of the spectrogram.
+ * The range is aligned to whole blocks so that block `i` always covers the
+ * samples starting at `i * shift`, whether it is read from the cached
+ * spectrogram or computed on the fly.
+ */
+void SpecParams::set_range(int64_t start_offset, int64_t end_offset)
+{
+  total_nsamples = nsamples;
+  int64_t min_interval = hours_to_samples(fs, 1);
+
+  start_offset = min(max(start_offset, (int64_t) 0), total_nsamples);
+  end_offset = min(max(end_offset, (int64_t) 0), total_nsamples);
+  if (start_offset == end_offset)
+  {
+    start_offset = max((int64_t) 0, start_offset - min_interval);
+  }
+  else if (start_offset > end_offset)
+  {
+    swap(start_offset, end_offset);
+  }
+
+  total_nblocks = get_nblocks(total_nsamples);
+  if (total_nblocks == 0)
+  {
+    spec_start_offset = 0;
+    spec_end_offset = 0;
+  }
+  else
+  {
+    spec_start_offset = min(start_offset / shift, total_nblocks);
+    spec_end_offset = min((end_offset + shift - 1) / shift, total_nblocks);
+  }
+  nblocks = spec_end_offset - spec_start_offset;
+
+  this->start_offset = spec_start_offset * shift;
+  this->end_offset = this->start_offset;
+  if (nblocks > 0)
+  {
+    // the last block reads a full window past its start
+    this->end_offset = min(total_nsamples, (spec_end_offset - 1) * shift + nfft);
+  }
+  nsamples = this->end_offset - this->start_offset;
+
+  start_time = fs ? samples_to_hours(fs, this->start_offset) : 0;
+  end_time = fs ? samples_to_hours(fs, min(total_nsamples, spec_end_offset * shift)) : 0;
+}
+
+/*
+ * Add attributes to the `SpecParams` object used to calculate the
+ * spectrogram for the time range [`start_time`, `end_time`) in hours.
+ */
+SpecParams::SpecParams(StorageBackend* backend,
+                       string mrn, float start_time, float end_time)
+{
+  this->mrn = mrn;
+  this->backend = backend;
+  load_metadata();
+  set_range(hours_to_samples(fs, start_time), hours_to_samples(fs, end_time));
+}
+
+/*
+ * Add attributes to the `SpecParams` object used to calculate the
+ * spectrogram for the samples [`start_offset`, `end_offset`).
+ */
+SpecParams::SpecParams(StorageBackend* backend,
+                       string mrn, int64_t start_offset, int64_t end_offset)
+{
+  this->mrn = mrn;
+  this->backend = backend;
+  load_metadata();
+  set_range(start_offset, end_offset);
 }
 
 
@@ -152,43 +218,93 @@ static inline float abs(fftw_complex* arr, int i)
   return sqrt(arr[i][0] * arr[i][0] + arr[i][1] * arr[i][1]);
 }
 
-// copy pasta http://ofdsp.blogspot.co.il/2011/08/short-time-fourier-transform-with-fftw3.html
 /*
- * Fill the `spec_mat` matrix with values for the spectrogram for the given
- * diff.  `spec_mat` is expected to be initialized and the results are added to
- * allow averaging
+ * Magnitude of frequency bin `k` of the `nfft` real samples in `data` using
+ * the Goertzel algorithm. This matches `abs` of the FFT result for bin `k`
+ * at O(nfft) per bin, which is cheaper than a full FFT for narrow bands.
  */
-void FFT(SpecParams* spec_params, frowvec& diff, fmat& spec_mat)
+static inline float goertzel(fftw_complex* data, int nfft, int k)
 {
-  fftw_complex    *data, *fft_result;
-  fftw_plan       plan_forward;
-  int nfft = spec_params->nfft;
+  double coeff = 2 * cos(2 * M_PI * k / nfft);
+  double s0, s1 = 0, s2 = 0;
+  for (int i = 0; i < nfft; i++)
+  {
+    s0 = data[i][0] + coeff * s1 - s2;
+    s2 = s1;
+    s1 = s0;
+  }
+  return sqrt(fmax(s1 * s1 + s2 * s2 - coeff * s1 * s2, 0));
+}
 
-  int nstep = spec_params->nstep;
+/*
+ * Initialize the FFT buffers, plan and window for the transforms of
+ * `spec_params`. The workspace is reused for every block and region of a
+ * request so the plan and window are only created once.
+ */
+void init_fft_state_t(SpecParams* spec_params, fft_state_t* fft_state)
+{
+  int nfft = spec_params->nfft;
+  fft_state->nfft = nfft;
 
-  int nblocks = spec_params->nblocks;
-  int nfreqs = spec_params->nfreqs;
-  int nsamples = spec_params->nsamples;
+  // the FFT costs O(nfft * log(nfft)) per block regardless of the band,
+  // evaluating a few bins directly is cheaper
+  fft_state->use_goertzel = spec_params->freq_end - spec_params->freq_start <= log2(nfft);
 
-  data = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * nfft);
-  fft_result = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * nfft);
-  // TODO keep plans in memory until end, create plans once and cache?
-  plan_forward = fftw_plan_dft_1d(nfft, data, fft_result,
-                                  FFTW_FORWARD, FFTW_ESTIMATE);
+  fft_state->data = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * nfft);
+  fft_state->fft_result = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * nfft);
+  if (!fft_state->use_goertzel)
+  {
+    fft_state->plan_forward = fftw_plan_dft_1d(nfft, fft_state->data, fft_state->fft_result,
+                                               FFTW_FORWARD, FFTW_ESTIMATE);
+  }
 
   // Create a hamming window of appropriate length
-  float window[nfft];
-  hamming(nfft, window);
+  fft_state->window = (float*) malloc(sizeof(float) * nfft);
+  hamming(nfft, fft_state->window);
+}
 
-  for (int idx = 0; idx < nblocks; idx++)
+void free_fft_state_t(fft_state_t* fft_state)
+{
+  if (!fft_state->use_goertzel)
+  {
+    fftw_destroy_plan(fft_state->plan_forward);
+  }
+  fftw_free(fft_state->data);
+  fftw_free(fft_state->fft_result);
+  free(fft_state->window);
+}
+
+// copy pasta http://ofdsp.blogspot.co.il/2011/08/short-time-fourier-transform-with-fftw3.html
+/*
+ * Fill the `spec_mat` (nbins x nblocks) matrix with values for the
+ * spectrogram for the given diff, keeping only the frequency bins
+ * [`freq_start`, `freq_end`). Block `i` is the window starting at sample
+ * `i * shift` of `diff`. `spec_mat` is expected to be initialized and the
+ * results are added to allow averaging
+ */
+void FFT(SpecParams* spec_params, fft_state_t* fft_state, frowvec& diff,
+    int64_t nblocks, fmat& spec_mat)
+{
+  fftw_complex* data = fft_state->data;
+  fftw_complex* fft_result = fft_state->fft_result;
+  float* window = fft_state->window;
+  int nfft = fft_state->nfft;
+
+  int shift = spec_params->shift;
+
+  int freq_start = spec_params->freq_start;
+  int freq_end = spec_params->freq_end;
+  int64_t nsamples = diff.n_elem;
+
+  for (int64_t idx = 0; idx < nblocks; idx++)
   {
     // get the last chunk
-    if (idx * nstep + nfft > nsamples)
+    if (idx * shift + nfft > nsamples)
     {
-      int upper_bound = nsamples - idx * nstep;
+      int upper_bound = nsamples - idx * shift;
       for (int i = 0; i < upper_bound; i++)
       {
-        data[i][0] = diff(idx * nstep + i) * window[i];
+        data[i][0] = diff(idx * shift + i) * window[i];
         data[i][1] = 0.0;
 
       }
@@ -197,26 +313,35 @@ void FFT(SpecParams* spec_params, frowvec& diff, fmat& spec_mat)
         data[i][0] = 0.0;
         data[i][1] = 0.0;
       }
-      break;
     }
     else
     {
       for (int i = 0; i < nfft; i++)
       {
         // TODO vector multiplication?
-        data[i][0] = diff(idx * nstep  + i) * window[i];
+        data[i][0] = diff(idx * shift + i) * window[i];
         data[i][1] = 0.0;
       }
     }
 
+    float* spec_col = spec_mat.colptr(idx);
+    if (fft_state->use_goertzel)
+    {
+      for (int i = freq_start; i < freq_end; i++)
+      {
+        spec_col[i - freq_start] += goertzel(data, nfft, i) / nfft;
+      }
+      continue;
+    }
+
     // Perform the FFT on our chunk
-    fftw_execute(plan_forward);
+    fftw_execute(fft_state->plan_forward);
 
     // TODO: change maybe?
     // http://www.fftw.org/fftw2_doc/fftw_2.html
-    for (int i = 0; i < nfreqs; i++)
+    for (int i = freq_start; i < freq_end; i++)
     {
-      spec_mat(idx, i) += abs(fft_result, i) / nfft;
+      spec_col[i - freq_start] += abs(fft_result, i) / nfft;
     }
 
     // Uncomment to see the raw-data output from the FFT calculation
@@ -227,60 +352,570 @@ void FFT(SpecParams* spec_params, frowvec& diff, fmat& spec_mat)
     // }
     // printf("]\n");
   }
-
-  fftw_destroy_plan(plan_forward);
-
-  fftw_free(data);
-  fftw_free(fft_result);
 }
 
-void eeg_spectrogram(SpecParams* spec_params, int ch, fmat& spec_mat)
+/*
+ * Mark the channels used by region `ch` in `needed`, indexed by
+ * `CH_REVERSE_IDX`
+ */
+static void mark_channels(int ch, bool* needed)
 {
+  for (int i = 0; i < NUM_DIFFS; i++)
+  {
+    needed[CH_REVERSE_IDX[DIFFERENCE_PAIRS[ch].ch_idx[i]]] = true;
+  }
+}
 
+/*
+ * Read the raw samples of the blocks [`block_start`, `block_end`) of the
+ * recording of `spec_params` for every channel marked in `needed`. Each
+ * channel is read once however many regions use it. Returns the time spent
+ * reading.
+ */
+static unsigned long long read_channels(SpecParams* spec_params, bool* needed,
+    int64_t block_start, int64_t block_end, frowvec* channels)
+{
   unsigned long long read_time_total = 0;
   unsigned long long read_time_start;
 
-  // nfreqs x nblocks matrix
-  spec_mat.set_size(spec_params->nblocks, spec_params->nfreqs);
-  spec_mat.fill(0); // can we eliminate this?
-
-  int nsamples = spec_params->nsamples;
+  int64_t start_offset = block_start * spec_params->shift;
+  int64_t end_offset = min(spec_params->total_nsamples,
+      (block_end - 1) * spec_params->shift + spec_params->nfft);
+  int64_t nsamples = end_offset - start_offset;
 
-  int ch_idx1, ch_idx2;
-  // Get the column which contains the first channel for the region.
-  ch_idx1 = DIFFERENCE_PAIRS[ch].ch_idx[0];
-  int start_offset = spec_params->start_offset;
-  int end_offset = spec_params->end_offset;
+  for (int i = 0; i < NCHANNELS; i++)
+  {
+    if (!needed[i])
+    {
+      continue;
+    }
+    channels[i].set_size(nsamples);
+    read_time_start = getticks();
+    unsigned long long span_start = get_monotonic_ticks();
+    spec_params->backend->read_array(spec_params->mrn, CHANNEL_ARRAY[i],
+        start_offset, end_offset, channels[i]);
+    trace_span(STAGE_READ, span_start);
+    trace_bytes_read(sizeof(float) * channels[i].n_elem);
+    read_time_total += getticks() - read_time_start;
+  }
+  return read_time_total;
+}
 
-  frowvec vec1 = frowvec(nsamples);
-  frowvec vec2 = frowvec(nsamples);
-  read_time_start = getticks();
-  spec_params->backend->read_array(spec_params->mrn, ch_idx1, start_offset, end_offset, vec1);
-  read_time_total += getticks() - read_time_start;
+/*
+ * Fill `spec_mat` (nbins x nblocks) with the spectrogram band of region `ch`
+ * for the `nblocks` blocks starting at block `first_block` of the raw
+ * `channels` read by `read_channels`.
+ */
+static void region_spectrogram(SpecParams* spec_params, fft_state_t* fft_state, int ch,
+    frowvec* channels, int64_t first_block, int64_t nblocks, fmat& spec_mat)
+{
+  spec_mat.zeros(spec_params->freq_end - spec_params->freq_start, nblocks);
+  if (nblocks <= 0)
+  {
+    return;
+  }
 
+  unsigned long long span_start = get_monotonic_ticks();
+  frowvec diff;
   for (int i = 1; i < NUM_DIFFS; i++)
   {
-    // Get the column which contains the next channel for the region.
-    ch_idx2 = DIFFERENCE_PAIRS[ch].ch_idx[i];
-    read_time_start = getticks();
-    spec_params->backend->read_array(spec_params->mrn, ch_idx2, start_offset, end_offset, vec2);
-    read_time_total += getticks() - read_time_start;
-    frowvec diff = vec2 - vec1;
+    // the diff is (i + 1) - (i) of the channels of the region
+    frowvec& vec1 = channels[CH_REVERSE_IDX[DIFFERENCE_PAIRS[ch].ch_idx[i - 1]]];
+    frowvec& vec2 = channels[CH_REVERSE_IDX[DIFFERENCE_PAIRS[ch].ch_idx[i]]];
+    uword first = first_block * spec_params->shift;
+    uword last = min((uword) ((first_block + nblocks - 1) * spec_params->shift + spec_params->nfft),
+        vec1.n_elem);
+    diff = vec2.cols(first, last - 1) - vec1.cols(first, last - 1);
 
     // fill in the spec matrix with FFT values
-    FFT(spec_params, diff, spec_mat);
-    swap(vec1, vec2);
+    FFT(spec_params, fft_state, diff, nblocks, spec_mat);
   }
   spec_mat /=  (NUM_DIFFS - 1); // average diff spectrograms
-  spec_mat = spec_mat.t(); // transpose the output
+  trace_span(STAGE_FFT, span_start);
+}
+
+/*
+ * Fill `spec_mat` (nbins x nblocks) with the spectrogram band of region `ch`
+ * for the blocks [`block_start`, `block_end`) of `spec_params`. Only the raw
+ * samples covered by those blocks are read. Returns the time spent reading.
+ */
+static unsigned long long spectrogram_blocks(SpecParams* spec_params, fft_state_t* fft_state,
+    int ch, int64_t block_start, int64_t block_end, fmat& spec_mat)
+{
+  int64_t nblocks = block_end - block_start;
+  if (nblocks <= 0)
+  {
+    spec_mat.zeros(spec_params->freq_end - spec_params->freq_start, 0);
+    return 0;
+  }
+
+  bool needed[NCHANNELS] = {false};
+  frowvec channels[NCHANNELS];
+  mark_channels(ch, needed);
+  unsigned long long read_time_total = read_channels(spec_params, needed,
+      block_start, block_end, channels);
+  region_spectrogram(spec_params, fft_state, ch, channels, 0, nblocks, spec_mat);
+  return read_time_total;
+}
 
+/*
+ * Log the time spent reading for the experiments
+ */
+static void log_read_time(SpecParams* spec_params, string ch_name, unsigned long long read_time_total)
+{
   string log_line = EXPERIMENT_TAG +  spec_params->mrn + "," + TOSTRING(BACKEND) + "," + to_string(WRITE_CHUNK_SIZE);
-  cout << log_line << "," << ticks_to_seconds(read_time_total) << ",read_time-" << CH_NAME_MAP[ch] << endl;
+  cout << log_line << "," << ticks_to_seconds(read_time_total) << ",read_time-" << ch_name << "\n";
+}
+
+/*
+ * Fill `spec_mat` (nbins x nblocks) with the full resolution
+ * spectrogram of region `ch` for `spec_params`
+ */
+void eeg_spectrogram(SpecParams* spec_params, int ch, fmat& spec_mat)
+{
+  fft_state_t fft_state;
+  init_fft_state_t(spec_params, &fft_state);
+  unsigned long long read_time_total = spectrogram_blocks(spec_params, &fft_state, ch,
+      spec_params->spec_start_offset, spec_params->spec_end_offset, spec_mat);
+  free_fft_state_t(&fft_state);
+  log_read_time(spec_params, CH_NAME_MAP[ch], read_time_total);
+}
+
+/*
+ * Fill `spec_mat` (nbins x ncols) with the mean of every `extent` blocks of
+ * the band of `spec_params` from the prefix sums `prefix_mrn_name` of the
+ * cached spectrogram. Only the `ncols + 1` group boundaries are read, however
+ * many blocks the range spans. Returns the time spent reading.
+ */
+static unsigned long long prefix_spectrogram(SpecParams* spec_params, string prefix_mrn_name,
+    uint extent, fmat& spec_mat)
+{
+  StorageBackend* backend = spec_params->backend;
+  vector<int64_t> rows(spec_mat.n_cols + 1);
+  for (uword col = 0; col < rows.size(); col++)
+  {
+    rows[col] = spec_params->spec_start_offset + col * extent;
+  }
+
+  // each bin is stored as a hi, lo pair
+  fmat prefix_mat = fmat(2 * spec_mat.n_rows, rows.size());
+  backend->open_array(prefix_mrn_name);
+  unsigned long long read_time_start = getticks();
+  unsigned long long span_start = get_monotonic_ticks();
+  backend->read_rows(prefix_mrn_name, rows, 2 * spec_params->freq_start,
+      2 * spec_params->freq_end, prefix_mat);
+  trace_span(STAGE_READ, span_start);
+  trace_bytes_read(sizeof(float) * prefix_mat.n_elem);
+  unsigned long long read_time_total = getticks() - read_time_start;
+  backend->close_array(prefix_mrn_name);
+
+  span_start = get_monotonic_ticks();
+  prefix_means(prefix_mat, rows, spec_mat);
+  trace_span(STAGE_AGGREGATE, span_start);
+  return read_time_total;
+}
+
+/*
+ * Fill `spec_mat` (nbins x ncols) from the cached spectrogram
+ * `cached_mrn_name`, reducing every `extent` blocks to one with `method`.
+ * The range is read in windows of about `READ_CHUNK_SIZE` samples. Returns
+ * the time spent reading.
+ */
+static unsigned long long cached_spectrogram(SpecParams* spec_params, string cached_mrn_name,
+    uint extent, int method, fmat& spec_mat)
+{
+  StorageBackend* backend = spec_params->backend;
+  int64_t spec_end_offset = spec_params->spec_end_offset;
+  int64_t window_nblocks = max(READ_CHUNK_SIZE / max(spec_params->shift, 1), 1);
+
+  unsigned long long read_time_total = 0;
+  unsigned long long read_time_start;
+  fmat window_mat;
+  ColumnAggregator aggregator = ColumnAggregator(method, extent,
+      spec_mat.n_rows, spec_mat.n_cols, spec_mat.memptr());
+  backend->open_array(cached_mrn_name);
+  for (int64_t block_start = spec_params->spec_start_offset;
+      block_start < spec_end_offset && !aggregator.done();
+      block_start += window_nblocks)
+  {
+    int64_t block_end = min(block_start + window_nblocks, spec_end_offset);
+    window_mat.set_size(spec_mat.n_rows, block_end - block_start);
+    read_time_start = getticks();
+    unsigned long long span_start = get_monotonic_ticks();
+    backend->read_array(cached_mrn_name, block_start, block_end,
+        spec_params->freq_start, spec_params->freq_end, window_mat);
+    trace_span(STAGE_READ, span_start);
+    trace_bytes_read(sizeof(float) * window_mat.n_elem);
+    read_time_total += getticks() - read_time_start;
+
+    span_start = get_monotonic_ticks();
+    for (uword i = 0; i < window_mat.n_cols && !aggregator.done(); i++)
+    {
+      aggregator.push(window_mat.colptr(i));
+    }
+    trace_span(STAGE_AGGREGATE, span_start);
+  }
+  backend->close_array(cached_mrn_name);
+  return read_time_total;
+}
+
+/*
+ * Fill `window_mat` (nbins x nblocks) with the spectrogram band of region
+ * `ch` for the blocks [`block_start`, `block_end`) of the raw `channels`,
+ * which start at `block_start`. Valid chunks are read from the sparse
+ * `cache` and the gaps are computed over the `SPARSE_BAND` bands of the band
+ * with `band_fft_state` so they can be written back, unless another request
+ * is already computing them. `block_start` is aligned to `SPARSE_CHUNK`.
+ * Without a `window_mat` only the gaps are filled.
+ */
+static void sparse_window(SpecParams* spec_params, fft_state_t* band_fft_state, int ch,
+    frowvec* channels, SparseCache* cache, int64_t block_start, int64_t block_end,
+    fmat* window_mat)
+{
+  int freq_start = spec_params->freq_start;
+  int freq_end = spec_params->freq_end;
+  int band_start = get_sparse_freq_start(freq_start);
+  int band_end = get_sparse_freq_end(freq_end, spec_params->nfreqs);
+  if (window_mat)
+  {
+    window_mat->set_size(freq_end - freq_start, block_end - block_start);
+  }
+
+  fmat run_mat;
+  int64_t run_end;
+  for (int64_t run_start = block_start; run_start < block_end; run_start = run_end)
+  {
+    // the longest run of chunks that are all valid or all missing
+    bool valid = cache->is_valid(run_start, min(run_start + SPARSE_CHUNK, block_end),
+        freq_start, freq_end);
+    run_end = run_start;
+    while (run_end < block_end &&
+        cache->is_valid(run_end, min(run_end + SPARSE_CHUNK, block_end), freq_start, freq_end) == valid)
+    {
+      run_end = min(run_end + SPARSE_CHUNK, block_end);
+    }
+
+    if (valid)
+    {
+      if (window_mat)
+      {
+        run_mat.set_size(freq_end - freq_start, run_end - run_start);
+        unsigned long long span_start = get_monotonic_ticks();
+        cache->read(run_start, run_end, freq_start, freq_end, run_mat);
+        trace_span(STAGE_READ, span_start);
+        trace_bytes_read(sizeof(float) * run_mat.n_elem);
+        window_mat->cols(run_start - block_start, run_end - block_start - 1) = run_mat;
+      }
+      continue;
+    }
+    if (!cache->claim(run_start, run_end))
+    {
+      run_end = run_start; // another request computed some of the run meanwhile
+      continue;
+    }
+
+    spec_params->freq_start = band_start;
+    spec_params->freq_end = band_end;
+    region_spectrogram(spec_params, band_fft_state, ch, channels,
+        run_start - block_start, run_end - run_start, run_mat);
+    spec_params->freq_start = freq_start;
+    spec_params->freq_end = freq_end;
+
+    cache->write(run_start, band_start, run_mat);
+    if (window_mat)
+    {
+      window_mat->cols(run_start - block_start, run_end - block_start - 1) =
+        run_mat.rows(freq_start - band_start, freq_end - band_start - 1);
+    }
+  }
+}
+
+/*
+ * Initialize `fft_state` for the `SPARSE_BAND` bands covering the band of
+ * `spec_params`, the bins the gaps of the sparse spectrograms are computed
+ * with
+ */
+static void init_sparse_fft_state_t(SpecParams* spec_params, fft_state_t* fft_state)
+{
+  int freq_start = spec_params->freq_start;
+  int freq_end = spec_params->freq_end;
+  spec_params->freq_start = get_sparse_freq_start(freq_start);
+  spec_params->freq_end = get_sparse_freq_end(freq_end, spec_params->nfreqs);
+  init_fft_state_t(spec_params, fft_state);
+  spec_params->freq_start = freq_start;
+  spec_params->freq_end = freq_end;
+}
+
+/*
+ * Fill `spec_mats[i]` with the spectrogram of region `chs[i]` for
+ * `spec_params`, reducing every `extent` blocks to one with the downsampling
+ * `method`. Mean downsampling is answered from the prefix sums if they were
+ * precomputed, otherwise the cached spectrogram is used if available. The
+ * remaining regions are computed together in windows of about
+ * `READ_CHUNK_SIZE` samples: every raw channel they use is read once per
+ * window and the FFT workspace is shared, so regions with common channels
+ * (e.g. FP1 for LL and LP) don't read them twice. Each window is reduced into
+ * the outputs as it is produced, so peak memory is bounded by the window and
+ * output sizes rather than the length of the range.
+ *
+ * With `SPARSE_CACHE` the computed blocks are written back to a sparse
+ * spectrogram of each region and later requests only compute the chunks
+ * that are still missing. The windows are then aligned to `SPARSE_CHUNK` so
+ * every computed chunk is complete.
+ *
+ * `cancelled` is checked before every window of the computed regions.
+ * Returns false if it stopped the computation, leaving the outputs
+ * incomplete.
+ */
+bool stream_spectrograms(SpecParams* spec_params, vector<int>& chs, uint extent, int method,
+    fmat* spec_mats, const function<bool()>& cancelled)
+{
+  StorageBackend* backend = spec_params->backend;
+  extent = max(extent, 1u);
+  int nbins = spec_params->freq_end - spec_params->freq_start;
+  bool has_data = backend->array_exists(spec_params->mrn);
+
+  bool needed[NCHANNELS] = {false};
+  vector<int> computed; // indices into `chs` computed from the raw data
+  string computed_names;
+  for (uint i = 0; i < chs.size(); i++)
+  {
+    int ch = chs[i];
+    fmat& spec_mat = spec_mats[i];
+    string cached_mrn_name = backend->mrn_to_cached_mrn_name(spec_params->mrn, CH_NAME_MAP[ch]);
+    string prefix_mrn_name = backend->mrn_to_prefix_mrn_name(spec_params->mrn, CH_NAME_MAP[ch]);
+    spec_mat.zeros(nbins, spec_params->nblocks / extent);
+    bool has_cached = backend->array_exists(cached_mrn_name);
+    // the prefix sums read two values of a bin per output column where the
+    // cached spectrogram reads `extent`, so they only help past an extent of 2
+    if (method == DOWNSAMPLE_MEAN && (extent > 2 || (extent > 1 && !has_cached)) &&
+        backend->array_exists(prefix_mrn_name))
+    {
+      unsigned long long read_time = prefix_spectrogram(spec_params, prefix_mrn_name, extent, spec_mat);
+      if (VERBOSE)
+      {
+        cout << "Using cached prefix sums!\n";
+        log_read_time(spec_params, CH_NAME_MAP[ch], read_time);
+      }
+    }
+    else if (has_cached)
+    {
+      unsigned long long read_time = cached_spectrogram(spec_params, cached_mrn_name,
+          extent, method, spec_mat);
+      if (VERBOSE)
+      {
+        cout << "Using cached visualization!\n";
+        log_read_time(spec_params, CH_NAME_MAP[ch], read_time);
+      }
+    }
+    else if (has_data)
+    {
+      mark_channels(ch, needed);
+      computed.push_back(i);
+      computed_names += (computed_names.empty() ? "" : "+") + CH_NAME_MAP[ch];
+    }
+  }
+  if (computed.empty())
+  {
+    return true;
+  }
+
+  int64_t spec_start_offset = spec_params->spec_start_offset;
+  int64_t spec_end_offset = spec_params->spec_end_offset;
+  int64_t window_nblocks = max(READ_CHUNK_SIZE / max(spec_params->shift, 1), 1);
+  int64_t window_start = spec_start_offset;
+  int64_t window_end = spec_end_offset;
+
+  bool sparse = SPARSE_CACHE && backend->positional_writes();
+  vector<unique_ptr<SparseCache>> caches;
+  if (sparse)
+  {
+    window_nblocks = max(window_nblocks / SPARSE_CHUNK, (int64_t) 1) * SPARSE_CHUNK;
+    window_start = spec_start_offset / SPARSE_CHUNK * SPARSE_CHUNK;
+    window_end = min((spec_end_offset + SPARSE_CHUNK - 1) / SPARSE_CHUNK * SPARSE_CHUNK,
+        spec_params->total_nblocks);
+    for (uint i = 0; i < computed.size(); i++)
+    {
+      caches.push_back(unique_ptr<SparseCache>(new SparseCache(backend, spec_params->mrn,
+              CH_NAME_MAP[chs[computed[i]]], spec_params->fs, spec_params->total_nblocks,
+              spec_params->nfreqs)));
+    }
+  }
+
+  vector<ColumnAggregator> aggregators;
+  for (uint i = 0; i < computed.size(); i++)
+  {
+    fmat& spec_mat = spec_mats[computed[i]];
+    aggregators.push_back(ColumnAggregator(method, extent,
+          spec_mat.n_rows, spec_mat.n_cols, spec_mat.memptr()));
+  }
+
+  // the gaps of the sparse spectrograms are computed for whole bands
+  fft_state_t fft_state;
+  if (sparse)
+  {
+    init_sparse_fft_state_t(spec_params, &fft_state);
+  }
+  else
+  {
+    init_fft_state_t(spec_params, &fft_state);
+  }
+  unsigned long long read_time_total = 0;
+  frowvec channels[NCHANNELS];
+  fmat window_mat;
+  for (int64_t block_start = window_start;
+      block_start < window_end && !aggregators[0].done();
+      block_start += window_nblocks)
+  {
+    int64_t block_end = min(block_start + window_nblocks, window_end);
+    if (cancelled && cancelled())
+    {
+      free_fft_state_t(&fft_state);
+      return false;
+    }
+
+    // only the channels of regions with missing chunks are read
+    if (sparse)
+    {
+      fill(needed, needed + NCHANNELS, false);
+      for (uint i = 0; i < computed.size(); i++)
+      {
+        if (!caches[i]->is_valid(block_start, block_end, spec_params->freq_start, spec_params->freq_end))
+        {
+          mark_channels(chs[computed[i]], needed);
+        }
+      }
+    }
+    read_time_total += read_channels(spec_params, needed, block_start, block_end, channels);
+
+    // every region has the same number of output columns
+    uword first_col = max(spec_start_offset - block_start, (int64_t) 0);
+    uword last_col = min(spec_end_offset, block_end) - block_start;
+    for (uint i = 0; i < computed.size(); i++)
+    {
+      if (sparse)
+      {
+        sparse_window(spec_params, &fft_state, chs[computed[i]], channels,
+            caches[i].get(), block_start, block_end, &window_mat);
+      }
+      else
+      {
+        region_spectrogram(spec_params, &fft_state, chs[computed[i]], channels,
+            0, block_end - block_start, window_mat);
+      }
+      unsigned long long span_start = get_monotonic_ticks();
+      for (uword col = first_col; col < last_col && !aggregators[i].done(); col++)
+      {
+        aggregators[i].push(window_mat.colptr(col));
+      }
+      trace_span(STAGE_AGGREGATE, span_start);
+    }
+  }
+  free_fft_state_t(&fft_state);
+  if (VERBOSE)
+  {
+    log_read_time(spec_params, computed_names, read_time_total);
+  }
+  return true;
+}
+
+/*
+ * Fill `spec_mat` with the spectrogram of region `ch` for `spec_params`,
+ * reducing every `extent` blocks to one with the downsampling `method`.
+ * See `stream_spectrograms`.
+ */
+void stream_spectrogram(SpecParams* spec_params, int ch, uint extent, int method, fmat& spec_mat)
+{
+  vector<int> chs = {ch};
+  stream_spectrograms(spec_params, chs, extent, method, &spec_mat);
+}
+
+/*
+ * Compute the chunks still missing from the sparse spectrograms of `mrn`,
+ * e.g. in the background for a recording that was viewed before it was
+ * precomputed. Regions with a cached spectrogram are skipped.
+ */
+void fill_spectrogram_gaps(string mrn, StorageBackend* backend)
+{
+  if (!backend->positional_writes())
+  {
+    cout << "Sparse spectrograms are not supported by " << TOSTRING(BACKEND) << endl;
+    return;
+  }
+  if (!backend->array_exists(mrn))
+  {
+    cout << "Could not find the recording: " << mrn << endl;
+    return;
+  }
+  backend->open_array(mrn);
+  SpecParams spec_params = SpecParams(backend, mrn, (int64_t) 0, backend->get_nsamples(mrn));
+  int64_t total_nblocks = spec_params.total_nblocks;
+  int64_t window_nblocks = max(READ_CHUNK_SIZE / max(spec_params.shift, 1) / SPARSE_CHUNK, 1) * SPARSE_CHUNK;
+
+  fft_state_t fft_state;
+  init_sparse_fft_state_t(&spec_params, &fft_state);
+  frowvec channels[NCHANNELS];
+  for (int ch = 0; ch < NUM_DIFF; ch++)
+  {
+    string ch_name = CH_NAME_MAP[ch];
+    if (backend->array_exists(backend->mrn_to_cached_mrn_name(mrn, ch_name)))
+    {
+      cout << "Skipping cached region: " << ch_name << endl;
+      continue;
+    }
+
+    SparseCache cache(backend, mrn, ch_name, spec_params.fs, total_nblocks, spec_params.nfreqs);
+    if (!cache.is_usable())
+    {
+      cout << "Skipping region in use with other parameters: " << ch_name << endl;
+      continue;
+    }
+    bool needed[NCHANNELS] = {false};
+    mark_channels(ch, needed);
+    int64_t nfilled = 0;
+    for (int64_t block_start = 0; block_start < total_nblocks; block_start += window_nblocks)
+    {
+      int64_t block_end = min(block_start + window_nblocks, total_nblocks);
+      if (cache.is_valid(block_start, block_end, spec_params.freq_start, spec_params.freq_end))
+      {
+        continue;
+      }
+      read_channels(&spec_params, needed, block_start, block_end, channels);
+      sparse_window(&spec_params, &fft_state, ch, channels, &cache, block_start, block_end, NULL);
+      nfilled += block_end - block_start;
+    }
+    cout << "Filled " << nfilled << " of " << total_nblocks << " blocks of region: " << ch_name << endl;
+  }
+  free_fft_state_t(&fft_state);
+  backend->close_array(mrn);
+}
+
+/*
+ * Flush the arrays written for a region to disk and close them
+ */
+static void close_region_arrays(StorageBackend* backend, vector<string>& mrn_names, bool sync)
+{
+  for (string& mrn_name : mrn_names)
+  {
+    if (backend->array_exists(mrn_name))
+    {
+      if (sync)
+      {
+        backend->sync_array(mrn_name);
+      }
+      backend->close_array(mrn_name);
+    }
+  }
 }
 
 /*
  * Compute and store the spectrogram data for
- * the given `mrn` for all available time
+ * the given `mrn` for all available time.
+ *
+ * The arrays of each region are written under temporary names and renamed
+ * once complete, so viewers never read a partially written spectrogram.
+ * Progress is recorded in a `PrecomputeJournal` after every chunk, and an
+ * interrupted precomputation continues from the last recorded chunk.
  */
 void precompute_spectrogram(string mrn, StorageBackend* backend)
 {
@@ -292,71 +927,170 @@ void precompute_spectrogram(string mrn, StorageBackend* backend)
 
   backend->open_array(mrn);
 
-  int fs = backend->get_fs(mrn);
-  int nsamples = backend->get_nsamples(mrn);
-
-  int nchunks = ceil(nsamples / (float) WRITE_CHUNK_SIZE);
-  cout << "Computing " << nchunks << " chunks and " << nsamples << " samples." << endl;
-
-  float start_time, end_time;
-  int start_offset, end_offset, cached_start_offset, cached_end_offset;
-  fmat spec_mat;
+  int64_t nsamples = backend->get_nsamples(mrn);
 
   // Create array for writing
-  start_time = 0;
-  end_time = samples_to_hours(fs, nsamples);
-
-  SpecParams spec_params = SpecParams(backend, mrn, start_time, end_time);
+  SpecParams spec_params = SpecParams(backend, mrn, (int64_t) 0, nsamples);
   spec_params.print();
-  ArrayMetadata metadata = ArrayMetadata(fs, spec_params.nblocks, spec_params.nblocks, spec_params.nfreqs);
+  int fs = spec_params.fs;
+  int shift = spec_params.shift;
+  int nfreqs = spec_params.nfreqs;
+  int64_t nblocks = spec_params.nblocks;
+  ArrayMetadata metadata = ArrayMetadata(fs, nblocks, nblocks, nfreqs);
   cout << metadata.to_string() << endl;
 
+  // each chunk covers a whole number of blocks so the chunks
+  // line up exactly with the blocks of the full spectrogram
+  int64_t chunk_nblocks = max(WRITE_CHUNK_SIZE / shift, 1);
+  int64_t nchunks = (nblocks + chunk_nblocks - 1) / chunk_nblocks;
+  cout << "Computing " << nchunks << " chunks and " << nsamples << " samples." << endl;
+
+  // progress can only be resumed with the same layout of chunks and arrays
+  string signature = metadata.to_string() + " " + to_string(chunk_nblocks) + " " +
+    TOSTRING(BACKEND) + " " + to_string(CACHE_CODEC) + " " + to_string(SPEC_PREFIX);
+  PrecomputeJournal journal = PrecomputeJournal(mrn, signature);
+
+  int64_t cached_start_offset, cached_end_offset;
+  fmat spec_mat;
+  fmat bp_mat;
+  region_progress_t progress;
+
   for (int ch = 0; ch < NUM_DIFF; ch++)
   {
     string ch_name = CH_NAME_MAP[ch];
     string cached_mrn_name = backend->mrn_to_cached_mrn_name(mrn, ch_name);
+    string prefix_mrn_name = backend->mrn_to_prefix_mrn_name(mrn, ch_name);
+    string bp_mrn_name = backend->mrn_to_bandpower_mrn_name(mrn, ch_name);
+    string bp_prefix_mrn_name = backend->mrn_to_bandpower_prefix_mrn_name(mrn, ch_name);
+    string cp_mrn_name = backend->mrn_to_changepoints_mrn_name(mrn, ch_name);
 
-    cout << "Creating: " << cached_mrn_name << endl;
-    backend->create_array(cached_mrn_name, &metadata);
+    // final names of the arrays of the region, written under temporary names
+    vector<string> mrn_names = {cached_mrn_name, bp_mrn_name, bp_prefix_mrn_name, cp_mrn_name};
+    if (SPEC_PREFIX)
+    {
+      mrn_names.push_back(prefix_mrn_name);
+    }
+    vector<string> tmp_mrn_names;
+    for (string& mrn_name : mrn_names)
+    {
+      tmp_mrn_names.push_back(backend->mrn_to_tmp_mrn_name(mrn_name));
+    }
+    string tmp_cached_mrn_name = backend->mrn_to_tmp_mrn_name(cached_mrn_name);
+    string tmp_prefix_mrn_name = backend->mrn_to_tmp_mrn_name(prefix_mrn_name);
+    string tmp_bp_mrn_name = backend->mrn_to_tmp_mrn_name(bp_mrn_name);
+    string tmp_bp_prefix_mrn_name = backend->mrn_to_tmp_mrn_name(bp_prefix_mrn_name);
+    string tmp_cp_mrn_name = backend->mrn_to_tmp_mrn_name(cp_mrn_name);
 
-    start_offset = 0;
-    end_offset = min(nsamples, WRITE_CHUNK_SIZE);
+    init_region_progress_t(&progress, nfreqs);
+    journal.load(ch, &progress);
+    if (progress.published && backend->array_exists(cached_mrn_name))
+    {
+      cout << "Skipping published region: " << ch_name << endl;
+      continue;
+    }
 
-    start_time = samples_to_hours(fs, start_offset);
-    end_time = samples_to_hours(fs, end_offset);
+    // the temporary arrays of an interrupted run hold the recorded chunks
+    bool resume = progress.end_block > 0 && !progress.published && backend->positional_writes();
+    for (uint i = 0; resume && i < mrn_names.size(); i++)
+    {
+      resume = mrn_names[i] == cp_mrn_name || backend->array_exists(tmp_mrn_names[i]);
+    }
+    if (resume)
+    {
+      cout << "Resuming: " << cached_mrn_name << " at block " << progress.end_block << endl;
+    }
+    else
+    {
+      init_region_progress_t(&progress, nfreqs);
+      cout << "Creating: " << tmp_cached_mrn_name << endl;
+      backend->create_array(tmp_cached_mrn_name, &metadata);
 
-    spec_params = SpecParams(backend, mrn, start_time, end_time);
+      create_band_power_arrays(backend, tmp_bp_mrn_name, tmp_bp_prefix_mrn_name, fs, nblocks);
 
-    cached_start_offset = 0;
-    cached_end_offset = spec_params.nblocks;
+      if (SPEC_PREFIX)
+      {
+        // row `i` holds the sums of the blocks [0, `i`)
+        ArrayMetadata prefix_metadata = ArrayMetadata(fs, nblocks + 1, nblocks + 1, 2 * nfreqs);
+        cout << "Creating: " << tmp_prefix_mrn_name << endl;
+        backend->create_array(tmp_prefix_mrn_name, &prefix_metadata);
+        fmat zero_row = zeros<fmat>(2 * nfreqs, 1);
+        backend->write_array(tmp_prefix_mrn_name, ALL, 0, 1, zero_row);
+      }
+    }
 
-    for (; end_offset <= nsamples; end_offset = min(end_offset + WRITE_CHUNK_SIZE, nsamples))
+    fmat prefix_mat;
+    for (cached_start_offset = progress.end_block; cached_start_offset < nblocks; cached_start_offset = cached_end_offset)
     {
-      start_time = samples_to_hours(fs, start_offset);
-      end_time = samples_to_hours(fs, end_offset);
-
-      spec_params = SpecParams(backend, mrn, start_time, end_time);
-      spec_params.nsamples = end_offset - start_offset;
+      cached_end_offset = min(cached_start_offset + chunk_nblocks, nblocks);
+      spec_params = SpecParams(backend, mrn, cached_start_offset * shift, cached_end_offset * shift);
 
+      unsigned long long span_start = get_monotonic_ticks();
       eeg_spectrogram(&spec_params, ch, spec_mat);
+      trace_complete("spectrogram", span_start, get_monotonic_ticks());
+
+      write_time_start = getticks();
+      span_start = get_monotonic_ticks();
+      backend->write_array(tmp_cached_mrn_name, ALL, cached_start_offset, cached_end_offset, spec_mat);
+      write_time_total += getticks() - write_time_start;
+      trace_complete("write", span_start, get_monotonic_ticks());
+
+      // the change point, band power and prefix sum state carry over between chunks
+      span_start = get_monotonic_ticks();
+      band_power(&spec_params, spec_mat, bp_mat);
+      trace_complete("band_power", span_start, get_monotonic_ticks());
+      write_time_start = getticks();
+      write_band_power(backend, tmp_bp_mrn_name, tmp_bp_prefix_mrn_name, cached_start_offset,
+          bp_mat, &progress.bp_state);
+      write_time_total += getticks() - write_time_start;
 
+      if (SPEC_PREFIX)
+      {
+        prefix_sums(spec_mat, progress.prefix_state.data(), prefix_mat);
+        write_time_start = getticks();
+        backend->write_array(tmp_prefix_mrn_name, ALL, cached_start_offset + 1, cached_end_offset + 1, prefix_mat);
+        write_time_total += getticks() - write_time_start;
+      }
+
+      update_change_points(spec_mat, &progress.cp_state, progress.cp_blocks);
+
+      // the chunk must be on disk before the journal says so
       write_time_start = getticks();
-      backend->write_array(cached_mrn_name, ALL, cached_start_offset, cached_end_offset, spec_mat);
+      span_start = get_monotonic_ticks();
+      for (string& tmp_mrn_name : tmp_mrn_names)
+      {
+        if (tmp_mrn_name != tmp_cp_mrn_name)
+        {
+          backend->sync_array(tmp_mrn_name);
+        }
+      }
+      progress.end_block = cached_end_offset;
+      journal.commit(ch, &progress);
       write_time_total += getticks() - write_time_start;
+      trace_complete("sync", span_start, get_monotonic_ticks());
+      trace_counter(CH_NAME_MAP[ch].c_str(), get_monotonic_ticks(), cached_end_offset);
+    }
 
-      start_offset = end_offset;
-      cached_start_offset = cached_end_offset;
-      cached_end_offset = min(cached_end_offset + spec_params.nblocks, metadata.nsamples);
+    cout << "Creating: " << tmp_cp_mrn_name << " with " << progress.cp_blocks.size() << " change points" << endl;
+    write_change_points(backend, tmp_cp_mrn_name, fs, progress.cp_blocks);
+    close_region_arrays(backend, tmp_mrn_names, true);
 
-      // ensure we write the last part of the samples
-      if (end_offset == nsamples)
+    // publish the spectrogram last so a viewer that finds it also finds the
+    // other arrays of the region
+    for (int i = mrn_names.size() - 1; i >= 0; i--)
+    {
+      if (backend->array_exists(tmp_mrn_names[i]))
       {
-        break;
+        cout << "Publishing: " << mrn_names[i] << endl;
+        backend->rename_array(tmp_mrn_names[i], mrn_names[i]);
       }
     }
-    backend->close_array(cached_mrn_name);
+    journal.publish(ch, &progress);
+
+    // requests read the published spectrogram from now on
+    remove_sparse_cache(backend, mrn, ch_name);
   }
   backend->close_array(mrn);
+  journal.remove();
 
   // Logging for experiments
   double total_time = ticks_to_seconds(getticks() - total_time_start);
@@ -365,4 +1099,3 @@ void precompute_spectrogram(string mrn, StorageBackend* backend)
   cout << log_line << "," << total_time << ",total_time" << endl;
   cout << log_line << "," << ticks_to_seconds(write_time_total) << ",write_time" << endl;
 }
-
@@ -4,6 +4,9 @@
 // #define ARMA_NO_DEBUG // enable for no bounds checking
 
 #include <armadillo>
+#include <vector>
+#include <functional>
+#include <fftw3.h>
 #include "../storage/backends.hpp"
 #include "../config.hpp"
 
@@ -14,44 +17,72 @@ class SpecParams
 {
   private:
     int get_nfft(int pad);
-    float clip_time(int nsamples, float time);
-    float get_valid_start_time(int nsamples);
-    float get_valid_end_time(int nsamples);
-    int get_nsamples(int data_len, float duration);
-    int get_nblocks(int nsamples);
+    int64_t get_nblocks(int64_t nsamples);
     int get_nfreqs();
+    void load_metadata();
+    void set_range(int64_t start_offset, int64_t end_offset);
 
   public:
     string mrn; // patient medical record number
     StorageBackend* backend; // array storage backend
-    float start_time; // start time of the spectrogram
-    float end_time; // end time of spectrogram
-    int start_offset; // start offset of raw data
-    int end_offset; // end offset of raw data
-    int spec_start_offset; // start offset of spectrogram data
-    int spec_end_offset; // start offset of spectrogram data
+    double start_time; // start time of the spectrogram in hours
+    double end_time; // end time of spectrogram in hours
+    int64_t start_offset; // start offset of raw data
+    int64_t end_offset; // end offset of raw data (exclusive)
+    int64_t spec_start_offset; // start offset of spectrogram data
+    int64_t spec_end_offset; // end offset of spectrogram data (exclusive)
     int fs; // sample rate
     int nfft; // number of samples for fft
     int nstep; // number of steps
-    int shift; // shift size for windows
-    int nsamples; // number of samples in the spectrogram
-    int nblocks; // number of blocks
+    int shift; // shift size for windows, block `i` starts at sample `i * shift`
+    int64_t nsamples; // number of samples in the spectrogram
+    int64_t nblocks; // number of blocks
+    int64_t total_nsamples; // number of samples of the recording
+    int64_t total_nblocks; // number of blocks of the recording
     int nfreqs; // number of frequencies
+    int freq_start; // first frequency bin of the spectrogram
+    int freq_end; // last frequency bin of the spectrogram (exclusive)
 
     void print();
+    void set_band(float min_freq, float max_freq);
+    float bin_to_freq(int bin);
     SpecParams(StorageBackend* backend,
         string mrn, float start_time, float end_time);
+    SpecParams(StorageBackend* backend,
+        string mrn, int64_t start_offset, int64_t end_offset);
     ~SpecParams()
     {
       backend->close_array(mrn);
     }
 };
 
+/*
+ * Buffers, plan and window shared by the transforms of one request
+ */
+typedef struct fft_state
+{
+  int nfft;
+  bool use_goertzel; // evaluate the bins directly instead of planning an FFT
+  fftw_complex* data;
+  fftw_complex* fft_result;
+  fftw_plan plan_forward;
+  float* window;
+} fft_state_t;
+
+void init_fft_state_t(SpecParams* spec_params, fft_state_t* fft_state);
+void free_fft_state_t(fft_state_t* fft_state);
+void FFT(SpecParams* spec_params, fft_state_t* fft_state, frowvec& diff,
+    int64_t nblocks, fmat& spec_mat);
+
 // does not need spec params
 void eeg_spectrogram_wrapper(string mrn, float start_time,
                               float end_time, int ch, fmat& spec_mat);
 void eeg_spectrogram(SpecParams* spec_params, int ch, fmat& spec_mat);
+void stream_spectrogram(SpecParams* spec_params, int ch, uint extent, int method, fmat& spec_mat);
+bool stream_spectrograms(SpecParams* spec_params, vector<int>& chs, uint extent, int method,
+    fmat* spec_mats, const function<bool()>& cancelled=nullptr);
 void precompute_spectrogram(string mrn, StorageBackend* backend);
+void fill_spectrogram_gaps(string mrn, StorageBackend* backend);
 
 #endif // SPECTROGRAM_H
 
@@ -0,0 +1,170 @@
+#include "event_trace.hpp"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "../helpers.hpp"
+
+using namespace std;
+
+/*
+ * Events recorded by one thread. The thread appends at `head` and the
+ * writer consumes from `tail`, so neither takes a lock. Events are dropped
+ * while the ring is full rather than blocking the thread.
+ */
+typedef struct event_ring
+{
+  trace_event_t events[EVENT_TRACE_BUFFER];
+  atomic<uint64_t> head;
+  atomic<uint64_t> tail;
+  atomic<uint64_t> dropped;
+  long tid;
+} event_ring_t;
+
+atomic<bool> event_trace_enabled(false);
+
+// rings are kept when their thread exits so its last events are written
+static mutex rings_mutex;
+static vector<event_ring_t*> rings;
+static thread_local event_ring_t* local_ring = nullptr;
+
+static thread writer;
+static atomic<bool> writer_running(false);
+static ofstream trace_file;
+static bool first_event;
+
+static event_ring_t* get_ring()
+{
+  if (local_ring == nullptr)
+  {
+    local_ring = new event_ring_t();
+    local_ring->tid = syscall(SYS_gettid);
+    lock_guard<mutex> lock(rings_mutex);
+    rings.push_back(local_ring);
+  }
+  return local_ring;
+}
+
+void record_event(const char* name, char phase, unsigned long long ts,
+    unsigned long long dur, int64_t value)
+{
+  event_ring_t* ring = get_ring();
+  uint64_t head = ring->head.load(memory_order_relaxed);
+  if (head - ring->tail.load(memory_order_acquire) >= EVENT_TRACE_BUFFER)
+  {
+    ring->dropped.store(ring->dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    return;
+  }
+  trace_event_t* event = &ring->events[head % EVENT_TRACE_BUFFER];
+  event->name = name;
+  event->phase = phase;
+  event->ts = ts;
+  event->dur = dur;
+  event->value = value;
+  ring->head.store(head + 1, memory_order_release);
+}
+
+/*
+ * Append the events recorded so far to the trace file in the Chrome trace
+ * JSON array format. Only the list of rings is read under `rings_mutex`, so
+ * threads starting meanwhile don't wait for the file.
+ */
+static void drain_rings()
+{
+  int pid = getpid();
+  vector<event_ring_t*> drained;
+  {
+    lock_guard<mutex> lock(rings_mutex);
+    drained = rings;
+  }
+  for (event_ring_t* ring : drained)
+  {
+    uint64_t head = ring->head.load(memory_order_acquire);
+    uint64_t tail = ring->tail.load(memory_order_relaxed);
+    for (; tail < head; tail++)
+    {
+      trace_event_t* event = &ring->events[tail % EVENT_TRACE_BUFFER];
+      trace_file << (first_event ? "\n" : ",\n") << "{\"name\":\"" << event->name <<
+        "\",\"ph\":\"" << event->phase << "\",\"ts\":" << event->ts <<
+        ",\"pid\":" << pid << ",\"tid\":" << ring->tid;
+      if (event->phase == 'X')
+      {
+        trace_file << ",\"dur\":" << event->dur;
+      }
+      else if (event->phase == 'C')
+      {
+        trace_file << ",\"args\":{\"value\":" << event->value << "}";
+      }
+      trace_file << "}";
+      first_event = false;
+    }
+    ring->tail.store(tail, memory_order_release);
+  }
+  trace_file.flush();
+}
+
+static void run_writer()
+{
+  while (writer_running)
+  {
+    this_thread::sleep_for(chrono::milliseconds(EVENT_TRACE_FLUSH_MS));
+    drain_rings();
+  }
+}
+
+/*
+ * Record events of every thread to `<program>-<pid>.trace.json` until
+ * `stop_event_trace` is called. The file can be opened in chrome://tracing
+ * or Perfetto while it is written.
+ */
+void start_event_trace(string program)
+{
+  string path = program + "-" + to_string(getpid()) + ".trace.json";
+  trace_file.open(path);
+  if (!trace_file.is_open())
+  {
+    cout << "Unable to open trace file: " << path << endl;
+    return;
+  }
+  cout << "Tracing events to: " << path << endl;
+  trace_file << "[";
+  first_event = true;
+  writer_running = true;
+  writer = thread(run_writer);
+  event_trace_enabled = true;
+}
+
+/*
+ * Write the remaining events and close the trace
+ */
+void stop_event_trace()
+{
+  if (!writer_running)
+  {
+    return;
+  }
+  event_trace_enabled = false;
+  writer_running = false;
+  writer.join();
+  drain_rings();
+
+  uint64_t dropped = 0;
+  {
+    lock_guard<mutex> lock(rings_mutex);
+    for (event_ring_t* ring : rings)
+    {
+      dropped += ring->dropped;
+    }
+  }
+  if (dropped)
+  {
+    cout << "Dropped " << dropped << " trace events, increase EVENT_TRACE_BUFFER" << endl;
+  }
+  trace_file << "\n]\n";
+  trace_file.close();
+}
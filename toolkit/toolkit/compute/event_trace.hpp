@@ -0,0 +1,72 @@
+#ifndef EVENT_TRACE_H
+#define EVENT_TRACE_H
+
+#include <string>
+#include <atomic>
+
+#include "../config.hpp"
+
+using namespace std;
+
+/*
+ * Event of the timeline, kept in binary until the writer formats it. Names
+ * must outlive the trace, e.g. string literals.
+ */
+typedef struct trace_event
+{
+  const char* name;
+  char phase; // 'B' begin, 'E' end, 'X' complete span, 'C' counter
+  unsigned long long ts; // monotonic ticks
+  unsigned long long dur; // ticks of a complete span
+  int64_t value; // counter value
+} trace_event_t;
+
+extern atomic<bool> event_trace_enabled;
+
+void start_event_trace(string program);
+void stop_event_trace();
+void record_event(const char* name, char phase, unsigned long long ts,
+    unsigned long long dur, int64_t value);
+
+/*
+ * Recording is a relaxed load while no trace is running
+ */
+static inline bool tracing()
+{
+  return event_trace_enabled.load(memory_order_relaxed);
+}
+
+static inline void trace_begin(const char* name, unsigned long long ts)
+{
+  if (tracing())
+  {
+    record_event(name, 'B', ts, 0, 0);
+  }
+}
+
+static inline void trace_end(const char* name, unsigned long long ts)
+{
+  if (tracing())
+  {
+    record_event(name, 'E', ts, 0, 0);
+  }
+}
+
+static inline void trace_complete(const char* name, unsigned long long start,
+    unsigned long long end)
+{
+  if (tracing())
+  {
+    record_event(name, 'X', start, end - start, 0);
+  }
+}
+
+static inline void trace_counter(const char* name, unsigned long long ts, int64_t value)
+{
+  if (tracing())
+  {
+    record_event(name, 'C', ts, 0, value);
+  }
+}
+
+#endif // EVENT_TRACE_H
@@ -0,0 +1,178 @@
+#include "precompute_journal.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include "../helpers.hpp"
+
+using namespace std;
+
+#define JOURNAL_PRECISION 17 // digits to print doubles and floats exactly
+
+void init_region_progress_t(region_progress_t* progress, int nfreqs)
+{
+  progress->end_block = 0;
+  progress->published = false;
+  init_cp_state_t(&progress->cp_state);
+  init_bp_state_t(&progress->bp_state);
+  progress->prefix_state.assign(nfreqs, 0);
+  progress->cp_blocks.clear();
+  progress->ncommitted_cps = 0;
+}
+
+/*
+ * Open the journal of `mrn`, starting a new one unless the existing journal
+ * was written with the same `signature`
+ */
+PrecomputeJournal::PrecomputeJournal(string mrn, string signature)
+{
+  path = mrn_to_filename(mrn, "precompute-journal");
+  string header = "signature " + signature;
+
+  ifstream journal(path);
+  string line;
+  if (getline(journal, line) && line == header)
+  {
+    cout << "Resuming from " << path << endl;
+    return;
+  }
+  journal.close();
+
+  ofstream new_journal(path, ios::trunc);
+  new_journal.close();
+  append(header);
+}
+
+/*
+ * Append `line` to the journal and flush it to disk
+ */
+void PrecomputeJournal::append(string line)
+{
+  line += "\n";
+  int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd < 0 || write(fd, line.c_str(), line.size()) != (ssize_t) line.size() || fsync(fd))
+  {
+    cout << "Error writing the journal " << path << endl;
+    exit(-1);
+  }
+  close(fd);
+}
+
+/*
+ * Restore the progress of region `ch` from the journal. A line cut short by
+ * an interruption ends the journal.
+ */
+void PrecomputeJournal::load(int ch, region_progress_t* progress)
+{
+  ifstream journal(path);
+  string line;
+  getline(journal, line); // signature
+  while (getline(journal, line))
+  {
+    istringstream fields(line);
+    string type;
+    int line_ch;
+    if (!(fields >> type >> line_ch))
+    {
+      break;
+    }
+    if (type == "published")
+    {
+      if (line_ch == ch)
+      {
+        progress->published = true;
+      }
+      continue;
+    }
+
+    region_progress_t chunk = *progress;
+    cp_state_t* cp = &chunk.cp_state;
+    size_t nprefix, ncps;
+    fields >> chunk.end_block;
+    fields >> cp->m >> cp->mu >> cp->cu >> cp->cl >> cp->np >> cp->nm >> cp->ct >> cp->block;
+    for (int i = 0; i < NUM_BAND_POWERS; i++)
+    {
+      fields >> chunk.bp_state.sums[i];
+    }
+    fields >> nprefix;
+    if (fields.fail() || nprefix != chunk.prefix_state.size())
+    {
+      break;
+    }
+    for (size_t i = 0; i < nprefix; i++)
+    {
+      fields >> chunk.prefix_state[i];
+    }
+    fields >> ncps;
+    for (size_t i = 0; i < ncps; i++)
+    {
+      int64_t block;
+      fields >> block;
+      chunk.cp_blocks.push_back(block);
+    }
+    string end;
+    if (fields.fail() || !(fields >> end) || end != "end")
+    {
+      break;
+    }
+    if (line_ch == ch)
+    {
+      chunk.ncommitted_cps = chunk.cp_blocks.size();
+      *progress = chunk;
+    }
+  }
+}
+
+/*
+ * Record that region `ch` was written up to `progress->end_block`. The
+ * arrays must have been synced to disk before.
+ */
+void PrecomputeJournal::commit(int ch, region_progress_t* progress)
+{
+  ostringstream line;
+  cp_state_t* cp = &progress->cp_state;
+  line << setprecision(JOURNAL_PRECISION);
+  line << "chunk " << ch << " " << progress->end_block;
+  line << " " << cp->m << " " << cp->mu << " " << cp->cu << " " << cp->cl;
+  line << " " << cp->np << " " << cp->nm << " " << cp->ct << " " << cp->block;
+  for (int i = 0; i < NUM_BAND_POWERS; i++)
+  {
+    line << " " << progress->bp_state.sums[i];
+  }
+  line << " " << progress->prefix_state.size();
+  for (double sum : progress->prefix_state)
+  {
+    line << " " << sum;
+  }
+  // only the change points found since the last commit
+  line << " " << progress->cp_blocks.size() - progress->ncommitted_cps;
+  for (size_t i = progress->ncommitted_cps; i < progress->cp_blocks.size(); i++)
+  {
+    line << " " << progress->cp_blocks[i];
+  }
+  line << " end";
+  append(line.str());
+  progress->ncommitted_cps = progress->cp_blocks.size();
+}
+
+/*
+ * Record that the arrays of region `ch` were renamed to their final names
+ */
+void PrecomputeJournal::publish(int ch, region_progress_t* progress)
+{
+  append("published " + to_string(ch));
+  progress->published = true;
+}
+
+/*
+ * Delete the journal once every region is published
+ */
+void PrecomputeJournal::remove()
+{
+  ::remove(path.c_str());
+}
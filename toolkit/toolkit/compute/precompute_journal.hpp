@@ -0,0 +1,51 @@
+#ifndef PRECOMPUTE_JOURNAL_H
+#define PRECOMPUTE_JOURNAL_H
+
+#include <string>
+#include <vector>
+
+#include "eeg_change_point.hpp"
+#include "band_power.hpp"
+
+using namespace std;
+
+/*
+ * Progress of the precomputation of one region, with the running state needed
+ * to continue after the last durable chunk
+ */
+typedef struct region_progress
+{
+  int64_t end_block; // the blocks [0, `end_block`) are written
+  bool published; // the arrays of the region were renamed to their final names
+  cp_state_t cp_state;
+  bp_state_t bp_state;
+  vector<double> prefix_state; // running sums of the spectrogram prefix sums
+  vector<int64_t> cp_blocks; // change points found so far
+  size_t ncommitted_cps; // change points already in the journal
+} region_progress_t;
+
+/*
+ * Append-only log of the chunks written by `precompute_spectrogram` for a
+ * recording. Each line records the state after a chunk and is flushed to disk
+ * after the chunk's arrays, so after an interruption every region continues
+ * from its last recorded chunk. A journal written with different parameters
+ * (`signature`) is discarded.
+ */
+class PrecomputeJournal
+{
+  private:
+    string path;
+
+    void append(string line);
+
+  public:
+    PrecomputeJournal(string mrn, string signature);
+    void load(int ch, region_progress_t* progress);
+    void commit(int ch, region_progress_t* progress);
+    void publish(int ch, region_progress_t* progress);
+    void remove();
+};
+
+void init_region_progress_t(region_progress_t* progress, int nfreqs);
+
+#endif // PRECOMPUTE_JOURNAL_H
@@ -3,19 +3,23 @@
 #include <math.h>
 
 #include "eeg_spectrogram.hpp"
+#include "event_trace.hpp"
 
 using namespace std;
 
 /*
  * Command line program to convert a given `mrn` to precalculated spectrograms
- * uses the current backend defined in `config.hpp`
+ * uses the current backend defined in `config.hpp`. With `gaps` only the
+ * missing chunks of the sparse spectrograms written by the server are
+ * computed.
  */
 int main(int argc, char* argv[])
 {
-  if (argc <= 2)
+  bool gaps = argc == 3 && string(argv[2]) == "gaps";
+  if (argc <= 2 || gaps)
   {
     string mrn;
-    if (argc == 2)
+    if (argc >= 2)
     {
       mrn = argv[1];
     }
@@ -26,12 +30,25 @@ int main(int argc, char* argv[])
     }
 
     cout << "Using mrn: " << mrn << " backend: " << TOSTRING(BACKEND) <<" and WRITE_CHUNK_SIZE: " << WRITE_CHUNK_SIZE << endl;
+    if (EVENT_TRACE)
+    {
+      start_event_trace("precompute_spectrogram");
+    }
     StorageBackend backend;
-    precompute_spectrogram(mrn, &backend);
+    if (gaps)
+    {
+      fill_spectrogram_gaps(mrn, &backend);
+    }
+    else
+    {
+      precompute_spectrogram(mrn, &backend);
+    }
+    stop_event_trace();
+    return 0;
   }
   else
   {
-    cout << "\nusage: ./precompute_spectrogram <mrn>\n" << endl;
+    cout << "\nusage: ./precompute_spectrogram <mrn> [gaps]\n" << endl;
   }
   return 1;
 }
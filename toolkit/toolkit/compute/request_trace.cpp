@@ -0,0 +1,60 @@
+#include "request_trace.hpp"
+
+#include "event_trace.hpp"
+#include "../helpers.hpp"
+
+using namespace std;
+
+// trace of the request served by the current thread, if any
+static thread_local request_trace_t* current_trace = nullptr;
+
+void init_request_trace_t(request_trace_t* trace, string type)
+{
+  trace->type = type;
+  trace->start = get_monotonic_ticks();
+  trace->send_start = 0;
+  for (int i = 0; i < NUM_STAGES; i++)
+  {
+    trace->spans[i] = 0;
+  }
+  trace->bytes_read = 0;
+  trace->cost_features.clear();
+  trace->cached_fraction = 0;
+}
+
+/*
+ * Attribute the spans of the current thread to `trace` until it is unset
+ * with `nullptr`. Threads without a trace, like the prefetcher, aren't
+ * traced.
+ */
+void set_request_trace(request_trace_t* trace)
+{
+  current_trace = trace;
+}
+
+request_trace_t* get_request_trace()
+{
+  return current_trace;
+}
+
+/*
+ * Add the time since `start`, from `get_monotonic_ticks`, to `stage` of the
+ * current request and to the event trace
+ */
+void trace_span(int stage, unsigned long long start)
+{
+  unsigned long long end = get_monotonic_ticks();
+  trace_complete(STAGE_NAMES[stage].c_str(), start, end);
+  if (current_trace != nullptr)
+  {
+    current_trace->spans[stage] += end - start;
+  }
+}
+
+void trace_bytes_read(uint64_t nbytes)
+{
+  if (current_trace != nullptr)
+  {
+    current_trace->bytes_read += nbytes;
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef REQUEST_TRACE_H
+#define REQUEST_TRACE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+using namespace std;
+
+// Stages of serving a request
+typedef enum
+{
+  STAGE_QUEUE = 0, // waiting for work another request is doing
+  STAGE_METADATA, // opening the arrays and reading their metadata
+  STAGE_READ, // reading raw, cached or precomputed data
+  STAGE_FFT, // computing spectrograms
+  STAGE_AGGREGATE, // downsampling and reducing
+  STAGE_ENCODE, // building the response messages
+  STAGE_SEND, // writing the responses to the socket
+  NUM_STAGES
+} stage_t;
+
+static const string STAGE_NAMES[NUM_STAGES] =
+{
+  "queue", "metadata", "read", "fft", "aggregate", "encode", "send"
+};
+
+/*
+ * Time spent in each stage of one request, in monotonic ticks
+ */
+typedef struct request_trace
+{
+  string type;
+  unsigned long long start;
+  unsigned long long send_start; // when the first response was queued, 0 before
+  atomic<unsigned long long> spans[NUM_STAGES];
+  atomic<uint64_t> bytes_read;
+  vector<double> cost_features; // features of the latency predicted for the request, if any
+  double cached_fraction; // share of the spectrograms answered by the tile cache
+} request_trace_t;
+
+void init_request_trace_t(request_trace_t* trace, string type);
+void set_request_trace(request_trace_t* trace);
+request_trace_t* get_request_trace();
+void trace_span(int stage, unsigned long long start);
+void trace_bytes_read(uint64_t nbytes);
+
+#endif // REQUEST_TRACE_H
@@ -0,0 +1,370 @@
+#include "sparse_cache.hpp"
+#include "request_trace.hpp"
+#include "../helpers.hpp"
+
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+
+using namespace arma;
+using namespace std;
+
+// serializes creating the arrays and updating the bitmaps and claims, every
+// request of a recording shares them
+static mutex sparse_mutex;
+static condition_variable sparse_cv; // notified when claimed chunks are written
+static unordered_map<string, set<int64_t>> filling; // claimed chunks of each sparse array
+static unordered_map<string, int> users; // caches with each sparse array open
+static set<string> removed; // sparse arrays deleted once their last cache closes
+static sparse_cache_stats_t stats = {};
+
+/*
+ * Number of bitmap entries for `nblocks` blocks
+ */
+static inline int64_t get_nchunks(int64_t nblocks)
+{
+  return (nblocks + SPARSE_CHUNK - 1) / SPARSE_CHUNK;
+}
+
+/*
+ * First frequency bin of the band of `freq_start`, gaps are computed for
+ * whole bands
+ */
+int get_sparse_freq_start(int freq_start)
+{
+  return freq_start / SPARSE_BAND * SPARSE_BAND;
+}
+
+/*
+ * End of the band of `freq_end`, at most `nfreqs`
+ */
+int get_sparse_freq_end(int freq_end, int nfreqs)
+{
+  return min((freq_end + SPARSE_BAND - 1) / SPARSE_BAND * SPARSE_BAND, nfreqs);
+}
+
+/*
+ * Open the sparse spectrogram of region `ch_name` of `mrn`, a recording with
+ * `nblocks` blocks of `nfreqs` frequencies. The arrays are created empty the
+ * first time or when the spectrogram parameters changed.
+ */
+SparseCache::SparseCache(StorageBackend* backend, string mrn, string ch_name,
+    int fs, int64_t nblocks, int nfreqs)
+{
+  this->backend = backend;
+  this->nblocks = nblocks;
+  this->nfreqs = nfreqs;
+  nbands = (nfreqs + SPARSE_BAND - 1) / SPARSE_BAND;
+  usable = true;
+  sparse_mrn_name = backend->mrn_to_sparse_mrn_name(mrn, ch_name);
+  valid_mrn_name = backend->mrn_to_sparse_valid_mrn_name(mrn, ch_name);
+  int64_t nchunks = get_nchunks(nblocks);
+  valid.assign(nchunks * nbands, 0);
+
+  lock_guard<mutex> lock(sparse_mutex);
+  bool matches = backend->array_exists(sparse_mrn_name) && backend->array_exists(valid_mrn_name);
+  if (matches)
+  {
+    backend->open_array(sparse_mrn_name);
+    backend->open_array(valid_mrn_name);
+    matches = backend->get_nrows(sparse_mrn_name) == nblocks &&
+      backend->get_ncols(sparse_mrn_name) == nfreqs &&
+      backend->get_nrows(valid_mrn_name) == nchunks &&
+      backend->get_ncols(valid_mrn_name) == nbands;
+  }
+
+  if (matches)
+  {
+    load_valid();
+  }
+  else if (users[sparse_mrn_name] > 0)
+  {
+    // another request reads the arrays with other parameters
+    usable = false;
+    return;
+  }
+  else
+  {
+    create(fs);
+  }
+  users[sparse_mrn_name]++;
+}
+
+SparseCache::~SparseCache()
+{
+  if (!usable)
+  {
+    return;
+  }
+
+  lock_guard<mutex> lock(sparse_mutex);
+  // give up the chunks that were never written
+  for (int64_t chunk : claimed)
+  {
+    filling[sparse_mrn_name].erase(chunk);
+  }
+  if (!claimed.empty())
+  {
+    sparse_cv.notify_all();
+  }
+
+  if (--users[sparse_mrn_name] > 0)
+  {
+    return;
+  }
+  users.erase(sparse_mrn_name);
+  backend->close_array(sparse_mrn_name);
+  backend->close_array(valid_mrn_name);
+  if (removed.erase(sparse_mrn_name))
+  {
+    cout << "Deleting: " << sparse_mrn_name << endl;
+    backend->delete_array(valid_mrn_name);
+    backend->delete_array(sparse_mrn_name);
+  }
+}
+
+/*
+ * Create the spectrogram and an all invalid bitmap, the caller holds
+ * `sparse_mutex`. They are written under temporary names and renamed over
+ * the old arrays rather than truncating them under a reader of another
+ * process.
+ */
+void SparseCache::create(int fs)
+{
+  int64_t nchunks = get_nchunks(nblocks);
+  string tmp_valid_mrn_name = backend->mrn_to_tmp_mrn_name(valid_mrn_name);
+  string tmp_sparse_mrn_name = backend->mrn_to_tmp_mrn_name(sparse_mrn_name);
+  cout << "Creating: " << sparse_mrn_name << endl;
+
+  ArrayMetadata valid_metadata = ArrayMetadata(fs, nchunks, nchunks, nbands);
+  backend->create_array(tmp_valid_mrn_name, &valid_metadata);
+  fmat zero_mat = zeros<fmat>(nbands, nchunks);
+  backend->write_array(tmp_valid_mrn_name, ALL, 0, nchunks, zero_mat);
+
+  ArrayMetadata metadata = ArrayMetadata(fs, nblocks, nblocks, nfreqs);
+  backend->create_array(tmp_sparse_mrn_name, &metadata);
+
+  // the bitmap is replaced first so no chunk of the new array is valid
+  backend->rename_array(tmp_valid_mrn_name, valid_mrn_name);
+  backend->rename_array(tmp_sparse_mrn_name, sparse_mrn_name);
+}
+
+/*
+ * Read the bitmap, the caller holds `sparse_mutex`
+ */
+void SparseCache::load_valid()
+{
+  int64_t nchunks = get_nchunks(nblocks);
+  fmat valid_mat = fmat(nbands, nchunks);
+  backend->read_array(valid_mrn_name, 0, nchunks, valid_mat);
+  for (int64_t i = 0; i < nchunks; i++)
+  {
+    for (int band = 0; band < nbands; band++)
+    {
+      valid[i * nbands + band] = valid_mat(band, i) != 0;
+    }
+  }
+}
+
+/*
+ * Returns false if the arrays could not be opened with the parameters of
+ * the request, every block is then computed and none is written
+ */
+bool SparseCache::is_usable()
+{
+  return usable;
+}
+
+/*
+ * Returns true if the bands [`band_start`, `band_end`) of every chunk of
+ * [`chunk_start`, `chunk_end`) are valid
+ */
+bool SparseCache::is_valid_band(int64_t chunk_start, int64_t chunk_end, int band_start, int band_end)
+{
+  for (int64_t i = chunk_start; i < chunk_end; i++)
+  {
+    for (int band = band_start; band < band_end; band++)
+    {
+      if (!valid[i * nbands + band])
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+ * Returns true if the frequency bins [`freq_start`, `freq_end`) of every
+ * chunk overlapping the blocks [`block_start`, `block_end`) are valid
+ */
+bool SparseCache::is_valid(int64_t block_start, int64_t block_end, int freq_start, int freq_end)
+{
+  return usable && is_valid_band(block_start / SPARSE_CHUNK, get_nchunks(block_end),
+      freq_start / SPARSE_BAND, (freq_end + SPARSE_BAND - 1) / SPARSE_BAND);
+}
+
+/*
+ * Claim the chunks of the missing blocks [`block_start`, `block_end`) before
+ * computing them, they are released by `write`. If another request is
+ * computing some of them this waits until they are written, reloads the
+ * bitmap and returns false: the caller has to check again which blocks are
+ * missing.
+ */
+bool SparseCache::claim(int64_t block_start, int64_t block_end)
+{
+  if (!usable)
+  {
+    return true;
+  }
+  int64_t chunk_start = block_start / SPARSE_CHUNK;
+  int64_t chunk_end = get_nchunks(block_end);
+  unique_lock<mutex> lock(sparse_mutex);
+  set<int64_t>& chunks = filling[sparse_mrn_name];
+  auto busy = [&]()
+  {
+    auto it = chunks.lower_bound(chunk_start);
+    return it != chunks.end() && *it < chunk_end;
+  };
+  if (!busy())
+  {
+    for (int64_t i = chunk_start; i < chunk_end; i++)
+    {
+      chunks.insert(i);
+      claimed.insert(i);
+    }
+    return true;
+  }
+
+  unsigned long long span_start = get_monotonic_ticks();
+  sparse_cv.wait(lock, [&]()
+  {
+    return !busy();
+  });
+  trace_span(STAGE_QUEUE, span_start);
+  stats.coalesced_blocks += block_end - block_start;
+  load_valid();
+  return false;
+}
+
+/*
+ * Fill `buf` (nbins x nblocks) with the frequency bins
+ * [`freq_start`, `freq_end`) of the valid blocks [`block_start`, `block_end`)
+ */
+void SparseCache::read(int64_t block_start, int64_t block_end,
+    int freq_start, int freq_end, fmat& buf)
+{
+  backend->read_array(sparse_mrn_name, block_start, block_end, freq_start, freq_end, buf);
+  lock_guard<mutex> lock(sparse_mutex);
+  stats.read_blocks += block_end - block_start;
+}
+
+/*
+ * Write `spec_mat` (nbins x nblocks), the frequency bins from `freq_start`
+ * of the blocks starting at `block_start`, mark the bands it covers of the
+ * chunks it covers entirely as valid and release their claims. The bins of
+ * the other bands are kept, the caller claimed the chunks so nothing else
+ * writes them meanwhile. The blocks are written before the bitmap so a valid
+ * chunk is always complete.
+ */
+void SparseCache::write(int64_t block_start, int freq_start, fmat& spec_mat)
+{
+  if (!usable)
+  {
+    return;
+  }
+  int64_t block_end = block_start + spec_mat.n_cols;
+  int freq_end = freq_start + spec_mat.n_rows;
+  int band_start = freq_start / SPARSE_BAND;
+  int band_end = (freq_end + SPARSE_BAND - 1) / SPARSE_BAND;
+  int64_t first_chunk = block_start / SPARSE_CHUNK;
+  int64_t last_chunk = get_nchunks(block_end);
+  if (freq_start == 0 && freq_end == nfreqs)
+  {
+    backend->write_array(sparse_mrn_name, ALL, block_start, block_end, spec_mat);
+  }
+  else
+  {
+    // the rows are written whole, so the valid bins of other bands are read
+    fmat rows_mat = zeros<fmat>(nfreqs, spec_mat.n_cols);
+    bool other_bands = false;
+    {
+      lock_guard<mutex> lock(sparse_mutex);
+      for (int64_t i = first_chunk; i < last_chunk && !other_bands; i++)
+      {
+        for (int band = 0; band < nbands && !other_bands; band++)
+        {
+          other_bands = valid[i * nbands + band] && (band < band_start || band >= band_end);
+        }
+      }
+    }
+    if (other_bands)
+    {
+      backend->read_array(sparse_mrn_name, block_start, block_end, 0, nfreqs, rows_mat);
+    }
+    rows_mat.rows(freq_start, freq_end - 1) = spec_mat;
+    backend->write_array(sparse_mrn_name, ALL, block_start, block_end, rows_mat);
+  }
+
+  int64_t chunk_start = get_nchunks(block_start);
+  int64_t chunk_end = block_end == nblocks ? get_nchunks(block_end) : block_end / SPARSE_CHUNK;
+  lock_guard<mutex> lock(sparse_mutex);
+  stats.computed_blocks += block_end - block_start;
+  if (chunk_start < chunk_end)
+  {
+    fmat valid_mat = fmat(nbands, chunk_end - chunk_start);
+    for (int64_t i = chunk_start; i < chunk_end; i++)
+    {
+      for (int band = 0; band < nbands; band++)
+      {
+        if (band >= band_start && band < band_end)
+        {
+          valid[i * nbands + band] = 1;
+        }
+        valid_mat(band, i - chunk_start) = valid[i * nbands + band];
+      }
+    }
+    backend->write_array(valid_mrn_name, ALL, chunk_start, chunk_end, valid_mat);
+  }
+
+  set<int64_t>& chunks = filling[sparse_mrn_name];
+  for (int64_t i = first_chunk; i < last_chunk; i++)
+  {
+    chunks.erase(i);
+    claimed.erase(i);
+  }
+  sparse_cv.notify_all();
+}
+
+/*
+ * Delete the sparse spectrogram of region `ch_name` of `mrn` once its cached
+ * spectrogram is published. Arrays open in a request of the process are
+ * deleted when the last of them closes them.
+ */
+void remove_sparse_cache(StorageBackend* backend, string mrn, string ch_name)
+{
+  string sparse_mrn_name = backend->mrn_to_sparse_mrn_name(mrn, ch_name);
+  string valid_mrn_name = backend->mrn_to_sparse_valid_mrn_name(mrn, ch_name);
+  lock_guard<mutex> lock(sparse_mutex);
+  if (users.count(sparse_mrn_name))
+  {
+    removed.insert(sparse_mrn_name);
+    return;
+  }
+  if (backend->array_exists(valid_mrn_name))
+  {
+    backend->delete_array(valid_mrn_name);
+  }
+  if (backend->array_exists(sparse_mrn_name))
+  {
+    cout << "Deleting: " << sparse_mrn_name << endl;
+    backend->delete_array(sparse_mrn_name);
+  }
+}
+
+sparse_cache_stats_t get_sparse_cache_stats()
+{
+  lock_guard<mutex> lock(sparse_mutex);
+  return stats;
+}
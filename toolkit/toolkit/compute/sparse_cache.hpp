@@ -0,0 +1,68 @@
+#ifndef SPARSE_CACHE_H
+#define SPARSE_CACHE_H
+
+#include <armadillo>
+#include <string>
+#include <vector>
+#include <set>
+
+#include "../storage/backends.hpp"
+#include "../config.hpp"
+
+using namespace arma;
+using namespace std;
+
+typedef struct sparse_cache_stats
+{
+  uint64_t read_blocks; // blocks read from sparse spectrograms
+  uint64_t computed_blocks; // blocks computed and written back
+  uint64_t coalesced_blocks; // blocks waited for while another request computed them
+} sparse_cache_stats_t;
+
+/*
+ * Spectrogram of a region filled in as blocks are computed on the fly. The
+ * array has the layout of the cached spectrogram and a validity bitmap with
+ * one row per `SPARSE_CHUNK` blocks and one column per `SPARSE_BAND`
+ * frequency bins, set once the bins of every block of the chunk are written.
+ * Reads use the valid chunks and only the gaps are computed, over the bands
+ * of the request rather than every frequency. Requests of the same process
+ * `claim` the gaps before computing them, so overlapping requests compute
+ * every chunk once.
+ *
+ * The arrays are never truncated under a request of the process that has
+ * them open: a cache whose arrays have other dimensions than a live one is
+ * not usable and its request computes every block without writing them.
+ */
+class SparseCache
+{
+  private:
+    StorageBackend* backend;
+    string sparse_mrn_name;
+    string valid_mrn_name;
+    int64_t nblocks;
+    int nfreqs;
+    int nbands;
+    bool usable;
+    vector<char> valid; // validity of each chunk and band when the cache was opened or written
+    set<int64_t> claimed; // chunks this cache is computing
+
+    void create(int fs);
+    void load_valid();
+    bool is_valid_band(int64_t chunk_start, int64_t chunk_end, int band_start, int band_end);
+
+  public:
+    SparseCache(StorageBackend* backend, string mrn, string ch_name, int fs, int64_t nblocks, int nfreqs);
+    ~SparseCache();
+    bool is_usable();
+    bool is_valid(int64_t block_start, int64_t block_end, int freq_start, int freq_end);
+    bool claim(int64_t block_start, int64_t block_end);
+    void read(int64_t block_start, int64_t block_end, int freq_start, int freq_end, fmat& buf);
+    void write(int64_t block_start, int freq_start, fmat& spec_mat);
+};
+
+int get_sparse_freq_start(int freq_start);
+int get_sparse_freq_end(int freq_end, int nfreqs);
+void remove_sparse_cache(StorageBackend* backend, string mrn, string ch_name);
+sparse_cache_stats_t get_sparse_cache_stats();
+
+#endif // SPARSE_CACHE_H
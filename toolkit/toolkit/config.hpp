@@ -29,17 +29,120 @@ using namespace std;
 #endif
 #define WRITE_CHUNK_SIZE ((int) (1000000 * WRITE_CHUNK / sizeof(float))) // nsamples
 
+// Codecs for the cached spectrogram arrays
+#define CODEC_NONE 0 // uncompressed float32
+#define CODEC_SHUFFLE_ZLIB 1 // byte-shuffle + deflate, lossless
+#define CODEC_LOGQ16_ZLIB 2 // log-quantized uint16 + byte-shuffle + deflate, lossy
+#ifndef CACHE_CODEC
+#define CACHE_CODEC CODEC_NONE
+#endif
+#define CACHE_CODEC_LEVEL 1 // zlib compression level
+
+// Number of spectrogram blocks per compressed chunk
+#ifndef CACHE_CHUNK
+#define CACHE_CHUNK 1024 // nblocks
+#endif
+#ifndef DECODE_THREADS
+#define DECODE_THREADS 4 // threads of the process decoding chunks, including the reader
+#endif
+#define DECODE_INLINE_CHUNKS 2 // reads of at most this many chunks are decoded by the reader
+
+// Store prefix sums of the cached spectrograms for exact mean downsampling
+#ifndef SPEC_PREFIX
+#define SPEC_PREFIX 0
+#endif
+
+// Write spectrograms computed on the fly back to sparse cached arrays
+#ifndef SPARSE_CACHE
+#define SPARSE_CACHE 0
+#endif
+#ifndef SPARSE_CHUNK
+#define SPARSE_CHUNK 64 // nblocks tracked by one row of the validity bitmap
+#endif
+#ifndef SPARSE_BAND
+#define SPARSE_BAND 16 // frequency bins tracked by one column of the validity bitmap
+#endif
+
+// Methods to reduce spectrogram blocks when downsampling
+#define DOWNSAMPLE_DROP 0 // keep the first block of every `extent`
+#define DOWNSAMPLE_MEAN 1 // mean of every `extent` blocks
+#define DOWNSAMPLE_MAX 2 // max of every `extent` blocks
+#define DOWNSAMPLE_PERCENTILE 3 // approximate 95th percentile of every `extent` blocks
+#ifndef DOWNSAMPLE
+#define DOWNSAMPLE DOWNSAMPLE_MEAN
+#endif
+
+// Min/max envelope pyramid of the raw waveforms
+#define WAVEFORM_FACTOR 4 // samples of a level reduced to one sample of the next level
+#ifndef WAVEFORM_MIN_ROWS
+#define WAVEFORM_MIN_ROWS 4096 // no more levels are built once a level is this short
+#endif
+
+// Size of the ws_server cache of computed spectrograms
+#ifndef TILE_CACHE
+#define TILE_CACHE 256 // MB
+#endif
+#define TILE_CACHE_SIZE ((size_t) 1000000 * TILE_CACHE) // bytes
+
+// Number of ranges ahead of the viewed range that ws_server computes while
+// idle, 0 disables prefetching
+#ifndef PREFETCH_DEPTH
+#define PREFETCH_DEPTH 2
+#endif
+
+// precompute_daemon config
+#ifndef INGEST_IO_WORKERS
+#define INGEST_IO_WORKERS 1 // concurrent EDF conversions
+#endif
+#ifndef INGEST_CPU_WORKERS
+#define INGEST_CPU_WORKERS 1 // concurrent spectrogram precomputations
+#endif
+#ifndef INGEST_NICE
+#define INGEST_NICE 10 // scheduling priority of the jobs, ws_server runs at 0
+#endif
+#define INGEST_MAX_ATTEMPTS 3 // a job is marked failed after this many failures
+#define INGEST_JOURNAL "ingest_jobs.journal" // persistent job queue in DATADIR
+#define VIEWING_DIR "viewing/" // ws_server touches DATADIR VIEWING_DIR <mrn> when viewing
+
+// Timeline of spans and counters in the Chrome trace format, written to
+// <program>-<pid>.trace.json by ws_server and precompute_spectrogram
+#ifndef EVENT_TRACE
+#define EVENT_TRACE 0
+#endif
+#ifndef EVENT_TRACE_BUFFER
+#define EVENT_TRACE_BUFFER 65536 // events per thread, more are dropped until written
+#endif
+#define EVENT_TRACE_FLUSH_MS 100 // interval of writing the events
+
 // Delimiter for log lines related to the experiments
 #define EXPERIMENT_TAG "experiment_data::"
 // websocket server config
 #define WS_DEFAULT_PORT 8080
-#define COLLECTD_SOCK "/home/ubuntu/eeg-toolkit/collectd-unixsock"
+#ifndef VERBOSE
+#define VERBOSE 0 // log every request, its parameters and read times to stdout
+#endif
+#ifndef METRICS_PORT
+#define METRICS_PORT 0 // port of the Prometheus metrics of ws_server at /metrics, 0 disables them
+#endif
+// Unsent responses of one connection, older frames are dropped past this
+#ifndef SEND_QUEUE_BUDGET
+#define SEND_QUEUE_BUDGET 64 // MB
+#endif
+#define SEND_QUEUE_BUDGET_SIZE ((size_t) 1000000 * SEND_QUEUE_BUDGET) // bytes
+#define SEND_SLOW_RATE 1000000 // bytes/s, clients draining slower are logged as slow
+#define PROFILE_INTERVAL_MS 1000 // interval of sampling the host profile
 
 #ifndef VISGOTH_IP
 #define VISGOTH_IP "localhost"
 #else
 #define VISGOTH_IP STRINGIFY(_VISGOTH_IP)
 #endif
+#define VISGOTH_PORT 5000 // webapp serving the visgoth model parameters
+
+// Defaults of the visgoth extent model until the webapp sends its parameters
+#define EXTENT_TARGET_LATENCY 3500 // ms
+#define EXTENT_MAX 16 // largest downsampling factor chosen
+#define EXTENT_PARAMS_INTERVAL_MS 60000 // interval of asking the webapp for new parameters
 
 // spectrogram config
 typedef enum
@@ -164,4 +267,38 @@ const ch_diff_t DIFFERENCE_PAIRS[NUM_DIFF] =
 // String names for brain regions
 static const string CH_NAME_MAP[NUM_DIFF] = {"LL", "LP", "RP", "RL"};
 
+// Frequency bands [min_freq, max_freq) in Hz for the band power trends
+typedef struct freq_band
+{
+  string name;
+  float min_freq;
+  float max_freq;
+} freq_band_t;
+
+static const int NUM_BANDS = 4;
+static const freq_band_t FREQ_BANDS[NUM_BANDS] =
+{
+  {"delta", 0.5, 4},
+  {"theta", 4, 8},
+  {"alpha", 8, 13},
+  {"beta", 13, 30},
+};
+
+// Ratios of band powers, stored after the bands
+typedef struct band_ratio
+{
+  string name;
+  int num; // index in FREQ_BANDS of the numerator
+  int den; // index in FREQ_BANDS of the denominator
+} band_ratio_t;
+
+static const int NUM_BAND_RATIOS = 2;
+static const band_ratio_t BAND_RATIOS[NUM_BAND_RATIOS] =
+{
+  {"alpha/delta", 2, 0},
+  {"theta/beta", 1, 3},
+};
+
+static const int NUM_BAND_POWERS = NUM_BANDS + NUM_BAND_RATIOS;
+
 #endif // CONFIG_H
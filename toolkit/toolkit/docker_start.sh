@@ -1,4 +1,4 @@
 #!/bin/bash
 
-collectd
+./precompute_daemon &
 ./ws_server
@@ -2,7 +2,9 @@
 #define HELPERS_H
 
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <iostream>
 #include <vector>
 #include <iomanip>
@@ -24,6 +26,16 @@ static inline unsigned long long getticks()
   return t.tv_sec * 1000000ULL + t.tv_usec;
 }
 
+/*
+ * Get a timestamp from a clock that isn't adjusted, for measuring durations
+ */
+static inline unsigned long long get_monotonic_ticks()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
 /*
  * Convert the ticks timestamp to seconds
  */
@@ -38,7 +50,7 @@ static inline double ticks_to_seconds(unsigned long long ticks)
 static inline void log_time_diff(string msg, unsigned long long ticks)
 {
   double diff_secs = ticks_to_seconds(getticks() - ticks);
-  cout << msg << " took " << setprecision(2) << diff_secs << " seconds" << endl;
+  cout << msg << " took " << setprecision(2) << diff_secs << " seconds\n";
 }
 
 /*
@@ -58,22 +70,41 @@ static inline int get_next_pow_2(unsigned int v)
 
 /*
  * Given the sampling rate `fs` return the number of
- * samples for the given `time` range.
+ * samples for the given `time` range in hours.
  */
-static inline int hours_to_samples(int fs, float time)
+static inline int64_t hours_to_samples(int fs, double time)
 {
-  return fs * 60 * 60 * time;
+  return fs * 60.0 * 60.0 * time;
 }
 
 /*
  * Return the number of hours for the number of `samples`
  * given and the given sampling rate `fs`
  */
-static inline float samples_to_hours(int fs, int samples)
+static inline double samples_to_hours(int fs, int64_t samples)
 {
   return samples / (fs * 60.0 * 60.0);
 }
 
+/*
+ * Given the sampling rate `fs` return the sample offset for the given `time`
+ * in milliseconds. Integer arithmetic keeps the mapping exact for any
+ * recording length.
+ */
+static inline int64_t ms_to_samples(int fs, int64_t time_ms)
+{
+  return time_ms * fs / 1000;
+}
+
+/*
+ * Return the time in milliseconds of the sample offset `samples`
+ * given the sampling rate `fs`
+ */
+static inline int64_t samples_to_ms(int fs, int64_t samples)
+{
+  return fs ? samples * 1000 / fs : 0;
+}
+
 /*
  * Return the length of the string aligned to 8 bytes
  * with an extra 4 bytes to store the length in a uint32_t
@@ -93,30 +124,37 @@ static inline bool file_exists(string path)
 }
 
 /*
- * Remove every `extent` column from the given matrix.
- * If `extent` is `0` or `1` the matrix is unchanged
+ * Combined extent of downsampling a matrix with `ncols` columns by `extent`
+ * and then enough to not exceed the width `max_width`.
  */
-static inline void downsample(fmat& buf, uint extent)
+static inline uint get_total_extent(int64_t ncols, uint extent, int max_width)
 {
-  if (extent > 1) // don't downsample for 0 or 1
+  extent = max(extent, 1u);
+  int64_t width = ncols / extent;
+  if (max_width > 0 && width > max_width)
   {
-    fmat new_buf = fmat(buf.n_rows, buf.n_cols/extent);
-    for (uword i = 0; i < new_buf.n_cols; i++)
-    {
-      new_buf.col(i) = buf.col(i * extent);
-    }
-    buf = new_buf;
+    extent *= ceil(width / (float) max_width);
   }
+  return extent;
+}
+
+/*
+ * Split `val` into two floats whose sum keeps about twice the precision
+ * of a single float. Used to store prefix sums, which grow too large for
+ * the differences of nearby rows to be exact in a float.
+ */
+static inline void split_double(double val, float* hi, float* lo)
+{
+  *hi = (float) val;
+  *lo = (float) (val - *hi);
 }
 
 /*
- * Given the maximum width `max_width`, downsample
- * the given matrix to not exceed this width.
+ * Inverse of `split_double`
  */
-static inline void cap_max_width(fmat& buf, int max_width)
+static inline double join_double(float hi, float lo)
 {
-  uint extent = ceil(buf.n_cols / (float) max_width);
-  downsample(buf, extent);
+  return (double) hi + (double) lo;
 }
 
 static inline vector<string> &split(const string &s, char delim, vector<string> &elems) {
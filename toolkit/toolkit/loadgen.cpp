@@ -0,0 +1,503 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <random>
+#include <fstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wslib/client_ws.hpp"
+#include "config.hpp"
+#include "helpers.hpp"
+#include "json11/json11.hpp"
+
+using namespace std;
+using namespace json11;
+
+#define BINARY_OPCODE 130
+#define DEFAULT_THINK_MS 500 // mean pause between requests of a viewer
+#define REQUEST_TIMEOUT_MS 30000 // a request is dropped without all its responses by then
+#define WATCH_INTERVAL_MS 100 // how often the requests are checked for timeouts
+#define LOG_PREFIX "Json data: " // requests logged by ws_server with VERBOSE
+
+// synthetic viewers look at windows of the recording like the webapp
+#define VIEW_HOURS 1.0
+#define VIEW_WIDTH 1000 // pixels
+#define VIEW_HEIGHT 300
+
+typedef SimpleWeb::SocketClient<SimpleWeb::WS> WsClient;
+
+typedef struct request_stats
+{
+  vector<double> latencies; // seconds from sending to the last response
+  uint64_t bytes; // bytes of the responses
+  uint64_t dropped; // requests without all their responses after `REQUEST_TIMEOUT_MS`
+  uint64_t timeouts; // requests without all their responses at the end
+} request_stats_t;
+
+static string get_response_key(string type, string canvas_id)
+{
+  return type + ":" + canvas_id;
+}
+
+/*
+ * Keys of the messages ws_server answers a request with, by the type and
+ * `canvasId` of their header. Responses for the same canvas replace each
+ * other on the server, so each key is expected once.
+ */
+static set<string> get_expected_responses(Json& request)
+{
+  set<string> keys;
+  string type = request["type"].string_value();
+  Json content = request["content"];
+  vector<Json> channels;
+  if (type == "spectrogram_batch")
+  {
+    channels = content["channels"].array_items();
+  }
+  else if (type == "spectrogram" || type == "change_points" || type == "band_power")
+  {
+    channels.push_back(content["channel"]);
+  }
+  else if (type == "waveform" || type == "prefetch_stats" || type == "trace_stats")
+  {
+    keys.insert(get_response_key(type, ""));
+  }
+  for (Json& channel : channels)
+  {
+    int ch = channel.int_value();
+    if (ch >= 0 && ch < NUM_DIFF)
+    {
+      // batches are answered with one spectrogram per channel
+      string response_type = type == "spectrogram_batch" ? "spectrogram" : type;
+      keys.insert(get_response_key(response_type, CH_NAME_MAP[ch]));
+    }
+  }
+  return keys;
+}
+
+/*
+ * Key of a response of ws_server, a uint32 header length followed by the
+ * JSON header and the data. Empty if the message is not a response.
+ */
+static string parse_response_key(string& message)
+{
+  uint32_t header_len;
+  if (message.size() < sizeof(uint32_t))
+  {
+    return "";
+  }
+  memcpy(&header_len, message.data(), sizeof(uint32_t));
+  if (header_len > message.size() - sizeof(uint32_t))
+  {
+    return "";
+  }
+  string err;
+  Json header = Json::parse(message.substr(sizeof(uint32_t), header_len), err);
+  if (!err.empty() || !header["type"].is_string())
+  {
+    return "";
+  }
+  return get_response_key(header["type"].string_value(),
+      header["content"]["canvasId"].string_value());
+}
+
+/*
+ * Requests of a session file, one JSON message per line as the webapp sends
+ * them. Lines of the ws_server log are accepted as well. A line may have a
+ * `delayMs` to wait before sending it.
+ */
+static vector<Json> load_session(string path)
+{
+  vector<Json> requests;
+  ifstream file(path);
+  string line;
+  while (getline(file, line))
+  {
+    size_t pos = line.find(LOG_PREFIX);
+    if (pos != string::npos)
+    {
+      line = line.substr(pos + string(LOG_PREFIX).size());
+    }
+    string err;
+    Json request = Json::parse(line, err);
+    if (err.empty() && request["type"].is_string())
+    {
+      requests.push_back(request);
+    }
+  }
+  return requests;
+}
+
+/*
+ * One simulated viewer. It sends a request, waits for all its responses and
+ * pauses before the next one, replaying `session` or panning and zooming
+ * randomly over the first `hours` of `mrn` when there is no session. A
+ * request still waiting after `REQUEST_TIMEOUT_MS` is dropped and the next
+ * one is sent right away.
+ */
+class LoadClient
+{
+  private:
+    WsClient client;
+    vector<Json>* session;
+    size_t next; // next request of the session
+    string mrn;
+    double hours;
+    double think_ms;
+    mt19937_64 rng;
+    double view_start; // hours
+    double view_length;
+
+    mutex state_lock; // the responses and the timeouts are handled by different threads
+    string type; // type of the request waiting for responses
+    set<string> pending; // keys of the responses still expected
+    uint64_t bytes;
+    unsigned long long sent;
+
+    Json next_request();
+    Json synthetic_request();
+    void send_next(bool think);
+
+  public:
+    map<string, request_stats_t> stats;
+
+    LoadClient(string server_path, int id, vector<Json>* session,
+        string mrn, double hours, double think_ms);
+    void run();
+    void stop();
+    void check_timeout();
+    void finish();
+};
+
+LoadClient::LoadClient(string server_path, int id, vector<Json>* session,
+    string mrn, double hours, double think_ms) : client(server_path), rng(id)
+{
+  this->session = session;
+  this->mrn = mrn;
+  this->hours = hours;
+  this->think_ms = think_ms;
+  // viewers don't start in lock step
+  next = session->empty() ? 0 : id % session->size();
+  view_length = min(VIEW_HOURS, hours);
+  view_start = uniform_real_distribution<double>(0, max(hours - view_length, 0.0))(rng);
+  bytes = 0;
+  sent = 0;
+
+  client.onopen = [this]()
+  {
+    send_next(true);
+  };
+
+  client.onmessage = [this](shared_ptr<WsClient::Message> message)
+  {
+    string data = message->string();
+    string key = parse_response_key(data);
+    {
+      lock_guard<mutex> guard(state_lock);
+      // responses of a dropped request are not counted for the next one
+      if (pending.erase(key) == 0)
+      {
+        return;
+      }
+      bytes += data.size();
+      if (!pending.empty())
+      {
+        return;
+      }
+      request_stats_t& type_stats = stats[type];
+      type_stats.latencies.push_back(ticks_to_seconds(getticks() - sent));
+      type_stats.bytes += bytes;
+    }
+    send_next(true);
+  };
+
+  client.onerror = [](const boost::system::error_code& ec)
+  {
+    cout << "Client: Error " << ec << ", error message: " << ec.message() << endl;
+  };
+}
+
+/*
+ * Pan by a window, zoom in or out by 2 or look at the waveform or band
+ * power of the window, like a reviewer using the webapp
+ */
+Json LoadClient::synthetic_request()
+{
+  double action = uniform_real_distribution<double>(0, 1)(rng);
+  string request_type = "spectrogram_batch";
+  if (action < 0.6)
+  {
+    view_start += (action < 0.3 ? -1 : 1) * view_length;
+  }
+  else if (action < 0.8)
+  {
+    double center = view_start + view_length / 2;
+    view_length = min(max(view_length * (action < 0.7 ? 0.5 : 2), 1 / 60.0), hours);
+    view_start = center - view_length / 2;
+  }
+  else
+  {
+    request_type = action < 0.9 ? "waveform" : "band_power";
+  }
+  view_start = min(max(view_start, 0.0), max(hours - view_length, 0.0));
+
+  double end = view_start + view_length;
+  Json::object content =
+  {
+    {"mrn", mrn},
+    {"nfft", 0},
+    {"startTime", view_start},
+    {"endTime", end},
+    {"startTimeMs", round(view_start * 3600 * 1000)},
+    {"endTimeMs", round(end * 3600 * 1000)},
+    {"overlap", 0.5},
+    {"minFreq", 0},
+    {"maxFreq", 20},
+    {"downsample", "mean"},
+    {"maxWidth", VIEW_WIDTH},
+    {"maxHeight", VIEW_HEIGHT},
+    {"channel", 0},
+    {"width", VIEW_WIDTH}
+  };
+  if (request_type == "spectrogram_batch")
+  {
+    content["channels"] = Json::array {0, 1, 2, 3};
+  }
+  return Json::object
+  {
+    {"type", request_type},
+    {"content", content},
+    {"visgoth_content", Json::object {{"metadata", Json::object {}}, {"profile", Json::object {}}}}
+  };
+}
+
+Json LoadClient::next_request()
+{
+  if (session->empty())
+  {
+    return synthetic_request();
+  }
+  Json request = (*session)[next];
+  next = (next + 1) % session->size();
+  return request;
+}
+
+/*
+ * Send the next request that has responses, after the pause of a viewer if
+ * `think` is set
+ */
+void LoadClient::send_next(bool think)
+{
+  Json request;
+  set<string> keys;
+  do
+  {
+    request = next_request();
+    keys = get_expected_responses(request);
+    if (think)
+    {
+      double delay_ms = request["delayMs"].is_number() ? request["delayMs"].number_value() :
+        exponential_distribution<double>(1 / max(think_ms, 1e-3))(rng);
+      this_thread::sleep_for(chrono::microseconds((int64_t) (delay_ms * 1000)));
+    }
+  } while (keys.empty());
+
+  {
+    lock_guard<mutex> guard(state_lock);
+    type = request["type"].string_value();
+    pending = keys;
+    bytes = 0;
+    sent = getticks();
+  }
+  auto send_stream = make_shared<WsClient::SendStream>();
+  *send_stream << request.dump();
+  client.send(send_stream);
+}
+
+void LoadClient::run()
+{
+  client.start();
+}
+
+void LoadClient::stop()
+{
+  client.stop();
+}
+
+/*
+ * Drop the request if it waited longer than `REQUEST_TIMEOUT_MS` for its
+ * responses and send the next one, the timeout replacing the pause
+ */
+void LoadClient::check_timeout()
+{
+  {
+    lock_guard<mutex> guard(state_lock);
+    if (pending.empty() || ticks_to_seconds(getticks() - sent) * 1000 < REQUEST_TIMEOUT_MS)
+    {
+      return;
+    }
+    stats[type].dropped++;
+    pending.clear();
+  }
+  send_next(false);
+}
+
+/*
+ * Count the request still waiting for responses, after `run` returned
+ */
+void LoadClient::finish()
+{
+  if (!pending.empty())
+  {
+    stats[type].timeouts++;
+  }
+}
+
+static double percentile(vector<double>& sorted, double p)
+{
+  if (sorted.empty())
+  {
+    return 0;
+  }
+  return sorted[min((size_t) (p * sorted.size()), sorted.size() - 1)];
+}
+
+/*
+ * Simulate concurrent viewers of ws_server and report the latency
+ * percentiles, throughput and bytes per second of each request type.
+ */
+int main(int argc, char* argv[])
+{
+  if (argc < 4 || argc > 7)
+  {
+    cout << "\nusage: ./loadgen <nclients> <seconds> <session.jsonl|mrn:hours> " <<
+      "[think_ms] [host:port] [output]\n" << endl;
+    return 1;
+  }
+  int nclients = max(atoi(argv[1]), 1);
+  double seconds = atof(argv[2]);
+  string session_arg = argv[3];
+  double think_ms = argc > 4 ? atof(argv[4]) : DEFAULT_THINK_MS;
+  string server = argc > 5 ? argv[5] : "localhost:" + to_string(WS_DEFAULT_PORT);
+  string output = argc > 6 ? argv[6] : "loadgen.json";
+
+  vector<Json> session;
+  string mrn;
+  double hours = 0;
+  if (file_exists(session_arg))
+  {
+    session = load_session(session_arg);
+    if (session.empty())
+    {
+      cout << "No requests in session: " << session_arg << endl;
+      return 1;
+    }
+  }
+  else
+  {
+    vector<string> parts = split(session_arg, ':');
+    if (parts.size() != 2 || atof(parts[1].c_str()) <= 0)
+    {
+      cout << "Expected a session file or mrn:hours, got: " << session_arg << endl;
+      return 1;
+    }
+    mrn = parts[0];
+    hours = atof(parts[1].c_str());
+  }
+
+  string server_path = server + "/compute/spectrogram/";
+  vector<unique_ptr<LoadClient>> clients;
+  vector<thread> threads;
+  for (int i = 0; i < nclients; i++)
+  {
+    clients.push_back(unique_ptr<LoadClient>(new LoadClient(server_path, i, &session, mrn, hours, think_ms)));
+  }
+  unsigned long long start = getticks();
+  for (auto& client : clients)
+  {
+    LoadClient* load_client = client.get();
+    threads.push_back(thread([load_client]()
+    {
+      load_client->run();
+    }));
+  }
+  while (ticks_to_seconds(getticks() - start) < seconds)
+  {
+    double remaining = seconds - ticks_to_seconds(getticks() - start);
+    this_thread::sleep_for(chrono::microseconds((int64_t) (min(remaining * 1e6, WATCH_INTERVAL_MS * 1e3))));
+    for (auto& client : clients)
+    {
+      client->check_timeout();
+    }
+  }
+  for (auto& client : clients)
+  {
+    client->stop();
+  }
+  for (thread& t : threads)
+  {
+    t.join();
+  }
+  double elapsed = ticks_to_seconds(getticks() - start);
+
+  map<string, request_stats_t> stats;
+  for (auto& client : clients)
+  {
+    client->finish();
+    for (auto& it : client->stats)
+    {
+      request_stats_t& type_stats = stats[it.first];
+      type_stats.latencies.insert(type_stats.latencies.end(),
+          it.second.latencies.begin(), it.second.latencies.end());
+      type_stats.bytes += it.second.bytes;
+      type_stats.dropped += it.second.dropped;
+      type_stats.timeouts += it.second.timeouts;
+    }
+  }
+
+  Json::object json_types;
+  cout << "type requests req/s p50 p95 p99 MB/s dropped timeouts" << endl;
+  for (auto& it : stats)
+  {
+    vector<double>& latencies = it.second.latencies;
+    sort(latencies.begin(), latencies.end());
+    double throughput = latencies.size() / elapsed;
+    double bytes_per_second = it.second.bytes / elapsed;
+    json_types[it.first] = Json::object
+    {
+      {"requests", (double) latencies.size()},
+      {"throughput", throughput},
+      {"p50", percentile(latencies, 0.5)},
+      {"p95", percentile(latencies, 0.95)},
+      {"p99", percentile(latencies, 0.99)},
+      {"max", latencies.empty() ? 0 : latencies.back()},
+      {"bytesPerSecond", bytes_per_second},
+      {"dropped", (double) it.second.dropped},
+      {"timeouts", (double) it.second.timeouts}
+    };
+    cout << it.first << " " << latencies.size() << " " << throughput << " " <<
+      percentile(latencies, 0.5) << " " << percentile(latencies, 0.95) << " " <<
+      percentile(latencies, 0.99) << " " << bytes_per_second / 1e6 << " " <<
+      it.second.dropped << " " << it.second.timeouts << endl;
+  }
+
+  Json json = Json::object
+  {
+    {"server", server},
+    {"clients", nclients},
+    {"seconds", elapsed},
+    {"thinkMs", think_ms},
+    {"session", session_arg},
+    {"types", json_types}
+  };
+  ofstream file(output);
+  file << json.dump() << endl;
+  file.close();
+  cout << "Wrote results to " << output << endl;
+  return 0;
+}
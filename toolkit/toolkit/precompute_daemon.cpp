@@ -0,0 +1,217 @@
+#include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#include "config.hpp"
+#include "server/job_queue.hpp"
+
+using namespace std;
+
+#define EVENT_BUF_LEN (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+// see linux/ioprio.h, the idle class only gets disk time when no other
+// process needs it
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+/*
+ * Return the mrn of an EDF file name, or an empty string for other files
+ */
+string edf_to_mrn(string filename)
+{
+  string ext = ".edf";
+  if (filename.size() <= ext.size() ||
+      filename.compare(filename.size() - ext.size(), ext.size(), ext))
+  {
+    return "";
+  }
+  return filename.substr(0, filename.size() - ext.size());
+}
+
+/*
+ * Run the program for the `stage` of `mrn` in a child process with a lower
+ * CPU and I/O priority than ws_server. Running each stage as its own process
+ * keeps the daemon alive when a conversion exits on an error. Returns true
+ * if the stage succeeded.
+ */
+bool run_stage(int stage, string mrn)
+{
+  string program = stage == JOB_CONVERT ? "./edf_converter" : "./precompute_spectrogram";
+  cout << "Starting " << get_stage_name(stage) << " for " << mrn << endl;
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    cout << "Unable to fork for " << mrn << endl;
+    return false;
+  }
+  if (pid == 0)
+  {
+    setpriority(PRIO_PROCESS, 0, INGEST_NICE);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    execl(program.c_str(), program.c_str(), mrn.c_str(), (char*) nullptr);
+    _exit(127);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0)
+  {
+    return false;
+  }
+  bool success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  cout << "Finished " << get_stage_name(stage) << " for " << mrn << (success ? "" : " with an error") << endl;
+  return success;
+}
+
+/*
+ * Run the jobs of `stage` until the queue is stopped
+ */
+void worker(JobQueue* queue, int stage)
+{
+  job_t job;
+  while (queue->take(stage, &job))
+  {
+    queue->finish(&job, run_stage(stage, job.mrn));
+  }
+}
+
+/*
+ * Schedule the EDF files of `DATADIR` that were not ingested before, e.g.
+ * files added while the daemon was not running
+ */
+void scan_datadir(JobQueue* queue)
+{
+  DIR* dir = opendir(DATADIR);
+  if (dir == nullptr)
+  {
+    cout << "Unable to open " << DATADIR << endl;
+    exit(-1);
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != nullptr)
+  {
+    string mrn = edf_to_mrn(entry->d_name);
+    if (!mrn.empty() && !queue->contains(mrn))
+    {
+      queue->add(mrn);
+    }
+  }
+  closedir(dir);
+}
+
+/*
+ * Schedule EDF files as they are written to or moved into `DATADIR` and
+ * prioritize the recordings ws_server marks as viewed
+ */
+void watch(JobQueue* queue)
+{
+  string viewing_dir = DATADIR VIEWING_DIR;
+  mkdir(viewing_dir.c_str(), 0755);
+
+  int fd = inotify_init();
+  if (fd < 0)
+  {
+    cout << "Unable to initialize inotify" << endl;
+    exit(-1);
+  }
+  int data_wd = inotify_add_watch(fd, DATADIR, IN_CLOSE_WRITE | IN_MOVED_TO);
+  int viewing_wd = inotify_add_watch(fd, viewing_dir.c_str(), IN_CLOSE_WRITE);
+  if (data_wd < 0 || viewing_wd < 0)
+  {
+    cout << "Unable to watch " << DATADIR << endl;
+    exit(-1);
+  }
+
+  char buf[EVENT_BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  while (true)
+  {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len <= 0)
+    {
+      continue;
+    }
+    for (char* ptr = buf; ptr < buf + len;)
+    {
+      struct inotify_event* event = (struct inotify_event*) ptr;
+      ptr += sizeof(struct inotify_event) + event->len;
+      if (!event->len)
+      {
+        continue;
+      }
+
+      string name = event->name;
+      if (event->wd == viewing_wd)
+      {
+        queue->prioritize(name);
+      }
+      else
+      {
+        string mrn = edf_to_mrn(name);
+        if (!mrn.empty())
+        {
+          cout << "Found " << name << endl;
+          queue->add(mrn);
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Daemon that converts the EDF files added to `DATADIR` and precomputes
+ * their spectrograms. Conversions and precomputations run in separate
+ * worker pools, `INGEST_IO_WORKERS` and `INGEST_CPU_WORKERS` by default.
+ */
+int main(int argc, char* argv[])
+{
+  int io_workers = INGEST_IO_WORKERS;
+  int cpu_workers = INGEST_CPU_WORKERS;
+  if (argc > 3)
+  {
+    cout << "\nusage: ./precompute_daemon <io_workers> <cpu_workers>\n" << endl;
+    return 1;
+  }
+  if (argc >= 2)
+  {
+    io_workers = max(atoi(argv[1]), 1);
+  }
+  if (argc == 3)
+  {
+    cpu_workers = max(atoi(argv[2]), 1);
+  }
+
+  JobQueue queue(DATADIR INGEST_JOURNAL);
+  queue.load();
+  scan_datadir(&queue);
+
+  cout << "Watching " << DATADIR << " with " << io_workers << " io workers and "
+    << cpu_workers << " cpu workers" << endl;
+  vector<thread> workers;
+  for (int i = 0; i < io_workers; i++)
+  {
+    workers.push_back(thread(worker, &queue, JOB_CONVERT));
+  }
+  for (int i = 0; i < cpu_workers; i++)
+  {
+    workers.push_back(thread(worker, &queue, JOB_PRECOMPUTE));
+  }
+
+  watch(&queue);
+
+  queue.stop();
+  for (auto& t : workers)
+  {
+    t.join();
+  }
+  return 0;
+}
@@ -0,0 +1,232 @@
+#include "job_queue.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+JobQueue::JobQueue(string journal_path)
+{
+  this->journal_path = journal_path;
+  max_priority = 0;
+  running = true;
+}
+
+/*
+ * Write every job to the journal as a line of `mrn stage priority attempts`.
+ * The journal is replaced atomically so a crash leaves either the old or the
+ * new queue. Must be called with `lock` held.
+ */
+void JobQueue::save()
+{
+  string tmp_path = journal_path + ".tmp";
+  ofstream journal(tmp_path, ios::trunc);
+  for (auto& it : jobs)
+  {
+    job_t& job = it.second;
+    journal << job.mrn << " " << job.stage << " " << job.priority << " " << job.attempts << endl;
+  }
+  journal.close();
+  if (journal.fail() || rename(tmp_path.c_str(), journal_path.c_str()))
+  {
+    cout << "Unable to write the job journal " << journal_path << endl;
+  }
+}
+
+/*
+ * Read the jobs of the journal. Jobs that were running when the daemon
+ * stopped restart their stage.
+ */
+void JobQueue::load()
+{
+  lock_guard<mutex> guard(lock);
+  ifstream journal(journal_path);
+  string line;
+  while (getline(journal, line))
+  {
+    job_t job = {};
+    istringstream fields(line);
+    if (!(fields >> job.mrn >> job.stage >> job.priority >> job.attempts))
+    {
+      continue;
+    }
+    jobs[job.mrn] = job;
+    max_priority = max(max_priority, job.priority);
+  }
+  cout << "Loaded " << jobs.size() << " jobs from " << journal_path << endl;
+}
+
+bool JobQueue::contains(string mrn)
+{
+  lock_guard<mutex> guard(lock);
+  return jobs.find(mrn) != jobs.end();
+}
+
+/*
+ * Schedule the conversion of the EDF file of `mrn`. A job that is running
+ * starts over once it finishes since the file changed under it.
+ */
+void JobQueue::add(string mrn)
+{
+  {
+    lock_guard<mutex> guard(lock);
+    auto it = jobs.find(mrn);
+    if (it == jobs.end())
+    {
+      jobs[mrn] = {mrn, JOB_CONVERT, 0, 0, false, false};
+    }
+    else if (it->second.running)
+    {
+      it->second.restart = true;
+    }
+    else
+    {
+      it->second.stage = JOB_CONVERT;
+      it->second.attempts = 0;
+    }
+    save();
+  }
+  cv.notify_all();
+}
+
+/*
+ * Run the pending stages of `mrn` before every other job, used for the
+ * recordings being viewed
+ */
+void JobQueue::prioritize(string mrn)
+{
+  {
+    lock_guard<mutex> guard(lock);
+    auto it = jobs.find(mrn);
+    if (it == jobs.end() || it->second.stage >= JOB_DONE)
+    {
+      return;
+    }
+    it->second.priority = ++max_priority;
+    save();
+  }
+  cout << "Prioritized " << mrn << endl;
+  cv.notify_all();
+}
+
+/*
+ * Wait for the highest priority job waiting for `stage` and mark it as
+ * running. Returns false once the queue is stopped.
+ */
+bool JobQueue::take(int stage, job_t* job)
+{
+  unique_lock<mutex> guard(lock);
+  while (running)
+  {
+    job_t* next = nullptr;
+    for (auto& it : jobs)
+    {
+      job_t& candidate = it.second;
+      if (candidate.stage == stage && !candidate.running &&
+          (next == nullptr || candidate.priority > next->priority))
+      {
+        next = &candidate;
+      }
+    }
+    if (next != nullptr)
+    {
+      next->running = true;
+      *job = *next;
+      return true;
+    }
+    cv.wait(guard);
+  }
+  return false;
+}
+
+/*
+ * Move a job taken with `take` to its next stage, or retry the stage if it
+ * failed until `INGEST_MAX_ATTEMPTS` is reached
+ */
+void JobQueue::finish(job_t* job, bool success)
+{
+  {
+    lock_guard<mutex> guard(lock);
+    job_t& current = jobs[job->mrn];
+    current.running = false;
+    if (current.restart)
+    {
+      current.restart = false;
+      current.stage = JOB_CONVERT;
+      current.attempts = 0;
+    }
+    else if (success)
+    {
+      current.stage++;
+      current.attempts = 0;
+    }
+    else if (++current.attempts >= INGEST_MAX_ATTEMPTS)
+    {
+      cout << "Giving up on " << get_stage_name(current.stage) << " for " << current.mrn << endl;
+      current.stage = JOB_FAILED;
+    }
+    save();
+  }
+  cv.notify_all();
+}
+
+/*
+ * Wake up and stop the workers waiting in `take`
+ */
+void JobQueue::stop()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    running = false;
+  }
+  cv.notify_all();
+}
+
+string get_stage_name(int stage)
+{
+  switch (stage)
+  {
+    case JOB_CONVERT:
+      return "convert";
+    case JOB_PRECOMPUTE:
+      return "precompute";
+    case JOB_DONE:
+      return "done";
+    default:
+      return "failed";
+  }
+}
+
+/*
+ * Returns true if `mrn` names a file in a directory rather than a path out of
+ * it or a hidden file
+ */
+bool is_valid_mrn(string mrn)
+{
+  return !mrn.empty() && mrn[0] != '.' && mrn.find('/') == string::npos;
+}
+
+/*
+ * Tell precompute_daemon that `mrn` is being viewed so its pending jobs run
+ * first. The daemon watches for writes to `DATADIR VIEWING_DIR <mrn>`.
+ */
+void mark_viewed(string mrn)
+{
+  if (!is_valid_mrn(mrn))
+  {
+    return;
+  }
+  string viewing_dir = DATADIR VIEWING_DIR;
+  mkdir(viewing_dir.c_str(), 0755);
+  int fd = open((viewing_dir + mrn).c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
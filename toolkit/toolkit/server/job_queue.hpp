@@ -0,0 +1,60 @@
+#ifndef JOB_QUEUE_H
+#define JOB_QUEUE_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+#include "../config.hpp"
+
+using namespace std;
+
+// Stages of a recording, jobs run one stage at a time
+#define JOB_CONVERT 0 // convert the EDF file to the backend format, I/O bound
+#define JOB_PRECOMPUTE 1 // precompute the spectrograms, CPU bound
+#define JOB_DONE 2
+#define JOB_FAILED 3
+
+typedef struct job
+{
+  string mrn;
+  int stage; // one of the JOB_* stages
+  int64_t priority; // jobs with the highest priority run first
+  int attempts; // failures of the current stage
+  bool running;
+  bool restart; // the EDF file changed while the job was running
+} job_t;
+
+/*
+ * Queue of the ingest jobs of every recording. Every change is written to
+ * the journal at `journal_path` so pending jobs resume after a restart.
+ */
+class JobQueue
+{
+  private:
+    mutex lock;
+    condition_variable cv;
+    map<string, job_t> jobs;
+    string journal_path;
+    int64_t max_priority;
+    bool running;
+
+    void save();
+
+  public:
+    JobQueue(string journal_path);
+    void load();
+    bool contains(string mrn);
+    void add(string mrn);
+    void prioritize(string mrn);
+    bool take(int stage, job_t* job);
+    void finish(job_t* job, bool success);
+    void stop();
+};
+
+string get_stage_name(int stage);
+bool is_valid_mrn(string mrn);
+void mark_viewed(string mrn);
+
+#endif // JOB_QUEUE_H
@@ -0,0 +1,464 @@
+#include "metrics.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <numeric>
+#include <sstream>
+#include <iostream>
+#include <boost/asio.hpp>
+
+#include "../helpers.hpp"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+#define METRICS_MIN_POW 6 // smallest exported bucket bound, 2^6 microseconds
+#define METRICS_MAX_POW 26 // largest exported bucket bound, about 67 seconds
+#define METRICS_TIMEOUT_S 5 // time a scrape may take before its connection is closed
+#define METRICS_BACKOFF_S 1 // wait after a failed accept, e.g. out of file descriptors
+
+/*
+ * Metrics recorded by one thread. Only the owning thread writes a shard, so
+ * recording is a relaxed load and store without locks or contended cache
+ * lines. Scrapes sum the shards of every thread.
+ */
+typedef struct metrics_shard
+{
+  atomic<uint64_t> counters[NUM_COUNTERS][NUM_REQUEST_TYPES];
+  atomic<int64_t> gauges[NUM_GAUGES];
+  atomic<uint64_t> latency[NUM_REQUEST_TYPES][METRICS_NBUCKETS];
+  atomic<uint64_t> latency_total[NUM_REQUEST_TYPES]; // microseconds
+  atomic<uint64_t> stages[NUM_REQUEST_TYPES][NUM_STAGES][METRICS_NBUCKETS];
+  atomic<uint64_t> stages_total[NUM_REQUEST_TYPES][NUM_STAGES];
+} metrics_shard_t;
+
+// shards are kept when their thread exits so counters never decrease
+static mutex shards_mutex;
+static vector<metrics_shard_t*> shards;
+static thread_local metrics_shard_t* local_shard = nullptr;
+
+static metrics_shard_t* get_shard()
+{
+  if (local_shard == nullptr)
+  {
+    local_shard = new metrics_shard_t(); // zeroed
+    lock_guard<mutex> lock(shards_mutex);
+    shards.push_back(local_shard);
+  }
+  return local_shard;
+}
+
+template<typename T>
+static inline void add(atomic<T>& value, T n)
+{
+  value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/*
+ * Histogram bucket of `value`, values below 2^METRICS_SUB_BITS are exact
+ */
+static inline int get_bucket(uint64_t value)
+{
+  if (value < (1 << METRICS_SUB_BITS))
+  {
+    return value;
+  }
+  int pow = 63 - __builtin_clzll(value);
+  int sub = (value >> (pow - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1);
+  return min(((pow - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub, METRICS_NBUCKETS - 1);
+}
+
+/*
+ * Smallest value of `bucket`
+ */
+static inline uint64_t get_bucket_start(int bucket)
+{
+  if (bucket < (1 << METRICS_SUB_BITS))
+  {
+    return bucket;
+  }
+  int pow = (bucket >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+  int sub = bucket & ((1 << METRICS_SUB_BITS) - 1);
+  return (uint64_t) ((1 << METRICS_SUB_BITS) + sub) << (pow - METRICS_SUB_BITS);
+}
+
+int get_request_type(string type)
+{
+  for (int i = 0; i < NUM_REQUEST_TYPES - 1; i++)
+  {
+    if (REQUEST_TYPES[i] == type)
+    {
+      return i;
+    }
+  }
+  return NUM_REQUEST_TYPES - 1;
+}
+
+void metrics_add(int counter, int type, uint64_t n)
+{
+  add(get_shard()->counters[counter][type], n);
+}
+
+void metrics_gauge_add(int gauge, int64_t n)
+{
+  add(get_shard()->gauges[gauge], n);
+}
+
+void metrics_observe_latency(int type, unsigned long long ticks)
+{
+  metrics_shard_t* shard = get_shard();
+  add(shard->latency[type][get_bucket(ticks)], (uint64_t) 1);
+  add(shard->latency_total[type], (uint64_t) ticks);
+}
+
+void metrics_observe_stage(int type, int stage, unsigned long long ticks)
+{
+  metrics_shard_t* shard = get_shard();
+  add(shard->stages[type][stage][get_bucket(ticks)], (uint64_t) 1);
+  add(shard->stages_total[type][stage], (uint64_t) ticks);
+}
+
+/*
+ * Append a metric without labels in the Prometheus text format, counts are
+ * printed exactly
+ */
+void append_metric(string* text, string name, string help, string type, uint64_t value)
+{
+  ostringstream out;
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+  out << name << " " << value << "\n";
+  *text += out.str();
+}
+
+/*
+ * Append the histogram `buckets` with `labels` as cumulative buckets bounded
+ * by powers of 2, which are bucket starts, in seconds
+ */
+static void append_histogram(ostringstream& out, string name, string labels,
+    vector<uint64_t>& buckets, uint64_t total)
+{
+  uint64_t count = 0;
+  int bucket = 0;
+  for (int pow = METRICS_MIN_POW; pow <= METRICS_MAX_POW; pow++)
+  {
+    for (; bucket < METRICS_NBUCKETS && get_bucket_start(bucket) < (1ULL << pow); bucket++)
+    {
+      count += buckets[bucket];
+    }
+    out << name << "_bucket{" << labels << ",le=\"" << ticks_to_seconds(1ULL << pow) <<
+      "\"} " << count << "\n";
+  }
+  for (; bucket < METRICS_NBUCKETS; bucket++)
+  {
+    count += buckets[bucket];
+  }
+  out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << count << "\n";
+  out << name << "_sum{" << labels << "} " << ticks_to_seconds(total) << "\n";
+  out << name << "_count{" << labels << "} " << count << "\n";
+}
+
+/*
+ * Start of the bucket of the `p` quantile of `buckets`, in seconds
+ */
+static double get_quantile(vector<uint64_t>& buckets, double p)
+{
+  uint64_t count = 0;
+  for (uint64_t n : buckets)
+  {
+    count += n;
+  }
+  uint64_t rank = p * count;
+  uint64_t seen = 0;
+  for (int i = 0; i < METRICS_NBUCKETS; i++)
+  {
+    seen += buckets[i];
+    if (seen > rank)
+    {
+      return ticks_to_seconds(get_bucket_start(i));
+    }
+  }
+  return 0;
+}
+
+/*
+ * Sum the stage histograms of every shard into `stages` and `stages_total`
+ */
+static void sum_stages(vector<vector<vector<uint64_t>>>& stages, vector<vector<uint64_t>>& stages_total)
+{
+  stages.assign(NUM_REQUEST_TYPES, vector<vector<uint64_t>>(NUM_STAGES, vector<uint64_t>(METRICS_NBUCKETS)));
+  stages_total.assign(NUM_REQUEST_TYPES, vector<uint64_t>(NUM_STAGES));
+  lock_guard<mutex> lock(shards_mutex);
+  for (metrics_shard_t* shard : shards)
+  {
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++)
+    {
+      for (int i = 0; i < NUM_STAGES; i++)
+      {
+        for (int b = 0; b < METRICS_NBUCKETS; b++)
+        {
+          stages[t][i][b] += shard->stages[t][i][b].load(memory_order_relaxed);
+        }
+        stages_total[t][i] += shard->stages_total[t][i].load(memory_order_relaxed);
+      }
+    }
+  }
+}
+
+/*
+ * Fill `stats` with the distribution of the time spent in each stage by
+ * every request type, from the shards of every thread
+ */
+void get_stage_stats(stage_stats_t stats[NUM_REQUEST_TYPES][NUM_STAGES])
+{
+  vector<vector<vector<uint64_t>>> stages;
+  vector<vector<uint64_t>> stages_total;
+  sum_stages(stages, stages_total);
+  for (int t = 0; t < NUM_REQUEST_TYPES; t++)
+  {
+    for (int i = 0; i < NUM_STAGES; i++)
+    {
+      vector<uint64_t>& buckets = stages[t][i];
+      stats[t][i].count = accumulate(buckets.begin(), buckets.end(), (uint64_t) 0);
+      stats[t][i].total = stages_total[t][i];
+      stats[t][i].p50 = get_quantile(buckets, 0.5);
+      stats[t][i].p95 = get_quantile(buckets, 0.95);
+      stats[t][i].p99 = get_quantile(buckets, 0.99);
+    }
+  }
+}
+
+/*
+ * Metrics of every thread in the Prometheus text format
+ */
+string get_metrics_text()
+{
+  static const string COUNTER_NAMES[NUM_COUNTERS] =
+  {
+    "ws_requests_total", "ws_read_bytes_total", "ws_sent_bytes_total",
+    "ws_sent_messages_total", "ws_send_errors_total", "ws_replaced_messages_total",
+    "ws_dropped_messages_total"
+  };
+  static const string COUNTER_HELP[NUM_COUNTERS] =
+  {
+    "Requests served.", "Bytes of EEG data read to serve requests.",
+    "Bytes of responses sent.", "Responses sent.", "Responses that failed to send.",
+    "Unsent responses replaced by a newer one for the same view.",
+    "Unsent responses dropped from a full send queue."
+  };
+  static const string GAUGE_NAMES[NUM_GAUGES] = {"ws_active_requests", "ws_pending_sends"};
+  static const string GAUGE_HELP[NUM_GAUGES] =
+  {
+    "Requests being served.", "Responses queued for the clients."
+  };
+
+  uint64_t counters[NUM_COUNTERS][NUM_REQUEST_TYPES] = {};
+  int64_t gauges[NUM_GAUGES] = {};
+  vector<vector<uint64_t>> latency(NUM_REQUEST_TYPES, vector<uint64_t>(METRICS_NBUCKETS));
+  vector<uint64_t> latency_total(NUM_REQUEST_TYPES);
+  vector<vector<vector<uint64_t>>> stages;
+  vector<vector<uint64_t>> stages_total;
+  sum_stages(stages, stages_total);
+  {
+    lock_guard<mutex> lock(shards_mutex);
+    for (metrics_shard_t* shard : shards)
+    {
+      for (int i = 0; i < NUM_REQUEST_TYPES; i++)
+      {
+        for (int c = 0; c < NUM_COUNTERS; c++)
+        {
+          counters[c][i] += shard->counters[c][i].load(memory_order_relaxed);
+        }
+        for (int b = 0; b < METRICS_NBUCKETS; b++)
+        {
+          latency[i][b] += shard->latency[i][b].load(memory_order_relaxed);
+        }
+        latency_total[i] += shard->latency_total[i].load(memory_order_relaxed);
+      }
+      for (int g = 0; g < NUM_GAUGES; g++)
+      {
+        gauges[g] += shard->gauges[g].load(memory_order_relaxed);
+      }
+    }
+  }
+
+  ostringstream out;
+  for (int c = 0; c < NUM_COUNTERS; c++)
+  {
+    out << "# HELP " << COUNTER_NAMES[c] << " " << COUNTER_HELP[c] << "\n";
+    out << "# TYPE " << COUNTER_NAMES[c] << " counter\n";
+    for (int i = 0; i < NUM_REQUEST_TYPES; i++)
+    {
+      out << COUNTER_NAMES[c] << "{type=\"" << REQUEST_TYPES[i] << "\"} " << counters[c][i] << "\n";
+    }
+  }
+  for (int g = 0; g < NUM_GAUGES; g++)
+  {
+    out << "# HELP " << GAUGE_NAMES[g] << " " << GAUGE_HELP[g] << "\n";
+    out << "# TYPE " << GAUGE_NAMES[g] << " gauge\n";
+    out << GAUGE_NAMES[g] << " " << gauges[g] << "\n";
+  }
+
+  out << "# HELP ws_request_duration_seconds Time from receiving a request to sending its last response.\n";
+  out << "# TYPE ws_request_duration_seconds histogram\n";
+  for (int i = 0; i < NUM_REQUEST_TYPES; i++)
+  {
+    append_histogram(out, "ws_request_duration_seconds", "type=\"" + REQUEST_TYPES[i] + "\"",
+        latency[i], latency_total[i]);
+  }
+  out << "# HELP ws_request_duration_quantile_seconds Quantiles of ws_request_duration_seconds within 12.5%.\n";
+  out << "# TYPE ws_request_duration_quantile_seconds gauge\n";
+  for (int i = 0; i < NUM_REQUEST_TYPES; i++)
+  {
+    for (double p : {0.5, 0.95, 0.99})
+    {
+      out << "ws_request_duration_quantile_seconds{type=\"" << REQUEST_TYPES[i] <<
+        "\",quantile=\"" << p << "\"} " << get_quantile(latency[i], p) << "\n";
+    }
+  }
+  out << "# HELP ws_stage_duration_seconds Time spent by a request in each stage.\n";
+  out << "# TYPE ws_stage_duration_seconds histogram\n";
+  for (int t = 0; t < NUM_REQUEST_TYPES; t++)
+  {
+    for (int i = 0; i < NUM_STAGES; i++)
+    {
+      append_histogram(out, "ws_stage_duration_seconds", "type=\"" + REQUEST_TYPES[t] +
+          "\",stage=\"" + STAGE_NAMES[i] + "\"", stages[t][i], stages_total[t][i]);
+    }
+  }
+  return out.str();
+}
+
+/*
+ * HTTP response to the request in `request`, the text of `get_text` for
+ * /metrics
+ */
+static string get_metrics_response(boost::asio::streambuf& request, function<string()>& get_text)
+{
+  istream request_stream(&request);
+  string method, path;
+  request_stream >> method >> path;
+
+  string status = "200 OK";
+  string body;
+  if (method == "GET" && (path == "/metrics" || path.find("/metrics?") == 0))
+  {
+    body = get_text();
+  }
+  else
+  {
+    status = "404 Not Found";
+    body = "Not found\n";
+  }
+  ostringstream response;
+  response << "HTTP/1.1 " << status << "\r\n" <<
+    "Content-Type: text/plain; version=0.0.4\r\n" <<
+    "Content-Length: " << body.size() << "\r\n" <<
+    "Connection: close\r\n\r\n" << body;
+  return response.str();
+}
+
+/*
+ * Read the request of `socket` and answer it. The socket is closed if the
+ * client takes longer than `METRICS_TIMEOUT_S`, so an idle client does not
+ * hold the listener.
+ */
+static void serve_metrics_request(boost::asio::io_service& io_service,
+    shared_ptr<tcp::socket> socket, function<string()>& get_text)
+{
+  auto request = make_shared<boost::asio::streambuf>();
+  auto timer = make_shared<boost::asio::deadline_timer>(io_service,
+      boost::posix_time::seconds(METRICS_TIMEOUT_S));
+  timer->async_wait([socket](const boost::system::error_code& ec)
+  {
+    if (!ec)
+    {
+      boost::system::error_code ignored;
+      socket->close(ignored);
+    }
+  });
+  boost::asio::async_read_until(*socket, *request, "\r\n\r\n",
+      [socket, request, timer, &get_text](const boost::system::error_code& ec, size_t)
+  {
+    if (ec)
+    {
+      timer->cancel();
+      return;
+    }
+    auto response = make_shared<string>(get_metrics_response(*request, get_text));
+    boost::asio::async_write(*socket, boost::asio::buffer(*response),
+        [socket, response, timer](const boost::system::error_code&, size_t)
+    {
+      timer->cancel();
+      boost::system::error_code ignored;
+      socket->close(ignored);
+    });
+  });
+}
+
+/*
+ * Accept the next scrape. A failed accept is retried after
+ * `METRICS_BACKOFF_S` rather than at once, which would spin while e.g. the
+ * process is out of file descriptors.
+ */
+static void accept_metrics(boost::asio::io_service& io_service, tcp::acceptor& acceptor,
+    function<string()>& get_text)
+{
+  auto socket = make_shared<tcp::socket>(io_service);
+  acceptor.async_accept(*socket, [&io_service, &acceptor, &get_text, socket]
+      (const boost::system::error_code& ec)
+  {
+    if (ec == boost::asio::error::operation_aborted)
+    {
+      return;
+    }
+    if (ec)
+    {
+      cout << "Metrics: accept error: " << ec.message() << endl;
+      auto timer = make_shared<boost::asio::deadline_timer>(io_service,
+          boost::posix_time::seconds(METRICS_BACKOFF_S));
+      timer->async_wait([&io_service, &acceptor, &get_text, timer](const boost::system::error_code&)
+      {
+        accept_metrics(io_service, acceptor, get_text);
+      });
+      return;
+    }
+    serve_metrics_request(io_service, socket, get_text);
+    accept_metrics(io_service, acceptor, get_text);
+  });
+}
+
+/*
+ * Answer HTTP requests for /metrics on `port` with the text of `get_text`
+ * until the process exits. Returns if the port cannot be listened on.
+ */
+void serve_metrics(int port, function<string()> get_text)
+{
+  boost::asio::io_service io_service;
+  tcp::acceptor acceptor(io_service);
+  tcp::endpoint endpoint(tcp::v4(), port);
+  boost::system::error_code ec;
+  acceptor.open(endpoint.protocol(), ec);
+  if (!ec)
+  {
+    acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+  }
+  if (!ec)
+  {
+    acceptor.bind(endpoint, ec);
+  }
+  if (!ec)
+  {
+    acceptor.listen(boost::asio::socket_base::max_connections, ec);
+  }
+  if (ec)
+  {
+    cout << "Metrics: could not listen at port " << port << ", error message: " <<
+      ec.message() << endl;
+    return;
+  }
+  cout << "Metrics served at port: " << port << endl;
+  accept_metrics(io_service, acceptor, get_text);
+  io_service.run();
+}
@@ -0,0 +1,69 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <functional>
+#include <stdint.h>
+
+#include "../compute/request_trace.hpp"
+#include "../config.hpp"
+
+using namespace std;
+
+// Request types of ws_server, anything else is counted as "unknown"
+static const int NUM_REQUEST_TYPES = 9;
+static const string REQUEST_TYPES[NUM_REQUEST_TYPES] =
+{
+  "spectrogram", "spectrogram_batch", "change_points", "band_power", "waveform",
+  "prefetch_stats", "trace_stats", "information", "unknown"
+};
+
+// Counters by request type
+typedef enum
+{
+  COUNTER_REQUESTS = 0,
+  COUNTER_BYTES_READ,
+  COUNTER_BYTES_SENT,
+  COUNTER_MESSAGES_SENT,
+  COUNTER_SEND_ERRORS,
+  COUNTER_REPLACED_MESSAGES,
+  COUNTER_DROPPED_MESSAGES,
+  NUM_COUNTERS
+} counter_t;
+
+typedef enum
+{
+  GAUGE_ACTIVE_REQUESTS = 0, // requests being served
+  GAUGE_PENDING_SENDS, // responses queued on the sockets
+  NUM_GAUGES
+} gauge_t;
+
+// Log-linear latency histograms in microseconds: every power of 2 is split
+// into 2^METRICS_SUB_BITS buckets, so bucket bounds are within 12.5% of a
+// value, up to 2^36 microseconds
+#define METRICS_SUB_BITS 3
+#define METRICS_NBUCKETS ((36 - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+/*
+ * Distribution of the spans of one stage of a request type
+ */
+typedef struct stage_stats
+{
+  uint64_t count;
+  unsigned long long total; // ticks
+  double p50; // seconds, within 12.5%
+  double p95;
+  double p99;
+} stage_stats_t;
+
+int get_request_type(string type);
+void metrics_add(int counter, int type, uint64_t n);
+void metrics_gauge_add(int gauge, int64_t n);
+void metrics_observe_latency(int type, unsigned long long ticks);
+void metrics_observe_stage(int type, int stage, unsigned long long ticks);
+void get_stage_stats(stage_stats_t stats[NUM_REQUEST_TYPES][NUM_STAGES]);
+void append_metric(string* text, string name, string help, string type, uint64_t value);
+string get_metrics_text();
+void serve_metrics(int port, function<string()> get_text);
+
+#endif // METRICS_H
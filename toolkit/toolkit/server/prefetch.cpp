@@ -0,0 +1,262 @@
+#include "prefetch.hpp"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "../helpers.hpp"
+#include "../storage/backends.hpp"
+
+using namespace std;
+
+#define PREFETCH_NICE 19 // lowest scheduling priority for the worker
+
+Prefetcher::Prefetcher(TileCache* cache)
+{
+  this->cache = cache;
+  active_requests = 0;
+  running = false;
+}
+
+Prefetcher::~Prefetcher()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    running = false;
+  }
+  cv.notify_all();
+  if (worker.joinable())
+  {
+    worker.join();
+  }
+}
+
+/*
+ * Start the worker thread, nothing is prefetched before this is called
+ */
+void Prefetcher::start()
+{
+  if (PREFETCH_DEPTH <= 0)
+  {
+    return;
+  }
+  running = true;
+  worker = thread(&Prefetcher::run, this);
+}
+
+/*
+ * Mark a foreground request as started, the worker pauses until all of them
+ * have ended
+ */
+void Prefetcher::begin_request()
+{
+  lock_guard<mutex> guard(lock);
+  active_requests++;
+}
+
+void Prefetcher::end_request()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    active_requests--;
+  }
+  cv.notify_all();
+}
+
+/*
+ * Record the range of `spec_params` requested by a connection, cancel its
+ * pending jobs and schedule the ranges around it. Panning by the width of
+ * the range sets the direction, zooming keeps it.
+ */
+void Prefetcher::update_view(size_t connection_id, SpecParams* spec_params, vector<int>& chs,
+    float min_freq, float max_freq, uint extent, int max_width, int method)
+{
+  if (!running)
+  {
+    return;
+  }
+  int64_t start_offset = spec_params->spec_start_offset * spec_params->shift;
+  int64_t end_offset = spec_params->spec_end_offset * spec_params->shift;
+  int64_t width = end_offset - start_offset;
+  if (width <= 0)
+  {
+    return;
+  }
+
+  {
+    lock_guard<mutex> guard(lock);
+    auto it = views.find(connection_id);
+    if (it == views.end())
+    {
+      it = views.insert({connection_id, {"", 0, 0, 1, 0}}).first;
+    }
+    view_state_t& view = it->second;
+    if (view.mrn == spec_params->mrn && view.end_offset - view.start_offset == width &&
+        view.start_offset != start_offset)
+    {
+      view.direction = start_offset > view.start_offset ? 1 : -1;
+    }
+    view.mrn = spec_params->mrn;
+    view.start_offset = start_offset;
+    view.end_offset = end_offset;
+    view.generation++;
+
+    jobs.erase(remove_if(jobs.begin(), jobs.end(), [connection_id](prefetch_job_t& job)
+    {
+      return job.connection_id == connection_id;
+    }), jobs.end());
+
+    // the nearest range ahead first, then one range behind
+    vector<int64_t> steps;
+    for (int i = 1; i <= PREFETCH_DEPTH; i++)
+    {
+      steps.push_back(i * view.direction);
+    }
+    steps.push_back(-view.direction);
+    for (int64_t step : steps)
+    {
+      int64_t job_start_offset = start_offset + step * width;
+      if (job_start_offset < 0)
+      {
+        continue;
+      }
+      jobs.push_back({connection_id, view.generation, view.mrn, chs,
+          job_start_offset, job_start_offset + width,
+          min_freq, max_freq, extent, max_width, method});
+    }
+  }
+  cv.notify_all();
+}
+
+/*
+ * Forget a closed connection and cancel its pending jobs
+ */
+void Prefetcher::remove_connection(size_t connection_id)
+{
+  lock_guard<mutex> guard(lock);
+  views.erase(connection_id);
+  jobs.erase(remove_if(jobs.begin(), jobs.end(), [connection_id](prefetch_job_t& job)
+  {
+    return job.connection_id == connection_id;
+  }), jobs.end());
+}
+
+/*
+ * Number of jobs waiting for the worker
+ */
+size_t Prefetcher::get_njobs()
+{
+  lock_guard<mutex> guard(lock);
+  return jobs.size();
+}
+
+/*
+ * Returns true if the job was scheduled for the last request of its
+ * connection. Must be called with `lock` held.
+ */
+bool Prefetcher::is_current(prefetch_job_t* job)
+{
+  auto it = views.find(job->connection_id);
+  return it != views.end() && it->second.generation == job->generation;
+}
+
+/*
+ * Returns true if no foreground request is being served and `job` is still
+ * current
+ */
+bool Prefetcher::is_idle(prefetch_job_t* job)
+{
+  lock_guard<mutex> guard(lock);
+  return running && active_requests == 0 && is_current(job);
+}
+
+/*
+ * Wait until no foreground request is being served. Returns false if the
+ * job was cancelled meanwhile.
+ */
+bool Prefetcher::wait_idle(prefetch_job_t* job)
+{
+  unique_lock<mutex> guard(lock);
+  cv.wait(guard, [this]
+  {
+    return !running || active_requests == 0;
+  });
+  return running && is_current(job);
+}
+
+/*
+ * Compute the spectrograms of the job that are not cached yet, one region at
+ * a time. A region is given up between windows as soon as a foreground
+ * request starts, so the request never waits for this low priority thread
+ * for more than a window.
+ */
+void Prefetcher::prefetch(prefetch_job_t* job)
+{
+  StorageBackend backend;
+  if (!backend.array_exists(job->mrn))
+  {
+    return;
+  }
+  backend.open_array(job->mrn);
+  int64_t nsamples = backend.get_nsamples(job->mrn);
+  backend.close_array(job->mrn);
+  if (job->start_offset >= nsamples)
+  {
+    return;
+  }
+
+  SpecParams spec_params = SpecParams(&backend, job->mrn, job->start_offset, job->end_offset);
+  spec_params.set_band(job->min_freq, job->max_freq);
+  uint total_extent = get_total_extent(spec_params.nblocks, job->extent, job->max_width);
+  for (int ch : job->chs)
+  {
+    if (!wait_idle(job))
+    {
+      return;
+    }
+    string key = get_tile_key(&spec_params, ch, total_extent, job->method);
+    if (!cache->claim(key))
+    {
+      continue; // cached or being computed by a foreground request
+    }
+    vector<int> chs = {ch};
+    auto spec_mat = make_shared<fmat>();
+    if (!stream_spectrograms(&spec_params, chs, total_extent, job->method, spec_mat.get(),
+          [this, job]() { return !is_idle(job); }))
+    {
+      cache->abandon(key, true, make_exception_ptr(runtime_error("prefetch cancelled")));
+      return;
+    }
+    cache->finish(key, spec_mat, true, true);
+  }
+}
+
+void Prefetcher::run()
+{
+  // on Linux the nice value of a thread can be set on its own
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), PREFETCH_NICE);
+  while (true)
+  {
+    prefetch_job_t job;
+    {
+      unique_lock<mutex> guard(lock);
+      cv.wait(guard, [this]
+      {
+        return !running || (!jobs.empty() && active_requests == 0);
+      });
+      if (!running)
+      {
+        return;
+      }
+      job = jobs.front();
+      jobs.pop_front();
+      if (!is_current(&job))
+      {
+        continue;
+      }
+    }
+    prefetch(&job);
+  }
+}
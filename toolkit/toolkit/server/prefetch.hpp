@@ -0,0 +1,85 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "tile_cache.hpp"
+#include "../config.hpp"
+
+using namespace std;
+
+/*
+ * A range of spectrograms to compute ahead of a connection's requests
+ */
+typedef struct prefetch_job
+{
+  size_t connection_id;
+  uint64_t generation; // generation of the view the job was scheduled for
+  string mrn;
+  vector<int> chs;
+  int64_t start_offset;
+  int64_t end_offset;
+  float min_freq;
+  float max_freq;
+  uint extent; // visgoth downsampling factor
+  int max_width;
+  int method;
+} prefetch_job_t;
+
+/*
+ * Last range requested by a connection and the direction it pans in
+ */
+typedef struct view_state
+{
+  string mrn;
+  int64_t start_offset;
+  int64_t end_offset;
+  int direction; // 1 when paging forward, -1 when paging backward
+  uint64_t generation; // incremented on every request, cancels older jobs
+} view_state_t;
+
+/*
+ * Speculatively computes the ranges next to the one each connection viewed
+ * last into the tile cache. `PREFETCH_DEPTH` ranges are computed ahead in the
+ * direction the connection pans and one behind it, at the zoom level of the
+ * last request. A single low priority worker runs the jobs and only while no
+ * foreground request is being served. A new request from a connection cancels
+ * its pending jobs.
+ */
+class Prefetcher
+{
+  private:
+    TileCache* cache;
+    mutex lock;
+    condition_variable cv;
+    deque<prefetch_job_t> jobs;
+    unordered_map<size_t, view_state_t> views;
+    int active_requests; // foreground requests being served
+    bool running;
+    thread worker;
+
+    bool is_current(prefetch_job_t* job);
+    bool is_idle(prefetch_job_t* job);
+    bool wait_idle(prefetch_job_t* job);
+    void prefetch(prefetch_job_t* job);
+    void run();
+
+  public:
+    Prefetcher(TileCache* cache);
+    ~Prefetcher();
+    void start();
+    void begin_request();
+    void end_request();
+    void update_view(size_t connection_id, SpecParams* spec_params, vector<int>& chs,
+        float min_freq, float max_freq, uint extent, int max_width, int method);
+    void remove_connection(size_t connection_id);
+    size_t get_njobs();
+};
+
+#endif // PREFETCH_H
@@ -0,0 +1,188 @@
+#include "send_queue.hpp"
+
+#include <vector>
+#include <iostream>
+#include <boost/asio/error.hpp>
+
+#include "../helpers.hpp"
+
+using namespace std;
+
+#define DRAIN_MIN_BYTES 65536 // smaller frames fit in the socket buffer and don't measure the client
+#define DRAIN_WEIGHT 0.3 // weight of the last frame in the drain rate
+
+SendQueue::SendQueue(size_t budget, sender_t sender)
+{
+  this->budget = budget;
+  this->sender = sender;
+  sending = false;
+  pending = false;
+  dispatching = false;
+  send_start = 0;
+  queued_bytes = 0;
+  drain_rate = 0;
+  slow = false;
+  closed = false;
+}
+
+/*
+ * Queue `frame`, replacing an unsent frame with the same key, and write it
+ * if nothing is being written. It is completed right away once the queue is
+ * closed.
+ */
+void SendQueue::push(send_frame_t frame)
+{
+  vector<send_frame_t> replaced;
+  vector<send_frame_t> dropped;
+  {
+    unique_lock<mutex> guard(lock);
+    if (closed)
+    {
+      guard.unlock();
+      frame.callback(boost::asio::error::not_connected);
+      return;
+    }
+    for (auto it = frames.begin(); !frame.key.empty() && it != frames.end(); it++)
+    {
+      if (it->key == frame.key)
+      {
+        queued_bytes -= it->nbytes;
+        replaced.push_back(*it);
+        frames.erase(it);
+        break;
+      }
+    }
+    for (auto it = frames.begin(); queued_bytes + frame.nbytes > budget && it != frames.end();)
+    {
+      if (it->key.empty())
+      {
+        it++;
+        continue;
+      }
+      queued_bytes -= it->nbytes;
+      dropped.push_back(*it);
+      it = frames.erase(it);
+    }
+
+    frames.push_back(frame);
+    queued_bytes += frame.nbytes;
+    if (!sending)
+    {
+      sending = true;
+      in_flight = frames.front();
+      frames.pop_front();
+      queued_bytes -= in_flight.nbytes;
+      send_start = get_monotonic_ticks();
+      pending = true;
+    }
+  }
+
+  for (send_frame_t& old_frame : replaced)
+  {
+    old_frame.callback(boost::asio::error::operation_aborted);
+  }
+  for (send_frame_t& old_frame : dropped)
+  {
+    old_frame.callback(boost::asio::error::no_buffer_space);
+  }
+  dispatch();
+}
+
+/*
+ * Complete the frame being written with `ec` and write the next one
+ */
+void SendQueue::finish(const boost::system::error_code& ec)
+{
+  send_frame_t sent;
+  bool was_closed;
+  {
+    lock_guard<mutex> guard(lock);
+    was_closed = closed;
+    sent = in_flight;
+    in_flight = send_frame_t();
+    double seconds = ticks_to_seconds(get_monotonic_ticks() - send_start);
+    if (!ec && sent.nbytes >= DRAIN_MIN_BYTES && seconds > 0)
+    {
+      double rate = sent.nbytes / seconds;
+      drain_rate = drain_rate ? DRAIN_WEIGHT * rate + (1 - DRAIN_WEIGHT) * drain_rate : rate;
+      if ((drain_rate < SEND_SLOW_RATE) != slow)
+      {
+        slow = !slow;
+        cout << "Client " << (slow ? "is slow" : "caught up") << ", draining " <<
+          drain_rate / 1e6 << " MB/s" << endl;
+      }
+    }
+
+    sending = !frames.empty();
+    if (sending)
+    {
+      in_flight = frames.front();
+      frames.pop_front();
+      queued_bytes -= in_flight.nbytes;
+      send_start = get_monotonic_ticks();
+      pending = true;
+    }
+  }
+
+  // writes aborted by closing the connection were not replaced
+  sent.callback(was_closed && ec ? boost::asio::error::not_connected : ec);
+  dispatch();
+}
+
+/*
+ * Hand the pending frame to the sender, a copy so it is not shared with
+ * `finish`. A sender that finishes the frame before returning makes the next
+ * one pending, which this loop sends instead of `finish` calling the sender
+ * again, so the stack doesn't grow with the queue.
+ */
+void SendQueue::dispatch()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    if (dispatching)
+    {
+      return;
+    }
+    dispatching = true;
+  }
+  while (true)
+  {
+    send_frame_t frame;
+    {
+      lock_guard<mutex> guard(lock);
+      if (!pending)
+      {
+        dispatching = false;
+        return;
+      }
+      pending = false;
+      frame = in_flight;
+    }
+    sender(shared_from_this(), frame);
+  }
+}
+
+/*
+ * Complete the unsent frames with `not_connected` once the connection is
+ * closed, the frame being written is completed by `finish`
+ */
+void SendQueue::close()
+{
+  deque<send_frame_t> unsent;
+  {
+    lock_guard<mutex> guard(lock);
+    closed = true;
+    unsent.swap(frames);
+    queued_bytes = 0;
+  }
+  for (send_frame_t& frame : unsent)
+  {
+    frame.callback(boost::asio::error::not_connected);
+  }
+}
+
+double SendQueue::get_drain_rate()
+{
+  lock_guard<mutex> guard(lock);
+  return drain_rate;
+}
@@ -0,0 +1,73 @@
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <boost/system/error_code.hpp>
+
+#include "../config.hpp"
+
+using namespace std;
+
+typedef function<void(const boost::system::error_code&)> send_callback_t;
+
+/*
+ * A response waiting to be written to a connection
+ */
+typedef struct send_frame
+{
+  string key; // a newer frame with the same key replaces it, "" is never replaced
+  size_t nbytes;
+  string header;
+  shared_ptr<const void> payload; // owner of `data`, released once encoded
+  const float* data;
+  size_t data_size; // bytes
+  send_callback_t callback; // called when sent, replaced or dropped
+} send_frame_t;
+
+/*
+ * Responses of one connection, written one at a time so the rate the client
+ * drains them can be measured. The sender encodes a frame only when it is
+ * written, so queued payloads are not copied. Frames not yet written are replaced by newer
+ * frames with the same key, and the oldest keyed frames are dropped when the
+ * unsent frames exceed `budget` bytes, so a slow client gets the latest view
+ * instead of growing memory with stale ones. Replaced frames are completed
+ * with `operation_aborted`, dropped ones with `no_buffer_space` and the ones
+ * left when the connection is closed with `not_connected`. The sender may
+ * call `finish` before it returns, e.g. on a closed connection, the next
+ * frame is then handed to it by the same loop rather than recursively.
+ */
+class SendQueue : public enable_shared_from_this<SendQueue>
+{
+  public:
+    typedef function<void(shared_ptr<SendQueue>, send_frame_t&)> sender_t;
+
+  private:
+    mutex lock;
+    deque<send_frame_t> frames;
+    send_frame_t in_flight;
+    bool sending;
+    bool pending; // `in_flight` is not handed to the sender yet
+    bool dispatching; // a thread is handing frames to the sender
+    unsigned long long send_start;
+    size_t budget;
+    size_t queued_bytes;
+    double drain_rate; // bytes per second, 0 until measured
+    bool slow;
+    bool closed;
+    sender_t sender;
+
+    void dispatch();
+
+  public:
+    SendQueue(size_t budget, sender_t sender);
+    void push(send_frame_t frame);
+    void finish(const boost::system::error_code& ec);
+    void close();
+    double get_drain_rate();
+};
+
+#endif // SEND_QUEUE_H
@@ -0,0 +1,360 @@
+#include "tile_cache.hpp"
+
+#include <armadillo>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#include "../helpers.hpp"
+#include "../compute/request_trace.hpp"
+#include "../compute/event_trace.hpp"
+
+using namespace arma;
+using namespace std;
+
+TileCache::TileCache(size_t max_bytes)
+{
+  this->max_bytes = max_bytes;
+  stats = {};
+}
+
+/*
+ * Return the tile for `key`, or `nullptr` if it is not cached. Lookups
+ * count towards the hit ratio, use `contains` to check for a tile without
+ * using it.
+ */
+shared_ptr<fmat> TileCache::get(string key)
+{
+  lock_guard<mutex> guard(lock);
+  auto it = index.find(key);
+  if (it == index.end())
+  {
+    stats.misses++;
+    return nullptr;
+  }
+
+  stats.hits++;
+  tile_t& tile = *it->second;
+  if (tile.prefetched)
+  {
+    stats.prefetch_hits++;
+    tile.prefetched = false;
+  }
+  tiles.splice(tiles.begin(), tiles, it->second);
+  return tile.spec_mat;
+}
+
+bool TileCache::contains(string key)
+{
+  lock_guard<mutex> guard(lock);
+  return index.find(key) != index.end();
+}
+
+/*
+ * Add the tile for `key`, evicting the least recently used tiles until the
+ * cache fits in `max_bytes`. Tiles larger than the cache are not stored.
+ */
+void TileCache::put(string key, shared_ptr<fmat> spec_mat, bool prefetched)
+{
+  size_t tile_bytes = sizeof(float) * spec_mat->n_elem;
+  if (tile_bytes > max_bytes)
+  {
+    return;
+  }
+
+  lock_guard<mutex> guard(lock);
+  auto it = index.find(key);
+  if (it != index.end())
+  {
+    stats.nbytes -= sizeof(float) * it->second->spec_mat->n_elem;
+    tiles.erase(it->second);
+    index.erase(it);
+  }
+  else if (prefetched)
+  {
+    stats.prefetched++;
+  }
+
+  while (!tiles.empty() && stats.nbytes + tile_bytes > max_bytes)
+  {
+    tile_t& last = tiles.back();
+    stats.nbytes -= sizeof(float) * last.spec_mat->n_elem;
+    index.erase(last.key);
+    tiles.pop_back();
+  }
+
+  tiles.push_front({key, spec_mat, prefetched});
+  index[key] = tiles.begin();
+  stats.nbytes += tile_bytes;
+  stats.ntiles = tiles.size();
+  trace_counter("tile_cache_bytes", get_monotonic_ticks(), stats.nbytes);
+}
+
+/*
+ * Mark the tile for `key` as being computed, replacing the claim of the
+ * prefetcher if any. The caller holds `lock`.
+ */
+void TileCache::add_claim(string key, bool prefetched)
+{
+  tile_claim_t claim;
+  claim.result = make_shared<promise<shared_ptr<fmat>>>();
+  claim.future = claim.result->get_future().share();
+  claim.prefetched = prefetched;
+  in_flight[key] = claim;
+}
+
+/*
+ * Look up the tile for `key` like `get`. If it is not cached and another
+ * foreground request is computing it, `pending` is set to its future result
+ * and `TILE_PENDING` returned. Otherwise the tile is marked as being computed
+ * and the caller has to compute it and call `finish`. A tile the prefetcher
+ * is computing is computed again rather than waited for, since the
+ * prefetcher runs at a low priority and yields to foreground requests.
+ */
+int TileCache::lookup(string key, shared_ptr<fmat>* tile, shared_future<shared_ptr<fmat>>* pending)
+{
+  *tile = get(key);
+  if (*tile != nullptr)
+  {
+    return TILE_HIT;
+  }
+
+  lock_guard<mutex> guard(lock);
+  auto it = in_flight.find(key);
+  if (it != in_flight.end() && !it->second.prefetched)
+  {
+    stats.coalesced++;
+    *pending = it->second.future;
+    return TILE_PENDING;
+  }
+  // the tile may have been added since `get`
+  auto cached = index.find(key);
+  if (cached != index.end())
+  {
+    *tile = cached->second->spec_mat;
+    return TILE_HIT;
+  }
+  add_claim(key, false);
+  return TILE_MISS;
+}
+
+/*
+ * Mark the tile for `key` as being computed by the prefetcher without
+ * counting a lookup. Returns false if it is cached or already being computed.
+ */
+bool TileCache::claim(string key)
+{
+  lock_guard<mutex> guard(lock);
+  if (index.find(key) != index.end() || in_flight.find(key) != in_flight.end())
+  {
+    return false;
+  }
+  add_claim(key, true);
+  return true;
+}
+
+/*
+ * Hand the computed tile for `key` to the requests waiting for it, and add it
+ * to the cache if `store` is set. A prefetched tile whose claim was taken
+ * over is only stored.
+ */
+void TileCache::finish(string key, shared_ptr<fmat> spec_mat, bool prefetched, bool store)
+{
+  if (store)
+  {
+    put(key, spec_mat, prefetched);
+  }
+
+  shared_ptr<promise<shared_ptr<fmat>>> result;
+  {
+    lock_guard<mutex> guard(lock);
+    auto it = in_flight.find(key);
+    if (it == in_flight.end() || it->second.prefetched != prefetched)
+    {
+      return;
+    }
+    result = it->second.result;
+    in_flight.erase(it);
+  }
+  result->set_value(spec_mat);
+}
+
+/*
+ * Give up the claim of the tile for `key` without computing it. Requests
+ * waiting for it get `error`.
+ */
+void TileCache::abandon(string key, bool prefetched, exception_ptr error)
+{
+  shared_ptr<promise<shared_ptr<fmat>>> result;
+  {
+    lock_guard<mutex> guard(lock);
+    auto it = in_flight.find(key);
+    if (it == in_flight.end() || it->second.prefetched != prefetched)
+    {
+      return;
+    }
+    result = it->second.result;
+    in_flight.erase(it);
+  }
+  result->set_exception(error);
+}
+
+tile_cache_stats_t TileCache::get_stats()
+{
+  lock_guard<mutex> guard(lock);
+  stats.ntiles = tiles.size();
+  return stats;
+}
+
+/*
+ * Key of the tile for region `ch` of `spec_params` reduced by `extent` with
+ * the downsampling `method`. The range and band are block and bin aligned so
+ * requests for the same blocks share tiles.
+ */
+string get_tile_key(SpecParams* spec_params, int ch, uint extent, int method)
+{
+  return spec_params->mrn + "-" + CH_NAME_MAP[ch] + ":" +
+    to_string(spec_params->spec_start_offset) + ":" +
+    to_string(spec_params->spec_end_offset) + ":" +
+    to_string(spec_params->freq_start) + ":" +
+    to_string(spec_params->freq_end) + ":" +
+    to_string(extent) + ":" +
+    to_string(method);
+}
+
+/*
+ * Tiles claimed by a request. The ones it leaves without finishing, e.g.
+ * when computing them throws, are abandoned so the requests waiting for them
+ * don't block forever.
+ */
+class TileClaims
+{
+  private:
+    TileCache* cache;
+    vector<string> keys;
+
+  public:
+    TileClaims(TileCache* cache)
+    {
+      this->cache = cache;
+    }
+
+    ~TileClaims()
+    {
+      for (string& key : keys)
+      {
+        cache->abandon(key, false, make_exception_ptr(runtime_error("computing " + key + " failed")));
+      }
+    }
+
+    void add(string key)
+    {
+      keys.push_back(key);
+    }
+
+    void finish(string key, shared_ptr<fmat> spec_mat, bool store)
+    {
+      cache->finish(key, spec_mat, false, store);
+      keys.erase(find(keys.begin(), keys.end(), key));
+    }
+};
+
+/*
+ * Set `spec_mats[i]` to the spectrogram of region `chs[i]` like
+ * `stream_spectrograms`, answering regions from `cache` when possible and
+ * adding the computed ones. Regions another request is computing are waited
+ * for instead of computed again, unless that request fails. The tiles are
+ * shared with the cache, not copied, so they must not be modified.
+ */
+void load_spectrograms(TileCache* cache, SpecParams* spec_params, vector<int>& chs,
+    uint extent, int method, shared_ptr<fmat>* spec_mats)
+{
+  TileClaims claims(cache);
+  vector<int> missing_chs;
+  vector<uint> missing_idxs;
+  vector<uint> pending_idxs;
+  vector<shared_future<shared_ptr<fmat>>> pending_results;
+  for (uint i = 0; i < chs.size(); i++)
+  {
+    shared_ptr<fmat> tile;
+    shared_future<shared_ptr<fmat>> pending;
+    switch (cache->lookup(get_tile_key(spec_params, chs[i], extent, method), &tile, &pending))
+    {
+      case TILE_HIT:
+        spec_mats[i] = tile;
+        break;
+      case TILE_PENDING:
+        pending_idxs.push_back(i);
+        pending_results.push_back(pending);
+        break;
+      default:
+        claims.add(get_tile_key(spec_params, chs[i], extent, method));
+        missing_chs.push_back(chs[i]);
+        missing_idxs.push_back(i);
+        break;
+    }
+  }
+  request_trace_t* trace = get_request_trace();
+  if (trace != nullptr && !chs.empty())
+  {
+    trace->cached_fraction = (double) (chs.size() - missing_chs.size() - pending_idxs.size()) /
+      chs.size();
+  }
+  if (missing_chs.empty() && pending_idxs.empty())
+  {
+    if (VERBOSE)
+    {
+      cout << "Using cached tiles!\n";
+    }
+    return;
+  }
+
+  // the claimed tiles are finished before waiting for others, so requests
+  // waiting on each other's tiles can't deadlock
+  if (!missing_chs.empty())
+  {
+    vector<fmat> missing_mats(missing_chs.size());
+    stream_spectrograms(spec_params, missing_chs, extent, method, missing_mats.data());
+    for (uint i = 0; i < missing_chs.size(); i++)
+    {
+      spec_mats[missing_idxs[i]] = make_shared<fmat>(std::move(missing_mats[i]));
+      // don't cache the empty result of a missing recording
+      claims.finish(get_tile_key(spec_params, missing_chs[i], extent, method),
+          spec_mats[missing_idxs[i]], spec_params->fs != 0);
+    }
+  }
+
+  if (!pending_idxs.empty())
+  {
+    cout << "Waiting for " << pending_idxs.size() << " tiles computed by other requests\n";
+  }
+  unsigned long long span_start = get_monotonic_ticks();
+  vector<int> failed_chs;
+  vector<uint> failed_idxs;
+  for (uint i = 0; i < pending_idxs.size(); i++)
+  {
+    try
+    {
+      spec_mats[pending_idxs[i]] = pending_results[i].get();
+    }
+    catch (exception& e)
+    {
+      cout << "Computing a waited for tile: " << e.what() << "\n";
+      failed_chs.push_back(chs[pending_idxs[i]]);
+      failed_idxs.push_back(pending_idxs[i]);
+    }
+  }
+  trace_span(STAGE_QUEUE, span_start);
+
+  // the request that claimed these tiles failed, they are computed here
+  // without being cached
+  if (!failed_chs.empty())
+  {
+    vector<fmat> failed_mats(failed_chs.size());
+    stream_spectrograms(spec_params, failed_chs, extent, method, failed_mats.data());
+    for (uint i = 0; i < failed_chs.size(); i++)
+    {
+      spec_mats[failed_idxs[i]] = make_shared<fmat>(std::move(failed_mats[i]));
+    }
+  }
+}
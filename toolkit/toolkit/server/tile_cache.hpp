@@ -0,0 +1,84 @@
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include <armadillo>
+#include <string>
+#include <list>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <exception>
+#include <vector>
+#include <unordered_map>
+
+#include "../compute/eeg_spectrogram.hpp"
+#include "../config.hpp"
+
+using namespace arma;
+using namespace std;
+
+typedef struct tile_cache_stats
+{
+  uint64_t hits; // foreground lookups found in the cache
+  uint64_t misses; // foreground lookups computed
+  uint64_t prefetched; // tiles added by the prefetcher
+  uint64_t prefetch_hits; // prefetched tiles later used by a foreground lookup
+  uint64_t coalesced; // misses that waited for a tile being computed
+  size_t ntiles;
+  size_t nbytes;
+} tile_cache_stats_t;
+
+#define TILE_HIT 0 // the tile is cached
+#define TILE_PENDING 1 // another foreground request is computing the tile
+#define TILE_MISS 2 // the caller computes the tile
+
+/*
+ * Least recently used cache of downsampled spectrograms ("tiles") shared by
+ * all connections of ws_server, bounded to `max_bytes` of spectrogram data.
+ * Tiles being computed are tracked so concurrent requests for the same tile
+ * wait for one computation rather than repeating it. Foreground requests
+ * never wait for the low priority prefetcher, they take its claims over.
+ */
+class TileCache
+{
+  private:
+    typedef struct tile
+    {
+      string key;
+      shared_ptr<fmat> spec_mat;
+      bool prefetched; // added by the prefetcher and not used yet
+    } tile_t;
+
+    typedef struct tile_claim
+    {
+      shared_ptr<promise<shared_ptr<fmat>>> result;
+      shared_future<shared_ptr<fmat>> future;
+      bool prefetched; // claimed by the prefetcher, foreground lookups take it over
+    } tile_claim_t;
+
+    mutex lock;
+    list<tile_t> tiles; // most recently used first
+    unordered_map<string, list<tile_t>::iterator> index;
+    unordered_map<string, tile_claim_t> in_flight;
+
+    void add_claim(string key, bool prefetched);
+    size_t max_bytes;
+    tile_cache_stats_t stats;
+
+  public:
+    TileCache(size_t max_bytes);
+    shared_ptr<fmat> get(string key);
+    bool contains(string key);
+    void put(string key, shared_ptr<fmat> spec_mat, bool prefetched);
+    int lookup(string key, shared_ptr<fmat>* tile, shared_future<shared_ptr<fmat>>* pending);
+    bool claim(string key);
+    void finish(string key, shared_ptr<fmat> spec_mat, bool prefetched, bool store);
+    void abandon(string key, bool prefetched, exception_ptr error);
+    tile_cache_stats_t get_stats();
+};
+
+string get_tile_key(SpecParams* spec_params, int ch, uint extent, int method);
+void load_spectrograms(TileCache* cache, SpecParams* spec_params, vector<int>& chs,
+    uint extent, int method, shared_ptr<fmat>* spec_mats);
+
+#endif // TILE_CACHE_H
@@ -4,11 +4,15 @@
 #include <unordered_map>
 #include <armadillo>
 #include <string>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "../json11/json11.hpp"
 #include "../config.hpp"
 #include "../helpers.hpp"
+#include "chunk_codec.hpp"
 #include "EDFlib/edflib.h"
 #include "H5Cpp.h"
 #include "TileDB/core/include/capis/tiledb.h"
@@ -35,8 +39,8 @@ class ArrayMetadata
 {
   public:
     int fs;
-    int nsamples;
-    int nrows;
+    int64_t nsamples;
+    int64_t nrows;
     int ncols;
     Json optional_metadata;
 
@@ -48,7 +52,7 @@ class ArrayMetadata
       ncols = 0;
     }
 
-    ArrayMetadata(int fs, int nsamples, int nrows, int ncols)
+    ArrayMetadata(int fs, int64_t nsamples, int64_t nrows, int ncols)
     {
       this->fs = fs;
       this->nsamples = nsamples;
@@ -61,9 +65,9 @@ class ArrayMetadata
       return Json::object
       {
         {"fs", fs},
-        {"nsamples", nsamples},
+        {"nsamples", (double) nsamples}, // json numbers are exact up to 2^53
         {"ncols", ncols},
-        {"nrows", nrows}
+        {"nrows", (double) nrows}
       };
     }
 
@@ -91,6 +95,8 @@ class AbstractStorageBackend
     unordered_map<string, T> data_cache;
     unordered_map<string, ArrayMetadata> metadata_cache;
     const char* cache_tag = "-cached";
+    const char* prefix_tag = "-prefix";
+    string data_dir = DATADIR; // directory of the arrays
 
     bool in_cache(string mrn)
     {
@@ -138,7 +144,7 @@ class AbstractStorageBackend
      * a data file lives in the filesystem
      */
     string _mrn_to_array_name(string mrn, string file_ext) {
-      return DATADIR + mrn + file_ext;
+      return data_dir + mrn + file_ext;
     }
 
     virtual string mrn_to_array_name(string mrn) = 0;
@@ -151,6 +157,15 @@ class AbstractStorageBackend
       return array_name.find(cache_tag) != string::npos;
     }
 
+    /*
+     * Returns a bool if the given array name holds prefix sums, which are
+     * read a few rows at a time
+     */
+    bool is_prefix_array(string array_name)
+    {
+      return array_name.find(prefix_tag) != string::npos;
+    }
+
     /*
      * Get the ArrayMetadata for the given `mrn`, populating the
      * `metadata_cache` if it empty.
@@ -174,6 +189,23 @@ class AbstractStorageBackend
 
 
   public:
+    /*
+     * Keep the arrays in `dir` rather than `DATADIR`, e.g. for benchmarks
+     * that must not touch the recordings
+     */
+    void set_data_dir(string dir)
+    {
+      data_dir = dir;
+    }
+
+    /*
+     * Path of the file or directory where the array `mrn` lives
+     */
+    string get_array_path(string mrn)
+    {
+      return mrn_to_array_name(mrn);
+    }
+
     /*
      * Convert a `mrn` and `ch_name` to the appropiate cached name
      */
@@ -182,27 +214,147 @@ class AbstractStorageBackend
       return mrn + "-" + ch_name + cache_tag;
     }
 
+    /*
+     * Convert a `mrn` and `ch_name` to the name of the change point index.
+     * It is not a cached array so it is never compressed lossily.
+     */
+    string mrn_to_changepoints_mrn_name(string mrn, string ch_name)
+    {
+      return mrn + "-" + ch_name + "-changepoints";
+    }
+
+    /*
+     * Convert a `mrn` and `ch_name` to the name of the spectrogram blocks
+     * written back as they are computed on the fly
+     */
+    string mrn_to_sparse_mrn_name(string mrn, string ch_name)
+    {
+      return mrn + "-" + ch_name + "-sparse";
+    }
+
+    /*
+     * Convert a `mrn` and `ch_name` to the name of the validity bitmap of
+     * the sparse spectrogram
+     */
+    string mrn_to_sparse_valid_mrn_name(string mrn, string ch_name)
+    {
+      return mrn + "-" + ch_name + "-sparse-valid";
+    }
+
+    /*
+     * Convert a `mrn` and `ch_name` to the name of the prefix sums of the
+     * cached spectrogram
+     */
+    string mrn_to_prefix_mrn_name(string mrn, string ch_name)
+    {
+      return mrn + "-" + ch_name + "-prefix";
+    }
+
+    /*
+     * Convert a `mrn` to the name of the `kind` ("min" or "max") array of
+     * the waveform envelope pyramid `level`
+     */
+    string mrn_to_waveform_mrn_name(string mrn, string kind, int level)
+    {
+      return mrn + "-" + kind + "-" + to_string(level);
+    }
+
+    /*
+     * Convert a `mrn` and `ch_name` to the name of the band power trends
+     */
+    string mrn_to_bandpower_mrn_name(string mrn, string ch_name)
+    {
+      return mrn + "-" + ch_name + "-bandpower";
+    }
+
+    /*
+     * Convert a `mrn` and `ch_name` to the name of the prefix sums of the
+     * band power trends
+     */
+    string mrn_to_bandpower_prefix_mrn_name(string mrn, string ch_name)
+    {
+      return mrn + "-" + ch_name + "-bandpower-prefix";
+    }
+
+    /*
+     * Convert an array name to the name it is written under before it is
+     * published with `rename_array`
+     */
+    string mrn_to_tmp_mrn_name(string mrn_name)
+    {
+      return mrn_name + "-tmp";
+    }
+
     /*
      * Determine if an array exists given the `mrn`
      */
-    bool array_exists(string mrn)
+    virtual bool array_exists(string mrn)
     {
       string array_name = mrn_to_array_name(mrn);
       return file_exists(array_name);
     }
 
+    /*
+     * Returns true if `write_array` honors the offsets it is given, so an
+     * interrupted write can be resumed by writing the remaining rows.
+     */
+    virtual bool positional_writes()
+    {
+      return true;
+    }
+
+    /*
+     * Flush the rows written to the array `mrn` to disk
+     */
+    virtual void sync_array(string mrn)
+    {
+      int fd = open(mrn_to_array_name(mrn).c_str(), O_RDONLY);
+      if (fd >= 0)
+      {
+        fsync(fd);
+        close(fd);
+      }
+    }
+
+    /*
+     * Delete the array `mrn`
+     */
+    virtual void delete_array(string mrn)
+    {
+      close_array(mrn);
+      metadata_cache.erase(mrn);
+      remove(mrn_to_array_name(mrn).c_str());
+    }
+
+    /*
+     * Atomically replace the array `to_mrn` with the array `from_mrn`.
+     * Readers see either the old or the new array, never a partial one.
+     */
+    virtual void rename_array(string from_mrn, string to_mrn)
+    {
+      close_array(from_mrn);
+      close_array(to_mrn);
+      metadata_cache.erase(from_mrn);
+      metadata_cache.erase(to_mrn);
+      if (rename(mrn_to_array_name(from_mrn).c_str(), mrn_to_array_name(to_mrn).c_str()))
+      {
+        cout << "Error renaming " << mrn_to_array_name(from_mrn) << " to " << mrn_to_array_name(to_mrn) << endl;
+        exit(-1);
+      }
+    }
+
     /////// METADATA GETTERS ///////
     int get_fs(string mrn)
     {
       return _get_array_metadata(mrn).fs;
     }
 
-    int get_nsamples(string mrn)
+    int64_t get_nsamples(string mrn)
     {
       return _get_array_metadata(mrn).nsamples;
     }
 
-    int get_nrows(string mrn)
+    int64_t get_nrows(string mrn)
     {
       return _get_array_metadata(mrn).nrows;
     }
@@ -215,10 +367,25 @@ class AbstractStorageBackend
     virtual ArrayMetadata get_array_metadata(string mrn) = 0;
     virtual void create_array(string mrn, ArrayMetadata* metadata) = 0;
     virtual void open_array(string mrn) = 0;
-    virtual void read_array(string mrn, int ch, int start_offset, int end_offset, frowvec& buf) = 0;
-    virtual void read_array(string mrn, int start_offset, int end_offset, fmat& buf) = 0;
-    virtual void write_array(string mrn, int ch, int start_offset, int end_offset, fmat& buf) = 0;
+    virtual void read_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, frowvec& buf) = 0;
+    virtual void read_array(string mrn, int64_t start_offset, int64_t end_offset, fmat& buf) = 0;
+    virtual void read_array(string mrn, int64_t start_offset, int64_t end_offset, int start_col, int end_col, fmat& buf) = 0;
+    virtual void write_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, fmat& buf) = 0;
     virtual void close_array(string mrn) = 0;
+
+    /*
+     * Gather the columns [`start_col`, `end_col`) of each row in `rows`
+     * into the matching column of `buf`.
+     */
+    virtual void read_rows(string mrn, vector<int64_t>& rows, int start_col, int end_col, fmat& buf)
+    {
+      fmat row = fmat(end_col - start_col, 1);
+      for (size_t i = 0; i < rows.size(); i++)
+      {
+        read_array(mrn, rows[i], rows[i] + 1, start_col, end_col, row);
+        buf.col(i) = row;
+      }
+    }
 };
 
 class EDFBackend: public AbstractStorageBackend<edf_hdr_struct*>
@@ -230,24 +397,34 @@ class EDFBackend: public AbstractStorageBackend<edf_hdr_struct*>
     ArrayMetadata get_array_metadata(string mrn);
     void create_array(string mrn, ArrayMetadata* metadata);
     void open_array(string mrn);
-    void read_array(string mrn, int ch, int start_offset, int end_offset, frowvec& buf);
-    void read_array(string mrn, int start_offset, int end_offset, fmat& buf);
-    void write_array(string mrn, int ch, int start_offset, int end_offset, fmat& buf);
+    void read_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, frowvec& buf);
+    void read_array(string mrn, int64_t start_offset, int64_t end_offset, fmat& buf);
+    void read_array(string mrn, int64_t start_offset, int64_t end_offset, int start_col, int end_col, fmat& buf);
+    void write_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, fmat& buf);
     void close_array(string mrn);
 };
 
 class BinaryBackend: public AbstractStorageBackend<ArrayMetadata>
 {
   protected:
+    // mrn to index of the compressed chunks of a cached array
+    unordered_map<string, chunk_index_t> chunk_index_cache;
+
     string mrn_to_array_name(string mrn);
+    void load_chunk_index(string mrn, ArrayMetadata* metadata);
+    void read_chunks(string mrn, int64_t start_offset, int start_col, fmat& buf);
+    void write_chunks(string mrn, int codec, int64_t start_offset, fmat& buf);
+    void read_row_major(string mrn, int64_t start_offset, int start_col, int end_col, fmat& buf);
 
   public:
     ArrayMetadata get_array_metadata(string mrn);
     void create_array(string mrn, ArrayMetadata* metadata);
     void open_array(string mrn);
-    void read_array(string mrn, int ch, int start_offset, int end_offset, frowvec& buf);
-    void read_array(string mrn, int start_offset, int end_offset, fmat& buf);
-    void write_array(string mrn, int ch, int start_offset, int end_offset, fmat& buf);
+    void read_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, frowvec& buf);
+    void read_array(string mrn, int64_t start_offset, int64_t end_offset, fmat& buf);
+    void read_array(string mrn, int64_t start_offset, int64_t end_offset, int start_col, int end_col, fmat& buf);
+    void read_rows(string mrn, vector<int64_t>& rows, int start_col, int end_col, fmat& buf);
+    void write_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, fmat& buf);
     void close_array(string mrn);
 };
 
@@ -262,10 +439,13 @@ class HDF5Backend: public AbstractStorageBackend<H5File>
     ArrayMetadata get_array_metadata(string mrn);
     void create_array(string mrn, ArrayMetadata* metadata);
     void open_array(string mrn);
-    void read_array(string mrn, int ch, int start_offset, int end_offset, frowvec& buf);
-    void read_array(string mrn, int start_offset, int end_offset, fmat& buf);
-    void write_array(string mrn, int ch, int start_offset, int end_offset, fmat& buf);
+    void read_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, frowvec& buf);
+    void read_array(string mrn, int64_t start_offset, int64_t end_offset, fmat& buf);
+    void read_array(string mrn, int64_t start_offset, int64_t end_offset, int start_col, int end_col, fmat& buf);
+    void write_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, fmat& buf);
     void close_array(string mrn);
+    void sync_array(string mrn);
+    void rename_array(string from_mrn, string to_mrn);
 };
 
 typedef pair<TileDB_CTX*, int> tiledb_cache_pair;
@@ -282,13 +462,18 @@ class TileDBBackend: public AbstractStorageBackend<tiledb_cache_pair>
     void write_metadata(string mrn, ArrayMetadata* metadata);
 
   public:
+    bool array_exists(string mrn);
     ArrayMetadata get_array_metadata(string mrn);
     void create_array(string mrn, ArrayMetadata* metadata);
     void open_array(string mrn);
-    void read_array(string mrn, int ch, int start_offset, int end_offset, frowvec& buf);
-    void read_array(string mrn, int start_offset, int end_offset, fmat& buf);
-    void write_array(string mrn, int ch, int start_offset, int end_offset, fmat& buf);
+    void read_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, frowvec& buf);
+    void read_array(string mrn, int64_t start_offset, int64_t end_offset, fmat& buf);
+    void read_array(string mrn, int64_t start_offset, int64_t end_offset, int start_col, int end_col, fmat& buf);
+    void write_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, fmat& buf);
     void close_array(string mrn);
+    bool positional_writes();
+    void delete_array(string mrn);
+    void rename_array(string from_mrn, string to_mrn);
 };
 
 typedef BACKEND StorageBackend;
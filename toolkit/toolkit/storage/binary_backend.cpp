@@ -4,7 +4,11 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include "decode_pool.hpp"
 #include "../helpers.hpp"
 #include "../json11/json11.hpp"
 
@@ -35,13 +39,15 @@ ArrayMetadata BinaryBackend::get_array_metadata(string mrn)
   string err;
   Json json = Json::parse(header, err);
   int fs = json["fs"].int_value();
-  int nsamples = json["nsamples"].int_value();
-  int nrows = json["nrows"].int_value();
+  int64_t nsamples = json["nsamples"].number_value();
+  int64_t nrows = json["nrows"].number_value();
   int ncols = json["ncols"].int_value();
   ArrayMetadata metadata = ArrayMetadata(fs, nsamples, nrows, ncols);
   metadata.optional_metadata = Json::object
   {
     {"header_offset", (int) (header_len + sizeof(uint32_t))},
+    {"codec", json["codec"].int_value()}, // arrays without a codec are uncompressed
+    {"row_major", json["row_major"].bool_value()}, // arrays store columns contiguously by default
   };
   return metadata;
 }
@@ -53,7 +59,19 @@ void BinaryBackend::create_array(string mrn, ArrayMetadata* metadata)
   file.open(path, ios::trunc|ios::binary);
 
   // Store metadata in header;
-  string header = metadata->to_string();
+  Json::object header_json = metadata->to_json().object_items();
+  if (is_cached_array(mrn))
+  {
+    // the codec can be chosen per array, e.g. to compare them in bench
+    Json codec = metadata->optional_metadata["codec"];
+    header_json["codec"] = codec.is_number() ? codec.int_value() : CACHE_CODEC;
+  }
+  else if (is_prefix_array(mrn))
+  {
+    // prefix sums are read at group boundaries, so each row is kept together
+    header_json["row_major"] = true;
+  }
+  string header = Json(header_json).dump();
   uint32_t header_len = get_byte_aligned_length(header);
   header.resize(header_len, ' ');
   file.write((char*) &header_len, sizeof(uint32_t));
@@ -72,16 +90,167 @@ void BinaryBackend::open_array(string mrn)
     return;
   }
   ArrayMetadata metadata = get_array_metadata(mrn);
+  if (metadata.optional_metadata["codec"].int_value() != CODEC_NONE)
+  {
+    load_chunk_index(mrn, &metadata);
+  }
   put_cache(mrn, metadata);
 }
 
-void BinaryBackend::read_array(string mrn, int ch, int start_offset, int end_offset, frowvec& buf)
+/*
+ * Walk the chunk headers of a compressed array and build the index used to
+ * find the chunks a read touches. A chunk cut short by an interrupted write is
+ * ignored.
+ */
+void BinaryBackend::load_chunk_index(string mrn, ArrayMetadata* metadata)
+{
+  string array_name = mrn_to_array_name(mrn);
+  ifstream file;
+  file.open(array_name, ios::binary | ios::ate);
+  uint64_t file_size = file.tellg();
+
+  chunk_index_t index;
+  chunk_entry_t entry;
+  uint64_t offset = metadata->optional_metadata["header_offset"].int_value();
+  while (offset + sizeof(chunk_header_t) <= file_size)
+  {
+    file.seekg(offset);
+    file.read((char*) &entry.header, sizeof(chunk_header_t));
+    entry.offset = offset + sizeof(chunk_header_t);
+    if (entry.offset + entry.header.nbytes > file_size)
+    {
+      break;
+    }
+    add_chunk(index, entry);
+    offset = entry.offset + entry.header.nbytes;
+  }
+  file.close();
+  chunk_index_cache[mrn] = index;
+}
+
+/*
+ * Read `buf.n_cols` rows starting at `start_offset` from a compressed array,
+ * keeping `buf.n_rows` values of each row starting at column `start_col`.
+ * Only the chunks overlapping the range are decoded, on the shared decode
+ * pool when the range spans more than `DECODE_INLINE_CHUNKS` chunks.
+ */
+void BinaryBackend::read_chunks(string mrn, int64_t start_offset, int start_col, fmat& buf)
+{
+  chunk_index_t& index = chunk_index_cache[mrn];
+  int64_t end_offset = start_offset + buf.n_cols;
+  vector<size_t> chunks;
+  find_chunks(index, start_offset, end_offset, chunks);
+
+  // rows that were never written read as zeros
+  int64_t nrows_found = 0;
+  for (size_t i = 0; i < chunks.size(); i++)
+  {
+    chunk_header_t* header = &index[chunks[i]].header;
+    nrows_found += min(end_offset, header->start_row + header->nrows) - max(start_offset, header->start_row);
+  }
+  if (nrows_found < (int64_t) buf.n_cols)
+  {
+    buf.zeros();
+  }
+
+  string array_name = mrn_to_array_name(mrn);
+  int fd = open(array_name.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    cout << "Error opening " << array_name << endl;
+    exit(-1);
+  }
+  // chunks are read with `pread` so the threads share the file descriptor
+  auto decode = [&](size_t i)
+  {
+    chunk_entry_t* entry = &index[chunks[i]];
+    vector<char> payload(entry->header.nbytes);
+    vector<float> data;
+    if (pread(fd, payload.data(), entry->header.nbytes, entry->offset) != (ssize_t) entry->header.nbytes)
+    {
+      cout << "Error reading chunk of " << array_name << endl;
+      exit(-1);
+    }
+    decode_chunk(&entry->header, payload, data);
+
+    int64_t first_row = max(start_offset, entry->header.start_row);
+    int64_t last_row = min(end_offset, entry->header.start_row + entry->header.nrows);
+    size_t row_size = min((uword) max(entry->header.ncols - start_col, 0), buf.n_rows) * sizeof(float);
+    for (int64_t row = first_row; row < last_row; row++)
+    {
+      float* src = data.data() + (row - entry->header.start_row) * entry->header.ncols + start_col;
+      memcpy(buf.colptr(row - start_offset), src, row_size);
+    }
+  };
+
+  if (chunks.size() <= DECODE_INLINE_CHUNKS)
+  {
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+      decode(i);
+    }
+  }
+  else
+  {
+    get_decode_pool()->run(chunks.size(), decode);
+  }
+  close(fd);
+}
+
+/*
+ * Append the columns of `buf` to a compressed array as chunks of at most
+ * `CACHE_CHUNK` rows, starting at row `start_offset`.
+ */
+void BinaryBackend::write_chunks(string mrn, int codec, int64_t start_offset, fmat& buf)
+{
+  chunk_index_t& index = chunk_index_cache[mrn];
+  string array_name = mrn_to_array_name(mrn);
+
+  // append after the last complete chunk, dropping a chunk cut short by an
+  // interrupted write so the array can be resumed
+  uint64_t data_end = get_cache(mrn).optional_metadata["header_offset"].int_value();
+  for (size_t i = 0; i < index.size(); i++)
+  {
+    data_end = max(data_end, index[i].offset + index[i].header.nbytes);
+  }
+  if (truncate(array_name.c_str(), data_end))
+  {
+    cout << "Error truncating " << array_name << endl;
+    exit(-1);
+  }
+
+  fstream file(array_name, ios::in | ios::out | ios::binary);
+  file.seekp(data_end);
+
+  chunk_entry_t entry;
+  vector<char> payload;
+  for (uword col = 0; col < buf.n_cols; col += CACHE_CHUNK)
+  {
+    int64_t nrows = min((uword) CACHE_CHUNK, buf.n_cols - col);
+    encode_chunk(codec, buf.colptr(col), nrows, buf.n_rows, &entry.header, payload);
+    entry.header.start_row = start_offset + col;
+    file.write((char*) &entry.header, sizeof(chunk_header_t));
+    entry.offset = file.tellp();
+    file.write(payload.data(), payload.size());
+    add_chunk(index, entry);
+  }
+  file.close();
+}
+
+void BinaryBackend::read_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, frowvec& buf)
 {
   ArrayMetadata metadata = get_cache(mrn);
   uint32_t header_offset = metadata.optional_metadata["header_offset"].int_value();
-  int nrows = metadata.nrows;
+  int64_t nrows = metadata.nrows;
 
   ch = CH_REVERSE_IDX[ch];
+  if (metadata.optional_metadata["row_major"].bool_value())
+  {
+    fmat col = fmat(1, buf.n_cols);
+    read_row_major(mrn, start_offset, ch, ch + 1, col);
+    buf = col.row(0);
+    return;
+  }
   size_t row_size = nrows * sizeof(float);
   size_t column_offset = ch * row_size;
   size_t row_offset = start_offset * sizeof(float);
@@ -96,12 +265,32 @@ void BinaryBackend::read_array(string mrn, int ch, int start_offset, int end_off
   file.close();
 }
 
-void BinaryBackend::read_array(string mrn, int start_offset, int end_offset, fmat& buf)
+void BinaryBackend::read_array(string mrn, int64_t start_offset, int64_t end_offset, fmat& buf)
+{
+  read_array(mrn, start_offset, end_offset, 0, buf.n_rows, buf);
+}
+
+/*
+ * Read the columns [`start_col`, `end_col`) of the rows [`start_offset`,
+ * `end_offset`). Each column is stored contiguously so only the requested
+ * columns are read from disk.
+ */
+void BinaryBackend::read_array(string mrn, int64_t start_offset, int64_t end_offset, int start_col, int end_col, fmat& buf)
 {
   ArrayMetadata metadata = get_cache(mrn);
+  if (metadata.optional_metadata["codec"].int_value() != CODEC_NONE)
+  {
+    read_chunks(mrn, start_offset, start_col, buf);
+    return;
+  }
+  if (metadata.optional_metadata["row_major"].bool_value())
+  {
+    read_row_major(mrn, start_offset, start_col, end_col, buf);
+    return;
+  }
   uint32_t header_offset = metadata.optional_metadata["header_offset"].int_value();
-  int nrows = metadata.nrows;
-  int ncols = metadata.ncols;
+  int64_t nrows = metadata.nrows;
+  int ncols = min(end_col, metadata.ncols);
 
   string array_name = mrn_to_array_name(mrn);
   ifstream file;
@@ -110,25 +299,106 @@ void BinaryBackend::read_array(string mrn, int start_offset, int end_offset, fma
   size_t read_size = buf.n_cols * sizeof(float);
   size_t row_size = nrows * sizeof(float);
   size_t row_offset = start_offset * sizeof(float);
-  size_t column_offset = 0;
+  size_t column_offset = start_col * row_size;
   size_t seek_size = header_offset + row_offset;
   frowvec row;
-  for (int i = 0; i < ncols; i++)
+  for (int i = start_col; i < ncols; i++)
   {
     file.seekg(seek_size + column_offset);
-    row = buf.row(i);
+    row = buf.row(i - start_col);
     file.read((char*) row.memptr(), read_size);
-    buf.row(i) = row; // needed?
+    buf.row(i - start_col) = row; // needed?
     column_offset += row_size;
   }
   file.close();
 }
 
-void BinaryBackend::write_array(string mrn, int ch, int start_offset, int end_offset, fmat& buf)
+/*
+ * Read the columns [`start_col`, `end_col`) of `buf.n_cols` rows from
+ * `start_offset` of an array stored row by row. The rows are contiguous so
+ * they are read at once.
+ */
+void BinaryBackend::read_row_major(string mrn, int64_t start_offset, int start_col, int end_col, fmat& buf)
 {
   ArrayMetadata metadata = get_cache(mrn);
   uint32_t header_offset = metadata.optional_metadata["header_offset"].int_value();
-  int nrows = metadata.nrows;
+  int ncols = metadata.ncols;
+  end_col = min(end_col, ncols);
+
+  fmat rows_mat = zeros<fmat>(ncols, buf.n_cols);
+  string array_name = mrn_to_array_name(mrn);
+  ifstream file;
+  file.open(array_name, ios::binary);
+  file.seekg(header_offset + start_offset * ncols * sizeof(float));
+  file.read((char*) rows_mat.memptr(), rows_mat.n_elem * sizeof(float));
+  file.close();
+  buf.rows(0, end_col - start_col - 1) = rows_mat.rows(start_col, end_col - 1);
+}
+
+/*
+ * Gather the rows with `pread` on one file descriptor instead of seeking a
+ * stream for every row. The columns of a row are contiguous in arrays stored
+ * row by row, so each row is a single read.
+ */
+void BinaryBackend::read_rows(string mrn, vector<int64_t>& rows, int start_col, int end_col, fmat& buf)
+{
+  ArrayMetadata metadata = get_cache(mrn);
+  if (metadata.optional_metadata["codec"].int_value() != CODEC_NONE)
+  {
+    AbstractStorageBackend::read_rows(mrn, rows, start_col, end_col, buf);
+    return;
+  }
+  uint32_t header_offset = metadata.optional_metadata["header_offset"].int_value();
+  size_t row_size = metadata.nrows * sizeof(float);
+  end_col = min(end_col, metadata.ncols);
+
+  string array_name = mrn_to_array_name(mrn);
+  int fd = open(array_name.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    cout << "Error opening " << array_name << endl;
+    exit(-1);
+  }
+  if (metadata.optional_metadata["row_major"].bool_value())
+  {
+    size_t read_size = (end_col - start_col) * sizeof(float);
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+      float* dst = buf.colptr(i);
+      off_t row_offset = header_offset + (rows[i] * metadata.ncols + start_col) * sizeof(float);
+      ssize_t nread = pread(fd, dst, read_size, row_offset);
+      // zero what is past the end of the written data
+      memset((char*) dst + max(nread, (ssize_t) 0), 0, read_size - max(nread, (ssize_t) 0));
+    }
+    close(fd);
+    return;
+  }
+  for (int col = start_col; col < end_col; col++)
+  {
+    off_t column_offset = header_offset + col * row_size;
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+      float* dst = buf.colptr(i) + (col - start_col);
+      if (pread(fd, dst, sizeof(float), column_offset + rows[i] * sizeof(float)) != sizeof(float))
+      {
+        *dst = 0; // past the end of the written data
+      }
+    }
+  }
+  close(fd);
+}
+
+void BinaryBackend::write_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, fmat& buf)
+{
+  ArrayMetadata metadata = get_cache(mrn);
+  int codec = metadata.optional_metadata["codec"].int_value();
+  if (codec != CODEC_NONE)
+  {
+    write_chunks(mrn, codec, start_offset, buf);
+    return;
+  }
+  uint32_t header_offset = metadata.optional_metadata["header_offset"].int_value();
+  int64_t nrows = metadata.nrows;
 
   string array_name = mrn_to_array_name(mrn);
   fstream file(array_name, ios::in | ios:: out | ios::binary); // open with ios::in and ios::out flags to write sections of file
@@ -138,6 +408,27 @@ void BinaryBackend::write_array(string mrn, int ch, int start_offset, int end_of
   } else {
     col = CH_REVERSE_IDX[ch];
   }
+  if (metadata.optional_metadata["row_major"].bool_value())
+  {
+    // the columns of `buf` are rows of the array
+    size_t row_size = metadata.ncols * sizeof(float);
+    size_t seek_size = header_offset + start_offset * row_size + col * sizeof(float);
+    if ((int) buf.n_rows == metadata.ncols)
+    {
+      file.seekp(seek_size);
+      file.write((char*) buf.memptr(), buf.n_elem * sizeof(float));
+    }
+    else
+    {
+      for (uword j = 0; j < buf.n_cols; j++)
+      {
+        file.seekp(seek_size + j * row_size);
+        file.write((char*) buf.colptr(j), buf.n_rows * sizeof(float));
+      }
+    }
+    file.close();
+    return;
+  }
   size_t write_size = buf.n_cols * sizeof(float);
   size_t row_size = nrows * sizeof(float);
   size_t row_offset = start_offset * sizeof(float);
@@ -157,6 +448,7 @@ void BinaryBackend::close_array(string mrn)
 {
   if (in_cache(mrn)) {
     pop_cache(mrn);
+    chunk_index_cache.erase(mrn);
   }
 }
 
@@ -0,0 +1,193 @@
+#include "chunk_codec.hpp"
+
+#include <math.h>
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+#define QUANT_LEVELS 65535.0
+
+/*
+ * Group the bytes of `nelem` values of `elem_size` bytes by significance.
+ * Neighbouring spectrogram values share their high order bytes, which makes
+ * the shuffled buffer compress much better.
+ */
+static void shuffle_bytes(const char* src, char* dst, size_t nelem, size_t elem_size)
+{
+  for (size_t i = 0; i < nelem; i++)
+  {
+    for (size_t b = 0; b < elem_size; b++)
+    {
+      dst[b * nelem + i] = src[i * elem_size + b];
+    }
+  }
+}
+
+/*
+ * Inverse of `shuffle_bytes`
+ */
+static void unshuffle_bytes(const char* src, char* dst, size_t nelem, size_t elem_size)
+{
+  for (size_t b = 0; b < elem_size; b++)
+  {
+    const char* plane = src + b * nelem;
+    for (size_t i = 0; i < nelem; i++)
+    {
+      dst[i * elem_size + b] = plane[i];
+    }
+  }
+}
+
+/*
+ * Shuffle and deflate `nelem` values of `elem_size` bytes into `payload`
+ */
+static void deflate_values(const char* src, size_t nelem, size_t elem_size, vector<char>& payload)
+{
+  size_t nbytes = nelem * elem_size;
+  vector<char> shuffled(nbytes);
+  shuffle_bytes(src, shuffled.data(), nelem, elem_size);
+
+  uLongf dst_len = compressBound(nbytes);
+  payload.resize(dst_len);
+  if (compress2((Bytef*) payload.data(), &dst_len, (const Bytef*) shuffled.data(),
+        nbytes, CACHE_CODEC_LEVEL) != Z_OK)
+  {
+    cout << "Error compressing chunk!" << endl;
+    exit(-1);
+  }
+  payload.resize(dst_len);
+}
+
+/*
+ * Inflate and unshuffle `nelem` values of `elem_size` bytes from `payload`
+ */
+static void inflate_values(const vector<char>& payload, size_t nelem, size_t elem_size, char* dst)
+{
+  uLongf nbytes = nelem * elem_size;
+  vector<char> shuffled(nbytes);
+  if (uncompress((Bytef*) shuffled.data(), &nbytes, (const Bytef*) payload.data(),
+        payload.size()) != Z_OK || nbytes != nelem * elem_size)
+  {
+    cout << "Error decompressing chunk!" << endl;
+    exit(-1);
+  }
+  unshuffle_bytes(shuffled.data(), dst, nelem, elem_size);
+}
+
+/*
+ * Encode `nrows` x `ncols` values from `data` with the given `codec`. The
+ * `header` is filled in except for `start_row`, which the caller sets.
+ */
+void encode_chunk(int codec, const float* data, int64_t nrows, int32_t ncols,
+                  chunk_header_t* header, vector<char>& payload)
+{
+  size_t nelem = nrows * ncols;
+  header->nrows = nrows;
+  header->ncols = ncols;
+  header->codec = codec;
+  header->qmin = 0;
+  header->qmax = 0;
+
+  if (codec == CODEC_LOGQ16_ZLIB)
+  {
+    // spectrogram magnitudes span several orders of magnitude so we quantize
+    // in log space to keep the relative error even across frequencies
+    vector<float> logs(nelem);
+    float qmin = INFINITY;
+    float qmax = -INFINITY;
+    for (size_t i = 0; i < nelem; i++)
+    {
+      logs[i] = log1pf(fmaxf(data[i], 0));
+      qmin = fminf(qmin, logs[i]);
+      qmax = fmaxf(qmax, logs[i]);
+    }
+    float scale = qmax > qmin ? QUANT_LEVELS / (qmax - qmin) : 0;
+    vector<uint16_t> quantized(nelem);
+    for (size_t i = 0; i < nelem; i++)
+    {
+      quantized[i] = (uint16_t) lrintf((logs[i] - qmin) * scale);
+    }
+    header->qmin = qmin;
+    header->qmax = qmax;
+    deflate_values((const char*) quantized.data(), nelem, sizeof(uint16_t), payload);
+  }
+  else
+  {
+    deflate_values((const char*) data, nelem, sizeof(float), payload);
+  }
+  header->nbytes = payload.size();
+}
+
+/*
+ * Decode the `payload` described by `header` into `data`
+ */
+void decode_chunk(const chunk_header_t* header, const vector<char>& payload,
+                  vector<float>& data)
+{
+  size_t nelem = header->nrows * header->ncols;
+  data.resize(nelem);
+
+  if (header->codec == CODEC_LOGQ16_ZLIB)
+  {
+    vector<uint16_t> quantized(nelem);
+    inflate_values(payload, nelem, sizeof(uint16_t), (char*) quantized.data());
+    float step = (header->qmax - header->qmin) / QUANT_LEVELS;
+    for (size_t i = 0; i < nelem; i++)
+    {
+      data[i] = expm1f(header->qmin + quantized[i] * step);
+    }
+  }
+  else
+  {
+    inflate_values(payload, nelem, sizeof(float), (char*) data.data());
+  }
+}
+
+static bool chunk_starts_before(const chunk_entry_t& entry, int64_t row)
+{
+  return entry.header.start_row < row;
+}
+
+/*
+ * Insert `entry` into the sorted `index`. A chunk that starts on the same
+ * row replaces the previous one since it was written later.
+ */
+void add_chunk(chunk_index_t& index, chunk_entry_t entry)
+{
+  auto it = lower_bound(index.begin(), index.end(), entry.header.start_row, chunk_starts_before);
+  if (it != index.end() && it->header.start_row == entry.header.start_row)
+  {
+    *it = entry;
+  }
+  else
+  {
+    index.insert(it, entry);
+  }
+}
+
+/*
+ * Fill `chunks` with the positions in `index` of every chunk overlapping the
+ * rows [`start_row`, `end_row`)
+ */
+void find_chunks(const chunk_index_t& index, int64_t start_row, int64_t end_row,
+                 vector<size_t>& chunks)
+{
+  auto it = lower_bound(index.begin(), index.end(), start_row, chunk_starts_before);
+  // the chunk before the first one starting at `start_row` may still overlap
+  if (it != index.begin())
+  {
+    auto prev = it - 1;
+    if (prev->header.start_row + prev->header.nrows > start_row)
+    {
+      it = prev;
+    }
+  }
+  for (; it != index.end() && it->header.start_row < end_row; it++)
+  {
+    chunks.push_back(it - index.begin());
+  }
+}
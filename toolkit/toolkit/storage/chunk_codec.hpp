@@ -0,0 +1,49 @@
+#ifndef CHUNK_CODEC_H
+#define CHUNK_CODEC_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "../config.hpp"
+
+using namespace std;
+
+/*
+ * Header stored in front of every encoded chunk of a cached array.  A chunk
+ * holds `nrows` consecutive rows (spectrogram blocks) of `ncols` values each,
+ * laid out row after row.
+ */
+typedef struct chunk_header
+{
+  int64_t start_row; // first row of the array stored in this chunk
+  int64_t nrows; // number of rows in this chunk
+  int32_t ncols; // number of values in each row
+  int32_t codec; // codec used for the payload
+  uint64_t nbytes; // size of the encoded payload following the header
+  float qmin; // log-quantization range, only used by CODEC_LOGQ16_ZLIB
+  float qmax;
+} chunk_header_t;
+
+/*
+ * Index entry for an encoded chunk. `offset` is the position of the payload
+ * in the file, directly after the header.
+ */
+typedef struct chunk_entry
+{
+  chunk_header_t header;
+  uint64_t offset;
+} chunk_entry_t;
+
+// chunks sorted by `start_row`
+typedef vector<chunk_entry_t> chunk_index_t;
+
+void encode_chunk(int codec, const float* data, int64_t nrows, int32_t ncols,
+                  chunk_header_t* header, vector<char>& payload);
+void decode_chunk(const chunk_header_t* header, const vector<char>& payload,
+                  vector<float>& data);
+void add_chunk(chunk_index_t& index, chunk_entry_t entry);
+void find_chunks(const chunk_index_t& index, int64_t start_row, int64_t end_row,
+                 vector<size_t>& chunks);
+
+#endif // CHUNK_CODEC_H
@@ -28,15 +28,16 @@ void data_to_file(string mrn, string type)
   backend.open_array(mrn);
 
   int nchannels = NCHANNELS;
-  int nsamples = backend.get_nsamples(mrn);
+  int64_t nsamples = backend.get_nsamples(mrn);
 
-  int ch, start_offset, end_offset;
+  int ch;
+  int64_t start_offset, end_offset;
   cell_t cell;
   for (int i = 0; i < nchannels; i++)
   {
     ch = CHANNEL_ARRAY[i];
     start_offset = 0;
-    end_offset = min(nsamples, READ_CHUNK_SIZE);
+    end_offset = min(nsamples, (int64_t) READ_CHUNK_SIZE);
     frowvec chunk_buf = frowvec(end_offset); // store samples from each channel here
 
     // read chunks from each signal and write them
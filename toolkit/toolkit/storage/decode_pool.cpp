@@ -0,0 +1,105 @@
+#include "decode_pool.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+DecodePool::DecodePool(int nthreads)
+{
+  running = true;
+  for (int i = 0; i < nthreads; i++)
+  {
+    workers.push_back(thread(&DecodePool::work, this));
+  }
+}
+
+DecodePool::~DecodePool()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    running = false;
+  }
+  cv.notify_all();
+  for (thread& worker : workers)
+  {
+    worker.join();
+  }
+}
+
+/*
+ * Run the next unclaimed task of `job`, returns false once all of them are
+ * claimed
+ */
+bool DecodePool::run_task(shared_ptr<decode_job_t> job)
+{
+  size_t i = job->next++;
+  if (i >= job->ntasks)
+  {
+    return false;
+  }
+  job->task(i);
+  if (++job->ndone == job->ntasks)
+  {
+    lock_guard<mutex> guard(lock);
+    done_cv.notify_all();
+  }
+  return true;
+}
+
+void DecodePool::work()
+{
+  unique_lock<mutex> guard(lock);
+  while (true)
+  {
+    cv.wait(guard, [this]() { return !running || !jobs.empty(); });
+    if (!running)
+    {
+      return;
+    }
+    shared_ptr<decode_job_t> job = jobs.front();
+    guard.unlock();
+    bool claimed = run_task(job);
+    guard.lock();
+    if (!claimed && !jobs.empty() && jobs.front() == job)
+    {
+      jobs.pop_front();
+    }
+  }
+}
+
+/*
+ * Run `task(i)` for every `i` below `ntasks` on the pool and the calling
+ * thread, returning once all of them are done
+ */
+void DecodePool::run(size_t ntasks, function<void(size_t)> task)
+{
+  auto job = make_shared<decode_job_t>();
+  job->task = task;
+  job->ntasks = ntasks;
+  job->next = 0;
+  job->ndone = 0;
+  {
+    lock_guard<mutex> guard(lock);
+    jobs.push_back(job);
+  }
+  cv.notify_all();
+
+  while (run_task(job));
+
+  unique_lock<mutex> guard(lock);
+  auto it = find(jobs.begin(), jobs.end(), job);
+  if (it != jobs.end())
+  {
+    jobs.erase(it);
+  }
+  done_cv.wait(guard, [job]() { return job->ndone == job->ntasks; });
+}
+
+/*
+ * Pool of the process, with at most `DECODE_THREADS` threads
+ */
+DecodePool* get_decode_pool()
+{
+  static DecodePool pool(max(min((int) thread::hardware_concurrency(), DECODE_THREADS) - 1, 0));
+  return &pool;
+}
@@ -0,0 +1,57 @@
+#ifndef DECODE_POOL_H
+#define DECODE_POOL_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include "../config.hpp"
+
+using namespace std;
+
+/*
+ * Tasks `0..ntasks` of one caller, claimed by index by the workers and the
+ * caller itself
+ */
+typedef struct decode_job
+{
+  function<void(size_t)> task;
+  size_t ntasks;
+  atomic<size_t> next;
+  atomic<size_t> ndone;
+} decode_job_t;
+
+/*
+ * Threads shared by every read of the process to decode compressed chunks.
+ * The number of threads is fixed, so concurrent requests share
+ * `DECODE_THREADS` instead of each starting their own. The caller of `run`
+ * works on its own job too, so it progresses even when the workers are busy
+ * with other reads.
+ */
+class DecodePool
+{
+  private:
+    mutex lock;
+    condition_variable cv;
+    condition_variable done_cv;
+    deque<shared_ptr<decode_job_t>> jobs;
+    vector<thread> workers;
+    bool running;
+
+    bool run_task(shared_ptr<decode_job_t> job);
+    void work();
+
+  public:
+    DecodePool(int nthreads);
+    ~DecodePool();
+    void run(size_t ntasks, function<void(size_t)> task);
+};
+
+DecodePool* get_decode_pool();
+
+#endif // DECODE_POOL_H
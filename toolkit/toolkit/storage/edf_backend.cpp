@@ -20,8 +20,8 @@ ArrayMetadata EDFBackend::get_array_metadata(string mrn)
     }
     edf_hdr_struct* hdr = get_cache(mrn);
     int fs = ((double)hdr->signalparam[0].smp_in_datarecord / (double)hdr->datarecord_duration) * EDFLIB_TIME_DIMENSION;
-    int nsamples = hdr->signalparam[0].smp_in_file;
-    int nrows = nsamples;
+    int64_t nsamples = hdr->signalparam[0].smp_in_file;
+    int64_t nrows = nsamples;
     int ncols = NCHANNELS;
   return ArrayMetadata(fs, nsamples, nrows, ncols);
 }
@@ -72,7 +72,7 @@ void EDFBackend::open_array(string mrn)
     }
 }
 
-void EDFBackend::read_array(string mrn, int ch, int start_offset, int end_offset, frowvec& buf)
+void EDFBackend::read_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, frowvec& buf)
 
 {
     if (is_cached_array(mrn))
@@ -86,7 +86,7 @@ void EDFBackend::read_array(string mrn, int ch, int start_offset, int end_offset
         cout << "error: edfseek()" << endl;
     }
 
-    int nsamples = end_offset - start_offset;
+    int64_t nsamples = end_offset - start_offset;
     int bytes_read = edfread_physical_samples(hdl, ch, nsamples, buf.memptr());
 
     if (bytes_read == -1)
@@ -95,18 +95,23 @@ void EDFBackend::read_array(string mrn, int ch, int start_offset, int end_offset
     }
 
     // clear buffer in case we didn't read as much as we expected to
-    for (int i = bytes_read; i < nsamples; i++)
+    for (int64_t i = max(bytes_read, 0); i < nsamples; i++)
     {
         buf(i) = 0.0;
     }
 }
 
-void EDFBackend::read_array(string mrn, int start_offset, int end_offset, fmat& buf)
+void EDFBackend::read_array(string mrn, int64_t start_offset, int64_t end_offset, fmat& buf)
 {
   throw NotImplementedError();
 }
 
-void EDFBackend::write_array(string mrn, int ch, int start_offset, int end_offset, fmat& buf)
+void EDFBackend::read_array(string mrn, int64_t start_offset, int64_t end_offset, int start_col, int end_col, fmat& buf)
+{
+  throw NotImplementedError();
+}
+
+void EDFBackend::write_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, fmat& buf)
 {
   throw NotImplementedError();
 }
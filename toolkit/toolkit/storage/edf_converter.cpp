@@ -39,6 +39,7 @@ int main(int argc, char* argv[])
     cout << "Using mrn: " << mrn << " backend: " << TOSTRING(BACKEND) << " with desired_size: " << desired_size << " and READ_CHUNK_SIZE: " << READ_CHUNK_SIZE << endl;
     StorageBackend backend;
     edf_to_array(mrn, &backend, desired_size);
+    return 0;
   }
   else
   {
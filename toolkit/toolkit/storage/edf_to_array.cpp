@@ -4,6 +4,7 @@
 #include<armadillo>
 
 #include "../helpers.hpp"
+#include "waveform.hpp"
 
 using namespace std;
 using namespace arma;
@@ -22,9 +23,9 @@ void edf_to_array(string mrn, StorageBackend* backend, size_t desired_size)
   edf_backend.open_array(mrn);
 
   int fs = edf_backend.get_fs(mrn);
-  int nsamples = edf_backend.get_nsamples(mrn);
+  int64_t nsamples = edf_backend.get_nsamples(mrn);
   int ncols = NCHANNELS;
-  int nrows;
+  int64_t nrows;
 
   if (desired_size != 0)
   {
@@ -39,16 +40,20 @@ void edf_to_array(string mrn, StorageBackend* backend, size_t desired_size)
   backend->create_array(mrn, &metadata);
   cout << "Converting mrn: " << mrn << " with " << nsamples << " samples and fs=" << fs <<endl;
   cout << "Array metadata: " << backend->get_array_metadata(mrn).to_string() << endl;;
+  create_waveform_arrays(backend, mrn, fs, nrows);
+  int nlevels = get_waveform_nlevels(nrows);
 
-  int ch, start_read_offset, end_read_offset, start_write_offset, end_write_offset;
+  int ch;
+  int64_t start_read_offset, end_read_offset, start_write_offset, end_write_offset;
   for (int i = 0; i < ncols; i++)
   {
     ch = CHANNEL_ARRAY[i];
     start_read_offset = 0;
     start_write_offset = 0;
-    end_read_offset = min(nsamples, READ_CHUNK_SIZE);
+    end_read_offset = min(nsamples, (int64_t) READ_CHUNK_SIZE);
     end_write_offset = 0;
     frowvec chunk_buf = frowvec(end_read_offset);
+    WaveformBuilder waveform_builder = WaveformBuilder(backend, mrn, ch, nlevels);
 
     // read chunks from each signal and write them
     for (; end_read_offset <= nsamples; end_read_offset = min(end_read_offset + READ_CHUNK_SIZE, nsamples))
@@ -56,7 +61,7 @@ void edf_to_array(string mrn, StorageBackend* backend, size_t desired_size)
       // Accounts if we get many small chunks at the end to fill the desired_size
       if (desired_size != 0 && end_read_offset == nsamples && start_read_offset != 0)
       {
-        start_read_offset = max(0, end_read_offset - READ_CHUNK_SIZE);
+        start_read_offset = max((int64_t) 0, end_read_offset - READ_CHUNK_SIZE);
       }
       end_write_offset = min(end_write_offset + end_read_offset - start_read_offset, nrows);
 
@@ -66,12 +71,13 @@ void edf_to_array(string mrn, StorageBackend* backend, size_t desired_size)
 
       edf_backend.read_array(mrn, ch, start_read_offset, end_read_offset, chunk_buf);
 
-      if (end_write_offset - start_write_offset < (int) chunk_buf.n_elem) {
+      if (end_write_offset - start_write_offset < (int64_t) chunk_buf.n_elem) {
         chunk_buf.resize(end_write_offset - start_write_offset);
       }
 
       // write_array handles opens or uses cached handle
       backend->write_array(mrn, ch, start_write_offset, end_write_offset, chunk_buf);
+      waveform_builder.push(chunk_buf);
 
       if ((desired_size == 0 && end_read_offset == nsamples) || end_write_offset >= nrows)
       {
@@ -80,6 +86,7 @@ void edf_to_array(string mrn, StorageBackend* backend, size_t desired_size)
       start_write_offset = end_write_offset;
       start_read_offset = end_read_offset;
     }
+    waveform_builder.finish();
 
     if (!(ch % 2))
     {
@@ -89,6 +96,7 @@ void edf_to_array(string mrn, StorageBackend* backend, size_t desired_size)
 
   // We handle the close, not `write_array`
   backend->close_array(mrn);
+  close_waveform_arrays(backend, mrn, nrows);
 
   // Logging for experiments
   double diff_secs = ticks_to_seconds(getticks() - start);
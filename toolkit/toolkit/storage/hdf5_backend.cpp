@@ -25,11 +25,21 @@ ArrayMetadata HDF5Backend::get_array_metadata(string mrn)
   H5File file = get_cache(mrn);
   DataSet dataset = file.openDataSet(mrn);
   Attribute attr = dataset.openAttribute(ATTR_NAME);
-  int attr_data[NUM_ATTR];
-  attr.read(PredType::NATIVE_INT, attr_data);
+  int64_t attr_data[NUM_ATTR];
+  if (attr.getDataType().getSize() == sizeof(int32_t))
+  {
+    // arrays written before offsets were 64 bit
+    int32_t attr_data32[NUM_ATTR];
+    attr.read(PredType::NATIVE_INT32, attr_data32);
+    copy(attr_data32, attr_data32 + NUM_ATTR, attr_data);
+  }
+  else
+  {
+    attr.read(PredType::NATIVE_INT64, attr_data);
+  }
   int fs = attr_data[FS_IDX];
-  int nsamples = attr_data[NSAMPLES_IDX];
-  int nrows = attr_data[NROWS_IDX];
+  int64_t nsamples = attr_data[NSAMPLES_IDX];
+  int64_t nrows = attr_data[NROWS_IDX];
   int ncols = attr_data[NCOLS_IDX];
   dataset.close();
   return ArrayMetadata(fs, nsamples, nrows, ncols);
@@ -48,26 +58,40 @@ void HDF5Backend::create_array(string mrn, ArrayMetadata* metadata)
 
   hsize_t chunk_dims[DATA_RANK];
 
-  if (is_cached_array(mrn))
+  bool compressed = is_cached_array(mrn) && CACHE_CODEC != CODEC_NONE;
+  if (compressed)
   {
-    chunk_dims[0] = min(metadata->nrows, WRITE_CHUNK_SIZE);
+    // small chunks so range reads only inflate the blocks they touch
+    chunk_dims[0] = min(metadata->nrows, (int64_t) CACHE_CHUNK);
+    chunk_dims[1] = metadata->ncols;
+  }
+  else if (is_cached_array(mrn))
+  {
+    chunk_dims[0] = min(metadata->nrows, (int64_t) WRITE_CHUNK_SIZE);
     chunk_dims[1] = metadata->ncols;
   }
   else
   {
-    chunk_dims[0] = min(metadata->nrows, READ_CHUNK_SIZE);
+    chunk_dims[0] = min(metadata->nrows, (int64_t) READ_CHUNK_SIZE);
     chunk_dims[1] = 1;
   }
 
   // Modify dataset creation property to enable chunking
   DSetCreatPropList prop;
   prop.setChunk(DATA_RANK, chunk_dims);
+  if (compressed)
+  {
+    // HDF5 has no log-quantization filter so both codecs store
+    // the lossless shuffle + deflate encoding
+    prop.setShuffle();
+    prop.setDeflate(CACHE_CODEC_LEVEL);
+  }
 
   // Create the chunked dataset.  Note the use of pointer.
   DataSet *dataset = new DataSet(file.createDataSet(mrn,
                            PredType::NATIVE_FLOAT, dataspace, prop));
 
-  int attr_data[NUM_ATTR];
+  int64_t attr_data[NUM_ATTR];
   attr_data[FS_IDX] = metadata->fs;
   attr_data[NSAMPLES_IDX] = metadata->nsamples;
   attr_data[NROWS_IDX] = metadata->nrows;
@@ -75,9 +99,9 @@ void HDF5Backend::create_array(string mrn, ArrayMetadata* metadata)
   hsize_t attr_dims[ATTR_RANK] = {NUM_ATTR};
   DataSpace attrspace = DataSpace(ATTR_RANK, attr_dims);
 
-  Attribute attribute = dataset->createAttribute(ATTR_NAME, PredType::STD_I32BE, attrspace);
+  Attribute attribute = dataset->createAttribute(ATTR_NAME, PredType::STD_I64BE, attrspace);
 
-  attribute.write(PredType::NATIVE_INT, attr_data);
+  attribute.write(PredType::NATIVE_INT64, attr_data);
   dataset->close();
 }
 
@@ -96,7 +120,7 @@ void HDF5Backend::open_array(string mrn)
   put_cache(mrn, file);
 }
 
-void HDF5Backend::read_array(string mrn, int ch, int start_offset, int end_offset, frowvec& buf)
+void HDF5Backend::read_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, frowvec& buf)
 {
   hsize_t offset[DATA_RANK], count[DATA_RANK];
 
@@ -109,11 +133,16 @@ void HDF5Backend::read_array(string mrn, int ch, int start_offset, int end_offse
   _read_array(mrn, offset, count, buf);
 }
 
-void HDF5Backend::read_array(string mrn, int start_offset, int end_offset, fmat& buf)
+void HDF5Backend::read_array(string mrn, int64_t start_offset, int64_t end_offset, fmat& buf)
+{
+  read_array(mrn, start_offset, end_offset, 0, buf.n_rows, buf);
+}
+
+void HDF5Backend::read_array(string mrn, int64_t start_offset, int64_t end_offset, int start_col, int end_col, fmat& buf)
 {
   hsize_t offset[DATA_RANK], count[DATA_RANK];
   offset[0] = start_offset; // start_offset rows down
-  offset[1] = 0; //  we want all columns
+  offset[1] = start_col; // only the columns [start_col, end_col)
 
   count[0] = buf.n_cols;
   count[1] = buf.n_rows;
@@ -141,7 +170,7 @@ void HDF5Backend::_read_array(string mrn, hsize_t offset[], hsize_t count[], fma
   dataset.close();
 }
 
-void HDF5Backend::write_array(string mrn, int ch, int start_offset, int end_offset, fmat& buf)
+void HDF5Backend::write_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, fmat& buf)
 {
   H5File file = get_cache(mrn);
   DataSet dataset = file.openDataSet(mrn);
@@ -171,3 +200,25 @@ void HDF5Backend::close_array(string mrn)
   }
 }
 
+
+void HDF5Backend::sync_array(string mrn)
+{
+  if (in_cache(mrn))
+  {
+    get_cache(mrn).flush(H5F_SCOPE_GLOBAL);
+  }
+  AbstractStorageBackend::sync_array(mrn);
+}
+
+/*
+ * The dataset inside the file is named after the array, so it is renamed
+ * before the file itself
+ */
+void HDF5Backend::rename_array(string from_mrn, string to_mrn)
+{
+  close_array(from_mrn);
+  H5File file(mrn_to_array_name(from_mrn), H5F_ACC_RDWR);
+  file.move(from_mrn, to_mrn);
+  file.close();
+  AbstractStorageBackend::rename_array(from_mrn, to_mrn);
+}
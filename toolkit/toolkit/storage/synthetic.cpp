@@ -0,0 +1,397 @@
+#include "synthetic.hpp"
+
+#include <armadillo>
+#include <string>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <math.h>
+
+#include "../helpers.hpp"
+#include "waveform.hpp"
+
+using namespace arma;
+using namespace std;
+
+#define SYNTHETIC_SLICE_SECONDS 600 // length of one unit of work
+#define SYNTHETIC_WARMUP 4096 // samples run through the 1/f filter before a slice
+
+#define SYNTHETIC_MIN_SEGMENT 600 // seconds between change points
+#define SYNTHETIC_MAX_SEGMENT 5400
+
+#define SYNTHETIC_PINK_UV 8.0 // amplitude of the 1/f background
+#define SYNTHETIC_DELTA_UV 20.0 // amplitude of the slow waves
+#define SYNTHETIC_DELTA_HZ 1.5
+#define SYNTHETIC_ALPHA_UV 30.0 // amplitude of the alpha bursts
+#define SYNTHETIC_ALPHA_RATE 0.2 // bursts per second
+#define SYNTHETIC_ARTIFACT_RATE (1 / 60.0) // artifacts per second
+
+#define SYNTHETIC_PHYSICAL_MAX 1000 // uV
+#define SYNTHETIC_DIGITAL_MAX 32767
+
+// streams of the random generators seeded from the recording seed
+#define STREAM_SEGMENTS 0
+#define STREAM_EVENTS 1
+#define STREAM_SIGNAL 2
+
+#define EVENT_ALPHA 0
+#define EVENT_BLINK 1 // slow frontal deflection
+#define EVENT_MUSCLE 2 // broadband noise on the temporal channels
+#define EVENT_POP 3 // decaying step on a single electrode
+
+/*
+ * Something happening on some of the signals during [`start`, `end`)
+ */
+typedef struct synthetic_event
+{
+  int64_t start;
+  int64_t end;
+  int type; // one of the EVENT_* types
+  float freq; // Hz, for alpha bursts
+  float amplitude; // uV
+  int signal; // the only signal for electrode pops
+} synthetic_event_t;
+
+/*
+ * How strongly a signal picks up each kind of activity, by scalp region
+ */
+typedef struct signal_weights
+{
+  float posterior; // alpha
+  float frontal; // slow waves and blinks
+  float temporal; // muscle
+} signal_weights_t;
+
+// EDF labels of the signals indexed by `ch_idx_t`
+static const char* EDF_LABELS[SYNTHETIC_MIN_SIGNALS] = {
+  "EEG C3", "EEG C4", "EEG O1", "EEG O2", "EEG CZ", "EEG FZ", "EEG PZ",
+  "EEG F3", "EEG F4", "EEG F7", "EEG F8", "EEG A1", "EEG FP1", "EEG FP2",
+  "EEG A2", "EEG P3", "EEG P4", "ECG", "EEG T3", "EEG T4", "EEG T5", "EEG T6"
+};
+
+/*
+ * Random generator for `stream` of the recording, e.g. one signal of one
+ * slice
+ */
+static mt19937_64 get_generator(synthetic_recording_t* recording, uint64_t stream,
+    uint64_t a, uint64_t b)
+{
+  seed_seq seq = {recording->seed, stream, a, b};
+  return mt19937_64(seq);
+}
+
+static signal_weights_t get_signal_weights(int signal)
+{
+  switch (signal)
+  {
+    case O1: case O2: return {1.0, 0.2, 0.1};
+    case P3: case P4: return {0.7, 0.3, 0.1};
+    case T5: case T6: return {0.6, 0.3, 0.8};
+    case T3: case T4: return {0.3, 0.4, 1.0};
+    case F7: case F8: return {0.1, 0.8, 0.8};
+    case F3: case F4: return {0.1, 0.9, 0.2};
+    case FP1: case FP2: return {0.1, 1.0, 0.3};
+    default: return {0.4, 0.5, 0.3};
+  }
+}
+
+/*
+ * Set up a recording of `nsamples` samples (rounded up to whole seconds) of
+ * `nsignals` signals at `fs` Hz and draw the change points of its activity
+ */
+void init_synthetic_recording_t(synthetic_recording_t* recording, uint64_t seed,
+    int fs, int nsignals, int64_t nsamples)
+{
+  recording->seed = seed;
+  recording->fs = fs;
+  recording->nsignals = max(nsignals, SYNTHETIC_MIN_SIGNALS);
+  recording->nsamples = (nsamples + fs - 1) / fs * fs;
+  recording->slice_nsamples = (int64_t) SYNTHETIC_SLICE_SECONDS * fs;
+
+  mt19937_64 rng = get_generator(recording, STREAM_SEGMENTS, 0, 0);
+  uniform_real_distribution<float> length(SYNTHETIC_MIN_SEGMENT, SYNTHETIC_MAX_SEGMENT);
+  uniform_real_distribution<float> scale(0.3, 1.7);
+  recording->segments.clear();
+  for (int64_t start = 0; start < recording->nsamples; start += (int64_t) (length(rng) * fs))
+  {
+    recording->segments.push_back({start, scale(rng), scale(rng), scale(rng)});
+  }
+}
+
+int64_t get_synthetic_nslices(synthetic_recording_t* recording)
+{
+  return (recording->nsamples + recording->slice_nsamples - 1) / recording->slice_nsamples;
+}
+
+static synthetic_segment_t* get_segment(synthetic_recording_t* recording, int64_t sample)
+{
+  auto it = upper_bound(recording->segments.begin(), recording->segments.end(), sample,
+      [](int64_t sample, const synthetic_segment_t& segment)
+      {
+        return sample < segment.start;
+      });
+  return &*(it - 1);
+}
+
+/*
+ * Append the events starting in `slice` to `events`. They are shared by
+ * every signal, so blinks and bursts line up across the channels.
+ */
+static void get_slice_events(synthetic_recording_t* recording, int64_t slice,
+    vector<synthetic_event_t>& events)
+{
+  int fs = recording->fs;
+  int64_t slice_start = slice * recording->slice_nsamples;
+  int64_t slice_end = min(slice_start + recording->slice_nsamples, recording->nsamples);
+  mt19937_64 rng = get_generator(recording, STREAM_EVENTS, slice, 0);
+  uniform_real_distribution<float> uniform(0, 1);
+
+  exponential_distribution<double> alpha_gap(SYNTHETIC_ALPHA_RATE);
+  for (int64_t start = slice_start + alpha_gap(rng) * fs; start < slice_end;
+      start += alpha_gap(rng) * fs)
+  {
+    int64_t length = (1 + 3 * uniform(rng)) * fs;
+    float amplitude = SYNTHETIC_ALPHA_UV * get_segment(recording, start)->alpha;
+    events.push_back({start, start + length, EVENT_ALPHA, 8.5f + 3 * uniform(rng), amplitude, -1});
+  }
+
+  exponential_distribution<double> artifact_gap(SYNTHETIC_ARTIFACT_RATE);
+  for (int64_t start = slice_start + artifact_gap(rng) * fs; start < slice_end;
+      start += artifact_gap(rng) * fs)
+  {
+    int type = EVENT_BLINK + (int) (3 * uniform(rng)) % 3;
+    switch (type)
+    {
+      case EVENT_BLINK:
+        events.push_back({start, start + (int64_t) (0.3 * fs), type, 0, 100 + 100 * uniform(rng), -1});
+        break;
+      case EVENT_MUSCLE:
+        events.push_back({start, start + (int64_t) ((1 + 2 * uniform(rng)) * fs), type, 0,
+            20 + 20 * uniform(rng), -1});
+        break;
+      default:
+        events.push_back({start, start + fs / 2, type, 0, 150 + 150 * uniform(rng),
+            CHANNEL_ARRAY[(int) (NCHANNELS * uniform(rng)) % NCHANNELS]});
+        break;
+    }
+  }
+}
+
+/*
+ * Fill `buf` with the samples of `signal` in `slice`: a 1/f background, slow
+ * waves and posterior alpha bursts whose power changes at every segment,
+ * plus blinks, muscle and electrode pop artifacts.
+ */
+void synthetic_slice(synthetic_recording_t* recording, int signal, int64_t slice, frowvec& buf)
+{
+  int fs = recording->fs;
+  int64_t slice_start = slice * recording->slice_nsamples;
+  int64_t slice_end = min(slice_start + recording->slice_nsamples, recording->nsamples);
+  buf.set_size(slice_end - slice_start);
+  signal_weights_t weights = get_signal_weights(signal);
+
+  // events of the previous slice may continue into this one
+  vector<synthetic_event_t> events;
+  if (slice > 0)
+  {
+    get_slice_events(recording, slice - 1, events);
+  }
+  get_slice_events(recording, slice, events);
+
+  mt19937_64 rng = get_generator(recording, STREAM_SIGNAL, signal, slice);
+  normal_distribution<float> normal(0, 1);
+  // the phase of the rhythms is the same in every slice of the signal
+  mt19937_64 phase_rng = get_generator(recording, STREAM_SIGNAL, signal, (uint64_t) -1);
+  float phase = 2 * M_PI * uniform_real_distribution<float>(0, 1)(phase_rng);
+
+  // Paul Kellet's filter of white noise, run ahead so the slice starts in
+  // its steady state
+  float b[7] = {0};
+  float pink = 0;
+  for (int64_t i = -SYNTHETIC_WARMUP; i < (int64_t) buf.n_elem; i++)
+  {
+    float white = normal(rng);
+    b[0] = 0.99886 * b[0] + white * 0.0555179;
+    b[1] = 0.99332 * b[1] + white * 0.0750759;
+    b[2] = 0.96900 * b[2] + white * 0.1538520;
+    b[3] = 0.86650 * b[3] + white * 0.3104856;
+    b[4] = 0.55000 * b[4] + white * 0.5329522;
+    b[5] = -0.7616 * b[5] - white * 0.0168980;
+    pink = b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] + white * 0.5362;
+    b[6] = white * 0.115926;
+    if (i >= 0)
+    {
+      buf(i) = pink;
+    }
+  }
+
+  synthetic_segment_t* segment = get_segment(recording, slice_start);
+  synthetic_segment_t* last_segment = &recording->segments.back();
+  for (uword i = 0; i < buf.n_elem; i++)
+  {
+    int64_t sample = slice_start + i;
+    if (segment != last_segment && sample >= (segment + 1)->start)
+    {
+      segment++;
+    }
+    double t = sample / (double) fs;
+    buf(i) = SYNTHETIC_PINK_UV * segment->amplitude * buf(i) +
+      SYNTHETIC_DELTA_UV * segment->delta * weights.frontal * sin(2 * M_PI * SYNTHETIC_DELTA_HZ * t + phase);
+  }
+
+  for (synthetic_event_t& event : events)
+  {
+    int64_t start = max(event.start, slice_start);
+    int64_t end = min(event.end, slice_end);
+    double length = event.end - event.start;
+    for (int64_t sample = start; sample < end; sample++)
+    {
+      double x = (sample - event.start) / length; // position in the event
+      float& val = buf(sample - slice_start);
+      switch (event.type)
+      {
+        case EVENT_ALPHA:
+          val += weights.posterior * event.amplitude * sin(M_PI * x) *
+            sin(2 * M_PI * event.freq * sample / fs + phase);
+          break;
+        case EVENT_BLINK:
+          val += weights.frontal * weights.frontal * event.amplitude * sin(M_PI * x);
+          break;
+        case EVENT_MUSCLE:
+          val += weights.temporal * event.amplitude * normal(rng);
+          break;
+        default:
+          if (signal == event.signal)
+          {
+            val += event.amplitude * exp(-6 * x);
+          }
+          break;
+      }
+    }
+  }
+  buf = clamp(buf, -SYNTHETIC_PHYSICAL_MAX, SYNTHETIC_PHYSICAL_MAX);
+}
+
+/*
+ * Run `f(0)` to `f(n - 1)` on every core
+ */
+static void parallel_for(int n, function<void(int)> f)
+{
+  atomic<int> next(0);
+  vector<thread> workers;
+  int nthreads = min(n, max((int) thread::hardware_concurrency(), 1));
+  for (int i = 0; i < nthreads; i++)
+  {
+    workers.push_back(thread([&]()
+    {
+      for (int j = next++; j < n; j = next++)
+      {
+        f(j);
+      }
+    }));
+  }
+  for (thread& worker : workers)
+  {
+    worker.join();
+  }
+}
+
+/*
+ * Write the recording as an EDF+ file at `path`, with one second data
+ * records. The signals of each slice are generated in parallel.
+ */
+void write_synthetic_edf(synthetic_recording_t* recording, string path)
+{
+  int fs = recording->fs;
+  int nsignals = recording->nsignals;
+  int hdl = edfopen_file_writeonly(path.c_str(), EDFLIB_FILETYPE_EDFPLUS, nsignals);
+  if (hdl < 0)
+  {
+    cout << "Error creating EDF file: " << path << endl;
+    exit(-1);
+  }
+  for (int i = 0; i < nsignals; i++)
+  {
+    string label = i < SYNTHETIC_MIN_SIGNALS ? EDF_LABELS[i] : "EEG X" + to_string(i);
+    if (edf_set_samplefrequency(hdl, i, fs) ||
+        edf_set_physical_maximum(hdl, i, SYNTHETIC_PHYSICAL_MAX) ||
+        edf_set_physical_minimum(hdl, i, -SYNTHETIC_PHYSICAL_MAX) ||
+        edf_set_digital_maximum(hdl, i, SYNTHETIC_DIGITAL_MAX) ||
+        edf_set_digital_minimum(hdl, i, -SYNTHETIC_DIGITAL_MAX - 1) ||
+        edf_set_label(hdl, i, label.c_str()) ||
+        edf_set_physical_dimension(hdl, i, "uV"))
+    {
+      cout << "Error setting up signal " << i << " of " << path << endl;
+      exit(-1);
+    }
+  }
+  edf_set_patientname(hdl, "synthetic");
+
+  vector<frowvec> bufs(nsignals);
+  vector<double> record(fs);
+  int64_t nslices = get_synthetic_nslices(recording);
+  for (int64_t slice = 0; slice < nslices; slice++)
+  {
+    parallel_for(nsignals, [&](int i)
+    {
+      synthetic_slice(recording, i, slice, bufs[i]);
+    });
+    for (uword offset = 0; offset < bufs[0].n_elem; offset += fs)
+    {
+      for (int i = 0; i < nsignals; i++)
+      {
+        copy(bufs[i].memptr() + offset, bufs[i].memptr() + offset + fs, record.begin());
+        if (edfwrite_physical_samples(hdl, record.data()))
+        {
+          cout << "Error writing EDF file: " << path << endl;
+          exit(-1);
+        }
+      }
+    }
+  }
+  edfclose_file(hdl);
+}
+
+/*
+ * Write the channels of `CHANNEL_ARRAY` of the recording directly as the
+ * array `mrn` of `backend`, with its waveform pyramid, like `edf_to_array`.
+ * The slices of each channel are generated in parallel and written in order.
+ */
+void write_synthetic_array(synthetic_recording_t* recording, StorageBackend* backend, string mrn)
+{
+  int fs = recording->fs;
+  int64_t nsamples = recording->nsamples;
+  ArrayMetadata metadata = ArrayMetadata(fs, nsamples, nsamples, NCHANNELS);
+  backend->create_array(mrn, &metadata);
+  create_waveform_arrays(backend, mrn, fs, nsamples);
+  int nlevels = get_waveform_nlevels(nsamples);
+
+  int64_t nslices = get_synthetic_nslices(recording);
+  int batch = max((int) thread::hardware_concurrency(), 1);
+  vector<frowvec> bufs(batch);
+  for (int i = 0; i < NCHANNELS; i++)
+  {
+    int ch = CHANNEL_ARRAY[i];
+    WaveformBuilder waveform_builder = WaveformBuilder(backend, mrn, ch, nlevels);
+    for (int64_t first = 0; first < nslices; first += batch)
+    {
+      int n = min((int64_t) batch, nslices - first);
+      parallel_for(n, [&](int j)
+      {
+        synthetic_slice(recording, ch, first + j, bufs[j]);
+      });
+      for (int j = 0; j < n; j++)
+      {
+        int64_t start_offset = (first + j) * recording->slice_nsamples;
+        backend->write_array(mrn, ch, start_offset, start_offset + bufs[j].n_elem, bufs[j]);
+        waveform_builder.push(bufs[j]);
+      }
+    }
+    waveform_builder.finish();
+    cout << "Wrote ch: " << ch << endl;
+  }
+  backend->close_array(mrn);
+  close_waveform_arrays(backend, mrn, nsamples);
+}
@@ -0,0 +1,49 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <armadillo>
+#include <string>
+#include <vector>
+
+#include "backends.hpp"
+#include "../config.hpp"
+
+using namespace arma;
+using namespace std;
+
+#define SYNTHETIC_MIN_SIGNALS (T6 + 1) // EDF signals up to the last channel of `ch_idx_t`
+
+/*
+ * State of the synthetic brain activity between two change points
+ */
+typedef struct synthetic_segment
+{
+  int64_t start; // first sample of the segment
+  float amplitude; // scale of the 1/f background
+  float alpha; // scale of the alpha bursts
+  float delta; // scale of the slow waves
+} synthetic_segment_t;
+
+/*
+ * Parameters of a synthetic recording. The samples of a signal only depend
+ * on these, so recordings are reproducible from the seed whatever the
+ * number of threads generating them.
+ */
+typedef struct synthetic_recording
+{
+  uint64_t seed;
+  int fs; // sample rate
+  int nsignals; // number of EDF signals, at least `SYNTHETIC_MIN_SIGNALS`
+  int64_t nsamples; // samples of each signal, a whole number of seconds
+  int64_t slice_nsamples; // samples generated by one unit of work
+  vector<synthetic_segment_t> segments;
+} synthetic_recording_t;
+
+void init_synthetic_recording_t(synthetic_recording_t* recording, uint64_t seed,
+    int fs, int nsignals, int64_t nsamples);
+int64_t get_synthetic_nslices(synthetic_recording_t* recording);
+void synthetic_slice(synthetic_recording_t* recording, int signal, int64_t slice, frowvec& buf);
+void write_synthetic_edf(synthetic_recording_t* recording, string path);
+void write_synthetic_array(synthetic_recording_t* recording, StorageBackend* backend, string mrn);
+
+#endif // SYNTHETIC_H
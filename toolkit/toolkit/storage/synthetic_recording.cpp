@@ -0,0 +1,69 @@
+#include <string>
+#include <stdlib.h>
+
+#include "backends.hpp"
+#include "synthetic.hpp"
+#include "../helpers.hpp"
+
+using namespace std;
+
+#define DEFAULT_FS 256
+#define DEFAULT_SEED 42
+
+/*
+ * Command line program to generate a synthetic recording for the given `mrn`
+ * as an EDF file in DATADIR, to be converted like a real one, or directly as
+ * an array of the backend defined in `config.hpp`. The length is given in
+ * hours or, with a GB suffix, as the size of the array.
+ */
+int main(int argc, char* argv[])
+{
+  if (argc < 3 || argc > 7)
+  {
+    cout << "\nusage: ./synthetic_recording <mrn> <hours|sizeGB> [edf|array] [fs] [nsignals] [seed]\n" << endl;
+    return 1;
+  }
+
+  string mrn = argv[1];
+  string length = argv[2];
+  string format = argc > 3 ? argv[3] : "edf";
+  int fs = argc > 4 ? atoi(argv[4]) : DEFAULT_FS;
+  int nsignals = argc > 5 ? atoi(argv[5]) : SYNTHETIC_MIN_SIGNALS;
+  uint64_t seed = argc > 6 ? strtoull(argv[6], NULL, 10) : DEFAULT_SEED;
+  if (fs <= 0 || (format != "edf" && format != "array"))
+  {
+    cout << "Invalid sample rate or format" << endl;
+    return 1;
+  }
+
+  int64_t nsamples;
+  if (length.size() > 2 && length.substr(length.size() - 2) == "GB")
+  {
+    double size = atof(length.substr(0, length.size() - 2).c_str());
+    nsamples = size * gigabytes_to_bytes(1) / (sizeof(float) * NCHANNELS);
+  }
+  else
+  {
+    nsamples = hours_to_samples(fs, atof(length.c_str()));
+  }
+
+  synthetic_recording_t recording;
+  init_synthetic_recording_t(&recording, seed, fs, nsignals, max(nsamples, (int64_t) fs));
+  cout << "Generating mrn: " << mrn << " format: " << format << " nsamples: " << recording.nsamples <<
+    " fs: " << fs << " nsignals: " << recording.nsignals << " seed: " << seed <<
+    " change points: " << recording.segments.size() - 1 << endl;
+
+  unsigned long long start = getticks();
+  if (format == "edf")
+  {
+    write_synthetic_edf(&recording, mrn_to_filename(mrn, "edf"));
+  }
+  else
+  {
+    cout << "Using backend: " << TOSTRING(BACKEND) << endl;
+    StorageBackend backend;
+    write_synthetic_array(&recording, &backend, mrn);
+  }
+  log_time_diff("synthetic_recording", start);
+  return 0;
+}
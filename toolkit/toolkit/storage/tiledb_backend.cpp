@@ -26,12 +26,22 @@ string TileDBBackend::get_array_name(string mrn)
 
 string TileDBBackend::get_workspace()
 {
-  return DATADIR WORKSPACE;
+  return data_dir + WORKSPACE;
 }
 
 string TileDBBackend::get_catalog()
 {
-  return DATADIR CATALOG;
+  return data_dir + CATALOG;
+}
+
+/*
+ * The metadata file is written once the array is complete, so an array
+ * without it is still being copied by `rename_array`
+ */
+bool TileDBBackend::array_exists(string mrn)
+{
+  return file_exists(mrn_to_array_name(mrn)) &&
+    file_exists(mrn_to_array_name(mrn) + "-metadata");
 }
 
 ArrayMetadata TileDBBackend::get_array_metadata(string mrn)
@@ -52,8 +62,8 @@ ArrayMetadata TileDBBackend::get_array_metadata(string mrn)
   string err;
   Json json = Json::parse(header, err);
   int fs = json["fs"].int_value();
-  int nsamples = json["nsamples"].int_value();
-  int nrows = json["nrows"].int_value();
+  int64_t nsamples = json["nsamples"].number_value();
+  int64_t nrows = json["nrows"].number_value();
   int ncols = json["ncols"].int_value();
   return ArrayMetadata(fs, nsamples, nrows, ncols);
 }
@@ -62,7 +72,8 @@ void TileDBBackend::write_metadata(string mrn, ArrayMetadata* metadata)
 {
   ofstream file;
   string path = mrn_to_array_name(mrn) + "-metadata";
-  file.open(path, ios::trunc|ios::binary);
+  string tmp_path = path + "-tmp";
+  file.open(tmp_path, ios::trunc|ios::binary);
 
   // Store metadata in header;
   string header = metadata->to_string();
@@ -71,6 +82,13 @@ void TileDBBackend::write_metadata(string mrn, ArrayMetadata* metadata)
   file.write((char*) &header_len, sizeof(uint32_t));
   file.write(header.c_str(), header_len);
   file.close();
+
+  // Renamed into place so `array_exists` never sees a partial file
+  if (rename(tmp_path.c_str(), path.c_str()))
+  {
+    cout << "Error renaming " << tmp_path << " to " << path << endl;
+    exit(-1);
+  }
 }
 
 void TileDBBackend::create_array(string mrn, ArrayMetadata* metadata)
@@ -103,20 +121,26 @@ void TileDBBackend::create_array(string mrn, ArrayMetadata* metadata)
   //array_schema.tile_order_ = "column-major";
 
   /* Set compression. */
+  bool compressed = is_cached_array(mrn) && CACHE_CODEC != CODEC_NONE;
   array_schema.compression_ = new const char*[attribute_num + 1];
-  array_schema.compression_[0] = "NONE";
+  array_schema.compression_[0] = compressed ? "GZIP" : "NONE";
   array_schema.compression_[1] = "GZIP";
 
   /* Set tile extents. */
   array_schema.tile_extents_ = new double[dim_num];
-  if (is_cached_array(mrn))
+  if (compressed)
+  {
+    array_schema.tile_extents_[1] = min(metadata->nrows, (int64_t) CACHE_CHUNK);
+    array_schema.tile_extents_[0] = metadata->ncols;
+  }
+  else if (is_cached_array(mrn))
   {
-    array_schema.tile_extents_[1] = min(metadata->nrows, WRITE_CHUNK_SIZE);
+    array_schema.tile_extents_[1] = min(metadata->nrows, (int64_t) WRITE_CHUNK_SIZE);
     array_schema.tile_extents_[0] = metadata->ncols;
   }
   else
   {
-    array_schema.tile_extents_[1] = min(metadata->nrows, READ_CHUNK_SIZE);
+    array_schema.tile_extents_[1] = min(metadata->nrows, (int64_t) READ_CHUNK_SIZE);
     array_schema.tile_extents_[0] = 1;
   }
 
@@ -130,7 +154,7 @@ void TileDBBackend::create_array(string mrn, ArrayMetadata* metadata)
   /* Set types: float32 for "sample" and int64 for the coordinates. */
   array_schema.types_ = new const char*[attribute_num + 1];
   array_schema.types_[0] = "float32";
-  array_schema.types_[1] = "int32";
+  array_schema.types_[1] = "int64";
 
   // Initialize TileDB
   TileDB_CTX* tiledb_ctx;
@@ -142,7 +166,7 @@ void TileDBBackend::create_array(string mrn, ArrayMetadata* metadata)
     cout << "TileDB workspace created." << endl;
   }
 
-  if (array_exists(mrn))
+  if (file_exists(array_name))
   {
     // Necessary for clean since arrays are not cleared when redefined
     if (tiledb_array_delete(tiledb_ctx, array_name.c_str()) == TILEDB_ERR)
@@ -194,7 +218,7 @@ void TileDBBackend::_open_array(string mrn, int mode)
   put_cache(mrn, tiledb_cache_pair(tiledb_ctx, array_id));
 }
 
-void TileDBBackend::read_array(string mrn, int ch, int start_offset, int end_offset, frowvec& buf)
+void TileDBBackend::read_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, frowvec& buf)
 {
   double* range = new double[RANGE_SIZE];
   range[0] = CH_REVERSE_IDX[ch];
@@ -204,13 +228,19 @@ void TileDBBackend::read_array(string mrn, int ch, int start_offset, int end_off
   _read_array(mrn, range, buf);
 }
 
-void TileDBBackend::read_array(string mrn, int start_offset, int end_offset, fmat& buf)
+void TileDBBackend::read_array(string mrn, int64_t start_offset, int64_t end_offset, fmat& buf)
+{
+  // the rows of `buf` are the columns of the array
+  read_array(mrn, start_offset, end_offset, 0, buf.n_rows, buf);
+}
+
+void TileDBBackend::read_array(string mrn, int64_t start_offset, int64_t end_offset, int start_col, int end_col, fmat& buf)
 {
   double* range = new double[RANGE_SIZE];
-  range[0] = 0;
-  range[1] = buf.n_cols;
+  range[0] = start_col;
+  range[1] = end_col;
   range[2] = start_offset;
-  range[3] = start_offset + buf.n_rows;
+  range[3] = end_offset;
   _read_array(mrn, range, buf);
   buf = buf.t();
 }
@@ -233,7 +263,7 @@ void TileDBBackend::_read_array(string mrn, double* range, fmat& buf)
       buf.memptr(), &buf_size);
 }
 
-void TileDBBackend::write_array(string mrn, int ch, int start_offset, int end_offset, fmat& buf)
+void TileDBBackend::write_array(string mrn, int ch, int64_t start_offset, int64_t end_offset, fmat& buf)
 {
   _open_array(mrn, TILEDB_ARRAY_MODE_WRITE);
   tiledb_cache_pair pair = get_cache(mrn);
@@ -259,3 +289,60 @@ void TileDBBackend::close_array(string mrn)
   }
 }
 
+
+/*
+ * Writes are appended to the array in order, the offsets are ignored
+ */
+bool TileDBBackend::positional_writes()
+{
+  return false;
+}
+
+void TileDBBackend::delete_array(string mrn)
+{
+  close_array(mrn);
+  metadata_cache.erase(mrn);
+
+  // the array stops existing for readers before it is deleted
+  remove((mrn_to_array_name(mrn) + "-metadata").c_str());
+  TileDB_CTX* tiledb_ctx;
+  tiledb_ctx_init(&tiledb_ctx);
+  if (tiledb_array_delete(tiledb_ctx, get_array_name(mrn).c_str()) == TILEDB_ERR)
+  {
+    cout << "TileDB delete error." << endl;
+    exit(-1);
+  }
+  tiledb_ctx_finalize(tiledb_ctx);
+}
+
+/*
+ * TileDB arrays record their own name, so the array is copied to `to_mrn`
+ * and `from_mrn` is deleted. The metadata file of `to_mrn` is the
+ * completion marker: it is removed before the copy starts and written once
+ * the copy is complete, so readers see the old array, no array, or the new
+ * one, never a partial copy.
+ */
+void TileDBBackend::rename_array(string from_mrn, string to_mrn)
+{
+  close_array(to_mrn);
+  metadata_cache.erase(to_mrn);
+  remove((mrn_to_array_name(to_mrn) + "-metadata").c_str());
+  ArrayMetadata metadata = get_array_metadata(from_mrn);
+  create_array(to_mrn, &metadata);
+  remove((mrn_to_array_name(to_mrn) + "-metadata").c_str());
+
+  open_array(from_mrn);
+  int64_t window_nrows = max(READ_CHUNK_SIZE / max(metadata.ncols, 1), 1);
+  fmat buf;
+  for (int64_t start_offset = 0; start_offset < metadata.nrows; start_offset += window_nrows)
+  {
+    int64_t end_offset = min(start_offset + window_nrows, metadata.nrows);
+    buf.set_size(metadata.ncols, end_offset - start_offset);
+    read_array(from_mrn, start_offset, end_offset, buf);
+    write_array(to_mrn, ALL, start_offset, end_offset, buf);
+  }
+  close_array(to_mrn);
+  write_metadata(to_mrn, &metadata);
+
+  delete_array(from_mrn);
+}
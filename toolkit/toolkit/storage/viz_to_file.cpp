@@ -48,13 +48,13 @@ void viz_to_file(string mrn, size_t desired_size, string type)
 
     backend.open_array(cached_mrn);
 
-    int nsamples = backend.get_nsamples(cached_mrn);
+    int64_t nsamples = backend.get_nsamples(cached_mrn);
     int ncols = backend.get_ncols(cached_mrn);
 
-    int start_offset, end_offset;
+    int64_t start_offset, end_offset;
     cell_t cell;
     start_offset = 0;
-    end_offset = min(nsamples, READ_CHUNK_SIZE);
+    end_offset = min(nsamples, (int64_t) READ_CHUNK_SIZE);
     fmat chunk_mat = fmat(ncols, end_offset);
 
     // read chunks from each signal and write them
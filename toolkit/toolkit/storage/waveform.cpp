@@ -0,0 +1,287 @@
+#include "waveform.hpp"
+
+#include <math.h>
+#include <armadillo>
+#include <string>
+#include <algorithm>
+
+#include "../helpers.hpp"
+
+using namespace arma;
+using namespace std;
+
+/*
+ * Number of samples of the raw data reduced to one row of `level`
+ */
+static inline int64_t level_factor(int level)
+{
+  int64_t factor = 1;
+  for (int i = 0; i < level; i++)
+  {
+    factor *= WAVEFORM_FACTOR;
+  }
+  return factor;
+}
+
+/*
+ * Number of rows of `level` for raw data with `nrows` samples
+ */
+static inline int64_t level_nrows(int64_t nrows, int level)
+{
+  int64_t factor = level_factor(level);
+  return (nrows + factor - 1) / factor;
+}
+
+/*
+ * Number of pyramid levels built for raw data with `nrows` samples. Levels
+ * are added until the previous one is no longer than `WAVEFORM_MIN_ROWS`.
+ */
+int get_waveform_nlevels(int64_t nrows)
+{
+  int nlevels = 0;
+  while (level_nrows(nrows, nlevels) > WAVEFORM_MIN_ROWS)
+  {
+    nlevels++;
+  }
+  return nlevels;
+}
+
+WaveformBuilder::WaveformBuilder(StorageBackend* backend, string mrn, int ch, int nlevels)
+{
+  this->backend = backend;
+  this->mrn = mrn;
+  this->ch = ch;
+  this->nlevels = nlevels;
+  group_min.resize(nlevels);
+  group_max.resize(nlevels);
+  group_count.resize(nlevels, 0);
+  pending_min.resize(nlevels);
+  pending_max.resize(nlevels);
+  level_offset.resize(nlevels, 0);
+}
+
+/*
+ * Add the next raw samples of the channel
+ */
+void WaveformBuilder::push(frowvec& buf)
+{
+  if (nlevels == 0)
+  {
+    return;
+  }
+  for (uword i = 0; i < buf.n_elem; i++)
+  {
+    push(0, buf(i), buf(i));
+  }
+}
+
+/*
+ * Add the next value of the level below `level` to its partial group
+ */
+void WaveformBuilder::push(int level, float min_val, float max_val)
+{
+  if (group_count[level] == 0)
+  {
+    group_min[level] = min_val;
+    group_max[level] = max_val;
+  }
+  else
+  {
+    group_min[level] = min(group_min[level], min_val);
+    group_max[level] = max(group_max[level], max_val);
+  }
+
+  if (++group_count[level] == WAVEFORM_FACTOR)
+  {
+    emit(level);
+  }
+}
+
+/*
+ * Finish the partial group of `level` as its next row, which is also
+ * the next value of the level above.
+ */
+void WaveformBuilder::emit(int level)
+{
+  pending_min[level].push_back(group_min[level]);
+  pending_max[level].push_back(group_max[level]);
+  group_count[level] = 0;
+  if ((int64_t) pending_min[level].size() >= READ_CHUNK_SIZE)
+  {
+    flush(level);
+  }
+  if (level + 1 < nlevels)
+  {
+    push(level + 1, group_min[level], group_max[level]);
+  }
+}
+
+/*
+ * Write the finished rows of `level`
+ */
+void WaveformBuilder::flush(int level)
+{
+  int64_t nrows = pending_min[level].size();
+  if (nrows == 0)
+  {
+    return;
+  }
+  int64_t start_offset = level_offset[level];
+  int64_t end_offset = start_offset + nrows;
+  frowvec buf = frowvec(nrows);
+
+  copy(pending_min[level].begin(), pending_min[level].end(), buf.memptr());
+  backend->write_array(backend->mrn_to_waveform_mrn_name(mrn, "min", level + 1),
+      ch, start_offset, end_offset, buf);
+  copy(pending_max[level].begin(), pending_max[level].end(), buf.memptr());
+  backend->write_array(backend->mrn_to_waveform_mrn_name(mrn, "max", level + 1),
+      ch, start_offset, end_offset, buf);
+
+  pending_min[level].clear();
+  pending_max[level].clear();
+  level_offset[level] = end_offset;
+}
+
+/*
+ * Write the remaining rows of every level, including the last partial
+ * groups.
+ */
+void WaveformBuilder::finish()
+{
+  for (int level = 0; level < nlevels; level++)
+  {
+    if (group_count[level] > 0)
+    {
+      emit(level);
+    }
+    flush(level);
+  }
+}
+
+/*
+ * Create the min and max arrays of each pyramid level for raw data with
+ * `nrows` samples of `NCHANNELS` channels
+ */
+void create_waveform_arrays(StorageBackend* backend, string mrn, int fs, int64_t nrows)
+{
+  int nlevels = get_waveform_nlevels(nrows);
+  for (int level = 1; level <= nlevels; level++)
+  {
+    int64_t nrows_level = level_nrows(nrows, level);
+    ArrayMetadata metadata = ArrayMetadata(fs, nrows_level, nrows_level, NCHANNELS);
+    backend->create_array(backend->mrn_to_waveform_mrn_name(mrn, "min", level), &metadata);
+    backend->create_array(backend->mrn_to_waveform_mrn_name(mrn, "max", level), &metadata);
+  }
+  cout << "Created " << nlevels << " waveform levels" << endl;
+}
+
+void close_waveform_arrays(StorageBackend* backend, string mrn, int64_t nrows)
+{
+  int nlevels = get_waveform_nlevels(nrows);
+  for (int level = 1; level <= nlevels; level++)
+  {
+    backend->close_array(backend->mrn_to_waveform_mrn_name(mrn, "min", level));
+    backend->close_array(backend->mrn_to_waveform_mrn_name(mrn, "max", level));
+  }
+}
+
+/*
+ * Fill `envelope_mat` (2 * NCHANNELS x npoints) with the min (first
+ * `NCHANNELS` rows) and max (last `NCHANNELS` rows) of every channel in
+ * `CHANNEL_ARRAY` for at most `width` equal buckets of the samples
+ * [`start_offset`, `end_offset`). The coarsest pyramid level with at least
+ * `width` rows in the range is read, so the cost is proportional to `width`
+ * rather than the length of the range. Raw samples are only read when the
+ * range has fewer than `WAVEFORM_FACTOR * width` samples or the recording
+ * has no pyramid. Returns the level used, 0 for the raw samples.
+ */
+int read_waveform(StorageBackend* backend, string mrn, int64_t start_offset,
+    int64_t end_offset, int width, fmat& envelope_mat)
+{
+  int64_t nsamples = end_offset - start_offset;
+  width = max(width, 1);
+  if (nsamples <= 0 || !backend->array_exists(mrn))
+  {
+    envelope_mat.zeros(2 * NCHANNELS, 0);
+    return 0;
+  }
+
+  int level = 0;
+  while (nsamples / level_factor(level) > WAVEFORM_FACTOR * width)
+  {
+    level++;
+  }
+  while (level > 0 && !backend->array_exists(backend->mrn_to_waveform_mrn_name(mrn, "min", level)))
+  {
+    level--;
+  }
+
+  fmat min_mat, max_mat;
+  if (level == 0)
+  {
+    // the raw samples are reduced to `width` buckets a window at a time, so
+    // a recording without a pyramid doesn't hold the whole range in memory
+    int64_t npoints = min((int64_t) width, nsamples);
+    min_mat.set_size(NCHANNELS, npoints);
+    max_mat.set_size(NCHANNELS, npoints);
+    min_mat.fill(INFINITY);
+    max_mat.fill(-INFINITY);
+    backend->open_array(mrn);
+    for (int64_t window_start = start_offset; window_start < end_offset; window_start += READ_CHUNK_SIZE)
+    {
+      int64_t window_end = min(window_start + READ_CHUNK_SIZE, end_offset);
+      frowvec buf = frowvec(window_end - window_start);
+      for (int i = 0; i < NCHANNELS; i++)
+      {
+        backend->read_array(mrn, CHANNEL_ARRAY[i], window_start, window_end, buf);
+        for (uword k = 0; k < buf.n_elem; k++)
+        {
+          int64_t col = (window_start - start_offset + k) * npoints / nsamples;
+          min_mat(i, col) = min(min_mat(i, col), buf(k));
+          max_mat(i, col) = max(max_mat(i, col), buf(k));
+        }
+      }
+    }
+    backend->close_array(mrn);
+  }
+  else
+  {
+    string min_mrn_name = backend->mrn_to_waveform_mrn_name(mrn, "min", level);
+    string max_mrn_name = backend->mrn_to_waveform_mrn_name(mrn, "max", level);
+    backend->open_array(min_mrn_name);
+    backend->open_array(max_mrn_name);
+    int64_t factor = level_factor(level);
+    int64_t start_row = start_offset / factor;
+    int64_t end_row = min((end_offset + factor - 1) / factor, backend->get_nrows(min_mrn_name));
+    min_mat.set_size(NCHANNELS, end_row - start_row);
+    max_mat.set_size(NCHANNELS, end_row - start_row);
+    backend->read_array(min_mrn_name, start_row, end_row, min_mat);
+    backend->read_array(max_mrn_name, start_row, end_row, max_mat);
+    backend->close_array(min_mrn_name);
+    backend->close_array(max_mrn_name);
+  }
+
+  // reduce the rows that were read to at most `width` buckets
+  uword nrows = min_mat.n_cols;
+  uword npoints = min((uword) width, nrows);
+  envelope_mat.set_size(2 * NCHANNELS, npoints);
+  for (uword col = 0; col < npoints; col++)
+  {
+    uword first = nrows * col / npoints;
+    uword last = nrows * (col + 1) / npoints;
+    float* envelope_col = envelope_mat.colptr(col);
+    for (int i = 0; i < NCHANNELS; i++)
+    {
+      float min_val = min_mat(i, first);
+      float max_val = max_mat(i, first);
+      for (uword row = first + 1; row < last; row++)
+      {
+        min_val = min(min_val, min_mat(i, row));
+        max_val = max(max_val, max_mat(i, row));
+      }
+      envelope_col[i] = min_val;
+      envelope_col[NCHANNELS + i] = max_val;
+    }
+  }
+  return level;
+}
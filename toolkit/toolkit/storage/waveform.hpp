@@ -0,0 +1,51 @@
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <armadillo>
+#include <string>
+#include <vector>
+
+#include "backends.hpp"
+#include "../config.hpp"
+
+using namespace arma;
+using namespace std;
+
+/*
+ * Builds the min/max envelope pyramid of one channel while the raw data is
+ * written. Level `l` (starting at 1) holds the min and max of every
+ * WAVEFORM_FACTOR^l samples, each level computed from the previous one as
+ * its rows are completed. Finished rows are written in chunks so memory does
+ * not depend on the length of the recording.
+ */
+class WaveformBuilder
+{
+  private:
+    StorageBackend* backend;
+    string mrn;
+    int ch;
+    int nlevels;
+    vector<float> group_min; // min of the partial group of each level
+    vector<float> group_max; // max of the partial group of each level
+    vector<int> group_count; // values in the partial group of each level
+    vector<vector<float>> pending_min; // finished rows of each level not yet written
+    vector<vector<float>> pending_max;
+    vector<int64_t> level_offset; // rows of each level written so far
+
+    void push(int level, float min_val, float max_val);
+    void emit(int level);
+    void flush(int level);
+
+  public:
+    WaveformBuilder(StorageBackend* backend, string mrn, int ch, int nlevels);
+    void push(frowvec& buf);
+    void finish();
+};
+
+int get_waveform_nlevels(int64_t nrows);
+void create_waveform_arrays(StorageBackend* backend, string mrn, int fs, int64_t nrows);
+void close_waveform_arrays(StorageBackend* backend, string mrn, int64_t nrows);
+int read_waveform(StorageBackend* backend, string mrn, int64_t start_offset,
+    int64_t end_offset, int width, fmat& envelope_mat);
+
+#endif // WAVEFORM_H
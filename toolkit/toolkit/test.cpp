@@ -1,17 +1,37 @@
 #include <string>
+#include <map>
+#include <math.h>
 #include <armadillo>
+#include <boost/asio/error.hpp>
 
 #include "helpers.hpp"
 #include "storage/backends.hpp"
+#include "storage/chunk_codec.hpp"
 #include "compute/eeg_spectrogram.hpp"
 #include "compute/eeg_change_point.hpp"
+#include "compute/downsample.hpp"
 #include "visgoth/visgoth.hpp"
+#include "server/send_queue.hpp"
 
 using namespace std;
 using namespace arma;
 
 #define NSAMPLES 10
 
+static int nfailures = 0;
+
+/*
+ * Print and count a failed check
+ */
+void check(bool ok, string msg)
+{
+  if (!ok)
+  {
+    cout << "FAIL: " << msg << endl;
+    nfailures++;
+  }
+}
+
 void example_spectrogram(fmat& spec_mat, SpecParams* spec_params)
 {
   spec_params->print();
@@ -34,11 +54,13 @@ void example_spectrogram(fmat& spec_mat, SpecParams* spec_params)
   {
     {"extent", 1},
   };
-  uint extent = visgoth.get_extent(1);
+  extent_request_t request = {spec_params->nblocks, spec_params->nfreqs, 1, 0};
+  vector<double> features;
+  uint extent = visgoth.get_extent(json, &request, &features);
   downsample(spec_mat, extent);
 
-  printf("Spectrogram shape as_mat: (%d, %d)\n",
-         spec_params->nblocks, spec_params->nfreqs);
+  printf("Spectrogram shape as_mat: (%lld, %d)\n",
+         (long long) spec_params->nblocks, spec_params->nfreqs);
   printf("Sample data: [\n[ ");
   for (int i = 0; i < NSAMPLES; i++)
   {
@@ -76,13 +98,195 @@ void storage_example(string mrn)
   cout << endl;
 }
 
+/*
+ * Streaming the change point detection over chunks of the spectrogram finds
+ * the same change points as `get_change_points` over the whole spectrogram
+ */
+void test_streaming_change_points()
+{
+  int nblocks = 3000;
+  fmat spec_mat = fmat(4, nblocks);
+  for (int j = 0; j < nblocks; j++)
+  {
+    float level = j < 1000 ? 250 : (j < 2000 ? 900 : 100);
+    for (int i = 0; i < 4; i++)
+    {
+      spec_mat(i, j) = level + 50 * sin(j * 0.7 + i);
+    }
+  }
+
+  cp_data_t cp_data;
+  get_change_points(spec_mat, &cp_data);
+
+  cp_state_t cp_state;
+  init_cp_state_t(&cp_state);
+  vector<int64_t> cp_blocks;
+  for (int start = 0; start < nblocks; start += 137)
+  {
+    fmat chunk = spec_mat.cols(start, min(start + 137, nblocks) - 1);
+    update_change_points(chunk, &cp_state, cp_blocks);
+  }
+
+  check(cp_data.total_count > 0, "change points: none found");
+  check((int) cp_blocks.size() == cp_data.total_count, "change points: streamed count " +
+      to_string(cp_blocks.size()) + " != " + to_string(cp_data.total_count));
+  for (int i = 0; i < min((int) cp_blocks.size(), cp_data.total_count); i++)
+  {
+    check(cp_blocks[i] == (int64_t) cp_data.cp[i], "change points: block " + to_string(i));
+  }
+}
+
+/*
+ * Encoding and decoding a chunk gives back the values, exactly for the
+ * lossless codecs and within one quantization step in log space for
+ * CODEC_LOGQ16_ZLIB
+ */
+void test_chunk_codec()
+{
+  int64_t nrows = 37;
+  int32_t ncols = 13;
+  vector<float> values(nrows * ncols);
+  for (size_t i = 0; i < values.size(); i++)
+  {
+    values[i] = i % 7 == 0 ? 0 : powf(10, (i % 11) - 3.0) * (1 + 0.3 * sinf(i));
+  }
+
+  for (int codec : {CODEC_NONE, CODEC_SHUFFLE_ZLIB, CODEC_LOGQ16_ZLIB})
+  {
+    string name = "chunk codec " + to_string(codec) + ": ";
+    chunk_header_t header;
+    vector<char> payload;
+    encode_chunk(codec, values.data(), nrows, ncols, &header, payload);
+    check(header.nrows == nrows && header.ncols == ncols && header.codec == codec,
+        name + "header");
+    check(header.nbytes == payload.size(), name + "nbytes");
+
+    vector<float> decoded;
+    decode_chunk(&header, payload, decoded);
+    check(decoded.size() == values.size(), name + "size " + to_string(decoded.size()));
+    if (decoded.size() != values.size())
+    {
+      continue;
+    }
+    float step = (header.qmax - header.qmin) / 65535;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+      bool ok = codec == CODEC_LOGQ16_ZLIB ?
+        fabsf(log1pf(decoded[i]) - log1pf(values[i])) <= step :
+        decoded[i] == values[i];
+      check(ok, name + "value " + to_string(i));
+    }
+  }
+}
+
+/*
+ * Frame of `nbytes` with `key` that records the error it is completed with
+ * in `results`
+ */
+send_frame_t make_test_frame(string key, size_t nbytes, string name,
+    map<string, boost::system::error_code>* results)
+{
+  send_frame_t frame;
+  frame.key = key;
+  frame.nbytes = nbytes;
+  frame.data = nullptr;
+  frame.data_size = 0;
+  frame.callback = [name, results](const boost::system::error_code& ec)
+  {
+    (*results)[name] = ec;
+  };
+  return frame;
+}
+
+/*
+ * Unsent frames of a `SendQueue` are replaced by newer frames with the same
+ * key, the oldest keyed ones are dropped past the budget, the rest are
+ * written in order and the unsent ones are completed when it is closed
+ */
+void test_send_queue()
+{
+  map<string, boost::system::error_code> results;
+  vector<string> sent;
+  auto queue = make_shared<SendQueue>(100, [&sent](shared_ptr<SendQueue> queue, send_frame_t& frame)
+  {
+    sent.push_back(frame.key);
+  });
+
+  queue->push(make_test_frame("a", 40, "first", &results));
+  check(sent.size() == 1 && sent[0] == "a", "send queue: the first frame is written right away");
+  queue->push(make_test_frame("b", 40, "old b", &results));
+  queue->push(make_test_frame("b", 40, "new b", &results));
+  check(results["old b"] == boost::asio::error::operation_aborted, "send queue: replaced frame");
+  check(!results.count("new b"), "send queue: the newest frame is kept");
+
+  queue->push(make_test_frame("", 40, "stats", &results));
+  queue->push(make_test_frame("c", 40, "c", &results));
+  check(results["new b"] == boost::asio::error::no_buffer_space, "send queue: oldest keyed frame dropped");
+  check(!results.count("stats"), "send queue: frames without a key are not dropped");
+
+  queue->finish(boost::system::error_code());
+  check(results.count("first") && !results["first"], "send queue: written frame completed");
+  check(sent.size() == 2 && sent[1] == "", "send queue: the next frame is written in order");
+
+  queue->close();
+  check(results["c"] == boost::asio::error::not_connected, "send queue: unsent frame completed on close");
+  queue->push(make_test_frame("d", 40, "late", &results));
+  check(results["late"] == boost::asio::error::not_connected, "send queue: frame pushed after close");
+  queue->finish(boost::asio::error::operation_aborted);
+  check(results["stats"] == boost::asio::error::not_connected, "send queue: aborted write on close");
+  check(sent.size() == 2, "send queue: nothing written after close");
+
+  // a sender that completes frames before returning, as on a dead
+  // connection, drains a long queue without recursing
+  bool dead = false;
+  size_t ndead = 0;
+  auto dead_queue = make_shared<SendQueue>(SIZE_MAX, [&dead](shared_ptr<SendQueue> queue, send_frame_t& frame)
+  {
+    if (dead)
+    {
+      queue->finish(boost::asio::error::not_connected);
+    }
+  });
+  for (int i = 0; i < 200000; i++)
+  {
+    send_frame_t frame;
+    frame.nbytes = 1;
+    frame.data = nullptr;
+    frame.data_size = 0;
+    frame.callback = [&ndead](const boost::system::error_code& ec)
+    {
+      ndead += ec == boost::asio::error::not_connected;
+    };
+    dead_queue->push(frame);
+  }
+  dead = true;
+  dead_queue->finish(boost::asio::error::not_connected);
+  check(ndead == 200000, "send queue: synchronous failures drain the queue");
+}
+
+/*
+ * Checks that need no recordings, returns the number of failures
+ */
+int run_checks()
+{
+  test_streaming_change_points();
+  test_chunk_codec();
+  test_send_queue();
+  cout << (nfailures ? "FAILED " : "OK ") << nfailures << " failures" << endl;
+  return nfailures;
+}
+
 /*
  * Command line program to test basic functionality when computing a
  * spectrogram or using different storage backends.
  */
 int main(int argc, char* argv[])
 {
-  if (argc <= 4)
+  if (argc == 2 && string(argv[1]) == "check")
+  {
+    return run_checks() ? 1 : 0;
+  }
+  else if (argc <= 4)
   {
     float start_time, end_time;
     string mrn;
@@ -113,7 +317,7 @@ int main(int argc, char* argv[])
   }
   else
   {
-    cout << "\nusage: ./main <mrn> <start_time> <end_time>\n" << endl;
+    cout << "\nusage: ./main <mrn> <start_time> <end_time>\n       ./main check\n" << endl;
   }
   return 1;
 }
@@ -0,0 +1,228 @@
+#include "extent_model.hpp"
+
+#include <iostream>
+#include <algorithm>
+
+#include "HappyHTTP/happyhttp.h"
+#include "../helpers.hpp"
+
+using namespace std;
+using namespace json11;
+
+#define DEFAULT_BANDWIDTH 1000 // bytes per ms when the client didn't measure it
+#define FORGETTING 0.995 // weight of the previous requests at each update
+#define PRIOR_VARIANCE 1e8 // uncertainty of the initial weights
+
+// initial weights: 50 ms per request, 100 ms per million spectrogram values,
+// the transfer time and nothing for the values in memory
+static const double PRIOR_WEIGHTS[EXTENT_NFEATURES] = {50000, 100000, 0, 1000, 0};
+
+ExtentModel::ExtentModel()
+{
+  for (int i = 0; i < EXTENT_NFEATURES; i++)
+  {
+    weights[i] = PRIOR_WEIGHTS[i];
+    for (int j = 0; j < EXTENT_NFEATURES; j++)
+    {
+      covariance[i][j] = i == j ? PRIOR_VARIANCE : 0;
+    }
+  }
+  nobservations = 0;
+  params = {"", false, EXTENT_TARGET_LATENCY * 1000.0, EXTENT_MAX};
+  running = true;
+  worker = thread(&ExtentModel::run, this);
+}
+
+ExtentModel::~ExtentModel()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    running = false;
+  }
+  cv.notify_all();
+  worker.join();
+}
+
+/*
+ * Fill `features` with the features of `request` downsampled by `extent`:
+ * a constant, millions of spectrogram values computed or read, those scaled
+ * by the load per cpu of the server, the time in ms to send the result at
+ * the bandwidth measured by the client and millions of values answered by
+ * the tile cache, none until the request is served
+ */
+void ExtentModel::get_features(extent_request_t* request, uint extent, Json client_profile,
+    Json server_profile, vector<double>* features)
+{
+  double values = (double) request->nblocks * request->nbins * request->nchannels / 1e6;
+  double load = server_profile["load-shortterm"].number_value() /
+    max(thread::hardware_concurrency(), 1u);
+  uint total_extent = get_total_extent(request->nblocks, extent, request->max_width);
+  double bytes = (double) sizeof(float) * request->nbins * request->nchannels *
+    (request->nblocks / total_extent);
+  double bandwidth = client_profile["bandwidth"].number_value(); // bytes per ms
+  if (bandwidth <= 0)
+  {
+    bandwidth = DEFAULT_BANDWIDTH;
+  }
+  *features = {1, values, values * load, bytes / bandwidth, 0};
+}
+
+/*
+ * Predicted latency in microseconds, must be called with `lock` held
+ */
+double ExtentModel::predict(vector<double>& features)
+{
+  double latency = 0;
+  for (int i = 0; i < EXTENT_NFEATURES; i++)
+  {
+    latency += weights[i] * features[i];
+  }
+  return max(latency, 0.0);
+}
+
+/*
+ * Smallest extent of `request` predicted to meet the target latency, or the
+ * largest allowed extent. `features` is set to the features of the extent,
+ * to `observe` the latency of the request later.
+ */
+uint ExtentModel::get_extent(extent_request_t* request, Json client_profile, Json server_profile,
+    vector<double>* features)
+{
+  lock_guard<mutex> guard(lock);
+  if (params.experiment)
+  {
+    uint extent = max(client_profile["extent"].int_value(), 1);
+    get_features(request, extent, client_profile, server_profile, features);
+    return extent;
+  }
+
+  uint extent = 1;
+  for (; extent < params.max_extent; extent++)
+  {
+    get_features(request, extent, client_profile, server_profile, features);
+    if (predict(*features) <= params.target_latency)
+    {
+      return extent;
+    }
+  }
+  get_features(request, extent, client_profile, server_profile, features);
+  return extent;
+}
+
+/*
+ * Update the weights with the `latency` in microseconds of a request with
+ * `features`, `cached_fraction` of its values answered by the tile cache
+ */
+void ExtentModel::observe(vector<double> features, double cached_fraction, double latency)
+{
+  // the values in memory are moved from the compute features to their own
+  features[4] = features[1] * cached_fraction;
+  features[1] *= 1 - cached_fraction;
+  features[2] *= 1 - cached_fraction;
+
+  lock_guard<mutex> guard(lock);
+  double cov_features[EXTENT_NFEATURES];
+  double denom = FORGETTING;
+  for (int i = 0; i < EXTENT_NFEATURES; i++)
+  {
+    cov_features[i] = 0;
+    for (int j = 0; j < EXTENT_NFEATURES; j++)
+    {
+      cov_features[i] += covariance[i][j] * features[j];
+    }
+    denom += features[i] * cov_features[i];
+  }
+
+  double error = latency - predict(features);
+  for (int i = 0; i < EXTENT_NFEATURES; i++)
+  {
+    weights[i] += cov_features[i] / denom * error;
+  }
+  for (int i = 0; i < EXTENT_NFEATURES; i++)
+  {
+    for (int j = 0; j < EXTENT_NFEATURES; j++)
+    {
+      covariance[i][j] = (covariance[i][j] - cov_features[i] * cov_features[j] / denom) / FORGETTING;
+    }
+  }
+  nobservations++;
+}
+
+static void on_begin(const happyhttp::Response* r, void* userdata)
+{
+}
+
+static void on_data(const happyhttp::Response* r, void* userdata, const unsigned char* data, int n)
+{
+  ((string*) userdata)->append((const char*) data, n);
+}
+
+static void on_complete(const happyhttp::Response* r, void* userdata)
+{
+}
+
+/*
+ * Ask the webapp for the model parameters, it only sends them when they
+ * changed since the version we have
+ */
+void ExtentModel::fetch_params()
+{
+  string version;
+  {
+    lock_guard<mutex> guard(lock);
+    version = params.version;
+  }
+
+  const char* headers[] =
+  {
+    "Connection", "close",
+    "Accept", "application/json",
+    0
+  };
+  string response;
+  string path = "/visgoth/model?version=" + version;
+  try
+  {
+    happyhttp::Connection conn(VISGOTH_IP, VISGOTH_PORT);
+    conn.setcallbacks(on_begin, on_data, on_complete, (void*) &response);
+    conn.request("GET", path.c_str(), headers, nullptr, 0);
+    while (conn.outstanding())
+    {
+      conn.pump();
+    }
+  }
+  catch (happyhttp::Wobbly& e)
+  {
+    return; // keep the current parameters until the webapp is up
+  }
+
+  string err;
+  Json json = Json::parse(response, err);
+  if (!err.empty() || !json["changed"].bool_value())
+  {
+    return;
+  }
+  lock_guard<mutex> guard(lock);
+  params.version = json["version"].string_value();
+  params.experiment = json["experiment"].bool_value();
+  params.target_latency = json["targetLatency"].number_value() * 1000;
+  params.max_extent = max(json["maxExtent"].int_value(), 1);
+  cout << "Visgoth model parameters version " << params.version << ": target latency " <<
+    params.target_latency << " us, max extent " << params.max_extent <<
+    (params.experiment ? ", experiment" : "") << " after " << nobservations << " requests" << endl;
+}
+
+void ExtentModel::run()
+{
+  unique_lock<mutex> guard(lock);
+  while (running)
+  {
+    guard.unlock();
+    fetch_params();
+    guard.lock();
+    cv.wait_for(guard, chrono::milliseconds(EXTENT_PARAMS_INTERVAL_MS), [this]()
+    {
+      return !running;
+    });
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef EXTENT_MODEL_H
+#define EXTENT_MODEL_H
+
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdint.h>
+#include "../json11/json11.hpp"
+#include "../config.hpp"
+
+using namespace std;
+using namespace json11;
+
+#define EXTENT_NFEATURES 5
+
+/*
+ * Cost of a spectrogram request before downsampling
+ */
+typedef struct extent_request
+{
+  int64_t nblocks; // blocks of the requested range
+  int nbins; // frequency bins of each block
+  int nchannels; // regions requested
+  int max_width; // pixels available for the blocks
+} extent_request_t;
+
+/*
+ * Parameters of the model set by the webapp
+ */
+typedef struct extent_params
+{
+  string version; // "" until the webapp answered
+  bool experiment; // use the extent requested by the client
+  double target_latency; // microseconds
+  uint max_extent;
+} extent_params_t;
+
+/*
+ * Online linear model of the latency of a request in microseconds, from its
+ * compute cost, the load of the server and the time to transfer the result
+ * to the client. The weights are fitted by recursive least squares to every
+ * finished request, forgetting old requests so the model follows changes of
+ * load. Values answered by the tile cache have their own feature, so cache
+ * hits don't make computing look cheap. The extent chosen is the smallest
+ * one predicted to meet the target latency without cache hits. A background
+ * thread asks the webapp for new parameters.
+ */
+class ExtentModel
+{
+  private:
+    mutex lock;
+    condition_variable cv;
+    bool running;
+    thread worker;
+    double weights[EXTENT_NFEATURES];
+    double covariance[EXTENT_NFEATURES][EXTENT_NFEATURES];
+    uint64_t nobservations;
+    extent_params_t params;
+
+    double predict(vector<double>& features);
+    void fetch_params();
+    void run();
+
+  public:
+    ExtentModel();
+    ~ExtentModel();
+    void get_features(extent_request_t* request, uint extent, Json client_profile,
+        Json server_profile, vector<double>* features);
+    uint get_extent(extent_request_t* request, Json client_profile, Json server_profile,
+        vector<double>* features);
+    void observe(vector<double> features, double cached_fraction, double latency);
+};
+
+#endif // EXTENT_MODEL_H
@@ -0,0 +1,169 @@
+#include "server_profile.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../helpers.hpp"
+
+using namespace std;
+using namespace json11;
+
+#define SECTOR_SIZE 512 // bytes of the sectors counted by /proc/diskstats
+
+/*
+ * Read the cumulative counters of the host into `counters`
+ */
+static void read_host_counters(host_counters_t* counters)
+{
+  *counters = {};
+  counters->ticks = get_monotonic_ticks();
+
+  // cpu  user nice system idle ...
+  ifstream proc_stat("/proc/stat");
+  string name;
+  proc_stat >> name >> counters->cpu_user;
+
+  // face |bytes packets errs drop fifo frame compressed multicast|bytes ...
+  ifstream net_dev("/proc/net/dev");
+  string line;
+  while (getline(net_dev, line))
+  {
+    size_t colon = line.find(':');
+    if (colon == string::npos)
+    {
+      continue; // header lines
+    }
+    istringstream fields(line.substr(colon + 1));
+    name = line.substr(0, colon);
+    name.erase(0, name.find_first_not_of(' '));
+    uint64_t rx, tx, skip;
+    fields >> rx;
+    for (int i = 0; i < 7; i++)
+    {
+      fields >> skip;
+    }
+    fields >> tx;
+    if (fields && name != "lo")
+    {
+      counters->network_rx += rx;
+      counters->network_tx += tx;
+    }
+  }
+
+  // major minor name reads merged sectors_read ms writes merged sectors_written ...
+  // partitions are skipped so their bytes aren't counted twice
+  ifstream diskstats("/proc/diskstats");
+  struct stat st;
+  while (getline(diskstats, line))
+  {
+    istringstream fields(line);
+    uint64_t major, minor, reads, merged, sectors_read, ms, writes, write_merged, sectors_written;
+    fields >> major >> minor >> name >> reads >> merged >> sectors_read >> ms >>
+      writes >> write_merged >> sectors_written;
+    if (fields && stat(("/sys/block/" + name).c_str(), &st) == 0)
+    {
+      counters->disk_read += sectors_read * SECTOR_SIZE;
+      counters->disk_write += sectors_written * SECTOR_SIZE;
+    }
+  }
+}
+
+/*
+ * Free memory in bytes from /proc/meminfo
+ */
+static double read_free_memory()
+{
+  ifstream meminfo("/proc/meminfo");
+  string name;
+  double kb;
+  string unit;
+  while (meminfo >> name >> kb)
+  {
+    getline(meminfo, unit);
+    if (name == "MemFree:")
+    {
+      return kb * 1024;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Rate per second of a counter between two samples, counters that were
+ * reset count as 0
+ */
+static inline double get_rate(uint64_t prev, uint64_t cur, double seconds)
+{
+  return cur >= prev && seconds > 0 ? (cur - prev) / seconds : 0;
+}
+
+ServerProfiler::ServerProfiler()
+{
+  running = true;
+  read_host_counters(&last);
+  sample();
+  worker = thread(&ServerProfiler::run, this);
+}
+
+ServerProfiler::~ServerProfiler()
+{
+  {
+    lock_guard<mutex> guard(lock);
+    running = false;
+  }
+  cv.notify_all();
+  worker.join();
+}
+
+/*
+ * Publish the rates since the last sample and the current gauges
+ */
+void ServerProfiler::sample()
+{
+  host_counters_t counters;
+  read_host_counters(&counters);
+  double seconds = ticks_to_seconds(counters.ticks - last.ticks);
+  double load[3] = {0, 0, 0};
+  ifstream loadavg("/proc/loadavg");
+  loadavg >> load[0] >> load[1] >> load[2];
+
+  // cpu time in jiffies of 1/100 s per second, like collectd's
+  double hz = sysconf(_SC_CLK_TCK);
+  Json::object stats =
+  {
+    {"memory-value", read_free_memory()},
+    {"cpu-value", get_rate(last.cpu_user, counters.cpu_user, seconds) * 100 / hz},
+    {"network-rx", get_rate(last.network_rx, counters.network_rx, seconds)},
+    {"network-tx", get_rate(last.network_tx, counters.network_tx, seconds)},
+    {"disk-read", get_rate(last.disk_read, counters.disk_read, seconds)},
+    {"disk-write", get_rate(last.disk_write, counters.disk_write, seconds)},
+    {"load-shortterm", load[0]},
+    {"load-midterm", load[1]},
+    {"load-longterm", load[2]},
+  };
+  atomic_store(&snapshot, shared_ptr<const Json>(make_shared<Json>(stats)));
+  last = counters;
+}
+
+void ServerProfiler::run()
+{
+  unique_lock<mutex> guard(lock);
+  while (running)
+  {
+    cv.wait_for(guard, chrono::milliseconds(PROFILE_INTERVAL_MS));
+    if (running)
+    {
+      sample();
+    }
+  }
+}
+
+/*
+ * The last published profile, without blocking on the sampler
+ */
+Json ServerProfiler::get_stats()
+{
+  return *atomic_load(&snapshot);
+}
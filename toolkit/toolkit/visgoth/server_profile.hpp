@@ -0,0 +1,55 @@
+#ifndef SERVER_PROFILE_H
+#define SERVER_PROFILE_H
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <condition_variable>
+#include <stdint.h>
+#include "../json11/json11.hpp"
+#include "../config.hpp"
+
+using namespace std;
+using namespace json11;
+
+/*
+ * Cumulative counters of the host read from /proc and /sys
+ */
+typedef struct host_counters
+{
+  unsigned long long ticks; // monotonic ticks of the sample
+  uint64_t cpu_user; // USER_HZ of all cpus in user mode
+  uint64_t network_rx; // bytes received by all interfaces but loopback
+  uint64_t network_tx;
+  uint64_t disk_read; // bytes read from all block devices
+  uint64_t disk_write;
+} host_counters_t;
+
+/*
+ * Profile of the host sent to the webapp and visgoth with every response.
+ * A background thread samples the counters every `PROFILE_INTERVAL_MS` and
+ * publishes a snapshot with the same keys as the collectd plugins used
+ * before: free memory in bytes, user cpu time, network and disk bytes per
+ * second, and load averages.
+ */
+class ServerProfiler
+{
+  private:
+    mutex lock;
+    condition_variable cv;
+    bool running;
+    thread worker;
+    host_counters_t last;
+    shared_ptr<const Json> snapshot; // replaced with atomic_store
+
+    void sample();
+    void run();
+
+  public:
+    ServerProfiler();
+    ~ServerProfiler();
+    Json get_stats();
+};
+
+#endif // SERVER_PROFILE_H
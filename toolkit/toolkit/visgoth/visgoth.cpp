@@ -2,108 +2,52 @@
 
 #include <iostream>
 #include <string>
-#include <unordered_map>
 #include <vector>
-#include "sys/socket.h"
-#include "collectd.hpp"
+#include "server_profile.hpp"
+#include "extent_model.hpp"
 
-#include "HappyHTTP/happyhttp.h"
 #include "../json11/json11.hpp"
 #include "../helpers.hpp"
 
 using namespace std;
 using namespace json11;
 
-static int BUF_SIZE = 1024;
-
 Visgoth::Visgoth() {}
 
-Json Visgoth::get_collectd_stats()
-{
-  unordered_map<string, float> float_values;
-  vector<string> lines = collectd.list();
-  for (auto l_it = lines.begin(); l_it != lines.end(); l_it++)
-  {
-    string list_key = split(*l_it, ' ')[1]; // stamp key
-    for (auto k_it = collectd_keys.begin(); k_it != collectd_keys.end(); k_it++)
-    {
-      string collectd_key = k_it->second;
-      string visgoth_key = k_it->first;
-      if (list_key.find(collectd_key) != string::npos)
-      {
-        vector<string> glines = collectd.get(list_key);
-        for (auto g_it = glines.begin(); g_it != glines.end(); g_it++)
-        {
-          vector<string> vals = split(*g_it, ' '); // v1=x v2=y
-          for (auto v_it = vals.begin(); v_it != vals.end(); v_it++)
-          {
-            vector<string> value_vec = split(*v_it, '='); // v1=x
-            string value = value_vec[0];
-            float float_val = stof(value_vec[1]);
-            float_values[visgoth_key + "-" + value] += float_val;
-          }
-        }
-      }
-    }
-  }
-  return Json(float_values);
-}
-
-void OnBegin(const happyhttp::Response* r, void* userdata)
+/*
+ * Profile of the host, sampled in the background by a profiler shared by
+ * every `Visgoth`
+ */
+Json Visgoth::get_server_stats()
 {
+  static ServerProfiler profiler;
+  return profiler.get_stats();
 }
 
-void OnData(const happyhttp::Response* r, void* userdata, const unsigned char* data, int n)
+/*
+ * Model of the request latency shared by every `Visgoth`
+ */
+static ExtentModel* get_extent_model()
 {
-  n = min(n, BUF_SIZE);
-  strncpy((char*) userdata, reinterpret_cast<const char*>(data), n);
-  ((char *) userdata)[n] = '\0';
+  static ExtentModel model;
+  return &model;
 }
 
-void OnComplete(const happyhttp::Response* r, void* userdata)
+/*
+ * Downsampling factor of `request` for the client with `profile_data`,
+ * predicted in process to meet the target latency. `features` is set to pass
+ * to `observe_latency` once the request is served.
+ */
+uint Visgoth::get_extent(Json profile_data, extent_request_t* request, vector<double>* features)
 {
+  return get_extent_model()->get_extent(request, profile_data, get_server_stats(), features);
 }
 
-uint Visgoth::get_extent(Json profile_data)
+/*
+ * Learn from the `latency` in microseconds of a request served with the
+ * extent chosen for `features`, `cached_fraction` of it from the tile cache
+ */
+void Visgoth::observe_latency(vector<double>& features, double cached_fraction, double latency)
 {
-  Json collectd_data = get_collectd_stats();
-  Json request_data = Json::object {
-    {"client_profile", profile_data},
-    {"server_profile", collectd_data},
-  };
-
-  string request = Json(request_data).dump();
-  const char* body = request.c_str();
-  int body_size = request.size();
-
-  const char* headers[] =
-  {
-    "Connection", "close",
-    "Content-type", "application/json",
-    "Accept", "application/json",
-    0
-  };
-
-  char* response = (char*) malloc(sizeof(char) * 1024);
-
-  happyhttp::Connection conn(VISGOTH_IP, 5000);
-  conn.setcallbacks(OnBegin, OnData, OnComplete, (void*) response);
-  conn.request("POST",
-      "/visgoth/get_extent",
-      headers,
-      (const unsigned char*)body,
-      body_size);
-
-  while(conn.outstanding())
-    conn.pump();
-
-  string err;
-  Json json_response = Json::parse(response, err);
-  uint extent = json_response["extent"].int_value();
-  if (extent == 0) {
-    cout << "WARNING: No extent provided from Visgoth" << endl;
-  }
-  free(response);
-
-  return extent;
+  get_extent_model()->observe(features, cached_fraction, latency);
 }
@@ -3,8 +3,8 @@
 
 #include <string>
 #include <vector>
-#include <unordered_map>
-#include "collectd.hpp"
+#include "server_profile.hpp"
+#include "extent_model.hpp"
 #include "../json11/json11.hpp"
 
 using namespace std;
@@ -12,20 +12,11 @@ using namespace json11;
 
 class Visgoth
 {
-  private:
-    Collectd collectd = Collectd();
-    unordered_map<string, string> collectd_keys {
-        {"memory", "memory-free"},
-        {"cpu", "cpu-user"},
-        {"network", "if_octets"},
-        {"disk", "disk_octets"},
-    };
-
   public:
     Visgoth();
-    uint get_extent(Json profile_data);
-    Json get_collectd_stats();
+    uint get_extent(Json profile_data, extent_request_t* request, vector<double>* features);
+    void observe_latency(vector<double>& features, double cached_fraction, double latency);
+    Json get_server_stats();
 };
 
 #endif // VISGOTH_H
-
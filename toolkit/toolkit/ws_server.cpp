@@ -1,6 +1,8 @@
 #include <armadillo>
 #include <thread>
 #include <algorithm>
+#include <signal.h>
+#include <pthread.h>
 
 #include "wslib/server_ws.hpp"
 #include "config.hpp"
@@ -8,8 +10,19 @@
 #include "json11/json11.hpp"
 #include "compute/eeg_spectrogram.hpp"
 #include "compute/eeg_change_point.hpp"
+#include "compute/downsample.hpp"
+#include "compute/band_power.hpp"
+#include "compute/sparse_cache.hpp"
+#include "compute/request_trace.hpp"
+#include "compute/event_trace.hpp"
 #include "storage/backends.hpp"
+#include "storage/waveform.hpp"
 #include "visgoth/visgoth.hpp"
+#include "server/tile_cache.hpp"
+#include "server/prefetch.hpp"
+#include "server/job_queue.hpp"
+#include "server/metrics.hpp"
+#include "server/send_queue.hpp"
 
 using namespace arma;
 using namespace std;
@@ -19,20 +32,289 @@ using namespace json11;
 
 typedef SimpleWeb::SocketServer<SimpleWeb::WS> WsServer;
 
+TileCache tile_cache(TILE_CACHE_SIZE); // spectrograms shared by all connections
+Prefetcher prefetcher(&tile_cache);
+
+/*
+ * Send queue of a connection. Connections are keyed by address, which a
+ * later connection can reuse, so the entry keeps the connection it was made
+ * for.
+ */
+typedef struct send_queue_entry
+{
+  weak_ptr<WsServer::Connection> connection;
+  shared_ptr<SendQueue> queue;
+} send_queue_entry_t;
+
+mutex send_queues_lock;
+unordered_map<size_t, send_queue_entry_t> send_queues; // by connection
+
+// trace of the request served by the current thread, kept alive by the
+// responses until they are sent
+static thread_local shared_ptr<request_trace_t> current_trace;
+
+/*
+ * Spans of `trace` so far in seconds
+ */
+Json get_trace_json(request_trace_t* trace)
+{
+  Json::object spans;
+  for (int i = 0; i < NUM_STAGES; i++)
+  {
+    spans[STAGE_NAMES[i]] = ticks_to_seconds(trace->spans[i]);
+  }
+  spans["total"] = ticks_to_seconds(get_monotonic_ticks() - trace->start);
+  spans["bytesRead"] = (double) trace->bytes_read;
+  return spans;
+}
+
+/*
+ * Record the trace of a request once its last response is sent
+ */
+void finish_request_trace(request_trace_t* trace)
+{
+  int type = get_request_type(trace->type);
+  unsigned long long latency = get_monotonic_ticks() - trace->start;
+  metrics_add(COUNTER_REQUESTS, type, 1);
+  metrics_add(COUNTER_BYTES_READ, type, trace->bytes_read);
+  metrics_observe_latency(type, latency);
+  if (!trace->cost_features.empty())
+  {
+    Visgoth visgoth = Visgoth();
+    visgoth.observe_latency(trace->cost_features, trace->cached_fraction, latency);
+  }
+  for (int i = 0; i < NUM_STAGES; i++)
+  {
+    metrics_observe_stage(type, i, trace->spans[i]);
+  }
+  delete trace;
+}
+
+/*
+ * Metrics of ws_server in the Prometheus text format, served at
+ * `METRICS_PORT`
+ */
+string get_server_metrics_text()
+{
+  string text = get_metrics_text();
+  tile_cache_stats_t stats = tile_cache.get_stats();
+  sparse_cache_stats_t sparse_stats = get_sparse_cache_stats();
+  append_metric(&text, "ws_tile_cache_hits_total", "Spectrogram lookups found in the tile cache.",
+      "counter", stats.hits);
+  append_metric(&text, "ws_tile_cache_misses_total", "Spectrogram lookups computed.",
+      "counter", stats.misses);
+  append_metric(&text, "ws_tile_cache_coalesced_total", "Misses that waited for another request.",
+      "counter", stats.coalesced);
+  append_metric(&text, "ws_tile_cache_prefetched_total", "Tiles added by the prefetcher.",
+      "counter", stats.prefetched);
+  append_metric(&text, "ws_tile_cache_prefetch_hits_total", "Prefetched tiles later requested.",
+      "counter", stats.prefetch_hits);
+  append_metric(&text, "ws_tile_cache_tiles", "Tiles in the cache.", "gauge", stats.ntiles);
+  append_metric(&text, "ws_tile_cache_bytes", "Bytes of the cached tiles.", "gauge", stats.nbytes);
+  append_metric(&text, "ws_sparse_cache_read_blocks_total", "Spectrogram blocks read from sparse arrays.",
+      "counter", sparse_stats.read_blocks);
+  append_metric(&text, "ws_sparse_cache_computed_blocks_total", "Spectrogram blocks written to sparse arrays.",
+      "counter", sparse_stats.computed_blocks);
+  append_metric(&text, "ws_sparse_cache_coalesced_blocks_total", "Blocks that waited for another request.",
+      "counter", sparse_stats.coalesced_blocks);
+  append_metric(&text, "ws_prefetch_jobs", "Prefetch jobs waiting for the worker.",
+      "gauge", prefetcher.get_njobs());
+  return text;
+}
+
+/*
+ * Message of `frame`: the length of the header, the header padded to 8 bytes
+ * and the payload. The stream is sized once so the payload is copied once,
+ * and the payload is released as soon as it is copied.
+ */
+shared_ptr<WsServer::SendStream> get_send_stream(send_frame_t* frame)
+{
+  auto send_stream = make_shared<WsServer::SendStream>();
+  static_cast<boost::asio::streambuf*>(send_stream->rdbuf())->prepare(frame->nbytes);
+  uint32_t header_len = frame->header.size();
+  send_stream->write((char*) &header_len, sizeof(uint32_t));
+  send_stream->write(frame->header.c_str(), header_len);
+  if (frame->data != nullptr)
+  {
+    send_stream->write((const char*) frame->data, frame->data_size);
+  }
+  frame->header = string();
+  frame->payload.reset();
+  frame->data = nullptr;
+  return send_stream;
+}
+
+/*
+ * Send queue of `connection`, writing the frames with `server`. Queues of
+ * connections that are gone, or of an earlier connection at the same
+ * address, are removed and closed so their frames are completed.
+ */
+shared_ptr<SendQueue> get_send_queue(WsServer* server, shared_ptr<WsServer::Connection> connection)
+{
+  size_t key = (size_t) connection.get();
+  shared_ptr<SendQueue> queue;
+  vector<shared_ptr<SendQueue>> stale;
+  {
+    lock_guard<mutex> guard(send_queues_lock);
+    auto it = send_queues.find(key);
+    if (it != send_queues.end() && it->second.connection.lock() == connection)
+    {
+      return it->second.queue;
+    }
+    for (it = send_queues.begin(); it != send_queues.end();)
+    {
+      if (it->first == key || it->second.connection.expired())
+      {
+        stale.push_back(it->second.queue);
+        it = send_queues.erase(it);
+      }
+      else
+      {
+        it++;
+      }
+    }
+
+    weak_ptr<WsServer::Connection> weak_connection = connection;
+    queue = make_shared<SendQueue>(SEND_QUEUE_BUDGET_SIZE,
+        [server, weak_connection](shared_ptr<SendQueue> queue, send_frame_t& frame)
+    {
+      shared_ptr<WsServer::Connection> connection = weak_connection.lock();
+      if (!connection)
+      {
+        queue->finish(boost::asio::error::not_connected);
+        return;
+      }
+      // server.send is an asynchronous function
+      server->send(connection, get_send_stream(&frame),
+          [queue](const boost::system::error_code & ec)
+      {
+        queue->finish(ec);
+      }, BINARY_OPCODE);
+    });
+    send_queues[key] = {connection, queue};
+  }
+  for (shared_ptr<SendQueue>& old_queue : stale)
+  {
+    old_queue->close();
+  }
+  return queue;
+}
+
+/*
+ * Close the send queue of `connection`, completing its unsent frames. The
+ * closed queue is kept until the connection is gone, so responses of
+ * requests still being served are completed instead of queued again.
+ */
+void close_send_queue(shared_ptr<WsServer::Connection> connection)
+{
+  shared_ptr<SendQueue> queue;
+  {
+    lock_guard<mutex> guard(send_queues_lock);
+    auto it = send_queues.find((size_t) connection.get());
+    if (it == send_queues.end() || it->second.connection.lock() != connection)
+    {
+      return;
+    }
+    queue = it->second.queue;
+  }
+  queue->close();
+}
+
+/*
+ * Rate `connection` drains its responses in bytes per second, 0 if unknown
+ */
+double get_drain_rate(shared_ptr<WsServer::Connection> connection)
+{
+  shared_ptr<SendQueue> queue;
+  {
+    lock_guard<mutex> guard(send_queues_lock);
+    auto it = send_queues.find((size_t) connection.get());
+    if (it == send_queues.end() || it->second.connection.lock() != connection)
+    {
+      return 0;
+    }
+    queue = it->second.queue;
+  }
+  return queue->get_drain_rate();
+}
+
+/*
+ * Responses with the same key show the same view, so only the newest unsent
+ * one is kept. Stats and errors are always sent.
+ */
+string get_frame_key(string type, Json content)
+{
+  if (type == "prefetch_stats" || type == "trace_stats" || type == "error")
+  {
+    return "";
+  }
+  return type + ":" + content["type"].string_value() + ":" + content["canvasId"].string_value();
+}
+
+/*
+ * Log json data to stdout if `VERBOSE`. The request traces record the
+ * requests otherwise, so stdout is kept off the request path.
+ */
+void log_json(Json content)
+{
+  if (VERBOSE)
+  {
+    cout << "Sending content " << content.dump() << "\n";
+  }
+}
+
+/*
+ * Log a request to stdout if `VERBOSE`, in the form loadgen replays
+ */
+void log_request(Json json)
+{
+  if (VERBOSE)
+  {
+    cout << "Json data: " << json.dump() << "\n";
+  }
+}
+
+/*
+ * Log `msg` to stdout if `VERBOSE`
+ */
+void log_message(string msg)
+{
+  if (VERBOSE)
+  {
+    cout << msg << "\n";
+  }
+}
+
+/*
+ * Log the time taken since `ticks` to stdout if `VERBOSE`
+ */
+void log_request_time(string msg, unsigned long long ticks)
+{
+  if (VERBOSE)
+  {
+    log_time_diff(msg, ticks);
+  }
+}
+
 /*
  * Send a binary encoded message with the given json header and optional data
- * buffer.
+ * buffer. `payload` owns `data` and is shared with the send queue until the
+ * message is written, so the data is not copied before then.
  */
 void send_message(WsServer* server, shared_ptr<WsServer::Connection> connection,
-                  string type, Json content, float* data, size_t data_size)
+                  string type, Json content, shared_ptr<const void> payload,
+                  const float* data, size_t data_size)
 {
   unsigned long long start = getticks();
+  unsigned long long span_start = get_monotonic_ticks();
+  shared_ptr<request_trace_t> trace = current_trace;
   Visgoth visgoth = Visgoth();
   Json msg = Json::object
   {
     {"type", type},
     {"content", content},
-    {"serverProfile", visgoth.get_collectd_stats()},
+    {"serverProfile", visgoth.get_server_stats()},
+    {"serverTrace", trace ? get_trace_json(trace.get()) : Json()},
   };
   string header = msg.dump();
 
@@ -43,40 +325,101 @@ void send_message(WsServer* server, shared_ptr<WsServer::Connection> connection,
   // the header, encoded as a 32 bit signed integer:
   header.resize(header_len, ' ');
 
-  auto send_stream = make_shared<WsServer::SendStream>();
-  send_stream->write((char*) &header_len, sizeof(uint32_t));
-  send_stream->write(header.c_str(), header_len);
-  if (data != nullptr)
+  trace_span(STAGE_ENCODE, span_start);
+  if (trace && trace->send_start == 0)
   {
-    send_stream->write((char*) data, data_size);
+    trace->send_start = get_monotonic_ticks();
   }
+  int request_type = get_request_type(trace ? trace->type : "");
+  unsigned long long send_start = get_monotonic_ticks();
+  size_t nbytes = sizeof(uint32_t) + header_len + (data ? data_size : 0);
+  metrics_add(COUNTER_MESSAGES_SENT, request_type, 1);
+  metrics_add(COUNTER_BYTES_SENT, request_type, nbytes);
+  metrics_gauge_add(GAUGE_PENDING_SENDS, 1);
 
-  // server.send is an asynchronous function
-  server->send(connection, send_stream, [type, start](const boost::system::error_code & ec)
+  send_frame_t frame;
+  frame.key = get_frame_key(type, content);
+  frame.nbytes = nbytes;
+  frame.header = header;
+  frame.payload = payload;
+  frame.data = data;
+  frame.data_size = data ? data_size : 0;
+  frame.callback = [type, start, trace, request_type, send_start](const boost::system::error_code & ec)
   {
-    log_time_diff("send_message::" + type, start);
-    if (ec)
+    log_request_time("send_message::" + type, start);
+    metrics_gauge_add(GAUGE_PENDING_SENDS, -1);
+    trace_complete(STAGE_NAMES[STAGE_SEND].c_str(), send_start, get_monotonic_ticks());
+    if (trace)
     {
+      // the responses of a request are sent concurrently, the span ends
+      // with the last one
+      unsigned long long span = get_monotonic_ticks() - trace->send_start;
+      unsigned long long prev = trace->spans[STAGE_SEND];
+      while (prev < span && !trace->spans[STAGE_SEND].compare_exchange_weak(prev, span));
+    }
+    if (ec == boost::asio::error::operation_aborted)
+    {
+      metrics_add(COUNTER_REPLACED_MESSAGES, request_type, 1);
+    }
+    else if (ec == boost::asio::error::no_buffer_space)
+    {
+      metrics_add(COUNTER_DROPPED_MESSAGES, request_type, 1);
+    }
+    else if (ec == boost::asio::error::not_connected)
+    {
+      // the client left, every unsent frame is completed without logging
+      metrics_add(COUNTER_SEND_ERRORS, request_type, 1);
+    }
+    else if (ec)
+    {
+      metrics_add(COUNTER_SEND_ERRORS, request_type, 1);
       cout << "Server: Error sending message. " <<
            // See http://www.boost.org/doc/libs/1_55_0/doc/html/boost_asio/reference.html
            // Error Codes for error code meanings
            "Error: " << ec << ", error message: " << ec.message() << endl;
     }
-  }, BINARY_OPCODE);
+  };
+  get_send_queue(server, connection)->push(frame);
 }
 
 /*
- * Log json data to stdout.
+ * Answer a request of `type` that can't be served with `message`
  */
-void log_json(Json content)
+void send_error(WsServer* server, shared_ptr<WsServer::Connection> connection,
+                string type, string message)
+{
+  Json content = Json::object
+  {
+    {"requestType", type},
+    {"message", message}
+  };
+  log_json(content);
+  send_message(server, connection, "error", content, nullptr, nullptr, 0);
+}
+
+/*
+ * Region of `channel` in a request of `type`, or -1 once the request is
+ * answered with an error if it isn't one
+ */
+int get_request_channel(WsServer* server, shared_ptr<WsServer::Connection> connection,
+                        string type, Json channel)
 {
-  cout << "Sending content " << content.dump() << endl;
+  int ch = channel.int_value();
+  if (!channel.is_number() || ch < 0 || ch >= NUM_DIFF)
+  {
+    send_error(server, connection, type, "Unknown channel: " + channel.dump());
+    return -1;
+  }
+  return ch;
 }
 
+/*
+ * Send `vector` to the client, moving it into the message
+ */
 void send_frowvec(WsServer* server,
                   shared_ptr<WsServer::Connection> connection,
                   string canvasId, string type,
-                  frowvec vector)
+                  frowvec& vector)
 {
 
   Json content = Json::object
@@ -85,13 +428,19 @@ void send_frowvec(WsServer* server,
     {"canvasId", canvasId}
   };
   log_json(content);
-  send_message(server, connection, "spectrogram", content, vector.memptr(), vector.n_elem);
+  auto payload = make_shared<frowvec>(std::move(vector));
+  send_message(server, connection, "spectrogram", content, payload,
+      payload->memptr(), sizeof(float) * payload->n_elem);
 }
 
+/*
+ * Send `spec_mat` to the client. The message shares it, it may be a tile of
+ * the cache, and it is written from its memory without a copy.
+ */
 void send_spectrogram(WsServer* server,
                              shared_ptr<WsServer::Connection> connection,
-                             SpecParams spec_params, string canvasId,
-                             fmat& spec_mat,
+                             SpecParams* spec_params, string canvasId,
+                             shared_ptr<fmat> spec_mat,
                              int extent)
 {
   // TODO: Request IDs, so that both server and client can dump stats like the
@@ -99,18 +448,23 @@ void send_spectrogram(WsServer* server,
   // client. For now, this is easier...
   Json content = Json::object
   {
-    {"nblocks", (int) spec_mat.n_cols},
-    {"nfreqs", (int) spec_mat.n_rows},
-    {"fs", spec_params.fs},
-    {"startTime", spec_params.start_time},
-    {"endTime", spec_params.end_time},
+    {"nblocks", (int) spec_mat->n_cols},
+    {"nfreqs", (int) spec_mat->n_rows},
+    {"fs", spec_params->fs},
+    {"startTime", spec_params->start_time},
+    {"endTime", spec_params->end_time},
+    {"startTimeMs", (double) samples_to_ms(spec_params->fs, spec_params->start_offset)},
+    {"endTimeMs", (double) samples_to_ms(spec_params->fs, spec_params->spec_end_offset * spec_params->shift)},
+    {"freqStart", spec_params->freq_start},
+    {"minFreq", spec_params->bin_to_freq(spec_params->freq_start)},
+    {"maxFreq", spec_params->bin_to_freq(spec_params->freq_end - 1)},
     {"canvasId", canvasId},
     {"extent", extent}
   };
 
-  size_t data_size = sizeof(float) * spec_mat.n_elem;
   log_json(content);
-  send_message(server, connection, "spectrogram", content, spec_mat.memptr(), data_size);
+  send_message(server, connection, "spectrogram", content, spec_mat,
+      spec_mat->memptr(), sizeof(float) * spec_mat->n_elem);
 }
 
 void send_change_points(WsServer* server,
@@ -122,6 +476,95 @@ void send_change_points(WsServer* server,
   send_frowvec(server, connection, canvasId, "summed_signal", cp_data->m);
 }
 
+/*
+ * Build the `SpecParams` for a spectrogram request. Times given as integer
+ * milliseconds (`startTimeMs`, `endTimeMs`) map to exact sample offsets,
+ * otherwise the float hours in `startTime` and `endTime` are used.
+ */
+SpecParams get_request_spec_params(StorageBackend* backend, string mrn, Json content)
+{
+  if (content["startTimeMs"].is_number() && content["endTimeMs"].is_number())
+  {
+    int fs = 0;
+    if (backend->array_exists(mrn))
+    {
+      backend->open_array(mrn);
+      fs = backend->get_fs(mrn);
+    }
+    int64_t start_offset = ms_to_samples(fs, content["startTimeMs"].number_value());
+    int64_t end_offset = ms_to_samples(fs, content["endTimeMs"].number_value());
+    return SpecParams(backend, mrn, start_offset, end_offset);
+  }
+  float start_time = content["startTime"].number_value();
+  float end_time = content["endTime"].number_value();
+  return SpecParams(backend, mrn, start_time, end_time);
+}
+
+/*
+ * Restrict `spec_params` to the optional frequency band of a request, given
+ * in Hz by `minFreq` and `maxFreq`. The band used is stored in `min_freq`
+ * and `max_freq`.
+ */
+void set_request_band(SpecParams* spec_params, Json content, float* min_freq, float* max_freq)
+{
+  *min_freq = 0;
+  *max_freq = spec_params->fs / 2.0;
+  if (content["minFreq"].is_number())
+  {
+    *min_freq = content["minFreq"].number_value();
+  }
+  if (content["maxFreq"].is_number())
+  {
+    *max_freq = content["maxFreq"].number_value();
+  }
+  spec_params->set_band(*min_freq, *max_freq);
+}
+
+/*
+ * Ask precompute_daemon to ingest `mrn` before other recordings if it exists
+ * and its spectrograms are not precomputed yet
+ */
+void prioritize_ingest(StorageBackend* backend, string mrn)
+{
+  if (!is_valid_mrn(mrn) || !backend->array_exists(mrn))
+  {
+    return;
+  }
+  // the regions are precomputed in order, the last one is written last
+  string cached_mrn_name = backend->mrn_to_cached_mrn_name(mrn, CH_NAME_MAP[NUM_DIFF - 1]);
+  if (!backend->array_exists(cached_mrn_name))
+  {
+    mark_viewed(mrn);
+  }
+}
+
+/*
+ * Downsampling factor of a request for `nchannels` regions of `spec_params`
+ * chosen by visgoth for the client profile in `visgoth_content` and the rate
+ * `connection` drains its responses. The model learns from the latency of the
+ * request once it is sent.
+ */
+uint get_request_extent(shared_ptr<WsServer::Connection> connection, Json visgoth_content,
+    SpecParams* spec_params, int nchannels, int max_width)
+{
+  Visgoth visgoth = Visgoth();
+  Json::object profile = visgoth_content["profile"].object_items();
+  double drain_rate = get_drain_rate(connection) / 1000; // bytes per ms
+  double bandwidth = profile["bandwidth"].number_value();
+  if (drain_rate > 0 && (bandwidth <= 0 || drain_rate < bandwidth))
+  {
+    profile["bandwidth"] = drain_rate;
+  }
+  extent_request_t request =
+  {
+    spec_params->nblocks,
+    spec_params->freq_end - spec_params->freq_start,
+    nchannels,
+    max_width
+  };
+  return visgoth.get_extent(profile, &request, &current_trace->cost_features);
+}
+
 /*
  * Compute the spectrogram and send to the client.
  * A cached version is used if available.
@@ -133,44 +576,339 @@ void serve_spectrogram(WsServer* server, shared_ptr<WsServer::Connection> connec
 
   // TODO(joshblum): add data validation
   string mrn = content["mrn"].string_value();
-  float start_time = content["startTime"].number_value();
-  float end_time = content["endTime"].number_value();
-  int ch = content["channel"].int_value();
+  int ch = get_request_channel(server, connection, "spectrogram", content["channel"]);
+  if (ch < 0)
+  {
+    return;
+  }
   int max_width = content["maxWidth"].int_value();
+  int method = get_downsample_method(content["downsample"].string_value());
   string ch_name = CH_NAME_MAP[ch];
 
   StorageBackend backend; // perhaps this should be a global thing..
-  Visgoth visgoth = Visgoth();
-  // TODO(joshblum): add flag for downsampling, call visgoth to get downsample factor
-  uint extent = visgoth.get_extent(visgoth_content["profile"]); // downsampling factor
-  SpecParams spec_params = SpecParams(&backend, mrn, start_time, end_time);
-  spec_params.print();
-  cout << endl; // print newline between each spectrogram computation
+  unsigned long long span_start = get_monotonic_ticks();
+  SpecParams spec_params = get_request_spec_params(&backend, mrn, content);
+  float min_freq, max_freq;
+  set_request_band(&spec_params, content, &min_freq, &max_freq);
+  prioritize_ingest(&backend, mrn);
+  trace_span(STAGE_METADATA, span_start);
+  uint extent = get_request_extent(connection, visgoth_content, &spec_params, 1, max_width); // downsampling factor
+  if (VERBOSE)
+  {
+    spec_params.print();
+    cout << "\n"; // print newline between each spectrogram computation
+  }
+
+  // downsample while computing so only the reduced blocks are held in memory
+  uint total_extent = get_total_extent(spec_params.nblocks, extent, max_width);
+  shared_ptr<fmat> spec_mat;
+  vector<int> chs = {ch};
+
+  unsigned long long start = getticks();
+  load_spectrograms(&tile_cache, &spec_params, chs, total_extent, method, &spec_mat);
+  log_request_time("eeg_spectrogram", start);
+  send_spectrogram(server, connection, &spec_params, ch_name, spec_mat, extent);
+  prefetcher.update_view((size_t) connection.get(), &spec_params, chs,
+      min_freq, max_freq, extent, max_width, method);
+}
+
+/*
+ * Compute the spectrograms of several channels for the same time range and
+ * send one spectrogram message per channel to the client. The metadata is
+ * read once and the raw channels shared by the regions are read once.
+ */
+void serve_spectrogram_batch(WsServer* server, shared_ptr<WsServer::Connection> connection, Json json)
+{
+  Json content = json["content"];
+  Json visgoth_content = json["visgoth_content"];
+
+  string mrn = content["mrn"].string_value();
+  int max_width = content["maxWidth"].int_value();
+  int method = get_downsample_method(content["downsample"].string_value());
+  // unknown channels are skipped, the others are still served
+  vector<int> chs;
+  for (auto& item : content["channels"].array_items())
+  {
+    int ch = item.int_value();
+    if (item.is_number() && ch >= 0 && ch < NUM_DIFF)
+    {
+      chs.push_back(ch);
+    }
+  }
+  if (chs.empty())
+  {
+    send_error(server, connection, "spectrogram_batch",
+        "No known channels in: " + content["channels"].dump());
+    return;
+  }
 
-  fmat spec_mat = fmat(spec_params.nfreqs, spec_params.nblocks);
-  string cached_mrn_name = backend.mrn_to_cached_mrn_name(mrn, ch_name);
+  StorageBackend backend;
+  unsigned long long span_start = get_monotonic_ticks();
+  SpecParams spec_params = get_request_spec_params(&backend, mrn, content);
+  float min_freq, max_freq;
+  set_request_band(&spec_params, content, &min_freq, &max_freq);
+  prioritize_ingest(&backend, mrn);
+  trace_span(STAGE_METADATA, span_start);
+  uint extent = get_request_extent(connection, visgoth_content, &spec_params, chs.size(), max_width); // downsampling factor
+  if (VERBOSE)
+  {
+    spec_params.print();
+    cout << "\n"; // print newline between each spectrogram computation
+  }
+
+  uint total_extent = get_total_extent(spec_params.nblocks, extent, max_width);
+  vector<shared_ptr<fmat>> spec_mats(chs.size());
 
   unsigned long long start = getticks();
-  if (backend.array_exists(cached_mrn_name))
+  load_spectrograms(&tile_cache, &spec_params, chs, total_extent, method, spec_mats.data());
+  log_request_time("eeg_spectrogram_batch", start);
+  for (uint i = 0; i < chs.size(); i++)
   {
-    cout << "Using cached visualization!" << endl;
-    backend.open_array(cached_mrn_name);
-    backend.read_array(cached_mrn_name, spec_params.spec_start_offset, spec_params.spec_end_offset, spec_mat);
-    backend.close_array(cached_mrn_name);
+    send_spectrogram(server, connection, &spec_params, CH_NAME_MAP[chs[i]], spec_mats[i], extent);
   }
-  else if (backend.array_exists(mrn))
+  prefetcher.update_view((size_t) connection.get(), &spec_params, chs,
+      min_freq, max_freq, extent, max_width, method);
+}
+
+/*
+ * Send the precomputed change points in the requested time range to the
+ * client. Only the change point index is read, not the spectrogram.
+ */
+void serve_change_points(WsServer* server, shared_ptr<WsServer::Connection> connection, Json json)
+{
+  Json content = json["content"];
+
+  string mrn = content["mrn"].string_value();
+  int ch = get_request_channel(server, connection, "change_points", content["channel"]);
+  if (ch < 0)
   {
-    eeg_spectrogram(&spec_params, ch, spec_mat);
+    return;
   }
+  string ch_name = CH_NAME_MAP[ch];
 
-  log_time_diff("eeg_spectrogram", start);
-  downsample(spec_mat, extent);
-  cap_max_width(spec_mat, max_width);
-  send_spectrogram(server, connection, spec_params, ch_name, spec_mat, extent);
+  StorageBackend backend;
+  unsigned long long span_start = get_monotonic_ticks();
+  SpecParams spec_params = get_request_spec_params(&backend, mrn, content);
+  trace_span(STAGE_METADATA, span_start);
 
-  // cp_data_t cp_data;
-  // get_change_points(spec_mat, &cp_data);
-  // send_change_points(server, connection, ch_name, &cp_data);
+  unsigned long long start = getticks();
+  span_start = get_monotonic_ticks();
+  vector<int64_t> cp_blocks;
+  string cp_mrn_name = backend.mrn_to_changepoints_mrn_name(mrn, ch_name);
+  read_change_points(&backend, cp_mrn_name, spec_params.spec_start_offset,
+      spec_params.spec_end_offset, cp_blocks);
+  trace_span(STAGE_READ, span_start);
+  trace_bytes_read(2 * sizeof(float) * cp_blocks.size());
+
+  // change points are sent as times in hours like `startTime`
+  frowvec cp_times = frowvec(cp_blocks.size());
+  for (uword i = 0; i < cp_blocks.size(); i++)
+  {
+    cp_times(i) = samples_to_hours(spec_params.fs, cp_blocks[i] * spec_params.shift);
+  }
+  log_request_time("change_points", start);
+
+  Json response = Json::object
+  {
+    {"canvasId", ch_name},
+    {"startTime", spec_params.start_time},
+    {"endTime", spec_params.end_time},
+    {"count", (int) cp_times.n_elem}
+  };
+  log_json(response);
+  auto payload = make_shared<frowvec>(std::move(cp_times));
+  send_message(server, connection, "change_points", response, payload,
+      payload->memptr(), sizeof(float) * payload->n_elem);
+}
+
+/*
+ * Send the average band powers of the requested time range, reduced to
+ * `width` buckets, to the client. They are answered from the precomputed
+ * prefix sums without reading the spectrogram.
+ */
+void serve_band_power(WsServer* server, shared_ptr<WsServer::Connection> connection, Json json)
+{
+  Json content = json["content"];
+
+  string mrn = content["mrn"].string_value();
+  int ch = get_request_channel(server, connection, "band_power", content["channel"]);
+  if (ch < 0)
+  {
+    return;
+  }
+  int width = content["width"].is_number() ? content["width"].int_value() : content["maxWidth"].int_value();
+  string ch_name = CH_NAME_MAP[ch];
+
+  StorageBackend backend;
+  unsigned long long span_start = get_monotonic_ticks();
+  SpecParams spec_params = get_request_spec_params(&backend, mrn, content);
+  trace_span(STAGE_METADATA, span_start);
+
+  unsigned long long start = getticks();
+  span_start = get_monotonic_ticks();
+  fmat bp_mat;
+  read_band_power(&backend, mrn, ch_name, spec_params.spec_start_offset,
+      spec_params.spec_end_offset, width, bp_mat);
+  trace_span(STAGE_READ, span_start);
+  trace_bytes_read(sizeof(float) * bp_mat.n_elem);
+  log_request_time("band_power", start);
+
+  vector<Json> bands;
+  for (int i = 0; i < NUM_BANDS; i++)
+  {
+    bands.push_back(FREQ_BANDS[i].name);
+  }
+  for (int i = 0; i < NUM_BAND_RATIOS; i++)
+  {
+    bands.push_back(BAND_RATIOS[i].name);
+  }
+
+  Json response = Json::object
+  {
+    {"canvasId", ch_name},
+    {"bands", bands},
+    {"nblocks", (int) bp_mat.n_cols},
+    {"startTime", spec_params.start_time},
+    {"endTime", spec_params.end_time},
+    {"startTimeMs", (double) samples_to_ms(spec_params.fs, spec_params.start_offset)},
+    {"endTimeMs", (double) samples_to_ms(spec_params.fs, spec_params.spec_end_offset * spec_params.shift)}
+  };
+  log_json(response);
+  auto payload = make_shared<fmat>(std::move(bp_mat));
+  send_message(server, connection, "band_power", response, payload,
+      payload->memptr(), sizeof(float) * payload->n_elem);
+}
+
+/*
+ * Send the min/max envelope of the raw waveforms of every channel in the
+ * requested time range, with at most `maxWidth` points per channel.
+ */
+void serve_waveform(WsServer* server, shared_ptr<WsServer::Connection> connection, Json json)
+{
+  Json content = json["content"];
+
+  string mrn = content["mrn"].string_value();
+  int max_width = content["maxWidth"].int_value();
+
+  StorageBackend backend;
+  unsigned long long span_start = get_monotonic_ticks();
+  int fs = 0;
+  int64_t nsamples = 0;
+  if (backend.array_exists(mrn))
+  {
+    backend.open_array(mrn);
+    fs = backend.get_fs(mrn);
+    nsamples = backend.get_nsamples(mrn);
+  }
+  trace_span(STAGE_METADATA, span_start);
+
+  int64_t start_offset, end_offset;
+  if (content["startTimeMs"].is_number() && content["endTimeMs"].is_number())
+  {
+    start_offset = ms_to_samples(fs, content["startTimeMs"].number_value());
+    end_offset = ms_to_samples(fs, content["endTimeMs"].number_value());
+  }
+  else
+  {
+    start_offset = hours_to_samples(fs, content["startTime"].number_value());
+    end_offset = hours_to_samples(fs, content["endTime"].number_value());
+  }
+  start_offset = min(max(start_offset, (int64_t) 0), nsamples);
+  end_offset = min(max(end_offset, start_offset), nsamples);
+
+  unsigned long long start = getticks();
+  span_start = get_monotonic_ticks();
+  fmat envelope_mat;
+  int level = read_waveform(&backend, mrn, start_offset, end_offset, max_width, envelope_mat);
+  trace_span(STAGE_READ, span_start);
+  trace_bytes_read(sizeof(float) * envelope_mat.n_elem);
+  log_request_time("waveform", start);
+
+  Json response = Json::object
+  {
+    {"nchannels", NCHANNELS},
+    {"npoints", (int) envelope_mat.n_cols},
+    {"level", level},
+    {"fs", fs},
+    {"startTime", fs ? samples_to_hours(fs, start_offset) : 0},
+    {"endTime", fs ? samples_to_hours(fs, end_offset) : 0},
+    {"startTimeMs", (double) samples_to_ms(fs, start_offset)},
+    {"endTimeMs", (double) samples_to_ms(fs, end_offset)}
+  };
+  log_json(response);
+  auto payload = make_shared<fmat>(std::move(envelope_mat));
+  send_message(server, connection, "waveform", response, payload,
+      payload->memptr(), sizeof(float) * payload->n_elem);
+  backend.close_array(mrn);
+}
+
+/*
+ * Send the tile cache statistics, including the ratio of prefetched
+ * spectrograms that were later requested, to tune `PREFETCH_DEPTH`, and how
+ * much work concurrent requests shared.
+ */
+void serve_prefetch_stats(WsServer* server, shared_ptr<WsServer::Connection> connection)
+{
+  tile_cache_stats_t stats = tile_cache.get_stats();
+  sparse_cache_stats_t sparse_stats = get_sparse_cache_stats();
+  uint64_t lookups = stats.hits + stats.misses;
+  Json response = Json::object
+  {
+    {"hits", (double) stats.hits},
+    {"misses", (double) stats.misses},
+    {"hitRatio", lookups ? stats.hits / (double) lookups : 0},
+    {"prefetched", (double) stats.prefetched},
+    {"prefetchHits", (double) stats.prefetch_hits},
+    {"prefetchHitRatio", stats.prefetched ? stats.prefetch_hits / (double) stats.prefetched : 0},
+    {"prefetchDepth", PREFETCH_DEPTH},
+    {"ntiles", (double) stats.ntiles},
+    {"nbytes", (double) stats.nbytes},
+    {"coalesced", (double) stats.coalesced},
+    {"sparseReadBlocks", (double) sparse_stats.read_blocks},
+    {"sparseComputedBlocks", (double) sparse_stats.computed_blocks},
+    {"sparseCoalescedBlocks", (double) sparse_stats.coalesced_blocks}
+  };
+  log_json(response);
+  send_message(server, connection, "prefetch_stats", response, nullptr, nullptr, 0);
+}
+
+/*
+ * Send the distribution of the time spent in each stage by every request
+ * type, from the metrics of all requests served so far. Times are in
+ * seconds and the percentiles are within 12.5%.
+ */
+void serve_trace_stats(WsServer* server, shared_ptr<WsServer::Connection> connection)
+{
+  stage_stats_t stats[NUM_REQUEST_TYPES][NUM_STAGES];
+  get_stage_stats(stats);
+  Json::object types;
+  for (int t = 0; t < NUM_REQUEST_TYPES; t++)
+  {
+    if (stats[t][0].count == 0)
+    {
+      continue;
+    }
+    Json::object stages;
+    for (int i = 0; i < NUM_STAGES; i++)
+    {
+      stage_stats_t* stage = &stats[t][i];
+      stages[STAGE_NAMES[i]] = Json::object
+      {
+        {"count", (double) stage->count},
+        {"mean", stage->count ? ticks_to_seconds(stage->total) / stage->count : 0},
+        {"p50", stage->p50},
+        {"p95", stage->p95},
+        {"p99", stage->p99}
+      };
+    }
+    types[REQUEST_TYPES[t]] = stages;
+  }
+  Json response = Json::object
+  {
+    {"types", types}
+  };
+  log_json(response);
+  send_message(server, connection, "trace_stats", response, nullptr, nullptr, 0);
 }
 
 void receive_message(WsServer* server, shared_ptr<WsServer::Connection> connection, shared_ptr<WsServer::Message> message)
@@ -182,19 +920,63 @@ void receive_message(WsServer* server, shared_ptr<WsServer::Connection> connecti
   // TODO add error checking for null fields
   string type = json["type"].string_value();
 
+  // the stages of serving the request are traced, the deleter records the
+  // trace once the responses are sent
+  current_trace = shared_ptr<request_trace_t>(new request_trace_t, finish_request_trace);
+  init_request_trace_t(current_trace.get(), type);
+  set_request_trace(current_trace.get());
+  metrics_gauge_add(GAUGE_ACTIVE_REQUESTS, 1);
+
+  // speculative work waits until the request is served
+  prefetcher.begin_request();
   if (type == "spectrogram")
   {
-    cout << "Json data: " << json.dump() << endl;
+    log_request(json);
     serve_spectrogram(server, connection, json);
   }
+  else if (type == "spectrogram_batch")
+  {
+    log_request(json);
+    serve_spectrogram_batch(server, connection, json);
+  }
+  else if (type == "change_points")
+  {
+    log_request(json);
+    serve_change_points(server, connection, json);
+  }
+  else if (type == "band_power")
+  {
+    log_request(json);
+    serve_band_power(server, connection, json);
+  }
+  else if (type == "waveform")
+  {
+    log_request(json);
+    serve_waveform(server, connection, json);
+  }
+  else if (type == "prefetch_stats")
+  {
+    serve_prefetch_stats(server, connection);
+  }
+  else if (type == "trace_stats")
+  {
+    serve_trace_stats(server, connection);
+  }
   else if (type == "information")
   {
-    cout << json.string_value() << endl;
+    log_message(json.string_value());
   }
   else
   {
-    cout << "Unknown type: " << type << " and content: " << json.string_value() << endl;
+    log_message("Unknown type: " + type + " and content: " + json.string_value());
+    current_trace->type = "unknown";
   }
+  prefetcher.end_request();
+  metrics_gauge_add(GAUGE_ACTIVE_REQUESTS, -1);
+  trace_complete(REQUEST_TYPES[get_request_type(current_trace->type)].c_str(),
+      current_trace->start, get_monotonic_ticks());
+  set_request_trace(nullptr);
+  current_trace.reset();
 }
 
 /*
@@ -202,6 +984,13 @@ void receive_message(WsServer* server, shared_ptr<WsServer::Connection> connecti
  */
 int main(int argc, char* argv[])
 {
+  // SIGINT and SIGTERM are blocked in every thread and handled below
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
   int port;
   if (argc == 2)
   {
@@ -233,6 +1022,8 @@ int main(int argc, char* argv[])
   ws.onclose = [](shared_ptr<WsServer::Connection> connection, int status, const string & reason)
   {
     cout << "Server: Closed connection " << (size_t)connection.get() << " with status code " << status << endl;
+    prefetcher.remove_connection((size_t) connection.get());
+    close_send_queue(connection);
   };
 
   // See http://www.boost.org/doc/libs/1_55_0/doc/html/boost_asio/reference.html, Error Codes for error code meanings
@@ -240,8 +1031,22 @@ int main(int argc, char* argv[])
   {
     cout << "Server: Error in connection " << (size_t)connection.get() << ". " <<
          "Error: " << ec << ", error message: " << ec.message() << endl;
+    prefetcher.remove_connection((size_t) connection.get());
+    close_send_queue(connection);
   };
 
+  prefetcher.start();
+  if (EVENT_TRACE)
+  {
+    start_event_trace("ws_server");
+  }
+
+  if (METRICS_PORT > 0)
+  {
+    thread metrics_thread(serve_metrics, METRICS_PORT, get_server_metrics_text);
+    metrics_thread.detach();
+  }
+
   // Start the server
   thread server_thread([&server, port, num_threads]()
   {
@@ -249,7 +1054,18 @@ int main(int argc, char* argv[])
     server.start();
   });
 
+  // stop the server on a signal so the event trace is closed
+  thread signal_thread([&server, signals]()
+  {
+    int sig;
+    sigwait(&signals, &sig);
+    cout << "Stopping on signal " << sig << endl;
+    server.stop();
+  });
+  signal_thread.detach();
+
   server_thread.join();
+  stop_event_trace();
 
   return 0;
 }
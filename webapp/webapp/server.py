@@ -5,10 +5,9 @@ from flask import request
 
 import os
 import csv
+import hashlib
 import simplejson as json
 
-import regression
-
 
 app = Flask(__name__)
 
@@ -19,13 +18,18 @@ PROFILE_FILENAME = 'profile-dump-{0}.csv'
 # Are we running an experiment?
 EXPERIMENT = False
 
-TARGET_LATENCY = 3500
-# Regressor tags have 3 parts: 1) which data dump to look at; 2) which profile
-# statistic to train on; 3) the value that the model should predict (always
-# latency for us).
-# TODO: change to named tuple...
-DEFAULT_REGRESSOR_TAG = ('chrome-ubuntu', 'bandwidth', 'latency')
-REGRESSORS = regression.save_and_load_regressors(*DEFAULT_REGRESSOR_TAG)
+TARGET_LATENCY = 3500  # ms
+MAX_EXTENT = 16
+
+# Parameters of the extent model that runs in the ws_server. The version
+# changes with them so the ws_server only receives them when they change.
+MODEL_PARAMS = {
+    'experiment': EXPERIMENT,
+    'targetLatency': TARGET_LATENCY,
+    'maxExtent': MAX_EXTENT,
+}
+MODEL_VERSION = hashlib.sha1(
+    json.dumps(MODEL_PARAMS, sort_keys=True)).hexdigest()[:12]
 
 
 @app.errorhandler(404)
@@ -116,36 +120,22 @@ def dump_visgoth():
   })
 
 
-@app.route('/visgoth/get_extent', methods=['POST'])
-def get_extent():
-  success = True
-  try:
-    data = request.get_json()
-
-  except:
+@app.route('/visgoth/model')
+def visgoth_model():
+  # The ws_server sends the version it has and predicts the extent itself.
+  # In an experiment it uses the extent requested by the client.
+  if request.args.get('version') == MODEL_VERSION:
     return jsonify({
-        'success': False,
+        'changed': False,
+        'version': MODEL_VERSION,
     })
 
-  # If we're running an experiment, the client will request the extent.
-  # Otherwise, use the models to predict a best extnet.
-  if EXPERIMENT:
-    extent = data['client_profile'].get('extent', 1)
-  else:
-    x_key = DEFAULT_REGRESSOR_TAG[1]
-    x_value = data['client_profile'].get(x_key)
-    # The client profile features needed weren't included.
-    if x_value is None:
-      return jsonify({
-          'success': False,
-      })
-
-    extent = regression.predict_extent(REGRESSORS, TARGET_LATENCY, x_value)
-
-  return jsonify({
-      'success': success,
-      'extent': extent,
+  response = dict(MODEL_PARAMS)
+  response.update({
+      'changed': True,
+      'version': MODEL_VERSION,
   })
+  return jsonify(response)
 
 if __name__ == '__main__':
   app.debug = True  # enable auto reload
@@ -7,6 +7,11 @@ ws.binaryType = "arraybuffer";
 var spectrogramRequestCount = 0;
 
 var OVERLAP = 0.5;
+// frequency band in Hz requested for the spectrograms
+var MIN_FREQ = 0;
+var MAX_FREQ = 20;
+// how blocks are reduced when downsampling: drop, mean, max or percentile
+var DOWNSAMPLE = "mean";
 
 function getwsUrl(wsPort) {
     var loc = window.location,
@@ -103,7 +108,8 @@ ws.onmessage = function(event) {
         } else {
           spectrogram.render(new Float32Array(event.data, headerLen + 4),
             content.nblocks, content.nfreqs, content.fs,
-            content.startTime, content.endTime, spectrogramRequestCount);
+            content.startTime, content.endTime, spectrogramRequestCount,
+            content.minFreq, content.maxFreq);
         }
 
         spectrogram.logBufferLoadEnd(spectrogramRequestCount);
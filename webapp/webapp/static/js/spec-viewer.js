@@ -17,10 +17,12 @@ function reloadSpectrograms() {
     // first we try to load a file
     if (patientIdentifier) {
         console.log("Requesting spectrogram for: " + patientIdentifier);
+        var channels = [];
         for (var ch = 0; ch < IDS.length; ch++) {
-          requestSpectrogram(patientIdentifier, fftLen, startTime, endTime,
-            OVERLAP, ch);
+          channels.push(ch);
         }
+        requestSpectrogramBatch(patientIdentifier, fftLen, startTime, endTime,
+          OVERLAP, channels);
     }
     if (!patientIdentifier) {
         console.log("Could not load spectrogram: No file selected");
@@ -46,13 +48,55 @@ function requestSpectrogram(mrn, nfft, startTime, endTime, overlap, channel) {
         nfft: nfft,
         startTime: startTime,
         endTime: endTime,
+        // integer milliseconds map to exact sample offsets on the server
+        startTimeMs: Math.round(hoursToSeconds(startTime) * 1000),
+        endTimeMs: Math.round(hoursToSeconds(endTime) * 1000),
         overlap: overlap,
         channel: channel,
+        // only the bins in this band are read, computed and sent
+        minFreq: MIN_FREQ,
+        maxFreq: MAX_FREQ,
+        downsample: DOWNSAMPLE,
         maxWidth: spectrogram.specView.width,
         maxHeight: spectrogram.specView.height,
     });
 }
 
+/*
+ *  Request the spectrograms of several channels for the same time range in
+ *  one message. The server reads each raw channel once for all of them and
+ *  answers with one "spectrogram" message per channel.
+ *
+ *  Arguments are the same as `requestSpectrogram` except
+ *  channels  the channels (LL, LP, ...) we are requesting
+*/
+function requestSpectrogramBatch(mrn, nfft, startTime, endTime, overlap, channels) {
+    var maxWidth = 0;
+    var maxHeight = 0;
+    for (var i = 0; i < channels.length; i++) {
+        var spectrogram = SPECTROGRAMS[IDS[channels[i]]];
+        spectrogram.updateStartRequestTime();
+        spectrogram.updateProgressBar(0);
+        maxWidth = Math.max(maxWidth, spectrogram.specView.width);
+        maxHeight = Math.max(maxHeight, spectrogram.specView.height);
+    }
+    visgoth.sendProfiledMessage("spectrogram_batch", {
+        mrn: mrn,
+        nfft: nfft,
+        startTime: startTime,
+        endTime: endTime,
+        startTimeMs: Math.round(hoursToSeconds(startTime) * 1000),
+        endTimeMs: Math.round(hoursToSeconds(endTime) * 1000),
+        overlap: overlap,
+        channels: channels,
+        minFreq: MIN_FREQ,
+        maxFreq: MAX_FREQ,
+        downsample: DOWNSAMPLE,
+        maxWidth: maxWidth,
+        maxHeight: maxHeight,
+    });
+}
+
 /*
  * Set the time of the given `timeId` as a formatted float.
  */
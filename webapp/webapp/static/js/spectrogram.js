@@ -303,8 +303,10 @@ Spectrogram.prototype.getShader = function(id) {
  *  data       a Float32Array containing nblocks x nfreqs values.
  *  nblocks    the width of the data, the number of blocks.
  *  nfreqs     the height of the data, the number of frequency bins.
+ *  minFreq    the frequency of the first bin, defaults to 0.
+ *  maxFreq    the frequency of the last bin, defaults to nfreqs - 1.
 */
-Spectrogram.prototype.render = function(data, nblocks, nfreqs, fs, startTime, endTime, profileDumpKey) {
+Spectrogram.prototype.render = function(data, nblocks, nfreqs, fs, startTime, endTime, profileDumpKey, minFreq, maxFreq) {
     this.networkBufferSizeStat.addValue(data.byteLength);
 
     // calculate the number of textures needed
@@ -375,10 +377,12 @@ Spectrogram.prototype.render = function(data, nblocks, nfreqs, fs, startTime, en
     // save spectrogram sizes
     var minT = hoursToSeconds(startTime);
     var maxT = hoursToSeconds(endTime);
-    this.specSize = new SpecSize(minT, maxT, 0, nfreqs - 1);
+    var minF = (minFreq === undefined) ? 0 : minFreq;
+    var maxF = (maxFreq === undefined) ? nfreqs - 1 : maxFreq;
+    this.specSize = new SpecSize(minT, maxT, minF, maxF);
     this.specSize.numT = nblocks;
     this.specSize.numF = nfreqs;
-    this.specViewSize = new SpecSize(minT, maxT, 0, nfreqs - 1, -45, 45);
+    this.specViewSize = new SpecSize(minT, maxT, minF, maxF, -45, 45);
     var self = this;
     window.requestAnimationFrame(function() {
         self.drawScene();